@@ -47,6 +47,9 @@ extern std::string get_absfilename(const std::string &_file);
 extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                          std::list<std::string> *extrafiles);
 
+/* In createenv.cpp - returns -1 if icecc-create-env needs to be used instead */
+extern int create_native_env(const std::string &compiler, const std::list<std::string> &extrafiles);
+
 /* In cpp.cpp.  */
 extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
 
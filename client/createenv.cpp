@@ -0,0 +1,1548 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+ * icecc -- A simple distributed compiler system
+ *
+ * Copyright (C) 2004 by the Icecream Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Native implementation of icecc-create-env for ELF (Linux) hosts.
+ *
+ * The shell script forks ldd, md5sum and friends for every single file, which makes
+ * creating the native environment take tens of seconds. This does the same job
+ * in-process: dependencies are resolved by reading DT_NEEDED entries directly, files
+ * are hashed by several worker processes, hashes of unchanged files are reused from
+ * a cache kept next to the tarballs, and the tarball itself is written by us with
+ * sorted entries and fixed metadata, so that the same input gives the same output.
+ *
+ * Anything not handled here (non-ELF platforms, unexpected failures) makes the caller
+ * fall back to the icecc-create-env script.
+ *
+ * Unlike the script, this does not add the CPU specific variants of libraries
+ * (haswell/, avx512_1/ and glibc-hwcaps/ subdirectories) next to the generic ones: libraries
+ * are only looked up in the directories themselves, and the compile servers may not
+ * have those CPUs anyway. A library that only exists in such a subdirectory cannot be
+ * found, which also falls back to the script.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <elf.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "client.h"
+#include "md5.h"
+#include "util.h"
+#include "services/util.h"
+
+using namespace std;
+
+#ifdef __linux__
+
+namespace
+{
+
+// Name of the file in the output directory caching hashes of the files put into
+// the environment, keyed by path and stat data.
+const char hash_cache_name[] = ".icecc-create-env.cache";
+
+// All entries in the tarball get this mtime, so that the tarball only depends
+// on the contents of the files (2004-01-01, the project's first year).
+const time_t tar_mtime = 1072915200;
+
+struct EnvEntry {
+    string source;      // path of the file to pack, empty if 'contents' is used
+    string contents;    // generated contents
+    bool generated;
+    mode_t mode;
+    off_t size;
+    string md5;
+
+    EnvEntry()
+        : generated(false)
+        , mode(0644)
+        , size(0)
+    {}
+};
+
+struct CachedHash {
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    ino_t inode;
+    string md5;
+};
+
+string md5_to_string(const md5_byte_t digest[16])
+{
+    char digest_cache[33];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(digest_cache + di * 2, "%02x", digest[di]);
+    }
+
+    digest_cache[32] = 0;
+    return digest_cache;
+}
+
+string md5_for_buffer(const string &buffer)
+{
+    md5_state_t state;
+    md5_byte_t digest[16];
+
+    md5_init(&state);
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(buffer.data()), buffer.size());
+    md5_finish(&state, digest);
+    return md5_to_string(digest);
+}
+
+string md5_for_path(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    md5_byte_t buffer[65536];
+
+    for (;;) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            close(fd);
+            return string();
+        }
+
+        if (bytes == 0) {
+            break;
+        }
+
+        md5_append(&state, buffer, bytes);
+    }
+
+    close(fd);
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+    return md5_to_string(digest);
+}
+
+string shell_quote(const string &str)
+{
+    string ret = "'";
+
+    for (string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        if (*it == '\'') {
+            ret += "'\\''";
+        } else {
+            ret += *it;
+        }
+    }
+
+    return ret + "'";
+}
+
+string dir_name(const string &path)
+{
+    string::size_type pos = path.rfind('/');
+
+    if (pos == string::npos) {
+        return ".";
+    }
+
+    if (pos == 0) {
+        return "/";
+    }
+
+    return path.substr(0, pos);
+}
+
+// Returns the absolute path with all symlinks resolved, or an empty string.
+string real_path(const string &path)
+{
+    char buf[PATH_MAX];
+
+    if (!realpath(path.c_str(), buf)) {
+        return string();
+    }
+
+    return buf;
+}
+
+// Removes /./, /../ and duplicated slashes without resolving symlinks.
+string clean_path(const string &path)
+{
+    vector<string> parts;
+    string::size_type begin = 0;
+
+    while (begin < path.size()) {
+        string::size_type end = path.find('/', begin);
+
+        if (end == string::npos) {
+            end = path.size();
+        }
+
+        string part = path.substr(begin, end - begin);
+        begin = end + 1;
+
+        if (part.empty() || part == ".") {
+            continue;
+        }
+
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+
+            continue;
+        }
+
+        parts.push_back(part);
+    }
+
+    string ret;
+
+    for (vector<string>::const_iterator it = parts.begin(); it != parts.end(); ++it) {
+        ret += '/' + *it;
+    }
+
+    return ret.empty() ? "/" : ret;
+}
+
+bool file_exists(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Information from an ELF file needed to pack it together with its dependencies.
+struct ElfInfo {
+    unsigned char elfclass;
+    unsigned short machine;
+    bool dynamic;
+    string interpreter;
+    list<string> needed;
+    list<string> rpath;
+    list<string> runpath;
+
+    ElfInfo()
+        : elfclass(ELFCLASSNONE)
+        , machine(EM_NONE)
+        , dynamic(false)
+    {}
+};
+
+template<typename Ehdr, typename Phdr, typename Dyn>
+bool read_elf_dynamic(int fd, ElfInfo &info)
+{
+    Ehdr ehdr;
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != (ssize_t)sizeof(ehdr)
+            || ehdr.e_phentsize != sizeof(Phdr)) {
+        return false;
+    }
+
+    info.machine = ehdr.e_machine;
+    vector<Phdr> phdrs(ehdr.e_phnum);
+
+    if (ehdr.e_phnum && pread(fd, &phdrs[0], sizeof(Phdr) * ehdr.e_phnum, ehdr.e_phoff)
+            != (ssize_t)(sizeof(Phdr) * ehdr.e_phnum)) {
+        return false;
+    }
+
+    const Phdr *dynamic = 0;
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_DYNAMIC) {
+            dynamic = &phdrs[i];
+        } else if (phdrs[i].p_type == PT_INTERP && phdrs[i].p_filesz < PATH_MAX) {
+            vector<char> interp(phdrs[i].p_filesz + 1, '\0');
+
+            if (pread(fd, &interp[0], phdrs[i].p_filesz, phdrs[i].p_offset)
+                    == (ssize_t)phdrs[i].p_filesz) {
+                info.interpreter = &interp[0];
+            }
+        }
+    }
+
+    if (!dynamic) {
+        info.dynamic = false;
+        return true;
+    }
+
+    info.dynamic = true;
+    vector<Dyn> dyns(dynamic->p_filesz / sizeof(Dyn));
+
+    if (dyns.empty() || pread(fd, &dyns[0], dyns.size() * sizeof(Dyn), dynamic->p_offset)
+            != (ssize_t)(dyns.size() * sizeof(Dyn))) {
+        return false;
+    }
+
+    // DT_STRTAB is a virtual address, map it to a file offset using the load segments.
+    unsigned long strtab_addr = 0;
+    unsigned long strtab_size = 0;
+
+    for (size_t i = 0; i < dyns.size() && dyns[i].d_tag != DT_NULL; ++i) {
+        if (dyns[i].d_tag == DT_STRTAB) {
+            strtab_addr = dyns[i].d_un.d_ptr;
+        } else if (dyns[i].d_tag == DT_STRSZ) {
+            strtab_size = dyns[i].d_un.d_val;
+        }
+    }
+
+    off_t strtab_offset = -1;
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_LOAD && strtab_addr >= phdrs[i].p_vaddr
+                && strtab_addr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+            strtab_offset = phdrs[i].p_offset + (strtab_addr - phdrs[i].p_vaddr);
+            break;
+        }
+    }
+
+    if (strtab_offset < 0 || strtab_size == 0 || strtab_size > 64 * 1024 * 1024) {
+        return false;
+    }
+
+    vector<char> strtab(strtab_size + 1, '\0');
+
+    if (pread(fd, &strtab[0], strtab_size, strtab_offset) != (ssize_t)strtab_size) {
+        return false;
+    }
+
+    for (size_t i = 0; i < dyns.size() && dyns[i].d_tag != DT_NULL; ++i) {
+        list<string> *target = 0;
+
+        switch (dyns[i].d_tag) {
+        case DT_NEEDED:
+            target = &info.needed;
+            break;
+        case DT_RPATH:
+            target = &info.rpath;
+            break;
+        case DT_RUNPATH:
+            target = &info.runpath;
+            break;
+        default:
+            continue;
+        }
+
+        if (dyns[i].d_un.d_val >= strtab_size) {
+            continue;
+        }
+
+        string value = &strtab[dyns[i].d_un.d_val];
+
+        if (target == &info.needed) {
+            target->push_back(value);
+            continue;
+        }
+
+        // rpath entries are colon separated lists
+        string::size_type begin = 0;
+
+        while (begin <= value.size()) {
+            string::size_type end = value.find(':', begin);
+
+            if (end == string::npos) {
+                end = value.size();
+            }
+
+            if (end > begin) {
+                target->push_back(value.substr(begin, end - begin));
+            }
+
+            begin = end + 1;
+        }
+    }
+
+    return true;
+}
+
+// Returns false if the file is not an ELF file for this host.
+bool read_elf_info(const string &path, ElfInfo &info)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned char ident[EI_NIDENT];
+    bool ret = false;
+
+    if (pread(fd, ident, EI_NIDENT, 0) == EI_NIDENT && memcmp(ident, ELFMAG, SELFMAG) == 0) {
+        const union {
+            unsigned short s;
+            unsigned char c;
+        } endian = { 1 };
+        const unsigned char host_data = endian.c ? ELFDATA2LSB : ELFDATA2MSB;
+
+        info.elfclass = ident[EI_CLASS];
+
+        if (ident[EI_DATA] == host_data) {
+            if (info.elfclass == ELFCLASS64) {
+                ret = read_elf_dynamic<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(fd, info);
+            } else if (info.elfclass == ELFCLASS32) {
+                ret = read_elf_dynamic<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(fd, info);
+            }
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+class EnvBuilder
+{
+public:
+    EnvBuilder();
+
+    bool add_file(const string &path, const string &name = string());
+    bool search_addfile(const string &compiler, const string &file_name,
+                        const string &installdir = string());
+    void add_generated(const string &name, const string &contents, mode_t mode = 0644);
+    bool add_directory(const string &dir);
+
+    void set_stripprefix(const string &prefix) {
+        m_stripprefix = prefix;
+    }
+
+    bool build(string &tarball);
+
+private:
+    bool add_elf_dependencies(const string &path, const ElfInfo &info);
+    string find_library(const string &lib, const string &origin, const ElfInfo &info);
+    void read_ld_so_conf(const string &file, set<string> &seen);
+    bool run_ldconfig(string &cache_name, string &cache_contents);
+    void hash_files();
+    void load_hash_cache();
+    void save_hash_cache();
+    bool write_tarball(const string &filename);
+
+    map<string, EnvEntry> m_files;     // target path -> entry
+    set<string> m_seen_sources;        // resolved paths already scanned for dependencies
+    string m_stripprefix;
+    vector<string> m_library_dirs;
+    map<string, CachedHash> m_hash_cache;
+};
+
+EnvBuilder::EnvBuilder()
+{
+    set<string> seen;
+    read_ld_so_conf("/etc/ld.so.conf", seen);
+
+    // the trusted directories the dynamic linker always searches
+    static const char *const default_dirs[] = {
+        "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL
+    };
+
+    for (int i = 0; default_dirs[i]; ++i) {
+        if (find(m_library_dirs.begin(), m_library_dirs.end(), default_dirs[i])
+                == m_library_dirs.end()) {
+            m_library_dirs.push_back(default_dirs[i]);
+        }
+    }
+}
+
+void EnvBuilder::read_ld_so_conf(const string &file, set<string> &seen)
+{
+    if (!seen.insert(file).second) {
+        return;
+    }
+
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return;
+    }
+
+    char line[PATH_MAX + 32];
+
+    while (fgets(line, sizeof(line), f)) {
+        if (char *comment = strchr(line, '#')) {
+            *comment = '\0';
+        }
+
+        istringstream words(line);
+        string word;
+
+        if (!(words >> word)) {
+            continue;
+        }
+
+        if (word == "include") {
+            while (words >> word) {
+                if (word[0] != '/') {
+                    word = dir_name(file) + '/' + word;
+                }
+
+                glob_t globbuf;
+
+                if (glob(word.c_str(), 0, NULL, &globbuf) == 0) {
+                    for (size_t i = 0; i < globbuf.gl_pathc; ++i) {
+                        read_ld_so_conf(globbuf.gl_pathv[i], seen);
+                    }
+                }
+
+                globfree(&globbuf);
+            }
+
+            continue;
+        }
+
+        if (word == "hwcap") {
+            continue;
+        }
+
+        do {
+            // directories may also be separated by commas or colons
+            string::size_type begin = 0;
+
+            while (begin < word.size()) {
+                string::size_type end = word.find_first_of(",:", begin);
+
+                if (end == string::npos) {
+                    end = word.size();
+                }
+
+                string dir = clean_path(word.substr(begin, end - begin));
+                begin = end + 1;
+
+                if (dir != "/" && find(m_library_dirs.begin(), m_library_dirs.end(), dir)
+                        == m_library_dirs.end()) {
+                    m_library_dirs.push_back(dir);
+                }
+            }
+        } while (words >> word);
+    }
+
+    fclose(f);
+}
+
+string EnvBuilder::find_library(const string &lib, const string &origin, const ElfInfo &info)
+{
+    if (lib.find('/') != string::npos) {
+        return file_exists(lib) ? lib : string();
+    }
+
+    vector<string> dirs;
+
+    // DT_RPATH is only used if there is no DT_RUNPATH
+    const list<string> &paths = info.runpath.empty() ? info.rpath : info.runpath;
+
+    for (list<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        string dir = *it;
+        string::size_type pos;
+
+        while ((pos = dir.find("${ORIGIN}")) != string::npos) {
+            dir.replace(pos, 9, origin);
+        }
+
+        while ((pos = dir.find("$ORIGIN")) != string::npos) {
+            dir.replace(pos, 7, origin);
+        }
+
+        dirs.push_back(dir);
+    }
+
+    dirs.insert(dirs.end(), m_library_dirs.begin(), m_library_dirs.end());
+
+    for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        string candidate = *it + '/' + lib;
+        ElfInfo libinfo;
+
+        // skip libraries for a different ABI, e.g. 32bit ones in multilib setups
+        if (file_exists(candidate) && read_elf_info(candidate, libinfo)
+                && libinfo.elfclass == info.elfclass && libinfo.machine == info.machine) {
+            return candidate;
+        }
+    }
+
+    return string();
+}
+
+bool EnvBuilder::add_elf_dependencies(const string &path, const ElfInfo &info)
+{
+    if (!info.interpreter.empty()) {
+        if (!add_file(info.interpreter)) {
+            log_error() << "cannot find ELF interpreter " << info.interpreter << " of "
+                        << path << endl;
+            return false;
+        }
+    }
+
+    string origin = dir_name(path);
+
+    for (list<string>::const_iterator it = info.needed.begin(); it != info.needed.end(); ++it) {
+        string lib = find_library(*it, origin, info);
+
+        if (lib.empty()) {
+            log_error() << "cannot find library " << *it << " needed by " << path << endl;
+            return false;
+        }
+
+        if (!add_file(lib)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EnvBuilder::add_file(const string &path, const string &_name)
+{
+    if (path.empty()) {
+        return true;
+    }
+
+    string source = real_path(path);
+    struct stat st;
+
+    if (source.empty() || stat(source.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        log_error() << "cannot add " << path << " to the environment" << endl;
+        return false;
+    }
+
+    string name = _name.empty() ? path : _name;
+
+    if (name[0] != '/') {
+        name = get_cwd() + '/' + name;
+    }
+
+    name = clean_path(name);
+
+    if (!m_stripprefix.empty() && m_stripprefix != "/"
+            && name.compare(0, m_stripprefix.size() + 1, m_stripprefix + '/') == 0) {
+        name = "/usr" + name.substr(m_stripprefix.size());
+    }
+
+    if (m_files.count(name)) {
+        return true;
+    }
+
+    trace() << "adding file " << name << "=" << source << endl;
+    EnvEntry &entry = m_files[name];
+    entry.source = source;
+    entry.mode = st.st_mode & 07777;
+    entry.size = st.st_size;
+
+    // libraries are not necessarily executable, so check every ELF file
+    if (!m_seen_sources.insert(source).second) {
+        return true;
+    }
+
+    ElfInfo info;
+
+    if (!read_elf_info(source, info) || !info.dynamic) {
+        return true;
+    }
+
+    return add_elf_dependencies(source, info);
+}
+
+void EnvBuilder::add_generated(const string &name, const string &contents, mode_t mode)
+{
+    EnvEntry &entry = m_files[name];
+    entry.source.clear();
+    entry.generated = true;
+    entry.contents = contents;
+    entry.mode = mode;
+    entry.size = contents.size();
+}
+
+bool EnvBuilder::add_directory(const string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        log_perror("opendir") << "\t" << dir << endl;
+        return false;
+    }
+
+    vector<string> subdirs;
+    bool ret = true;
+
+    while (struct dirent *ent = readdir(d)) {
+        string name = ent->d_name;
+
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        string path = dir + '/' + name;
+        struct stat st;
+
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            subdirs.push_back(path);
+        } else if (S_ISREG(st.st_mode) && !add_file(path)) {
+            ret = false;
+        }
+    }
+
+    closedir(d);
+
+    for (vector<string>::const_iterator it = subdirs.begin(); ret && it != subdirs.end(); ++it) {
+        ret = add_directory(*it);
+    }
+
+    return ret;
+}
+
+bool EnvBuilder::search_addfile(const string &compiler, const string &file_name,
+                                const string &_installdir)
+{
+    string file = read_command_output(shell_quote(compiler) + " -print-prog-name=" + file_name);
+
+    if (file.empty() || file == file_name || ::access(file.c_str(), F_OK) != 0) {
+        file = read_command_output(shell_quote(compiler) + " -print-file-name=" + file_name);
+    }
+
+    if (file == file_name) {
+        file = compiler_path_lookup(file_name);
+    }
+
+    if (file.empty() || ::access(file.c_str(), F_OK) != 0) {
+        return false;
+    }
+
+    string installdir = _installdir;
+
+    if (installdir.empty()) {
+        // add it in the same place the compiler found it, the prefix stripping
+        // takes care of compilers not installed in /usr
+        installdir = real_path(dir_name(file));
+    }
+
+    return add_file(file, installdir + '/' + file_name);
+}
+
+void EnvBuilder::load_hash_cache()
+{
+    FILE *f = fopen(hash_cache_name, "r");
+
+    if (!f) {
+        return;
+    }
+
+    char line[PATH_MAX + 128];
+
+    while (fgets(line, sizeof(line), f)) {
+        istringstream fields(line);
+        CachedHash hash;
+        unsigned long long size, inode;
+        string path;
+
+        if (fields >> hash.md5 >> size >> hash.mtime >> hash.mtime_nsec >> inode
+                && getline(fields >> ws, path)) {
+            hash.size = size;
+            hash.inode = inode;
+            m_hash_cache[path] = hash;
+        }
+    }
+
+    fclose(f);
+}
+
+void EnvBuilder::save_hash_cache()
+{
+    string tmpname = string(hash_cache_name) + ".tmp";
+    FILE *f = fopen(tmpname.c_str(), "w");
+
+    if (!f) {
+        return;
+    }
+
+    // only keep the files used by this environment, so that the cache doesn't grow forever
+    set<string> used;
+
+    for (map<string, EnvEntry>::const_iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        if (!it->second.generated) {
+            used.insert(it->second.source);
+        }
+    }
+
+    for (map<string, CachedHash>::const_iterator it = m_hash_cache.begin();
+            it != m_hash_cache.end(); ++it) {
+        if (used.count(it->first)) {
+            fprintf(f, "%s %llu %ld %ld %llu %s\n", it->second.md5.c_str(),
+                    (unsigned long long)it->second.size, (long)it->second.mtime,
+                    it->second.mtime_nsec, (unsigned long long)it->second.inode,
+                    it->first.c_str());
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmpname.c_str(), hash_cache_name) != 0) {
+        unlink(tmpname.c_str());
+    }
+}
+
+void EnvBuilder::hash_files()
+{
+    load_hash_cache();
+
+    // collect the files whose hash is not known yet
+    vector<string> tohash;
+    map<string, struct stat> stats;
+
+    for (map<string, EnvEntry>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        EnvEntry &entry = it->second;
+
+        if (entry.generated) {
+            entry.md5 = md5_for_buffer(entry.contents);
+            continue;
+        }
+
+        struct stat st;
+
+        if (stat(entry.source.c_str(), &st) != 0) {
+            continue;
+        }
+
+        entry.size = st.st_size;
+        stats[entry.source] = st;
+        map<string, CachedHash>::const_iterator cached = m_hash_cache.find(entry.source);
+
+        if (cached != m_hash_cache.end() && cached->second.size == st.st_size
+                && cached->second.mtime == st.st_mtim.tv_sec
+                && cached->second.mtime_nsec == st.st_mtim.tv_nsec
+                && cached->second.inode == st.st_ino) {
+            entry.md5 = cached->second.md5;
+        } else if (find(tohash.begin(), tohash.end(), entry.source) == tohash.end()) {
+            tohash.push_back(entry.source);
+        }
+    }
+
+    trace() << "hashing " << tohash.size() << " files, " << m_files.size() - tohash.size()
+            << " cached" << endl;
+
+    // Hash in several worker processes, each one handling every n-th file and reporting
+    // the results through a pipe, "-" for files they failed to read.
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = max(1L, min(min(workers, 16L), (long)tohash.size() / 8));
+    vector<string> results(tohash.size());
+    vector<pair<pid_t, int> > children;
+
+    for (long w = 1; w < workers; ++w) {
+        int fds[2];
+
+        if (pipe(fds) != 0) {
+            break;
+        }
+
+        flush_debug();
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+
+        if (pid == 0) {
+            close(fds[0]);
+            FILE *out = fdopen(fds[1], "w");
+
+            for (size_t i = w; out && i < tohash.size(); i += workers) {
+                string md5 = md5_for_path(tohash[i]);
+                fprintf(out, "%lu %s\n", (unsigned long)i, md5.empty() ? "-" : md5.c_str());
+            }
+
+            _exit(out && fclose(out) == 0 ? 0 : 1);
+        }
+
+        close(fds[1]);
+        children.push_back(make_pair(pid, fds[0]));
+    }
+
+    for (size_t i = 0; i < tohash.size(); i += workers) {
+        results[i] = md5_for_path(tohash[i]);
+    }
+
+    for (size_t c = 0; c < children.size(); ++c) {
+        FILE *in = fdopen(children[c].second, "r");
+        unsigned long index;
+        char md5[40];
+
+        while (in && fscanf(in, "%lu %39s", &index, md5) == 2) {
+            if (index < results.size()) {
+                results[index] = md5;
+            }
+        }
+
+        if (in) {
+            fclose(in);
+        } else {
+            close(children[c].second);
+        }
+
+        int status;
+
+        while (waitpid(children[c].first, &status, 0) < 0 && errno == EINTR) {}
+    }
+
+    map<string, string> hashed;
+
+    for (size_t i = 0; i < tohash.size(); ++i) {
+        if (results[i] == "-") {
+            // build() fails on the missing hash
+            results[i].clear();
+        } else if (results[i].empty()) {
+            // the share of a worker that failed to start or died
+            results[i] = md5_for_path(tohash[i]);
+        }
+
+        hashed[tohash[i]] = results[i];
+
+        if (results[i].empty()) {
+            continue;
+        }
+
+        const struct stat &st = stats[tohash[i]];
+        CachedHash &cached = m_hash_cache[tohash[i]];
+        cached.size = st.st_size;
+        cached.mtime = st.st_mtim.tv_sec;
+        cached.mtime_nsec = st.st_mtim.tv_nsec;
+        cached.inode = st.st_ino;
+        cached.md5 = results[i];
+    }
+
+    for (map<string, EnvEntry>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        if (it->second.md5.empty() && !it->second.generated) {
+            it->second.md5 = hashed[it->second.source];
+        }
+    }
+
+    save_hash_cache();
+}
+
+bool mkdir_p(const string &dir)
+{
+    if (dir.empty() || dir == "/" || ::access(dir.c_str(), F_OK) == 0) {
+        return true;
+    }
+
+    if (!mkdir_p(dir_name(dir))) {
+        return false;
+    }
+
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+bool copy_file(const string &from, const string &to, mode_t mode)
+{
+    if (link(from.c_str(), to.c_str()) == 0) {
+        return true;
+    }
+
+    int in = open(from.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    bool ret = out >= 0;
+    char buffer[65536];
+
+    while (ret) {
+        ssize_t bytes = read(in, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ret = bytes == 0;
+            break;
+        }
+
+        ret = write(out, buffer, bytes) == bytes;
+    }
+
+    close(in);
+
+    if (out >= 0 && close(out) != 0) {
+        ret = false;
+    }
+
+    return ret;
+}
+
+void remove_tree(const string &path)
+{
+    struct stat st;
+
+    if (lstat(path.c_str(), &st) != 0) {
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (DIR *d = opendir(path.c_str())) {
+            while (struct dirent *ent = readdir(d)) {
+                if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+                    remove_tree(path + '/' + ent->d_name);
+                }
+            }
+
+            closedir(d);
+        }
+
+        rmdir(path.c_str());
+    } else {
+        unlink(path.c_str());
+    }
+}
+
+// Runs ldconfig on a scratch tree containing only the shared libraries of the
+// environment (ldconfig needs nothing else) and returns the generated cache.
+bool EnvBuilder::run_ldconfig(string &cache_name, string &cache_contents)
+{
+    const char *ldconfig = "/sbin/ldconfig";
+
+    if (::access(ldconfig, X_OK) != 0) {
+        return true;
+    }
+
+    char tmpl[] = "/tmp/iceccenvXXXXXX";
+
+    if (!mkdtemp(tmpl)) {
+        log_perror("mkdtemp");
+        return false;
+    }
+
+    string tempdir = tmpl;
+
+    // special case for weird multilib setups, where e.g. /lib64 is a symlink to /usr/lib
+    static const char *const multilib_dirs[] = { "/lib", "/lib64", "/usr/lib", "/usr/lib64", NULL };
+
+    for (int i = 0; multilib_dirs[i]; ++i) {
+        string target;
+
+        if (resolve_link(multilib_dirs[i], target) != 0) {
+            continue;
+        }
+
+        if (target[0] == '/') {
+            // make it relative so that it points inside the scratch tree
+            string dir = dir_name(multilib_dirs[i]);
+            string up;
+
+            for (size_t pos = 0; dir != "/" && pos < dir.size(); ++pos) {
+                if (dir[pos] == '/') {
+                    up += "../";
+                }
+            }
+
+            target = up + target.substr(1);
+        }
+
+        mkdir_p(dir_name(tempdir + multilib_dirs[i]));
+
+        if (symlink(target.c_str(), (tempdir + multilib_dirs[i]).c_str()) != 0) {
+            log_perror("symlink") << "\t" << multilib_dirs[i] << endl;
+        }
+
+        // the link must not be dangling for mkdir_p() to work through it
+        string resolved = real_path(multilib_dirs[i]);
+
+        if (!resolved.empty()) {
+            mkdir_p(tempdir + resolved);
+        }
+    }
+
+    bool ret = true;
+
+    for (map<string, EnvEntry>::const_iterator it = m_files.begin(); ret && it != m_files.end();
+            ++it) {
+        const string &name = it->first;
+        string file = tempdir + name;
+
+        if (name.find(".so") == string::npos && name.compare(0, 5, "/etc/") != 0) {
+            continue;
+        }
+
+        if (::access(file.c_str(), F_OK) == 0) {
+            continue;
+        }
+
+        if (!mkdir_p(dir_name(file))) {
+            ret = false;
+        } else if (it->second.generated) {
+            int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, it->second.mode);
+            ret = fd >= 0 && write(fd, it->second.contents.data(), it->second.contents.size())
+                  == (ssize_t)it->second.contents.size();
+
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else {
+            ret = copy_file(it->second.source, file, it->second.mode);
+        }
+
+        if (!ret) {
+            log_perror("copying to scratch tree") << "\t" << name << endl;
+        }
+    }
+
+    if (ret) {
+        mkdir_p(tempdir + "/var/cache/ldconfig");
+        const char *argv[] = { ldconfig, "-r", tempdir.c_str(), NULL };
+        flush_debug();
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_WRONLY);
+
+            if (devnull >= 0) {
+                dup2(devnull, STDOUT_FILENO);
+                dup2(devnull, STDERR_FILENO);
+            }
+
+            execv(argv[0], const_cast<char *const *>(argv));
+            _exit(127);
+        }
+
+        int status = 0;
+
+        while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            log_error() << "ldconfig failed for the environment" << endl;
+            ret = false;
+        }
+    }
+
+    static const char *const cache_names[] = {
+        "/etc/ld.so.cache", "/var/cache/ldconfig/ld.so.cache", NULL
+    };
+
+    for (int i = 0; ret && cache_names[i]; ++i) {
+        FILE *f = fopen((tempdir + cache_names[i]).c_str(), "r");
+
+        if (!f) {
+            continue;
+        }
+
+        char buffer[65536];
+        size_t bytes;
+
+        while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            cache_contents.append(buffer, bytes);
+        }
+
+        fclose(f);
+        cache_name = cache_names[i];
+        break;
+    }
+
+    remove_tree(tempdir);
+    return ret;
+}
+
+// Writes 'value' as a zero-padded octal number into a tar header field.
+void tar_octal(char *field, size_t size, unsigned long long value)
+{
+    snprintf(field, size, "%0*llo", (int)size - 1, value);
+}
+
+void tar_header(string &out, const string &name, char type, mode_t mode, off_t size)
+{
+    char header[512];
+    memset(header, 0, sizeof(header));
+
+    // ustar can split up to 255 characters between prefix and name
+    string::size_type split = string::npos;
+
+    if (name.size() > 100) {
+        split = name.find('/', name.size() > 101 ? name.size() - 101 : 0);
+
+        if (split == string::npos || split > 155 || name.size() - split - 1 > 100) {
+            // use a GNU long name entry instead
+            tar_header(out, "././@LongLink", 'L', 0644, name.size() + 1);
+            out.append(name);
+            out.append(512 - name.size() % 512, '\0');
+            split = string::npos;
+        }
+    }
+
+    if (split == string::npos) {
+        strncpy(header, name.c_str(), 100);
+    } else {
+        strncpy(header, name.c_str() + split + 1, 100);
+        strncpy(header + 345, name.substr(0, split).c_str(), 155);
+    }
+
+    tar_octal(header + 100, 8, mode & 07777);
+    tar_octal(header + 108, 8, 0);      // uid
+    tar_octal(header + 116, 8, 0);      // gid
+    tar_octal(header + 124, 12, size);
+    tar_octal(header + 136, 12, tar_mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    memset(header + 148, ' ', 8);
+    unsigned int checksum = 0;
+
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        checksum += (unsigned char)header[i];
+    }
+
+    snprintf(header + 148, 8, "%06o", checksum);
+    out.append(header, sizeof(header));
+}
+
+bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool EnvBuilder::write_tarball(const string &filename)
+{
+    string tmpname = filename + ".tmp";
+    int out = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out < 0) {
+        log_perror("open") << "\t" << tmpname << endl;
+        return false;
+    }
+
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        close(out);
+        return false;
+    }
+
+    // Compression is by far the slowest part, so use pigz if available, otherwise trade
+    // some size for speed. -n keeps the name and timestamp out of the gzip header.
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        close(fds[1]);
+        dup2(fds[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execlp("pigz", "pigz", "-n", "-c", (char *)NULL);
+        execlp("gzip", "gzip", "-n", "-1", "-c", (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[0]);
+    close(out);
+    bool ret = pid > 0;
+
+    for (map<string, EnvEntry>::const_iterator it = m_files.begin(); ret && it != m_files.end();
+            ++it) {
+        const EnvEntry &entry = it->second;
+        string block;
+        tar_header(block, it->first.substr(1), '0', entry.mode, entry.size);
+
+        if (entry.generated) {
+            block += entry.contents;
+            ret = write_all(fds[1], block.data(), block.size());
+        } else {
+            ret = write_all(fds[1], block.data(), block.size());
+            int in = ret ? open(entry.source.c_str(), O_RDONLY) : -1;
+            off_t remaining = entry.size;
+            char buffer[65536];
+
+            ret = in >= 0;
+
+            while (ret && remaining > 0) {
+                ssize_t bytes = read(in, buffer, min((off_t)sizeof(buffer), remaining));
+
+                if (bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                // the file must not change while we're packing it
+                ret = bytes > 0 && write_all(fds[1], buffer, bytes);
+                remaining -= bytes;
+            }
+
+            if (in >= 0) {
+                close(in);
+            }
+
+            if (!ret) {
+                log_error() << "failed to pack " << entry.source << endl;
+            }
+        }
+
+        if (ret && entry.size % 512) {
+            string padding(512 - entry.size % 512, '\0');
+            ret = write_all(fds[1], padding.data(), padding.size());
+        }
+    }
+
+    if (ret) {
+        string trailer(1024, '\0');
+        ret = write_all(fds[1], trailer.data(), trailer.size());
+    }
+
+    close(fds[1]);
+    int status = 0;
+
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (!ret || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+            || rename(tmpname.c_str(), filename.c_str()) != 0) {
+        log_error() << "couldn't create archive " << filename << endl;
+        unlink(tmpname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool EnvBuilder::build(string &tarball)
+{
+    // for ldconfig -r to work, ld.so.conf must list the directories directly,
+    // the files it includes are not part of the environment
+    string ld_so_conf;
+
+    for (vector<string>::const_iterator it = m_library_dirs.begin();
+            it != m_library_dirs.end(); ++it) {
+        ld_so_conf += *it + '\n';
+    }
+
+    add_generated("/etc/ld.so.conf", ld_so_conf);
+
+    string cache_name, cache_contents;
+
+    if (!run_ldconfig(cache_name, cache_contents)) {
+        return false;
+    }
+
+    if (!cache_name.empty()) {
+        add_generated(cache_name, cache_contents);
+    }
+
+    hash_files();
+
+    // the files are sorted by name, which makes the checksum independent of ordering
+    string sums;
+
+    for (map<string, EnvEntry>::const_iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        if (it->second.md5.empty()) {
+            log_error() << "couldn't compute MD5 sum of " << it->first << endl;
+            return false;
+        }
+
+        sums += it->second.md5 + ' ' + it->first + '\n';
+    }
+
+    tarball = md5_for_buffer(sums) + ".tar.gz";
+
+    // unchanged files give the same name, so there's nothing to do
+    if (file_exists(tarball)) {
+        trace() << "reusing " << tarball << endl;
+        return true;
+    }
+
+    printf("creating %s\n", tarball.c_str());
+    return write_tarball(tarball);
+}
+
+// Returns the compiler binary itself, bypassing possible wrappers, and whether it is clang.
+bool detect_compiler(const string &compiler, string &binary, bool &clang)
+{
+    string test_output = read_command_output("echo 'clang __clang__ gcc __GNUC__' | "
+                                             + shell_quote(compiler) + " -E - 2>/dev/null");
+
+    if (test_output.find("clang 1 gcc") != string::npos) {
+        clang = true;
+        // -print-prog-name gives the full path to the actual clang binary, if passed
+        // just the binary name
+        binary = read_command_output(shell_quote(compiler) + " -print-prog-name="
+                                     + shell_quote(find_basename(compiler)));
+    } else if (test_output.find("clang __clang__ gcc") != string::npos) {
+        clang = false;
+        // -print-prog-name just prints "gcc", but gcc -v prints its argv[0] as COLLECT_GCC
+        string output = read_command_output(shell_quote(compiler) + " -v 2>&1");
+        string::size_type pos = output.find("COLLECT_GCC=");
+
+        if (pos == string::npos) {
+            log_error() << "failed to find gcc location" << endl;
+            return false;
+        }
+
+        pos += strlen("COLLECT_GCC=");
+        binary = output.substr(pos, output.find('\n', pos) - pos);
+    } else {
+        log_error() << compiler << " is not a known compiler" << endl;
+        return false;
+    }
+
+    if (binary.find('/') == string::npos) {
+        binary = compiler_path_lookup(binary);
+    }
+
+    binary = real_path(binary);
+    return !binary.empty() && ::access(binary.c_str(), X_OK) == 0;
+}
+
+}
+
+int create_native_env(const string &compiler, const list<string> &extrafiles)
+{
+    string added_compiler;
+    bool clang = false;
+
+    if (!detect_compiler(compiler, added_compiler, clang)) {
+        return -1;
+    }
+
+    // gzip dying must not kill us, write_tarball() handles the error
+    dcc_ignore_sigpipe(1);
+
+    EnvBuilder builder;
+
+    // for testing the environment is usable at all
+    if (file_exists("/bin/true")) {
+        builder.add_file("/bin/true");
+    } else if (file_exists("/usr/bin/true")) {
+        builder.add_file("/usr/bin/true", "/bin/true");
+    }
+
+    // in case the compiler is installed elsewhere
+    builder.set_stripprefix(dir_name(dir_name(added_compiler)));
+    bool ok = true;
+
+    if (!clang) {
+        string added_gxx = added_compiler;
+        string::size_type pos = added_gxx.rfind("gcc");
+
+        if (pos != string::npos) {
+            added_gxx.replace(pos, 3, "g++");
+        }
+
+        if (::access(added_gxx.c_str(), X_OK) != 0) {
+            log_error() << "'" << added_gxx << "' is no executable." << endl;
+            return -1;
+        }
+
+        ok = builder.add_file(added_compiler, "/usr/bin/gcc")
+             && builder.add_file(added_gxx, "/usr/bin/g++")
+             && builder.search_addfile(added_compiler, "cc1", "/usr/bin")
+             && builder.search_addfile(added_gxx, "cc1plus", "/usr/bin");
+        builder.search_addfile(added_compiler, "as", "/usr/bin");
+        builder.search_addfile(added_compiler, "specs");
+        builder.search_addfile(added_compiler, "liblto_plugin.so");
+        builder.search_addfile(added_compiler, "objcopy", "/usr/bin");
+    } else {
+        ok = builder.add_file(added_compiler, "/usr/bin/clang")
+             // Older remotes have /usr/bin/{gcc|g++} hardcoded, so include a wrapper
+             // that calls gcc or clang depending on an extra argument added by icecream.
+             && builder.add_file(PLIBDIR "/compilerwrapper", "/usr/bin/gcc")
+             && builder.add_file(PLIBDIR "/compilerwrapper", "/usr/bin/g++");
+        builder.search_addfile(added_compiler, "as", "/usr/bin");
+        builder.search_addfile(added_compiler, "objcopy", "/usr/bin");
+
+        // Clang accesses /proc/cpuinfo and reports an error if it's missing, even
+        // though it doesn't really need it.
+        builder.add_generated("/proc/cpuinfo", string());
+
+        // clang always uses its internal .h files
+        string clangincludes = read_command_output(shell_quote(added_compiler)
+                                                   + " -print-file-name=include/limits.h");
+
+        if (clangincludes.empty() || !file_exists(clangincludes)) {
+            log_error() << added_compiler << " cannot find its includes" << endl;
+            return -1;
+        }
+
+        ok = ok && builder.add_directory(real_path(dir_name(clangincludes)));
+    }
+
+    // Extra files (e.g. clang plugins) are usually referred to using their original path.
+    builder.set_stripprefix(string());
+
+    for (list<string>::const_iterator it = extrafiles.begin(); ok && it != extrafiles.end();
+            ++it) {
+        ok = builder.add_file(*it);
+    }
+
+    string tarball;
+
+    if (!ok || !builder.build(tarball)) {
+        return -1;
+    }
+
+    // Print the tarball name to fd 5 (if it's open, created by whatever has invoked this)
+    string line = tarball + '\n';
+    ignore_result(write(5, line.c_str(), line.size()));
+    return 0;
+}
+
+#else
+
+int create_native_env(const string &, const list<string> &)
+{
+    // Only ELF hosts are handled natively, the rest uses icecc-create-env.
+    return -1;
+}
+
+#endif
@@ -172,6 +172,18 @@ static int create_native(char **args)
         }
     }
 
+    list<string> extrafiles_list;
+
+    for (int extracount = 0; extrafiles[extracount]; extracount++) {
+        extrafiles_list.push_back(extrafiles[extracount]);
+    }
+
+    if (create_native_env(compiler, extrafiles_list) == 0) {
+        return 0;
+    }
+
+    log_warning() << "falling back to icecc-create-env" << endl;
+
     vector<char*> argv;
     struct stat st;
 
@@ -238,6 +250,50 @@ static void debug_arguments(int argc, char** argv, bool original)
     }
 }
 
+/* Which slot pool of the local daemon a local job belongs to, and how much
+   memory it roughly needs. Links need about twice their input in memory,
+   LTO links (which compile again) considerably more. */
+static JobLocalBeginMsg::job_class local_job_class(char **argv, bool icerun,
+                                                   unsigned int &mem_estimate)
+{
+    mem_estimate = 0;
+
+    if (icerun) {
+        return JobLocalBeginMsg::COMPILE_JOB;
+    }
+
+    bool lto = false;
+    unsigned long long input_size = 0;
+
+    for (int i = 1; argv[i]; ++i) {
+        const char *a = argv[i];
+
+        if (!strcmp(a, "-c") || !strcmp(a, "-S") || !strcmp(a, "-E")) {
+            return JobLocalBeginMsg::COMPILE_JOB;
+        }
+
+        if (!strcmp(a, "-flto") || !strncmp(a, "-flto=", 6)) {
+            lto = true;
+        } else if (!strcmp(a, "-fno-lto")) {
+            lto = false;
+        } else if (!strcmp(a, "-o")) {
+            // the output may still be there from the last build
+            if (argv[i + 1]) {
+                ++i;
+            }
+        } else if (a[0] != '-') {
+            struct stat st;
+
+            if (stat(a, &st) == 0 && S_ISREG(st.st_mode)) {
+                input_size += st.st_size;
+            }
+        }
+    }
+
+    mem_estimate = (input_size * (lto ? 8 : 2)) >> 20;
+    return lto ? JobLocalBeginMsg::HEAVY_JOB : JobLocalBeginMsg::LINK_JOB;
+}
+
 class ArgumentExpander
 {
 public:
@@ -568,8 +624,12 @@ int main(int argc, char **argv)
         struct rusage ru;
         Msg *startme = 0L;
 
+        unsigned int mem_estimate;
+        JobLocalBeginMsg::job_class job_class = local_job_class(argv, icerun, mem_estimate);
+
         /* Inform the daemon that we like to start a job.  */
-        if (local_daemon->send_msg(JobLocalBeginMsg(0, get_absfilename(job.outputFile())))) {
+        if (local_daemon->send_msg(JobLocalBeginMsg(0, get_absfilename(job.outputFile()),
+                                                    job_class, mem_estimate))) {
             /* Now wait until the daemon gives us the start signal.  40 minutes
                should be enough for all normal compile or link jobs.  */
             startme = local_daemon->get_msg(40 * 60);
@@ -41,6 +41,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pwd.h>
 #include <map>
 #include <algorithm>
 #include <netinet/in.h>
@@ -221,6 +222,30 @@ get_absfilename(const string &_file)
     return file;
 }
 
+/* The tarballs for ENVS, so that the local daemon can send them to other compile servers. */
+static list<string>
+env_files(const Environments &envs, map<string, string> &versionfile_map)
+{
+    list<string> files;
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        files.push_back(get_absfilename(versionfile_map[it->first]));
+    }
+
+    return files;
+}
+
+/* Whose share of the compile farm our jobs use up, $ICECC_SHARE_ID overrides the login. */
+static string share_user()
+{
+    if (const char *id = getenv("ICECC_SHARE_ID")) {
+        return id;
+    }
+
+    struct passwd *pw = getpwuid(getuid());
+    return pw ? pw->pw_name : string();
+}
+
 static UseCSMsg *get_server(MsgChannel *local_daemon)
 {
     Msg *umsg = local_daemon->get_msg(4 * 60);
@@ -247,7 +272,9 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
-static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
+/* Sends what comes from CPP_FD to the server, and keeps a copy in SOURCE
+   if that is given.  */
+static void write_server_cpp(int cpp_fd, MsgChannel *cserver, string *source = 0)
 {
     unsigned char buffer[100000]; // some random but huge number
     off_t offset = 0;
@@ -273,6 +300,10 @@ static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
             break;
         } while (1);
 
+        if (source) {
+            source->append((const char *)buffer + offset, bytes);
+        }
+
         offset += bytes;
 
         if (!bytes || offset == sizeof(buffer)) {
@@ -310,6 +341,25 @@ static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
     }
 }
 
+/* Sends the preprocessed source kept by write_server_cpp() again.  */
+static void write_server_source(const string &source, MsgChannel *cserver)
+{
+    const size_t chunk_size = 100000;
+
+    for (size_t pos = 0; pos < source.size(); pos += chunk_size) {
+        FileChunkMsg fcmsg((unsigned char *)source.data() + pos,
+                           min(chunk_size, source.size() - pos));
+
+        if (!cserver->send_msg(fcmsg)) {
+            Msg *m = cserver->get_msg(2);
+            check_for_failure(m, cserver);
+
+            log_error() << "write of source chunk to host " << cserver->name.c_str() << endl;
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+    }
+}
+
 static void receive_file(const string& output_file, MsgChannel* cserver)
 {
     string tmp_file = output_file + "_icetmp";
@@ -385,9 +435,40 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
     }
 }
 
+static void check_verify_env_result(const CompileJob &job, MsgChannel *cserver,
+                                    const string &hostname, MsgChannel *local_daemon,
+                                    int timeout = 60)
+{
+    Msg *verify_msg = cserver->get_msg(timeout);
+
+    if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
+        if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
+            // The remote can't handle the environment at all (e.g. kernel too old),
+            // mark it as never to be used again for this environment.
+            log_info() << "Host " << hostname
+                       << " did not successfully verify environment."
+                       << endl;
+            BlacklistHostEnvMsg blacklist(job.targetPlatform(),
+                                          job.environmentVersion(), hostname);
+            local_daemon->send_msg(blacklist);
+            delete verify_msg;
+            throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
+        } else
+            trace() << "Verified host " << hostname << " for environment "
+                    << job.environmentVersion() << " (" << job.targetPlatform() << ")"
+                    << endl;
+        delete verify_msg;
+    } else {
+        delete verify_msg;
+        throw client_error(25, "Error 25 - other error verifying environment on remote");
+    }
+}
+
+/* SOURCE is the preprocessed source if the job was redirected and it ran
+   the preprocessor for another server already.  */
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output, const string *source = 0)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
@@ -404,6 +485,9 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     int status = 255;
 
     MsgChannel *cserver = 0;
+    bool verify_pending = false;
+    // servers that may pass the job on get the same source again
+    string kept_source;
 
     try {
         cserver = Service::createChannel(hostname, port, 10);
@@ -415,32 +499,61 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         if (!got_env) {
-            log_block b("Transfer Environment");
-            // transfer env
-            struct stat buf;
+            bool fetched = false;
 
-            if (stat(version_file.c_str(), &buf)) {
-                log_perror("error stat'ing file") << "\t" << version_file << endl;
-                throw client_error(4, "Error 4 - unable to stat version file");
-            }
+            if (!usecs->env_peers.empty() && IS_PROTOCOL_41(cserver)) {
+                log_block b("Fetch Environment");
+                // other compile servers have it, let the remote get it from them
+                FetchEnvMsg msg(job.targetPlatform(), job.environmentVersion(), usecs->env_peers);
+
+                if (!cserver->send_msg(msg)) {
+                    throw client_error(6, "Error 6 - send environment to remove failed");
+                }
 
-            EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+                Msg *fetch_msg = cserver->get_msg(MAX_BUSY_INSTALLING);
 
-            if (!cserver->send_msg(msg)) {
-                throw client_error(6, "Error 6 - send environment to remove failed");
-            }
+                if (!fetch_msg || fetch_msg->type != M_FETCH_ENV_RESULT) {
+                    delete fetch_msg;
+                    throw client_error(32, "Error 32 - remote failed to fetch environment");
+                }
 
-            int env_fd = open(version_file.c_str(), O_RDONLY);
+                fetched = static_cast<FetchEnvResultMsg*>(fetch_msg)->ok;
+                delete fetch_msg;
 
-            if (env_fd < 0) {
-                throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
+                if (!fetched) {
+                    trace() << "Host " << hostname << " could not fetch environment, sending it"
+                            << endl;
+                }
             }
 
-            write_server_cpp(env_fd, cserver);
+            if (!fetched) {
+                log_block b("Transfer Environment");
+                // transfer env
+                struct stat buf;
 
-            if (!cserver->send_msg(EndMsg())) {
-                log_error() << "write of environment failed" << endl;
-                throw client_error(8, "Error 8 - write environment to remote failed");
+                if (stat(version_file.c_str(), &buf)) {
+                    log_perror("error stat'ing file") << "\t" << version_file << endl;
+                    throw client_error(4, "Error 4 - unable to stat version file");
+                }
+
+                EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+
+                if (!cserver->send_msg(msg)) {
+                    throw client_error(6, "Error 6 - send environment to remove failed");
+                }
+
+                int env_fd = open(version_file.c_str(), O_RDONLY);
+
+                if (env_fd < 0) {
+                    throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
+                }
+
+                write_server_cpp(env_fd, cserver);
+
+                if (!cserver->send_msg(EndMsg())) {
+                    log_error() << "write of environment failed" << endl;
+                    throw client_error(8, "Error 8 - write environment to remote failed");
+                }
             }
 
             if (IS_PROTOCOL_31(cserver)) {
@@ -450,28 +563,13 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                     throw client_error(22, "Error 22 - error sending environment");
                 }
 
-                Msg *verify_msg = cserver->get_msg(60);
-
-                if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
-                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
-                        // The remote can't handle the environment at all (e.g. kernel too old),
-                        // mark it as never to be used again for this environment.
-                        log_info() << "Host " << hostname
-                                   << " did not successfully verify environment."
-                                   << endl;
-                        BlacklistHostEnvMsg blacklist(job.targetPlatform(),
-                                                      job.environmentVersion(), hostname);
-                        local_daemon->send_msg(blacklist);
-                        delete verify_msg;
-                        throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
-                    } else
-                        trace() << "Verified host " << hostname << " for environment "
-                                << job.environmentVersion() << " (" << job.targetPlatform() << ")"
-                                << endl;
-                    delete verify_msg;
-                } else {
-                    delete verify_msg;
-                    throw client_error(25, "Error 25 - other error verifying environment on remote");
+                // Newer remotes get the compile job right away, the result of the
+                // verification is read before the compile result.
+                verify_pending = true;
+
+                if (!IS_PROTOCOL_43(cserver)) {
+                    check_verify_env_result(job, cserver, hostname, local_daemon);
+                    verify_pending = false;
                 }
             }
         }
@@ -498,7 +596,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
+        if (source) {
+            log_block b("write_server_source");
+            write_server_source(*source, cserver);
+        } else if (!preproc_file) {
             int sockets[2];
 
             if (pipe(sockets)) {
@@ -517,7 +618,8 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
 
             try {
                 log_block bl2("write_server_cpp from cpp");
-                write_server_cpp(sockets[0], cserver);
+                write_server_cpp(sockets[0], cserver,
+                                 IS_PROTOCOL_50(cserver) ? &kept_source : 0);
             } catch (...) {
                 kill(cpp_pid, SIGTERM);
                 throw;
@@ -549,6 +651,12 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(12, "Error 12 - failed to send file to remote");
         }
 
+        if (verify_pending) {
+            // comes with the compile result, which is thrown away if the
+            // environment doesn't work
+            check_verify_env_result(job, cserver, hostname, local_daemon, 12 * 60);
+        }
+
         Msg *msg;
         {
             log_block wait_cs("wait for cs");
@@ -559,6 +667,31 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
+        if (msg->type == M_USE_CS) {
+            // the job had not started yet and the scheduler moved it to a less busy host
+            UseCSMsg *redirect = static_cast<UseCSMsg *>(msg);
+            trace() << "job " << job.jobID() << " moved from " << hostname << " to "
+                    << redirect->hostname << endl;
+            delete cserver;
+            cserver = 0;
+            remote_daemon = redirect->hostname;
+
+            try {
+                if (!source && !kept_source.empty()) {
+                    source = &kept_source;
+                }
+
+                status = build_remote_int(job, redirect, local_daemon, environment, version_file,
+                                          preproc_file, output, source);
+            } catch (...) {
+                delete redirect;
+                throw;
+            }
+
+            delete redirect;
+            return status;
+        }
+
         check_for_failure(msg, cserver);
 
         if (msg->type != M_COMPILE_RESULT) {
@@ -780,6 +913,8 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     }
 
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
+    const string user = share_user();
+    const char *priority = getenv("ICECC_PRIORITY");
 
     if (torepeat == 1) {
         string fake_filename;
@@ -801,6 +936,9 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job));
+        getcs.env_files = env_files(envs, versionfile_map);
+        getcs.user = user;
+        getcs.priority = priority ? atoi(priority) : 0;
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
@@ -854,6 +992,9 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job));
+        getcs.env_files = env_files(envs, versionfile_map);
+        getcs.user = user;
+        getcs.priority = priority ? atoi(priority) : 0;
 
 
         if (!local_daemon->send_msg(getcs)) {
@@ -0,0 +1,138 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "autotune.h"
+#include <logging.h>
+#include <algorithm>
+
+using namespace std;
+
+// long enough for a few jobs to finish at every slot
+static const time_t window_seconds = 30;
+// throughput has to drop by more than this to count as congestion
+static const double congestion_drop = 0.95;
+
+ConcurrencyTuner::ConcurrencyTuner()
+    : m_max(1)
+    , m_limit(1)
+    , m_enabled(false)
+    , m_slowStart(false)
+    , m_windowStart(0)
+    , m_lastSample(0)
+    , m_busy(0)
+    , m_bytes(0)
+    , m_jobs(0)
+{
+}
+
+void ConcurrencyTuner::init(unsigned int max, bool enabled)
+{
+    m_max = std::max(max, 1U);
+    m_limit = enabled ? (m_max + 1) / 2 : m_max;
+    m_enabled = enabled;
+    m_slowStart = enabled;
+    m_throughput.clear();
+}
+
+unsigned int ConcurrencyTuner::limit() const
+{
+    return m_limit;
+}
+
+string ConcurrencyTuner::dump() const
+{
+    if (!m_enabled) {
+        return "fixed at " + toString(m_limit);
+    }
+
+    string result = toString(m_limit) + " of " + toString(m_max);
+
+    for (map<unsigned int, double>::const_iterator it = m_throughput.begin();
+            it != m_throughput.end(); ++it) {
+        result += ", " + toString(it->first) + ": " + toString(int(it->second / 1024)) + " KiB/s";
+    }
+
+    return result;
+}
+
+void ConcurrencyTuner::jobDone(unsigned int out_bytes)
+{
+    m_bytes += out_bytes;
+    m_jobs++;
+}
+
+bool ConcurrencyTuner::update(time_t now, unsigned int running, unsigned int memory_fillgrade,
+                              unsigned int mem_pressure)
+{
+    if (!m_enabled) {
+        return false;
+    }
+
+    if (!m_windowStart || now < m_lastSample) {
+        m_windowStart = m_lastSample = now;
+        m_busy = 0;
+        m_bytes = m_jobs = 0;
+        return false;
+    }
+
+    m_busy += double(running) * (now - m_lastSample);
+    m_lastSample = now;
+
+    if (now - m_windowStart < window_seconds) {
+        return false;
+    }
+
+    double seconds = now - m_windowStart;
+    double concurrency = m_busy / seconds;
+    double throughput = m_bytes / seconds;
+    unsigned int old = m_limit;
+
+    if (memory_fillgrade >= 900 || mem_pressure >= 100) {
+        m_limit = std::max(1U, m_limit * 3 / 4);
+        m_slowStart = false;
+    } else if (concurrency >= m_limit - 0.5 && m_jobs >= m_limit) {
+        // only a saturated window says something about this limit
+        double &average = m_throughput[m_limit];
+        average = average ? 0.7 * average + 0.3 * throughput : throughput;
+
+        map<unsigned int, double>::const_iterator fewer = m_throughput.lower_bound(m_limit);
+
+        if (fewer != m_throughput.begin() && (--fewer)->second * congestion_drop > average) {
+            m_limit = std::max(1U, std::min(m_limit - 1, m_limit * 7 / 8));
+            m_slowStart = false;
+        } else if (m_limit < m_max) {
+            m_limit = m_slowStart ? std::min(m_max, m_limit * 2) : m_limit + 1;
+        }
+    }
+
+    m_windowStart = now;
+    m_busy = 0;
+    m_bytes = m_jobs = 0;
+
+    if (m_limit != old) {
+        log_info() << "adjusting maximum of concurrent jobs from " << old << " to " << m_limit
+                   << " (" << int(concurrency * 10) / 10.0 << " busy, "
+                   << int(throughput / 1024) << " KiB/s)" << endl;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_AUTOTUNE_H
+#define ICECREAM_AUTOTUNE_H
+
+#include <map>
+#include <string>
+#include <time.h>
+
+/**
+ * Tunes the number of concurrent compile jobs AIMD-style. While the slots
+ * are saturated, the output throughput at the current limit is compared to
+ * the one at the next lower limit seen: if more jobs got less done (CPU
+ * quota, thermal throttling, other workloads), the limit is cut, otherwise
+ * it grows by one up to the configured maximum. Memory pressure cuts it by
+ * a quarter. Like TCP it starts at half the maximum and doubles until the
+ * first cut, so that there is something to compare with.
+ */
+class ConcurrencyTuner
+{
+public:
+    ConcurrencyTuner();
+
+    // If not enabled the limit stays at max.
+    void init(unsigned int max, bool enabled);
+
+    unsigned int limit() const;
+    std::string dump() const;
+
+    void jobDone(unsigned int out_bytes);
+
+    // Called periodically with the current state, returns true if the limit changed.
+    bool update(time_t now, unsigned int running, unsigned int memory_fillgrade,
+                unsigned int mem_pressure);
+
+private:
+    unsigned int m_max;
+    unsigned int m_limit;
+    bool m_enabled;
+    bool m_slowStart;
+
+    time_t m_windowStart;
+    time_t m_lastSample;
+    double m_busy; // job seconds in this window
+    unsigned long long m_bytes;
+    unsigned int m_jobs;
+
+    // average output bytes per second seen at each saturated limit
+    std::map<unsigned int, double> m_throughput;
+};
+
+#endif
@@ -0,0 +1,334 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "cgroup.h"
+#include "workit.h"
+#include <logging.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char cgroup_root[] = "/sys/fs/cgroup";
+
+// where the per-job cgroups are created, empty if they are not used
+static string jobs_dir;
+
+bool read_cgroup_file(int dirfd, const string &file, char *buf, size_t size)
+{
+    int fd = openat(dirfd, file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    ssize_t n;
+
+    while ((n = read(fd, buf, size - 1)) < 0 && errno == EINTR) {}
+
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = '\0';
+    return true;
+}
+
+static bool write_cgroup_file(const string &file, const string &value)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    ssize_t n;
+
+    while ((n = write(fd, value.c_str(), value.size())) < 0 && errno == EINTR) {}
+
+    int saved_errno = errno;
+
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    errno = saved_errno;
+    return n == ssize_t(value.size());
+}
+
+unsigned long long cgroup_key(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+
+    for (const char *b = strstr(buf, key); b; b = strstr(b + 1, key)) {
+        if ((b == buf || b[-1] == '\n') && b[len] == ' ') {
+            return strtoull(b + len + 1, NULL, 10);
+        }
+    }
+
+    return 0;
+}
+
+const string &cgroup_dir()
+{
+    static string dir;
+    static bool checked = false;
+
+    if (checked) {
+        return dir;
+    }
+
+    checked = true;
+    char buf[4096];
+
+    if (!read_cgroup_file(AT_FDCWD, "/proc/self/cgroup", buf, sizeof(buf))) {
+        return dir;
+    }
+
+    const char *line = strstr(buf, "0::");
+
+    while (line && line != buf && line[-1] != '\n') {
+        line = strstr(line + 1, "0::");
+    }
+
+    if (!line) {
+        return dir;
+    }
+
+    string path(line + 3, strcspn(line + 3, "\n"));
+    string candidate = cgroup_root + (path == "/" ? string() : path);
+
+    if (access((candidate + "/cgroup.controllers").c_str(), R_OK) == 0) {
+        dir = candidate;
+    }
+
+    return dir;
+}
+
+/* Enables those of CONTROLLERS that DIR has for its children. */
+static void enable_controllers(const string &dir, const char *const controllers[])
+{
+    char available[256];
+
+    if (!read_cgroup_file(AT_FDCWD, dir + "/cgroup.controllers", available, sizeof(available))) {
+        return;
+    }
+
+    for (int i = 0; controllers[i]; ++i) {
+        if (strstr(available, controllers[i])
+                && !write_cgroup_file(dir + "/cgroup.subtree_control", string("+") + controllers[i])) {
+            log_perror("enabling cgroup controller") << "\t" << controllers[i] << " in " << dir << endl;
+        }
+    }
+}
+
+static void remove_stale_job_cgroups(const string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(d)) {
+        if (!strncmp(ent->d_name, "job-", 4)) {
+            (void) rmdir((dir + "/" + ent->d_name).c_str());
+        }
+    }
+
+    closedir(d);
+}
+
+bool init_job_cgroups(int nice_level)
+{
+    static const char *const controllers[] = { "memory", "cpu", "io", 0 };
+    string base = cgroup_dir();
+
+    if (base.empty() || access((base + "/cgroup.subtree_control").c_str(), W_OK) != 0) {
+        return false;
+    }
+
+    char buf[256];
+
+    if (!read_cgroup_file(AT_FDCWD, base + "/cgroup.controllers", buf, sizeof(buf))
+            || !strstr(buf, "memory")) {
+        return false;
+    }
+
+    string jobs;
+
+    if (base == cgroup_root) {
+        // the root cgroup may have both processes and children
+        jobs = base + "/icecream-jobs";
+    } else {
+        // other cgroups can only have controllers enabled for their children
+        // if they have no processes of their own, so move us into a leaf
+        string leaf = base + "/daemon";
+
+        if ((mkdir(leaf.c_str(), 0755) < 0 && errno != EEXIST)
+                || !write_cgroup_file(leaf + "/cgroup.procs", toString(getpid()))) {
+            log_perror("moving daemon into its own cgroup") << "\t" << leaf << endl;
+            return false;
+        }
+
+        jobs = base + "/jobs";
+    }
+
+    enable_controllers(base, controllers);
+
+    if (mkdir(jobs.c_str(), 0755) < 0 && errno != EEXIST) {
+        log_perror("mkdir") << "\t" << jobs << endl;
+        return false;
+    }
+
+    enable_controllers(jobs, controllers);
+    remove_stale_job_cgroups(jobs);
+
+    if (access((jobs + "/cgroup.subtree_control").c_str(), W_OK) != 0) {
+        return false;
+    }
+
+    // Niceness only orders tasks within a cgroup, so give the jobs as a whole
+    // the weight of their nice level (100 is the weight of nice 0, and every
+    // nice level is worth 25%) to keep the daemon responsive.
+    int weight = std::max(1, std::min(10000, int(100 / pow(1.25, nice_level) + 0.5)));
+    (void) write_cgroup_file(jobs + "/cpu.weight", toString(weight));
+    (void) write_cgroup_file(jobs + "/io.weight", "default " + toString(weight));
+
+    jobs_dir = jobs;
+    log_info() << "compile jobs run in cgroups below " << jobs_dir << endl;
+    return true;
+}
+
+int enter_job_cgroup(unsigned long int mem_limit)
+{
+    if (jobs_dir.empty()) {
+        return -1;
+    }
+
+    string dir = jobs_dir + "/job-" + toString(getpid());
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        log_perror("mkdir") << "\t" << dir << endl;
+        return -1;
+    }
+
+    // Reclaim and throttle above the limit, and only kill at twice
+    // that: unlike RLIMIT_AS this is real use, not address space.
+    unsigned long long limit = (unsigned long long) mem_limit * 1024 * 1024;
+    (void) write_cgroup_file(dir + "/memory.high", toString(limit));
+    (void) write_cgroup_file(dir + "/memory.max", toString(2 * limit));
+    // No memory.oom.group: the serving process is in here as well, and
+    // it has to survive to tell the client that the job ran out of memory.
+    // The OOM killer picks the largest task, which is the compiler.
+
+    if (!write_cgroup_file(dir + "/cgroup.procs", "0")) {
+        log_perror("entering job cgroup") << "\t" << dir << endl;
+        (void) rmdir(dir.c_str());
+        return -1;
+    }
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log_perror("open") << "\t" << dir << endl;
+    }
+
+    return fd;
+}
+
+/* Total stall time ("some" line) of a PSI file, in milliseconds. */
+static unsigned int stall_msec(int fd, const char *file)
+{
+    char buf[256];
+
+    if (!read_cgroup_file(fd, file, buf, sizeof(buf))) {
+        return 0;
+    }
+
+    const char *total = strstr(buf, "total=");
+    return total ? strtoull(total + 6, NULL, 10) / 1000 : 0;
+}
+
+void job_cgroup_stats(int fd, unsigned int job_stat[])
+{
+    char buf[4096];
+
+    // memory.peak is only there since Linux 5.19
+    if (read_cgroup_file(fd, "memory.peak", buf, sizeof(buf))) {
+        job_stat[JobStatistics::mem_peak] = strtoull(buf, NULL, 10) / 1024;
+    }
+
+    if (read_cgroup_file(fd, "io.stat", buf, sizeof(buf))) {
+        // "MAJ:MIN rbytes=N wbytes=N rios=N ..." per device
+        unsigned long long bytes = 0;
+        const char *keys[] = { "rbytes=", "wbytes=" };
+
+        for (int i = 0; i < 2; ++i) {
+            for (const char *b = strstr(buf, keys[i]); b; b = strstr(b + 1, keys[i])) {
+                bytes += strtoull(b + strlen(keys[i]), NULL, 10);
+            }
+        }
+
+        job_stat[JobStatistics::io_kb] = bytes / 1024;
+    }
+
+    if (read_cgroup_file(fd, "cpu.stat", buf, sizeof(buf))) {
+        job_stat[JobStatistics::cpu_usage_msec] = cgroup_key(buf, "usage_usec") / 1000;
+        job_stat[JobStatistics::cpu_user_msec] = cgroup_key(buf, "user_usec") / 1000;
+        job_stat[JobStatistics::cpu_system_msec] = cgroup_key(buf, "system_usec") / 1000;
+    }
+
+    job_stat[JobStatistics::cpu_stall_msec] = stall_msec(fd, "cpu.pressure");
+    job_stat[JobStatistics::mem_stall_msec] = stall_msec(fd, "memory.pressure");
+    job_stat[JobStatistics::io_stall_msec] = stall_msec(fd, "io.pressure");
+}
+
+bool job_cgroup_oom(int fd)
+{
+    char buf[512];
+    return read_cgroup_file(fd, "memory.events", buf, sizeof(buf))
+           && cgroup_key(buf, "oom_kill") > 0;
+}
+
+void remove_job_cgroup(pid_t pid)
+{
+    if (jobs_dir.empty()) {
+        return;
+    }
+
+    string dir = jobs_dir + "/job-" + toString(pid);
+
+    if (rmdir(dir.c_str()) < 0 && errno != ENOENT) {
+        log_perror("rmdir") << "\t" << dir << endl;
+    }
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CGROUP_H
+#define ICECREAM_CGROUP_H
+
+#include <string>
+#include <sys/types.h>
+
+// Directory of the cgroup (v2) the daemon was started in,
+// empty if there is no unified hierarchy.
+const std::string &cgroup_dir();
+
+// Reads a small cgroup or proc file (relative to dirfd unless absolute).
+bool read_cgroup_file(int dirfd, const std::string &file, char *buf, size_t size);
+
+// Value of KEY in a flat keyed file such as cpu.stat ("key value" lines).
+unsigned long long cgroup_key(const char *buf, const char *key);
+
+// Moves the daemon into a leaf of its cgroup and enables the memory, cpu and io
+// controllers for per-job cgroups next to it. Returns false if the cgroup has
+// not been delegated to us, in which case jobs run without their own cgroups.
+bool init_job_cgroups(int nice_level);
+
+// Called in the forked job process: creates a cgroup for it limited to
+// mem_limit megabytes and moves the process into it. Returns an fd of
+// the cgroup directory, or -1 if jobs don't get their own cgroups.
+int enter_job_cgroup(unsigned long int mem_limit);
+
+// Fills the cgroup accounting fields of job_stat once the compiler exited.
+void job_cgroup_stats(int fd, unsigned int job_stat[]);
+
+// Whether the kernel OOM killer had to kill something in the job cgroup.
+bool job_cgroup_oom(int fd);
+
+// Removes the cgroup of the exited job process PID, if there is one.
+void remove_job_cgroup(pid_t pid);
+
+#endif
@@ -0,0 +1,289 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "cpuslots.h"
+#include <logging.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// used until enough jobs were measured; SMT siblings are about 40% slower
+static const uint32_t prior_speed[CPUSlots::NumClasses] = { 1000, 600, 500 };
+static const unsigned int min_samples = 10;
+
+CPUSlots::CPUSlots()
+    : m_cores(0)
+    , m_nodes(0)
+{
+    for (int i = 0; i < NumClasses; ++i) {
+        m_speed[i] = 0;
+        m_samples[i] = 0;
+    }
+}
+
+#ifdef __linux__
+static int read_int(const string &file)
+{
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return -1;
+    }
+
+    int val = -1;
+
+    if (fscanf(f, "%d", &val) != 1) {
+        val = -1;
+    }
+
+    fclose(f);
+    return val;
+}
+
+static int numa_node(const string &cpu_dir)
+{
+    DIR *d = opendir(cpu_dir.c_str());
+
+    if (!d) {
+        return 0;
+    }
+
+    int node = 0;
+
+    while (struct dirent *ent = readdir(d)) {
+        if (!strncmp(ent->d_name, "node", 4) && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(d);
+    return node;
+}
+#endif
+
+void CPUSlots::init()
+{
+    m_slots.clear();
+    m_cores = m_nodes = 0;
+
+#ifdef __linux__
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        log_perror("sched_getaffinity");
+        return;
+    }
+
+    // node -> (package, core) -> threads
+    map<int, map<pair<int, int>, vector<int> > > topology;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        string dir = "/sys/devices/system/cpu/cpu" + toString(cpu);
+        int core = read_int(dir + "/topology/core_id");
+
+        if (core < 0) {
+            // no topology information, we would only guess
+            return;
+        }
+
+        int package = read_int(dir + "/topology/physical_package_id");
+        topology[numa_node(dir)][make_pair(package, core)].push_back(cpu);
+    }
+
+    vector<vector<vector<int> > > nodes;
+
+    for (map<int, map<pair<int, int>, vector<int> > >::const_iterator nit = topology.begin();
+            nit != topology.end(); ++nit) {
+        nodes.push_back(vector<vector<int> >());
+
+        for (map<pair<int, int>, vector<int> >::const_iterator cit = nit->second.begin();
+                cit != nit->second.end(); ++cit) {
+            nodes.back().push_back(cit->second);
+        }
+
+        m_cores += nit->second.size();
+    }
+
+    m_nodes = nodes.size();
+
+    // one thread of every core first, then the next, interleaving
+    // the nodes so that memory bandwidth is shared evenly
+    for (size_t thread = 0; m_slots.size() < size_t(CPU_COUNT(&allowed)); ++thread) {
+        for (size_t core = 0; ; ++core) {
+            bool any = false;
+
+            for (size_t node = 0; node < nodes.size(); ++node) {
+                if (core >= nodes[node].size()) {
+                    continue;
+                }
+
+                any = true;
+
+                if (thread < nodes[node][core].size()) {
+                    Slot slot;
+                    slot.core_cpus = nodes[node][core];
+                    slot.speed_class = thread == 0 ? OwnCore : SharedCore;
+                    slot.busy = false;
+                    m_slots.push_back(slot);
+                }
+            }
+
+            if (!any) {
+                break;
+            }
+        }
+    }
+#endif
+}
+
+size_t CPUSlots::count() const
+{
+    return m_slots.size();
+}
+
+string CPUSlots::dump() const
+{
+    size_t busy = 0;
+
+    for (vector<Slot>::const_iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+        busy += it->busy;
+    }
+
+    string result = toString(m_slots.size()) + " slots on " + toString(m_cores) + " cores, "
+                    + toString(m_nodes) + " nodes, " + toString(busy) + " busy";
+
+    for (int i = 0; i < NumClasses; ++i) {
+        result += ", class " + toString(i) + ": " + toString(m_samples[i]) + " jobs";
+    }
+
+    return result;
+}
+
+int CPUSlots::acquire()
+{
+    for (size_t i = 0; i < m_slots.size(); ++i) {
+        if (!m_slots[i].busy) {
+            m_slots[i].busy = true;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void CPUSlots::release(int slot)
+{
+    if (slot >= 0 && size_t(slot) < m_slots.size()) {
+        m_slots[slot].busy = false;
+    }
+}
+
+vector<int> CPUSlots::cpus(int slot) const
+{
+    if (slot < 0 || size_t(slot) >= m_slots.size()) {
+        return vector<int>();
+    }
+
+    return m_slots[slot].core_cpus;
+}
+
+CPUSlots::SpeedClass CPUSlots::speedClass(int slot) const
+{
+    if (slot < 0 || size_t(slot) >= m_slots.size()) {
+        return Unpinned;
+    }
+
+    return m_slots[slot].speed_class;
+}
+
+void CPUSlots::jobDone(int slot, unsigned int out_bytes, unsigned int cpu_msec)
+{
+    // too small to say anything
+    if (cpu_msec < 100) {
+        return;
+    }
+
+    SpeedClass c = speedClass(slot);
+    double speed = double(out_bytes) / cpu_msec;
+
+    if (m_samples[c]) {
+        m_speed[c] = 0.9 * m_speed[c] + 0.1 * speed;
+    } else {
+        m_speed[c] = speed;
+    }
+
+    m_samples[c]++;
+}
+
+vector<uint32_t> CPUSlots::slotSpeeds(unsigned int max_kids) const
+{
+    vector<uint32_t> speeds;
+
+    for (unsigned int i = 0; i < max_kids; ++i) {
+        SpeedClass c = i < m_slots.size() ? m_slots[i].speed_class : Unpinned;
+        uint32_t speed = prior_speed[c];
+
+        if (c != OwnCore && m_samples[OwnCore] >= min_samples && m_samples[c] >= min_samples
+                && m_speed[OwnCore] > 0) {
+            speed = uint32_t(min(1000.0, 1000 * m_speed[c] / m_speed[OwnCore]));
+        }
+
+        speeds.push_back(speed);
+    }
+
+    return speeds;
+}
+
+void pin_to_cpus(const vector<int> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty()) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (vector<int>::const_iterator it = cpus.begin(); it != cpus.end(); ++it) {
+        CPU_SET(*it, &set);
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        log_perror("sched_setaffinity");
+    }
+#else
+    (void) cpus;
+#endif
+}
@@ -0,0 +1,87 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CPUSLOTS_H
+#define ICECREAM_CPUSLOTS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Job slots modelled from the CPU topology. There is one slot per hardware
+ * thread; the first thread of every physical core comes first, NUMA nodes
+ * interleaved, then the SMT siblings. A job in a slot is pinned to the
+ * threads of that slot's core, so it never leaves its core or NUMA node.
+ */
+class CPUSlots
+{
+public:
+    enum SpeedClass {
+        OwnCore = 0,   // first slot on its physical core
+        SharedCore,    // SMT sibling of an earlier slot
+        Unpinned,      // more jobs than slots
+        NumClasses
+    };
+
+    CPUSlots();
+
+    // Reads /sys/devices/system/cpu, only using the CPUs we may run on.
+    void init();
+
+    size_t count() const;
+    std::string dump() const;
+
+    // Claims the first free slot, -1 if there is none (the job floats freely).
+    int acquire();
+    void release(int slot);
+
+    // CPUs a job in SLOT is pinned to, empty for -1.
+    std::vector<int> cpus(int slot) const;
+
+    SpeedClass speedClass(int slot) const;
+
+    // Measures the speed classes from finished jobs.
+    void jobDone(int slot, unsigned int out_bytes, unsigned int cpu_msec);
+
+    // Expected speed (per mille of a job on its own core) of the n-th of max_kids
+    // concurrent jobs; measured once enough jobs finished, a rough prior before.
+    std::vector<uint32_t> slotSpeeds(unsigned int max_kids) const;
+
+private:
+    struct Slot {
+        std::vector<int> core_cpus;
+        SpeedClass speed_class;
+        bool busy;
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_cores;
+    size_t m_nodes;
+
+    // average output bytes per CPU msec per speed class
+    double m_speed[NumClasses];
+    unsigned int m_samples[NumClasses];
+};
+
+// Pins the calling process to CPUS, does nothing if empty.
+void pin_to_cpus(const std::vector<int> &cpus);
+
+#endif
@@ -29,8 +29,10 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <signal.h>
 #ifdef HAVE_SCHED_H
@@ -600,6 +602,312 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
     return sumup_dir(dirname);
 }
 
+static void drop_privileges(uid_t user_uid, gid_t user_gid)
+{
+#ifndef HAVE_LIBCAP_NG
+
+    if (setgroups(0, NULL) < 0) {
+        log_perror("setgroups fails");
+        _exit(143);
+    }
+
+    if (setgid(user_gid) < 0) {
+        log_perror("setgid fails");
+        _exit(143);
+    }
+
+    if (!geteuid() && setuid(user_uid) < 0) {
+        log_perror("setuid fails");
+        _exit(142);
+    }
+
+#else
+    (void) user_uid;
+    (void) user_gid;
+#endif
+}
+
+// Sends an installed environment to another compile server, as a tarball in file chunks
+// followed by M_END. If tarball is set, that file is sent as it is instead. The child
+// process does all the work, so the caller can forget about the channel. With a non-zero
+// max_rate (bytes per second) the transfer is throttled.
+pid_t start_serve_environment(const string &basename, const string &target, const string &name,
+                              const string &tarball, MsgChannel *c, uid_t user_uid,
+                              gid_t user_gid, unsigned int max_rate)
+{
+    string dirname = basename + "/target=" + target + "/" + name;
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to serve environment");
+        return 0;
+    }
+
+    if (pid) {
+        return pid;
+    }
+
+    // else
+    drop_privileges(user_uid, user_gid);
+
+    int fds[2];
+    pid_t tar_pid = 0;
+
+    if (!tarball.empty()) {
+        // opened only after dropping privileges, the path comes from a client
+        fds[0] = open(tarball.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fds[0] < 0 || fstat(fds[0], &st) || !S_ISREG(st.st_mode)) {
+            log_error() << "cannot serve " << tarball << endl;
+            _exit(1);
+        }
+    } else if (pipe(fds) == -1) {
+        log_perror("pipe failed");
+        _exit(1);
+    } else {
+        tar_pid = fork();
+    }
+
+    if (tar_pid == -1) {
+        log_perror("fork - trying to run tar");
+        _exit(1);
+    }
+
+    if (!tar_pid && tarball.empty()) {
+        if ((-1 == close(fds[0])) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        if (-1 == dup2(fds[1], 1)){
+            log_perror("dup2 failed");
+        }
+
+        // tmp/ is created by finalize_install_environment() and used by the compile jobs
+        execl(TAR, TAR, "-cf", "-", "--exclude=./tmp", "-C", dirname.c_str(), ".", (char *)NULL);
+        log_perror("execl failed");
+        _exit(100);
+    }
+
+    if (tar_pid && (-1 == close(fds[1])) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    unsigned char buffer[100000];
+    bool ok = true;
+    size_t sent = 0;
+    struct timeval start;
+    gettimeofday(&start, 0);
+
+    while (ok) {
+        ssize_t bytes = read(fds[0], buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        FileChunkMsg fcmsg(buffer, bytes);
+        ok = c->send_msg(fcmsg);
+        sent += bytes;
+
+        if (max_rate) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            long long elapsed = (now.tv_sec - start.tv_sec) * 1000000LL
+                                + now.tv_usec - start.tv_usec;
+            long long due = sent * 1000000LL / max_rate;
+
+            if (due > elapsed) {
+                usleep(due - elapsed);
+            }
+        }
+    }
+
+    int status = 0;
+
+    if (tar_pid) {
+        if (!ok) {
+            kill(tar_pid, SIGTERM);
+        }
+
+        status = 1;
+
+        while (waitpid(tar_pid, &status, 0) < 0 && errno == EINTR) {}
+    }
+
+    // the peer throws the environment away if there's no M_END
+    if (ok && shell_exit_status(status) == 0) {
+        ok = c->send_msg(EndMsg());
+    }
+
+    trace() << "serving environment " << target << "/" << name << (ok ? " done" : " failed") << endl;
+    _exit(ok ? 0 : 1);
+}
+
+static bool write_chunk(int fd, const FileChunkMsg *fcmsg)
+{
+    size_t len = fcmsg->len;
+    size_t off = 0;
+
+    while (len) {
+        ssize_t bytes = write(fd, fcmsg->buffer + off, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes == -1) {
+            log_perror("write to transfer env pipe failed. ");
+            return false;
+        }
+
+        len -= bytes;
+        off += bytes;
+    }
+
+    return true;
+}
+
+// Installs an environment by getting it from the first of the given peers (host:port)
+// that has it. Like start_install_environment(), but the whole transfer happens
+// in the child, which writes the installed size to the returned pipe when done.
+int start_fetch_environment(const string &basename, const string &target, const string &name,
+                            const list<string> &peers, uid_t user_uid, gid_t user_gid,
+                            int extract_priority)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        log_perror("pipe failed");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to fetch environment");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if (pid) {
+        if ((-1 == close(fds[1])) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        return fds[0];
+    }
+
+    // else
+    if ((-1 == close(fds[0])) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    // don't let tar keep the pipe open
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    size_t installed_size = 0;
+
+    for (list<string>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        string::size_type colon = it->rfind(':');
+
+        if (colon == string::npos) {
+            continue;
+        }
+
+        string host = it->substr(0, colon);
+        unsigned short port = atoi(it->substr(colon + 1).c_str());
+        MsgChannel *c = Service::createChannel(host, port, 10);
+
+        if (!c) {
+            log_info() << "cannot connect to " << *it << " to fetch environment" << endl;
+            continue;
+        }
+
+        int pipe_to_stdin = -1;
+        FileChunkMsg *fmsg = 0;
+        pid_t tar_pid = 0;
+
+        if (c->send_msg(GetEnvMsg(target, name))) {
+            tar_pid = start_install_environment(basename, target, name, c, pipe_to_stdin, fmsg,
+                                                user_uid, user_gid, extract_priority);
+        }
+
+        if (tar_pid <= 0) {
+            log_info() << *it << " did not send environment " << target << "/" << name << endl;
+            delete fmsg;
+            delete c;
+            continue;
+        }
+
+        trace() << "fetching environment " << target << "/" << name << " from " << *it << endl;
+        Msg *msg = fmsg;
+        bool ok = true;
+
+        while (ok) {
+            if (msg->type == M_END) {
+                break;
+            }
+
+            ok = msg->type == M_FILE_CHUNK
+                 && write_chunk(pipe_to_stdin, static_cast<FileChunkMsg *>(msg));
+            delete msg;
+            msg = ok ? c->get_msg(30) : 0;
+            ok = ok && msg;
+        }
+
+        delete msg;
+        delete c;
+
+        if ((-1 == close(pipe_to_stdin)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        if (!ok) {
+            kill(tar_pid, SIGTERM);
+        }
+
+        installed_size = finalize_install_environment(basename, target + "/" + name, tar_pid,
+                                                      user_uid, user_gid);
+
+        if (!ok && installed_size) {
+            remove_environment(basename, target + "/" + name);
+            installed_size = 0;
+        }
+
+        // the directory has been used now, so there's no point in trying another peer
+        break;
+    }
+
+    string result = toString(installed_size) + "\n";
+    ignore_result(write(fds[1], result.c_str(), result.size()));
+    _exit(installed_size ? 0 : 1);
+}
+
+size_t finish_fetch_environment(int pipe)
+{
+    char buf[64];
+    ssize_t bytes;
+
+    while ((bytes = read(pipe, buf, sizeof(buf) - 1)) < 0 && errno == EINTR) {}
+
+    buf[bytes > 0 ? bytes : 0] = '\0';
+
+    if ((-1 == close(pipe)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    return strtoul(buf, NULL, 10);
+}
+
 size_t remove_environment(const string &basename, const string &env)
 {
     string dirname = basename + "/target=" + env;
@@ -663,7 +971,7 @@ size_t remove_native_environment(const string &env)
 static void
 error_client(MsgChannel *client, string error)
 {
-    if (IS_PROTOCOL_23(client)) {
+    if (client && IS_PROTOCOL_23(client)) {
         client->send_msg(StatusTextMsg(error));
     }
 }
@@ -751,14 +1059,16 @@ void chdir_to_environment(MsgChannel *client, const string &dirname, uid_t user_
 #endif
 }
 
-// Verify that the environment works by simply running the bundled bin/true.
-bool verify_env(MsgChannel *client, const string &basedir, const string &target, const string &env,
-                uid_t user_uid, gid_t user_gid)
+// Verify that the environment works by simply running the bundled bin/true,
+// in a child whose exit status is the result. Returns its pid or -1.
+// The client can be NULL, if there's nobody to report errors to.
+pid_t start_verify_env(MsgChannel *client, const string &basedir, const string &target,
+                       const string &env, uid_t user_uid, gid_t user_gid)
 {
     if (target.empty() || env.empty()) {
         error_client(client, "verify_env: target or env empty");
         log_error() << "verify_env target or env empty\n\t" << target << "\n\t" << env << endl;
-        return false;
+        return -1;
     }
 
     string dirname = basedir + "/target=" + target + "/" + env;
@@ -766,22 +1076,17 @@ bool verify_env(MsgChannel *client, const string &basedir, const string &target,
     if (::access(string(dirname + "/bin/true").c_str(), X_OK) < 0) {
         error_client(client, dirname + "/bin/true is not executable, installed environment removed?");
         log_error() << "I don't have environment " << env << "(" << target << ") to verify." << endl;
-        return false;
+        return -1;
     }
 
     flush_debug();
     pid_t pid = fork();
-    assert(pid >= 0);
 
     if (pid > 0) {  // parent
-        int status;
-
-        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
-
-        return shell_exit_status(status) == 0;
+        return pid;
     } else if (pid < 0) {
         log_perror("fork failed");
-        return false;
+        return -1;
     }
 
     // child
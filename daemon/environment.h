@@ -45,10 +45,18 @@ extern pid_t start_install_environment(const std::string &basename,
                                        uid_t user_uid, gid_t user_gid, int extract_priority);
 extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
         pid_t pid, uid_t user_uid, gid_t user_gid);
+extern pid_t start_serve_environment(const std::string &basename, const std::string &target,
+                                     const std::string &name, const std::string &tarball,
+                                     MsgChannel *c, uid_t user_uid, gid_t user_gid,
+                                     unsigned int max_rate);
+extern int start_fetch_environment(const std::string &basename, const std::string &target,
+                                   const std::string &name, const std::list<std::string> &peers,
+                                   uid_t user_uid, gid_t user_gid, int extract_priority);
+extern size_t finish_fetch_environment(int pipe);
 extern size_t remove_environment(const std::string &basedir, const std::string &env);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
-extern bool verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
-                       const std::string &env, uid_t user_uid, gid_t user_gid);
+extern pid_t start_verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
+                              const std::string &env, uid_t user_uid, gid_t user_gid);
 
 #endif
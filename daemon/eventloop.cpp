@@ -0,0 +1,234 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "eventloop.h"
+#include <logging.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+using namespace std;
+
+static long long monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+EventLoop::EventLoop()
+    : m_interval(0)
+    , m_timerExpired(false)
+    , m_nextTimer(0)
+    , m_epollFd(-1)
+    , m_timerFd(-1)
+{
+#ifdef USE_EPOLL
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (m_epollFd < 0) {
+        log_perror("epoll_create1");
+    }
+
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (m_timerFd < 0) {
+        log_perror("timerfd_create");
+    } else if (m_epollFd >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = m_timerFd;
+
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_timerFd, &ev) < 0) {
+            log_perror("epoll_ctl");
+        }
+    }
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+    if (m_timerFd >= 0 && (-1 == close(m_timerFd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    if (m_epollFd >= 0 && (-1 == close(m_epollFd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+}
+
+void EventLoop::watch(int fd)
+{
+    if (fd < 0 || !m_fds.insert(fd).second) {
+        return;
+    }
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (m_epollFd >= 0 && epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_perror("epoll_ctl add") << "\t" << fd << endl;
+    }
+#endif
+}
+
+void EventLoop::unwatch(int fd)
+{
+    if (!m_fds.erase(fd)) {
+        return;
+    }
+
+    vector<int>::iterator it = lower_bound(m_ready.begin(), m_ready.end(), fd);
+
+    // whatever was ready is not of interest anymore
+    if (it != m_ready.end() && *it == fd) {
+        m_ready.erase(it);
+    }
+
+#ifdef USE_EPOLL
+    if (m_epollFd >= 0 && epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        log_perror("epoll_ctl del") << "\t" << fd << endl;
+    }
+#endif
+}
+
+void EventLoop::setInterval(int seconds)
+{
+    if (seconds == m_interval) {
+        return;
+    }
+
+    m_interval = seconds;
+    m_nextTimer = monotonic_msec() + seconds * 1000;
+
+#ifdef USE_EPOLL
+    if (m_timerFd >= 0) {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_interval.tv_sec = spec.it_value.tv_sec = seconds;
+
+        if (timerfd_settime(m_timerFd, 0, &spec, NULL) < 0) {
+            log_perror("timerfd_settime");
+        }
+    }
+#endif
+}
+
+int EventLoop::wait()
+{
+    m_ready.clear();
+    m_timerExpired = false;
+
+#ifdef USE_EPOLL
+    if (m_epollFd >= 0 && m_timerFd >= 0) {
+        struct epoll_event events[64];
+        int n = epoll_wait(m_epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (n < 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == m_timerFd) {
+                uint64_t expirations;
+
+                if (read(m_timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    log_perror("read timerfd");
+                }
+
+                m_timerExpired = true;
+            } else {
+                m_ready.push_back(events[i].data.fd);
+            }
+        }
+
+        sort(m_ready.begin(), m_ready.end());
+        return m_ready.size();
+    }
+#endif
+
+    // poll() does not have FD_SETSIZE limits, but is linear in the descriptors
+    vector<struct pollfd> pfds;
+    pfds.reserve(m_fds.size());
+
+    for (set<int>::const_iterator it = m_fds.begin(); it != m_fds.end(); ++it) {
+        struct pollfd pfd;
+        pfd.fd = *it;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+    }
+
+    int timeout = -1;
+
+    if (m_interval > 0) {
+        timeout = max(m_nextTimer - monotonic_msec(), 0LL);
+    }
+
+    int n = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    // a busy loop may not see a timeout for long
+    if (m_interval > 0 && monotonic_msec() >= m_nextTimer) {
+        m_timerExpired = true;
+        m_nextTimer = monotonic_msec() + m_interval * 1000;
+    }
+
+    for (size_t i = 0; i < pfds.size(); ++i) {
+        if (pfds[i].revents) {
+            m_ready.push_back(pfds[i].fd);
+        }
+    }
+
+    return m_ready.size();
+}
+
+const vector<int> &EventLoop::ready() const
+{
+    return m_ready;
+}
+
+bool EventLoop::isReady(int fd) const
+{
+    return binary_search(m_ready.begin(), m_ready.end(), fd);
+}
+
+bool EventLoop::timerExpired() const
+{
+    return m_timerExpired;
+}
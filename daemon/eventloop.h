@@ -0,0 +1,66 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_EVENTLOOP_H
+#define ICECREAM_EVENTLOOP_H
+
+#include <set>
+#include <vector>
+
+/**
+ * Waits for file descriptors to become readable and for a periodic timer.
+ * Descriptors stay registered between waits, so the cost of a wait depends
+ * on how many of them are ready rather than on how many there are. Uses
+ * epoll and timerfd where available and poll() otherwise.
+ *
+ * A descriptor has to be unwatched before it is closed: forked children may
+ * keep the file open, and epoll would go on reporting it.
+ */
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    void watch(int fd);
+    void unwatch(int fd);
+
+    // Wake up at least every SECONDS.
+    void setInterval(int seconds);
+
+    // Returns the number of ready descriptors, or -1 with errno set.
+    int wait();
+
+    const std::vector<int> &ready() const;
+    bool isReady(int fd) const;
+    // True if the interval passed since the timer expired the last time.
+    bool timerExpired() const;
+
+private:
+    std::set<int> m_fds;
+    std::vector<int> m_ready; // sorted
+    int m_interval;
+    bool m_timerExpired;
+    long long m_nextTimer; // msec, for poll()
+    int m_epollFd;
+    int m_timerFd;
+};
+
+#endif
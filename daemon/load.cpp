@@ -21,6 +21,7 @@
 
 #include "config.h"
 #include "load.h"
+#include "cgroup.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <math.h>
@@ -28,6 +29,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
 #ifdef HAVE_SYS_PARAM_H
 #include <sys/param.h>
 #endif
@@ -389,6 +394,150 @@ int fakeloadavg(double *p_result, int resultEntries, unsigned int currentJobs)
     return numFilled;
 }
 
+#if !defined(USE_SYSCTL) && !defined(USE_MACH)
+static const char cgroup_root[] = "/sys/fs/cgroup";
+
+/* Limits may be set on any ancestor (e.g. a systemd slice), so walk up
+   and use the tightest one. Returns the number of CPUs the quota in cpu.max
+   allows, or 0 if unlimited. */
+static double cgroup_cpu_quota(string *where)
+{
+    double best = 0;
+
+    for (string d = cgroup_dir(); d.size() > sizeof(cgroup_root) - 1; d.erase(d.rfind('/'))) {
+        char buf[64];
+        unsigned long long quota, period;
+
+        if (!read_cgroup_file(AT_FDCWD, d + "/cpu.max", buf, sizeof(buf))
+                || sscanf(buf, "%llu %llu", &quota, &period) != 2 || !period) {
+            continue; // "max <period>" - no quota here
+        }
+
+        double cpus = double(quota) / period;
+
+        if (!best || cpus < best) {
+            best = cpus;
+
+            if (where) {
+                *where = d;
+            }
+        }
+    }
+
+    return best;
+}
+
+unsigned int cgroup_cpu_limit()
+{
+    return (unsigned int) ceil(cgroup_cpu_quota(NULL));
+}
+
+/* Share (0-1000) of the CPU quota used since the last call, or -1 if
+   there is no quota. With a quota the host's idle time is not ours to use. */
+static int cgroup_cpu_busy()
+{
+    static unsigned long long last_usage = 0;
+    static double last_time = 0;
+
+    string d;
+    double cpus = cgroup_cpu_quota(&d);
+    char buf[1024];
+
+    if (!cpus || !read_cgroup_file(AT_FDCWD, d + "/cpu.stat", buf, sizeof(buf))) {
+        return -1;
+    }
+
+    unsigned long long usage = cgroup_key(buf, "usage_usec");
+    double now = getEpocTime();
+    int busy = -1;
+
+    if (last_time && now > last_time && usage >= last_usage) {
+        busy = std::min(int((usage - last_usage) / ((now - last_time) * 1000 * cpus)), 1000);
+    }
+
+    last_usage = usage;
+    last_time = now;
+    return busy;
+}
+
+/* Applies memory.max to the free memory seen on the host and returns the
+   fill grade (0-1000) within the cgroup. Reclaimable page cache is not
+   counted as used, like Cached in calculateMemLoad(). */
+static unsigned int cgroup_mem_load(unsigned long int &NetMemFree)
+{
+    unsigned int fillgrade = 0;
+
+    for (string d = cgroup_dir(); d.size() > sizeof(cgroup_root) - 1; d.erase(d.rfind('/'))) {
+        char buf[4096];
+
+        if (!read_cgroup_file(AT_FDCWD, d + "/memory.max", buf, sizeof(buf)) || !strncmp(buf, "max", 3)) {
+            continue;
+        }
+
+        unsigned long long limit = strtoull(buf, NULL, 10);
+
+        if (!limit || !read_cgroup_file(AT_FDCWD, d + "/memory.current", buf, sizeof(buf))) {
+            continue;
+        }
+
+        unsigned long long used = strtoull(buf, NULL, 10);
+
+        if (read_cgroup_file(AT_FDCWD, d + "/memory.stat", buf, sizeof(buf))) {
+            unsigned long long inactive = cgroup_key(buf, "inactive_file");
+            used = used > inactive ? used - inactive : 0;
+        }
+
+        unsigned long int free_kb = limit > used ? (limit - used) / 1024 : 0;
+        NetMemFree = std::min(NetMemFree, free_kb);
+        fillgrade = std::max(fillgrade, (unsigned int) std::min(used * 1000 / limit, 1000ULL));
+    }
+
+    return fillgrade;
+}
+
+/* The "avg10" of the "some" line of a PSI file: the share of the last
+   10 seconds (0-1000) in which at least one task was stalled. */
+static unsigned int read_pressure(const string &file)
+{
+    char buf[256];
+
+    if (!read_cgroup_file(AT_FDCWD, file, buf, sizeof(buf)) || strncmp(buf, "some", 4)) {
+        return 0;
+    }
+
+    const char *avg = strstr(buf, "avg10=");
+
+    if (!avg) {
+        return 0;
+    }
+
+    return (unsigned int) std::min(strtod(avg + 6, NULL) * 10 + 0.5, 1000.0);
+}
+
+static void fill_pressure(StatsMsg *msg)
+{
+    /* Inside a cgroup its own pressure is what our jobs will feel,
+       otherwise (or on kernels without PSI per cgroup) use the system's. */
+    const string &d = cgroup_dir();
+    string prefix = "/proc/pressure/";
+    string suffix;
+
+    if (!d.empty() && access((d + "/cpu.pressure").c_str(), R_OK) == 0) {
+        prefix = d + "/";
+        suffix = ".pressure";
+    }
+
+    msg->cpuPressure = read_pressure(prefix + "cpu" + suffix);
+    msg->memPressure = read_pressure(prefix + "memory" + suffix);
+    msg->ioPressure = read_pressure(prefix + "io" + suffix);
+}
+#else
+unsigned int cgroup_cpu_limit()
+{
+    return 0;
+}
+#endif
+
 void fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned int &memory_fillgrade, StatsMsg *msg, unsigned int hint)
 {
     static CPULoadInfo load;
@@ -398,10 +547,22 @@ void fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned i
     myidleload = load.idleLoad;
     myniceload = load.niceLoad;
 
+#if !defined(USE_SYSCTL) && !defined(USE_MACH)
+    int cgroup_busy = cgroup_cpu_busy();
+
+    if (cgroup_busy >= 0) {
+        myidleload = std::min(myidleload, (unsigned long)(1000 - cgroup_busy));
+    }
+#endif
+
     if (msg) {
         unsigned long int MemFree = 0;
 
         memory_fillgrade = calculateMemLoad(MemFree);
+#if !defined(USE_SYSCTL) && !defined(USE_MACH)
+        memory_fillgrade = std::max(memory_fillgrade, cgroup_mem_load(MemFree));
+        fill_pressure(msg);
+#endif
 
         double avg[3];
 #if HAVE_GETLOADAVG
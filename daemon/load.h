@@ -28,4 +28,7 @@
 // 'hint' is used to approximate the load, whenever getloadavg() is unavailable.
 void fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned int &memory_fillgrade, StatsMsg *msg, unsigned int hint);
 
+// Number of CPUs the daemon's cgroup CPU quota allows, 0 if not limited.
+unsigned int cgroup_cpu_limit();
+
 #endif
@@ -47,6 +47,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pwd.h>
+#include <limits.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -79,6 +80,7 @@
 #endif
 
 #include <deque>
+#include <list>
 #include <map>
 #include <algorithm>
 #include <set>
@@ -92,6 +94,11 @@
 #include "logging.h"
 #include <comm.h>
 #include "load.h"
+#include "cgroup.h"
+#include "cpuslots.h"
+#include "autotune.h"
+#include "eventloop.h"
+#include "objcache.h"
 #include "environment.h"
 #include "platform.h"
 #include "util.h"
@@ -122,10 +129,13 @@ public:
      * CLIENTWORK: Client is busy working and we reserve the spot (job_id is set if it's a scheduler job)
      * WAITFORCHILD: Client is waiting for the compile job to finish.
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
+     * WAITFETCHENV: We're waiting for an environment to be fetched from another compile server.
+     * REDIRECTED: The job was TOCOMPILE, but went to another compile server - ignore the rest of it
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, TOCOMPILE,
                   WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
+                  WAITFETCHENV, REDIRECTED,
+                  LASTSTATE = REDIRECTED
                 } status;
     Client() {
         job_id = 0;
@@ -136,6 +146,14 @@ public:
         status = UNKNOWN;
         pipe_to_child = -1;
         child_pid = -1;
+        slot = -1;
+        queued_since.tv_sec = queued_since.tv_usec = 0;
+        queue_msec = 0;
+        job_class = JobLocalBeginMsg::COMPILE_JOB;
+        mem_estimate = 0;
+        queued = false;
+        queue_seq = 0;
+        verify_env = false;
     }
 
     static string status_str(Status status) {
@@ -164,6 +182,10 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case WAITFETCHENV:
+            return "waitfetchenv";
+        case REDIRECTED:
+            return "redirected";
         }
 
         assert(false);
@@ -187,22 +209,35 @@ public:
 
     }
     uint32_t job_id;
-    string outfile; // only useful for LINKJOB or TOINSTALL
+    string outfile; // only useful for LINKJOB, TOINSTALL or WAITFETCHENV
     MsgChannel *channel;
     UseCSMsg *usecsmsg;
     CompileJob *job;
     int client_id;
     int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD or TOINSTALL
     pid_t child_pid;
+    int slot; // CPU slot of the child, only if WAITFORCHILD
+    struct timeval queued_since; // only for TOCOMPILE
+    unsigned int queue_msec; // time spent in TOCOMPILE
+    JobLocalBeginMsg::job_class job_class; // only for LINKJOB and CLIENTWORK
+    unsigned int mem_estimate; // in MiB, only for LINKJOB and CLIENTWORK
     string pending_create_env; // only for WAITCREATEENV
+    bool verify_env; // the compile job verifies its environment, see handle_verify_env()
+
+    // position in the run queue of its status, maintained by Clients
+    bool queued;
+    list<Client *>::iterator queue_pos;
+    unsigned long queue_seq;
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
 
         switch (status) {
         case LINKJOB:
-            return ret + " CID: " + toString(client_id) + " " + outfile;
+            return ret + " CID: " + toString(client_id) + " " + outfile
+                   + " class: " + toString(job_class) + " mem: " + toString(mem_estimate);
         case TOINSTALL:
+        case WAITFETCHENV:
             return ret + " " + toString(client_id) + " " + outfile;
         case WAITFORCHILD:
             return ret + " CID: " + toString(client_id) + " PID: " + toString(child_pid) + " PFD: " + toString(pipe_to_child);
@@ -227,21 +262,87 @@ public:
     }
 };
 
+/* All clients by channel. They are also indexed by client id and child
+   pid, and queued per status (and job class) in the order they got there,
+   so that the main loop does not have to scan all of them. Status, job
+   class and child pid of a client in here must only be changed through
+   set_status() and set_child_pid(). */
 class Clients : public map<MsgChannel*, Client*>
 {
 public:
     Clients() {
         active_processes = 0;
+        next_seq = 0;
+
+        for (int s = 0; s <= Client::LASTSTATE; ++s) {
+            for (int c = 0; c < num_classes; ++c) {
+                queue_size[s][c] = 0;
+            }
+        }
     }
     unsigned int active_processes;
 
-    Client *find_by_client_id(int id) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->client_id == id) {
-                return it->second;
-            }
+    void add(Client *client) {
+        (*this)[client->channel] = client;
+        by_client_id[client->client_id] = client;
 
-        return 0;
+        if (client->child_pid > 0) {
+            by_pid[client->child_pid] = client;
+        }
+
+        enqueue(client);
+    }
+
+    bool remove(Client *client) {
+        if (!erase(client->channel)) {
+            return false;
+        }
+
+        dequeue(client);
+        by_client_id.erase(client->client_id);
+
+        if (client->child_pid > 0) {
+            by_pid.erase(client->child_pid);
+        }
+
+        return true;
+    }
+
+    void set_status(Client *client, Client::Status s) {
+        bool tracked = client->queued;
+        dequeue(client);
+        client->status = s;
+
+        if (tracked) {
+            enqueue(client);
+        }
+    }
+
+    void set_job_class(Client *client, JobLocalBeginMsg::job_class c) {
+        bool tracked = client->queued;
+        dequeue(client);
+        client->job_class = c;
+
+        if (tracked) {
+            enqueue(client);
+        }
+    }
+
+    void set_child_pid(Client *client, pid_t pid) {
+        if (client->queued && client->child_pid > 0) {
+            by_pid.erase(client->child_pid);
+        }
+
+        client->child_pid = pid;
+
+        if (client->queued && pid > 0) {
+            by_pid[pid] = client;
+        }
+    }
+
+    Client *find_by_client_id(int id) const {
+        map<int, Client *>::const_iterator it = by_client_id.find(id);
+        return it == by_client_id.end() ? 0 : it->second;
     }
 
     Client *find_by_channel(MsgChannel *c) const {
@@ -255,12 +356,8 @@ public:
     }
 
     Client *find_by_pid(pid_t pid) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->child_pid == pid) {
-                return it->second;
-            }
-
-        return 0;
+        map<pid_t, Client *>::const_iterator it = by_pid.find(pid);
+        return it == by_pid.end() ? 0 : it->second;
     }
 
     Client *first() {
@@ -274,17 +371,19 @@ public:
         return cl;
     }
 
-    string dump_status(Client::Status s) const {
-        int count = 0;
+    size_t count(Client::Status s) const {
+        size_t count = 0;
 
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s) {
-                count++;
-            }
+        for (int c = 0; c < num_classes; ++c) {
+            count += queue_size[s][c];
         }
 
-        if (count) {
-            return toString(count) + " " + Client::status_str(s) + ", ";
+        return count;
+    }
+
+    string dump_status(Client::Status s) const {
+        if (size_t n = count(s)) {
+            return toString(n) + " " + Client::status_str(s) + ", ";
         }
 
         return string();
@@ -300,20 +399,52 @@ public:
 
         return s;
     }
-    Client *get_earliest_client(Client::Status s) const {
-        // TODO: possibly speed this up in adding some sorted lists
+    // The client that is longest in status S (and of JOB_CLASS, if given).
+    Client *get_earliest_client(Client::Status s, int job_class = -1) const {
         Client *client = 0;
-        int min_client_id = 0;
 
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s && (!min_client_id || min_client_id > it->second->client_id)) {
-                client = it->second;
-                min_client_id = client->client_id;
+        for (int c = 0; c < num_classes; ++c) {
+            if ((job_class >= 0 && c != job_class) || queues[s][c].empty()) {
+                continue;
+            }
+
+            Client *front = queues[s][c].front();
+
+            if (!client || front->queue_seq < client->queue_seq) {
+                client = front;
             }
         }
 
         return client;
     }
+
+private:
+    static const int num_classes = JobLocalBeginMsg::HEAVY_JOB + 1;
+
+    void enqueue(Client *client) {
+        assert(!client->queued);
+        list<Client *> &queue = queues[client->status][client->job_class];
+        client->queue_pos = queue.insert(queue.end(), client);
+        client->queue_seq = next_seq++;
+        client->queued = true;
+        queue_size[client->status][client->job_class]++;
+    }
+
+    void dequeue(Client *client) {
+        if (!client->queued) {
+            return;
+        }
+
+        queues[client->status][client->job_class].erase(client->queue_pos);
+        queue_size[client->status][client->job_class]--;
+        client->queued = false;
+    }
+
+    map<int, Client *> by_client_id;
+    map<pid_t, Client *> by_pid;
+    list<Client *> queues[Client::LASTSTATE + 1][num_classes];
+    size_t queue_size[Client::LASTSTATE + 1][num_classes];
+    unsigned long next_seq;
 };
 
 static int set_new_pgrp(void)
@@ -406,7 +537,8 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [--env-upload-limit <KB/s>]"
+        " [--max-link-jobs <n>] [--max-heavy-jobs <n>] [--object-cache-limit <MB>] [-N <node_name>]" << endl;
     exit(1);
 }
 
@@ -421,8 +553,30 @@ const int min_mem_limit = 100;
 
 unsigned int max_kids = 0;
 
+// Local jobs other than compiles get their own slots (0 means a quarter of the CPUs)
+unsigned int max_link_jobs = 0;
+unsigned int max_heavy_jobs = 1;
+
 size_t cache_size_limit = 100 * 1024 * 1024;
 
+// Compile results kept to answer repeated jobs, 0 disables that.
+size_t object_cache_limit = 256 * 1024 * 1024;
+
+// How many environments can be sent to other compile servers at the same time.
+const size_t max_env_serves = 2;
+
+// How often free slots ask the scheduler for jobs queued elsewhere, at first and at most.
+const time_t min_steal_interval = 5;
+const time_t max_steal_interval = 60;
+
+// Leased slots this close to expiring are not handed out anymore but returned,
+// the client still has to connect to the compile server in time.
+const time_t lease_margin = 2;
+
+// Bandwidth limit in bytes per second for sending the environment tarballs of local
+// clients to other compile servers, that happens in the background.
+unsigned int env_upload_limit = 10 * 1024 * 1024;
+
 struct NativeEnvironment {
     string name; // the hash
     map<string, time_t> extrafilestimes;
@@ -440,6 +594,31 @@ struct NativeEnvironment {
     }
 };
 
+// A child of start_verify_env() and what waits for its result.
+struct EnvVerify {
+    string env_key; // "target/name"
+    int pipe; // closes when the child exits, -1 once it did
+    Client *client; // gets the result, if still there
+    size_t fetched_size; // a fetch that is only finished once verified
+};
+
+// The environment tarball of a local client, for other compile servers to fetch.
+struct EnvTarball {
+    string file;
+    Client *client; // registered it, the entry goes with it
+};
+
+// A job slot on a compile server the scheduler reserved for our clients.
+struct LeasedSlot {
+    unsigned int job_id;
+    string hostname;
+    unsigned int port;
+    string target;
+    string host_platform;
+    string version;
+    time_t expires;
+};
+
 struct Daemon {
     Clients clients;
     map<string, time_t> envs_last_use;
@@ -448,6 +627,29 @@ struct Daemon {
     // The key is the compiler name and a concatenated list of the additional files
     // (or just the compiler name for the basic ones).
     map<string, NativeEnvironment> native_environments;
+    // Environments being fetched from other compile servers, "target/name" -> pipe
+    // of the child doing it (see start_fetch_environment()).
+    CPUSlots cpu_slots;
+    ConcurrencyTuner tuner;
+    ObjectCache object_cache;
+    unsigned int reported_max_kids; // what the scheduler knows
+    unsigned int reported_link_jobs;
+    unsigned int link_jobs; // running local jobs of the LINK_JOB class
+    unsigned int heavy_jobs; // ... and the HEAVY_JOB class
+    unsigned int free_memory; // in MiB, as of the last stats
+    unsigned int pending_link_memory; // estimates of local jobs started since then
+    map<string, int> env_fetches;
+    // Environment fetches the scheduler asked for, it gets told about the result.
+    set<string> staged_fetches;
+    // Children sending an environment to another compile server.
+    set<pid_t> env_serves;
+    // Environment tarballs of local clients, "target/name" -> file.
+    map<string, EnvTarball> env_tarballs;
+    // Results of start_verify_env(), "target/name fingerprint" -> ok.
+    map<string, bool> verified_envs;
+    map<pid_t, EnvVerify> env_verifies;
+    // What verify_env() results depend on, the kernel and machine.
+    string host_fingerprint;
     string envbasedir;
     uid_t user_uid;
     gid_t user_gid;
@@ -460,12 +662,25 @@ struct Daemon {
     bool custom_nodename;
     size_t cache_size;
     map<int, MsgChannel *> fd2chan;
+    EventLoop loop;
+    int service_fd; // scheduler or discovery socket being watched
+    // Client channels not watched while the client waits for something else.
+    set<int> parked_fds;
+    // Pipes of compile jobs to the clients they are for.
+    map<int, Client *> child_pipes;
+    // Pipes of compile children still sending the output, -> job id.
+    map<int, unsigned int> output_sends;
     int new_client_id;
     string remote_name;
     time_t next_scheduler_connect;
+    time_t last_steal_request;
+    time_t steal_backoff; // grows while asking brings nothing
+    // Slots to answer M_GET_CS with without asking the scheduler, see M_SLOT_LEASE.
+    list<LeasedSlot> leased_slots;
     unsigned long icecream_load;
     struct timeval icecream_usage;
     int current_load;
+    int current_pressure;
     int num_cpus;
     MsgChannel *scheduler;
     DiscoverSched *discover;
@@ -500,13 +715,23 @@ struct Daemon {
         tcp_listen_fd = -1;
         unix_listen_fd = -1;
         new_client_id = 0;
+        service_fd = -1;
         next_scheduler_connect = 0;
+        last_steal_request = 0;
+        steal_backoff = 0;
         cache_size = 0;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
         icecream_usage.tv_sec = icecream_usage.tv_usec = 0;
         current_load = - 1000;
+        current_pressure = 0;
+        reported_max_kids = 0;
+        reported_link_jobs = 0;
+        link_jobs = 0;
+        heavy_jobs = 0;
+        free_memory = 0;
+        pending_link_memory = 0;
         num_cpus = 0;
         scheduler = 0;
         discover = 0;
@@ -523,11 +748,23 @@ struct Daemon {
 
     bool reannounce_environments() __attribute_warn_unused_result__;
     void answer_client_requests();
+    void read_client(Client *client);
+    void park_client(Client *client);
+    void unpark_clients();
+    void sync_service_fds();
+    void unwatch_service_fd();
     bool handle_transfer_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_transfer_env_done(Client *client);
+    bool environment_installed(const string &env, size_t installed_size);
+    bool handle_fetch_env(Client *client, FetchEnvMsg *msg) __attribute_warn_unused_result__;
+    bool fetch_env_finished(string env_key);
+    bool handle_get_env(Client *client, GetEnvMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_fetch_env(FetchEnvMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
+    bool start_local_job(Client *client) __attribute_warn_unused_result__;
+    void start_link_jobs();
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
@@ -536,11 +773,25 @@ struct Daemon {
     void clear_children();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
     int scheduler_no_cs(NoCSMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_redirect_job(RedirectJobMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_slot_lease(SlotLeaseMsg *msg);
+    void use_cs(Client *c, UseCSMsg *msg);
+    bool use_leased_slot(Client *client, GetCSMsg *msg);
+    void return_leases();
+    int scheduler_revoke_leases(LeaseReturnMsg *msg);
+    void maybe_steal_jobs();
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
+    bool handle_output_sent(int pipe) __attribute_warn_unused_result__;
     bool handle_verify_env(Client *client, VerifyEnvMsg *msg) __attribute_warn_unused_result__;
+    bool start_verify_environment(Client *client, const string &env_key, size_t fetched_size);
+    bool environment_verified(const string &env_key, bool ok);
+    bool env_verify_finished(pid_t pid, int status) __attribute_warn_unused_result__;
+    bool verifying_fetch(const string &env_key) const;
+    bool fetch_env_verified(const string &env_key, size_t installed_size);
+    Environments verified_environments(const Environments &envs) const;
     bool handle_blacklist_host_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     int handle_cs_conf(ConfCSMsg *msg);
     string dump_internals() const;
@@ -706,6 +957,7 @@ void Daemon::determine_system()
         nodename = uname_buf.nodename;
     }
 
+    host_fingerprint = string(uname_buf.sysname) + " " + uname_buf.release + " " + uname_buf.machine;
     machine_name = determine_platform();
 }
 
@@ -746,6 +998,7 @@ bool Daemon::reannounce_environments()
     log_error() << "reannounce_environments " << endl;
     LoginMsg lmsg(0, nodename, "");
     lmsg.envs = available_environmnents(envbasedir);
+    lmsg.verified_envs = verified_environments(lmsg.envs);
     return send_scheduler(lmsg);
 }
 
@@ -755,8 +1008,11 @@ void Daemon::close_scheduler()
         return;
     }
 
+    unwatch_service_fd();
     delete scheduler;
     scheduler = 0;
+    // the job ids are of no use with another scheduler
+    leased_slots.clear();
     delete discover;
     discover = 0;
     next_scheduler_connect = time(0) + 20 + (rand() & 31);
@@ -816,6 +1072,16 @@ bool Daemon::maybe_stats(bool force_check)
 
         msg.load = std::max((1000 - idle_average), memory_fillgrade);
 
+        if (tuner.update(now.tv_sec, current_kids, memory_fillgrade, msg.memPressure)) {
+            max_kids = tuner.limit();
+        }
+
+        msg.maxJobs = max_kids;
+        msg.linkJobs = link_jobs;
+        msg.heavyJobs = heavy_jobs;
+        free_memory = msg.freeMem;
+        pending_link_memory = 0;
+
 #ifdef HAVE_SYS_VFS_H
         struct statfs buf;
         int ret = statfs(envbasedir.c_str(), &buf);
@@ -827,15 +1093,26 @@ bool Daemon::maybe_stats(bool force_check)
 
 #endif
 
+        msg.slotSpeeds = cpu_slots.slotSpeeds(max_kids);
+
         // Matz got in the urine that not all CPUs are always feed
         mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), min_mem_limit);
 
+        int pressure = std::max(msg.cpuPressure, std::max(msg.memPressure, msg.ioPressure));
+
         if (abs(int(msg.load) - current_load) >= 100
             || (msg.load == 1000 && current_load != 1000)
-            || (msg.load != 1000 && current_load == 1000)) {
+            || (msg.load != 1000 && current_load == 1000)
+            || abs(pressure - current_pressure) >= 100
+            || max_kids != reported_max_kids
+            || link_jobs + heavy_jobs != reported_link_jobs) {
             if (!send_scheduler(msg)) {
                 return false;
             }
+
+            current_pressure = pressure;
+            reported_max_kids = max_kids;
+            reported_link_jobs = link_jobs + heavy_jobs;
         }
 
         icecream_load = 0;
@@ -881,12 +1158,39 @@ string Daemon::dump_internals() const
         result += "  envs_last_use[" + it->first  + "] = " + toString(it->second) + "\n";
     }
 
+    for (map<string, int>::const_iterator it = env_fetches.begin(); it != env_fetches.end(); ++it) {
+        result += "  Fetching environment: " + it->first + "\n";
+    }
+
+    if (!env_serves.empty()) {
+        result += "  Serving environments: " + toString(env_serves.size()) + "\n";
+    }
+
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
 
+    result += "  Concurrency: " + tuner.dump() + "\n";
+
+    if (object_cache.enabled()) {
+        result += "  Object cache: " + object_cache.dump() + "\n";
+    }
+
+    result += "  Local link jobs: " + toString(link_jobs) + " (max: " + toString(max_link_jobs)
+              + "), heavy: " + toString(heavy_jobs) + " (max: " + toString(max_heavy_jobs) + ")\n";
+
+    if (cpu_slots.count()) {
+        result += "  CPU slots: " + cpu_slots.dump() + "\n";
+    }
+
     if (scheduler) {
         result += "  Scheduler protocol: " + toString(scheduler->protocol) + "\n";
     }
 
+    for (list<LeasedSlot>::const_iterator it = leased_slots.begin(); it != leased_slots.end(); ++it) {
+        result += "  Leased slot " + toString(it->job_id) + ": " + it->hostname + ":"
+                  + toString(it->port) + " for " + it->host_platform + "/" + it->version
+                  + " until " + toString(it->expires) + "\n";
+    }
+
     StatsMsg msg;
     unsigned int memory_fillgrade = 0;
     unsigned long idleLoad = 0;
@@ -899,6 +1203,8 @@ string Daemon::dump_internals() const
               + toString(icecream_load) + "\n";
     result += "  memory: " + toString(memory_fillgrade)
               + " (free: " + toString(msg.freeMem) + ")\n";
+    result += "  pressure: cpu " + toString(msg.cpuPressure) + ", memory "
+              + toString(msg.memPressure) + ", io " + toString(msg.ioPressure) + "\n";
 
     return result;
 }
@@ -923,25 +1229,29 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         return 1;
     }
 
+    use_cs(c, msg);
+    return 0;
+}
+
+void Daemon::use_cs(Client *c, UseCSMsg *msg)
+{
     if (msg->hostname == remote_name && int(msg->port) == daemon_port) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
-        c->status = Client::PENDING_USE_CS;
+        clients.set_status(c, Client::PENDING_USE_CS);
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
 
         if (!c->channel->send_msg(*msg)) {
             handle_end(c, 143);
-            return 0;
+            return;
         }
 
-        c->status = Client::WAITCOMPILE;
+        clients.set_status(c, Client::WAITCOMPILE);
     }
 
     c->job_id = msg->job_id;
-
-    return 0;
 }
 
 int Daemon::scheduler_no_cs(NoCSMsg *msg)
@@ -959,7 +1269,7 @@ int Daemon::scheduler_no_cs(NoCSMsg *msg)
     }
 
     c->usecsmsg = new UseCSMsg(string(), "127.0.0.1", daemon_port, msg->job_id, true, 1, 0);
-    c->status = Client::PENDING_USE_CS;
+    clients.set_status(c, Client::PENDING_USE_CS);
 
     c->job_id = msg->job_id;
 
@@ -967,6 +1277,165 @@ int Daemon::scheduler_no_cs(NoCSMsg *msg)
 
 }
 
+/* The scheduler found a compile server with free slots for a job queued here,
+   send the client there unless the job has started already.  */
+int Daemon::scheduler_redirect_job(RedirectJobMsg *msg)
+{
+    Client *client = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::TOCOMPILE && it->second->job->jobID() == msg->job_id) {
+            client = it->second;
+            break;
+        }
+    }
+
+    // the client waits for the verification the job does before anything else
+    bool ok = client && IS_PROTOCOL_50(client->channel) && !client->verify_env;
+
+    if (ok) {
+        UseCSMsg usecs(msg->host_platform, msg->hostname, msg->port, msg->job_id, msg->got_env,
+                       msg->client_id, msg->matched_job_id);
+        usecs.env_peers = msg->env_peers;
+
+        if (client->channel->send_msg(usecs)) {
+            trace() << "job " << msg->job_id << " goes to " << msg->hostname << " instead" << endl;
+            clients.set_status(client, Client::REDIRECTED);
+        } else {
+            ok = false;
+            handle_end(client, 121);
+        }
+    }
+
+    return send_scheduler(JobRedirectedMsg(msg->job_id, ok)) ? 0 : 1;
+}
+
+/* The scheduler reserved slots for our clients, they are used up by
+   use_leased_slot() or given back by return_leases().  */
+int Daemon::scheduler_slot_lease(SlotLeaseMsg *msg)
+{
+    time_t now = time(0);
+
+    for (vector<SlotLeaseMsg::Slot>::const_iterator it = msg->slots.begin();
+            it != msg->slots.end(); ++it) {
+        LeasedSlot slot;
+        slot.job_id = it->job_id;
+        slot.hostname = it->hostname;
+        slot.port = it->port;
+        slot.target = msg->target;
+        slot.host_platform = msg->host_platform;
+        slot.version = msg->version;
+        slot.expires = now + msg->duration;
+        leased_slots.push_back(slot);
+    }
+
+    trace() << "leased " << msg->slots.size() << " slots for " << msg->host_platform << "/"
+            << msg->version << " for " << msg->duration << "s" << endl;
+    return 0;
+}
+
+/* Answers a plain request for one compile server from a leased slot, the
+   scheduler only gets told afterwards.  */
+bool Daemon::use_leased_slot(Client *client, GetCSMsg *msg)
+{
+    if (msg->count != 1 || !msg->preferred_host.empty() || msg->minimal_host_version > 0) {
+        return false;
+    }
+
+    time_t now = time(0);
+
+    for (list<LeasedSlot>::iterator it = leased_slots.begin(); it != leased_slots.end(); ++it) {
+        if (it->expires - now < lease_margin || it->target != msg->target) {
+            continue;
+        }
+
+        if (find(msg->versions.begin(), msg->versions.end(),
+                 make_pair(it->host_platform, it->version)) == msg->versions.end()) {
+            continue;
+        }
+
+        LeasedSlot slot = *it;
+        leased_slots.erase(it);
+
+        msg->client_count = clients.size();
+
+        if (!send_scheduler(LeaseUsedMsg(slot.job_id, *msg))) {
+            return false;
+        }
+
+        trace() << "client " << msg->client_id << " gets leased slot " << slot.job_id
+                << " on " << slot.hostname << endl;
+        UseCSMsg usecs(slot.host_platform, slot.hostname, slot.port, slot.job_id, true,
+                       msg->client_id, 0);
+        use_cs(client, &usecs);
+        return true;
+    }
+
+    return false;
+}
+
+/* Gives back the leased slots that are about to expire, so that the scheduler
+   does not keep them from other jobs until then.  */
+void Daemon::return_leases()
+{
+    LeaseReturnMsg msg;
+    time_t now = time(0);
+
+    for (list<LeasedSlot>::iterator it = leased_slots.begin(); it != leased_slots.end();) {
+        if (it->expires - now < lease_margin) {
+            msg.job_ids.push_back(it->job_id);
+            it = leased_slots.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!msg.job_ids.empty() && !send_scheduler(msg)) {
+        trace() << "failed to return leased slots" << endl;
+    }
+}
+
+/* The server of these leased slots logged out.  */
+int Daemon::scheduler_revoke_leases(LeaseReturnMsg *msg)
+{
+    for (vector<uint32_t>::const_iterator it = msg->job_ids.begin(); it != msg->job_ids.end();
+            ++it) {
+        for (list<LeasedSlot>::iterator sit = leased_slots.begin(); sit != leased_slots.end();
+                ++sit) {
+            if (sit->job_id == *it) {
+                trace() << "leased slot " << *it << " on " << sit->hostname << " revoked" << endl;
+                leased_slots.erase(sit);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Free slots ask the scheduler for jobs that wait for a slot on other compile
+   servers, the load the scheduler knows of is not always up to date.  */
+void Daemon::maybe_steal_jobs()
+{
+    if (noremote || !IS_PROTOCOL_50(scheduler) || current_load >= 1000) {
+        return;
+    }
+
+    unsigned int busy = current_kids + clients.active_processes + clients.count(Client::TOCOMPILE);
+    time_t now = time(0);
+
+    if (busy >= max_kids || now - last_steal_request < std::max(steal_backoff, min_steal_interval)) {
+        return;
+    }
+
+    last_steal_request = now;
+    steal_backoff = std::min(std::max(steal_backoff, min_steal_interval) * 2, max_steal_interval);
+
+    if (!send_scheduler(StealJobsMsg(max_kids - busy))) {
+        trace() << "failed to ask the scheduler for jobs" << endl;
+    }
+}
+
 bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
 {
     log_error() << "handle_transfer_env" << endl;
@@ -989,14 +1458,14 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     pid_t pid = start_install_environment(envbasedir, target, emsg->name, client->channel,
                                           sock_to_stdin, fmsg, user_uid, user_gid, nice_level);
 
-    client->status = Client::TOINSTALL;
+    clients.set_status(client, Client::TOINSTALL);
     client->outfile = emsg->target + "/" + emsg->name;
     current_kids++;
 
     if (pid > 0) {
         log_error() << "got pid " << pid << endl;
         client->pipe_to_child = sock_to_stdin;
-        client->child_pid = pid;
+        clients.set_child_pid(client, pid);
 
         if (!handle_file_chunk_env(client, fmsg)) {
             pid = 0;
@@ -1027,13 +1496,18 @@ bool Daemon::handle_transfer_env_done(Client *client)
         client->pipe_to_child = -1;
     }
 
-    client->status = Client::UNKNOWN;
+    clients.set_status(client, Client::UNKNOWN);
     string current = client->outfile;
     client->outfile.clear();
-    client->child_pid = -1;
+    clients.set_child_pid(client, -1);
     assert(current_kids > 0);
     current_kids--;
 
+    return environment_installed(current, installed_size);
+}
+
+bool Daemon::environment_installed(const string &current, size_t installed_size)
+{
     log_error() << "installed_size: " << installed_size << endl;
 
     if (installed_size) {
@@ -1054,6 +1528,187 @@ bool Daemon::handle_transfer_env_done(Client *client)
     return r;
 }
 
+bool Daemon::handle_fetch_env(Client *client, FetchEnvMsg *msg)
+{
+    string env_key = msg->target + "/" + msg->name;
+    trace() << "handle_fetch_env " << env_key << endl;
+
+    bool verifying = verifying_fetch(env_key);
+
+    if (envs_last_use.count(env_key) && !verifying) {
+        // somebody else already brought it here
+        return client->channel->send_msg(FetchEnvResultMsg(true));
+    }
+
+    if (!env_fetches.count(env_key) && !verifying) {
+        int pipe = 0;
+
+        if (!msg->target.empty() && !msg->peers.empty()) {
+            pipe = start_fetch_environment(envbasedir, msg->target, msg->name, msg->peers,
+                                           user_uid, user_gid, nice_level);
+        }
+
+        if (!pipe) {
+            // let the client upload it
+            return client->channel->send_msg(FetchEnvResultMsg(false));
+        }
+
+        env_fetches[env_key] = pipe;
+        loop.watch(pipe);
+        current_kids++;
+    }
+
+    clients.set_status(client, Client::WAITFETCHENV);
+    client->outfile = env_key;
+    return true;
+}
+
+bool Daemon::fetch_env_finished(string env_key)
+{
+    assert(env_fetches.count(env_key));
+    loop.unwatch(env_fetches[env_key]);
+    size_t installed_size = finish_fetch_environment(env_fetches[env_key]);
+    env_fetches.erase(env_key);
+    assert(current_kids > 0);
+    current_kids--;
+    trace() << "fetch_env_finished " << env_key << " " << installed_size << endl;
+
+    // No client may verify it (see stage_environment() in the scheduler),
+    // so do it here before anybody gets to use it.
+    if (installed_size) {
+        envs_last_use[env_key] = time(NULL);
+
+        if (start_verify_environment(0, env_key, installed_size)) {
+            return true;
+        }
+
+        remove_environment(envbasedir, env_key);
+        envs_last_use.erase(env_key);
+        installed_size = 0;
+    }
+
+    return fetch_env_verified(env_key, installed_size);
+}
+
+bool Daemon::verifying_fetch(const string &env_key) const
+{
+    for (map<pid_t, EnvVerify>::const_iterator it = env_verifies.begin();
+            it != env_verifies.end(); ++it) {
+        if (it->second.fetched_size && it->second.env_key == env_key) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Tells the scheduler and the waiting clients about a fetch, INSTALLED_SIZE
+   is 0 if it failed.  */
+bool Daemon::fetch_env_verified(const string &env_key, size_t installed_size)
+{
+    bool r = environment_installed(env_key, installed_size);
+
+    if (staged_fetches.erase(env_key)) {
+        string::size_type slash = env_key.rfind('/');
+        FetchEnvResultMsg result(installed_size > 0, env_key.substr(0, slash),
+                                 env_key.substr(slash + 1));
+
+        if (!send_scheduler(result)) {
+            r = false;
+        }
+    }
+
+    // handle_end() invalidates the iterators
+    list<Client *> waiting;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::WAITFETCHENV && it->second->outfile == env_key) {
+            waiting.push_back(it->second);
+        }
+    }
+
+    for (list<Client *>::const_iterator it = waiting.begin(); it != waiting.end(); ++it) {
+        Client *client = *it;
+        clients.set_status(client, Client::UNKNOWN);
+        client->outfile.clear();
+
+        if (!client->channel->send_msg(FetchEnvResultMsg(installed_size > 0))) {
+            handle_end(client, 123);
+        }
+    }
+
+    return r;
+}
+
+bool Daemon::handle_get_env(Client *client, GetEnvMsg *msg)
+{
+    string env_key = msg->target + "/" + msg->name;
+
+    bool installed = envs_last_use.count(env_key);
+    map<string, EnvTarball>::const_iterator tarball = env_tarballs.find(env_key);
+
+    // Only what is completely installed here (or what local clients use) can be sent,
+    // and a few at a time so that serving environments does not starve the compile jobs.
+    if ((installed || tarball != env_tarballs.end()) && env_serves.size() < max_env_serves) {
+        // nobody waits for a tarball upload, see stage_environment() in the scheduler
+        pid_t pid = installed
+                    ? start_serve_environment(envbasedir, msg->target, msg->name, string(),
+                                              client->channel, user_uid, user_gid, 0)
+                    : start_serve_environment(envbasedir, msg->target, msg->name,
+                                              tarball->second.file, client->channel, user_uid,
+                                              user_gid, env_upload_limit);
+
+        if (pid > 0) {
+            trace() << "handle_get_env " << env_key << " serving in " << pid << endl;
+            env_serves.insert(pid);
+
+            if (installed) {
+                envs_last_use[env_key] = time(NULL);
+            }
+        }
+    } else {
+        trace() << "handle_get_env " << env_key << " refused" << endl;
+        client->channel->send_msg(EndMsg());
+    }
+
+    // the child owns the connection now
+    handle_end(client, 124);
+    return false;
+}
+
+int Daemon::scheduler_fetch_env(FetchEnvMsg *msg)
+{
+    string env_key = msg->target + "/" + msg->name;
+    trace() << "scheduler_fetch_env " << env_key << endl;
+
+    bool verifying = verifying_fetch(env_key);
+
+    if (envs_last_use.count(env_key) && !verifying) {
+        return send_scheduler(FetchEnvResultMsg(true, msg->target, msg->name)) ? 0 : 1;
+    }
+
+    if (!env_fetches.count(env_key) && !verifying) {
+        int pipe = 0;
+
+        // nobody needs it yet, so don't make room for it
+        if (!msg->target.empty() && !msg->peers.empty() && cache_size < cache_size_limit) {
+            pipe = start_fetch_environment(envbasedir, msg->target, msg->name, msg->peers,
+                                           user_uid, user_gid, nice_level);
+        }
+
+        if (!pipe) {
+            return send_scheduler(FetchEnvResultMsg(false, msg->target, msg->name)) ? 0 : 1;
+        }
+
+        env_fetches[env_key] = pipe;
+        loop.watch(pipe);
+        current_kids++;
+    }
+
+    staged_fetches.insert(env_key);
+    return 0;
+}
+
 void Daemon::check_cache_size(const string &new_env)
 {
     time_t now = time(NULL);
@@ -1133,6 +1788,7 @@ void Daemon::check_cache_size(const string &new_env)
 
         cache_size -= min(removed, cache_size);
         envs_last_use.erase(oldest);
+        verified_envs.erase(oldest + " " + host_fingerprint);
     }
 }
 
@@ -1168,6 +1824,8 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             cache_size -= remove_native_environment(env.name);
             envs_last_use.erase(env.name);
             if (env.create_env_pipe) {
+                loop.unwatch(env.create_env_pipe);
+
                 if ((-1 == close(env.create_env_pipe)) && (errno != EBADF)){
                     log_perror("close failed");
                 }
@@ -1180,7 +1838,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
     trace() << "get_native_env " << native_environments[env_key].name
             << " (" << env_key << ")" << endl;
 
-    client->status = Client::WAITCREATEENV;
+    clients.set_status(client, Client::WAITCREATEENV);
     client->pending_create_env = env_key;
 
     if (native_environments[env_key].name.length()) { // already available
@@ -1191,6 +1849,10 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             env.extrafilestimes = extrafilestimes;
             trace() << "start_create_env " << env_key << endl;
             env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, msg->compiler, msg->extrafiles);
+
+            if (env.create_env_pipe) {
+                loop.watch(env.create_env_pipe);
+            }
         } else {
             trace() << "waiting for already running create_env " << env_key << endl;
         }
@@ -1210,7 +1872,7 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
     }
 
     envs_last_use[native_environments[env_key].name] = time(NULL);
-    client->status = Client::GOTNATIVE;
+    clients.set_status(client, Client::GOTNATIVE);
     client->pending_create_env.clear();
     return true;
 }
@@ -1222,6 +1884,7 @@ bool Daemon::create_env_finished(string env_key)
 
     trace() << "create_env_finished " << env_key << endl;
     assert(env.create_env_pipe);
+    loop.unwatch(env.create_env_pipe);
     size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
     env.create_env_pipe = 0;
 
@@ -1264,7 +1927,7 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
         clients.active_processes--;
     }
 
-    cl->status = Client::JOBDONE;
+    clients.set_status(cl, Client::JOBDONE);
     JobDoneMsg *msg = static_cast<JobDoneMsg *>(m);
     trace() << "handle_job_done " << msg->job_id << " " << msg->exitcode << endl;
 
@@ -1281,26 +1944,71 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
     return send_scheduler(*msg);
 }
 
-void Daemon::handle_old_request()
+bool Daemon::start_local_job(Client *client)
 {
-    while ((current_kids + clients.active_processes) < std::max((unsigned int)1, max_kids)) {
+    trace() << "send JobLocalBeginMsg to client" << endl;
 
-        Client *client = clients.get_earliest_client(Client::LINKJOB);
+    if (!client->channel->send_msg(JobLocalBeginMsg())) {
+        log_warning() << "can't send start message to client" << endl;
+        handle_end(client, 112);
+        return true;
+    }
 
-        if (client) {
-            trace() << "send JobLocalBeginMsg to client" << endl;
+    clients.set_status(client, Client::CLIENTWORK);
 
-            if (!client->channel->send_msg(JobLocalBeginMsg())) {
-                log_warning() << "can't send start message to client" << endl;
-                handle_end(client, 112);
-            } else {
-                client->status = Client::CLIENTWORK;
-                clients.active_processes++;
-                trace() << "pushed local job " << client->client_id << endl;
+    if (client->job_class == JobLocalBeginMsg::LINK_JOB) {
+        link_jobs++;
+    } else if (client->job_class == JobLocalBeginMsg::HEAVY_JOB) {
+        heavy_jobs++;
+    } else {
+        clients.active_processes++;
+    }
 
-                if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile))) {
-                    return;
-                }
+    pending_link_memory += client->mem_estimate;
+    trace() << "pushed local job " << client->client_id << endl;
+
+    return send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile,
+                                           client->job_class, client->mem_estimate));
+}
+
+/* Links and the like don't take compile slots, but have their own pools,
+   and are only started if their memory estimate fits into the free memory
+   (unless nothing of the kind runs, so that nothing starves). */
+void Daemon::start_link_jobs()
+{
+    for (int c = JobLocalBeginMsg::LINK_JOB; c <= JobLocalBeginMsg::HEAVY_JOB; ++c) {
+        bool heavy = c == JobLocalBeginMsg::HEAVY_JOB;
+
+        while (Client *client = clients.get_earliest_client(Client::LINKJOB, c)) {
+            if ((heavy ? heavy_jobs : link_jobs) >= (heavy ? max_heavy_jobs : max_link_jobs)) {
+                break;
+            }
+
+            if ((link_jobs || heavy_jobs) && free_memory
+                    && pending_link_memory + client->mem_estimate > free_memory) {
+                trace() << "local job " << client->client_id << " waits for memory ("
+                        << client->mem_estimate << " MiB)" << endl;
+                break;
+            }
+
+            if (!start_local_job(client)) {
+                return;
+            }
+        }
+    }
+}
+
+void Daemon::handle_old_request()
+{
+    start_link_jobs();
+
+    while ((current_kids + clients.active_processes) < std::max((unsigned int)1, max_kids)) {
+
+        Client *client = clients.get_earliest_client(Client::LINKJOB, JobLocalBeginMsg::COMPILE_JOB);
+
+        if (client) {
+            if (!start_local_job(client)) {
+                return;
             }
 
             continue;
@@ -1312,7 +2020,7 @@ void Daemon::handle_old_request()
             trace() << "pending " << client->dump() << endl;
 
             if (client->channel->send_msg(*client->usecsmsg)) {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 /* we make sure we reserve a spot and the rest is done if the
                  * client contacts as back with a Compile request */
                 clients.active_processes++;
@@ -1341,19 +2049,29 @@ void Daemon::handle_old_request()
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
             envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            int slot = cpu_slots.acquire();
+            struct timeval now;
+            gettimeofday(&now, 0);
+            client->queue_msec = (now.tv_sec - client->queued_since.tv_sec) * 1000
+                                 + (now.tv_usec - client->queued_since.tv_usec) / 1000;
+            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                    cpu_slots.cpus(slot), object_cache.fd(), client->verify_env);
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
                 current_kids++;
-                client->status = Client::WAITFORCHILD;
+                clients.set_status(client, Client::WAITFORCHILD);
                 client->pipe_to_child = sock;
-                client->child_pid = pid;
+                child_pipes[sock] = client;
+                loop.watch(sock);
+                clients.set_child_pid(client, pid);
+                client->slot = slot;
 
                 if (!send_scheduler(JobBeginMsg(job->jobID(), clients.size()))) {
                     log_info() << "failed sending scheduler about " << job->jobID() << endl;
                 }
             } else {
+                cpu_slots.release(slot);
                 handle_end(client, 117);
             }
 
@@ -1375,10 +2093,12 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::num_stats];
     int end_status = 151;
+    unsigned int env_verified = 0;
 
     if (read(client->pipe_to_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
+        env_verified = job_stat[JobStatistics::env_verified];
         msg->in_uncompressed = job_stat[JobStatistics::in_uncompressed];
         msg->in_compressed = job_stat[JobStatistics::in_compressed];
         msg->out_compressed = msg->out_uncompressed = job_stat[JobStatistics::out_uncompressed];
@@ -1387,19 +2107,94 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->mem_peak = job_stat[JobStatistics::mem_peak];
+        msg->io_kb = job_stat[JobStatistics::io_kb];
+        msg->cpu_stall_msec = job_stat[JobStatistics::cpu_stall_msec];
+        msg->mem_stall_msec = job_stat[JobStatistics::mem_stall_msec];
+        msg->io_stall_msec = job_stat[JobStatistics::io_stall_msec];
+
+        static const struct {
+            int stat;
+            JobTelemetry::key key;
+        } telemetry[] = {
+            { JobStatistics::max_rss_kb, JobTelemetry::max_rss_kb },
+            { JobStatistics::read_kb, JobTelemetry::read_kb },
+            { JobStatistics::write_kb, JobTelemetry::write_kb },
+            { JobStatistics::voluntary_csw, JobTelemetry::voluntary_csw },
+            { JobStatistics::involuntary_csw, JobTelemetry::involuntary_csw },
+            { JobStatistics::receive_msec, JobTelemetry::receive_msec },
+            { JobStatistics::compile_msec, JobTelemetry::compile_msec },
+            { JobStatistics::time_report_msec, JobTelemetry::time_report_msec },
+            { JobStatistics::cpu_usage_msec, JobTelemetry::cpu_usage_msec },
+            { JobStatistics::cpu_user_msec, JobTelemetry::cpu_user_msec },
+            { JobStatistics::cpu_system_msec, JobTelemetry::cpu_system_msec }
+        };
+
+        for (size_t i = 0; i < sizeof(telemetry) / sizeof(telemetry[0]); ++i) {
+            if (job_stat[telemetry[i].stat]) {
+                msg->telemetry[telemetry[i].key] = job_stat[telemetry[i].stat];
+            }
+        }
+
+        msg->telemetry[JobTelemetry::queue_msec] = client->queue_msec;
+
+        if (job_stat[JobStatistics::cache_hit]) {
+            msg->telemetry[JobTelemetry::cache_hit] = 1;
+        }
+
+        object_cache.jobDone(job_stat[JobStatistics::cache_hit], job_stat[JobStatistics::cache_miss],
+                             job_stat[JobStatistics::cache_stored_bytes]);
+
+        // a cached result says nothing about the speed
+        if (msg->exitcode == 0 && !job_stat[JobStatistics::cache_hit]) {
+            cpu_slots.jobDone(client->slot, msg->out_uncompressed, msg->user_msec + msg->sys_msec);
+            tuner.jobDone(msg->out_uncompressed);
+        }
+    }
+
+    child_pipes.erase(client->pipe_to_child);
+
+    // the output goes to the client now, the scheduler learns how long that took
+    if (end_status == 0 && scheduler && IS_PROTOCOL_49(scheduler)) {
+        output_sends[client->pipe_to_child] = client->job->jobID();
+    } else {
+        loop.unwatch(client->pipe_to_child);
+        close(client->pipe_to_child);
     }
 
-    close(client->pipe_to_child);
     client->pipe_to_child = -1;
     string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
     envs_last_use[envforjob] = time(NULL);
 
     bool r = send_scheduler(*msg);
+
+    if (env_verified && environment_verified(envforjob, env_verified == 1) && scheduler
+            && !reannounce_environments()) {
+        r = false;
+    }
+
     handle_end(client, end_status);
     delete msg;
     return r;
 }
 
+bool Daemon::handle_output_sent(int pipe)
+{
+    unsigned int job_id = output_sends[pipe];
+    output_sends.erase(pipe);
+    loop.unwatch(pipe);
+    uint32_t send_msec;
+    bool sent = read(pipe, &send_msec, sizeof(send_msec)) == sizeof(send_msec);
+    close(pipe);
+
+    // nothing if sending failed
+    if (!sent || !scheduler || !IS_PROTOCOL_49(scheduler)) {
+        return true;
+    }
+
+    return send_scheduler(JobSentMsg(job_id, send_msec));
+}
+
 bool Daemon::handle_compile_file(Client *client, Msg *msg)
 {
     CompileJob *job = dynamic_cast<CompileFileMsg *>(msg)->takeJob();
@@ -1418,23 +2213,154 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 
         // no scheduler is not an error case!
     } else {
-        client->status = Client::TOCOMPILE;
+        clients.set_status(client, Client::TOCOMPILE);
+        gettimeofday(&client->queued_since, 0);
+        // there is work around, look for more of it soon
+        steal_backoff = min_steal_interval;
     }
 
     return true;
 }
 
+/* Runs bin/true of ENV_KEY in a child, env_verify_finished() gets the
+   result once it exited.  */
+bool Daemon::start_verify_environment(Client *client, const string &env_key, size_t fetched_size)
+{
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        log_perror("pipe()");
+        return false;
+    }
+
+    // only the child keeps the write end, bin/true inherits it
+    string::size_type slash = env_key.rfind('/');
+    pid_t pid = start_verify_env(client ? client->channel : 0, envbasedir,
+                                 env_key.substr(0, slash), env_key.substr(slash + 1),
+                                 user_uid, user_gid);
+    close(fds[1]);
+
+    if (pid <= 0) {
+        close(fds[0]);
+        return false;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    loop.watch(fds[0]);
+    EnvVerify &verify = env_verifies[pid];
+    verify.env_key = env_key;
+    verify.pipe = fds[0];
+    verify.client = client;
+    verify.fetched_size = fetched_size;
+    return true;
+}
+
+/* Remembers the result, returns true if the scheduler should learn about it.  */
+bool Daemon::environment_verified(const string &env_key, bool ok)
+{
+    trace() << "Verify environment done, " << (ok ? "success" : "failure") << ", environment "
+            << env_key << endl;
+
+    // check_cache_size() forgets the result when removing the environment
+    if (!envs_last_use.count(env_key)) {
+        return false;
+    }
+
+    string key = env_key + " " + host_fingerprint;
+    bool known = verified_envs.count(key);
+    verified_envs[key] = ok;
+    return ok && !known;
+}
+
+bool Daemon::env_verify_finished(pid_t pid, int status)
+{
+    map<pid_t, EnvVerify>::iterator it = env_verifies.find(pid);
+
+    if (it == env_verifies.end()) {
+        return true;
+    }
+
+    EnvVerify verify = it->second;
+    env_verifies.erase(it);
+
+    if (verify.pipe >= 0) {
+        loop.unwatch(verify.pipe);
+        close(verify.pipe);
+    }
+
+    bool ok = shell_exit_status(status) == 0;
+
+    if (verify.fetched_size) {
+        environment_verified(verify.env_key, ok);
+
+        if (!ok) {
+            log_error() << "fetched environment " << verify.env_key << " does not work here"
+                        << endl;
+            remove_environment(envbasedir, verify.env_key);
+            envs_last_use.erase(verify.env_key);
+        }
+
+        return fetch_env_verified(verify.env_key, ok ? verify.fetched_size : 0);
+    }
+
+    bool announce = environment_verified(verify.env_key, ok);
+
+    if (verify.client && !verify.client->channel->send_msg(VerifyEnvResultMsg(ok))) {
+        log_error() << "sending verify end result failed.." << endl;
+        handle_end(verify.client, 123);
+    }
+
+    if (announce && scheduler) {
+        return reannounce_environments();
+    }
+
+    return true;
+}
+
+Environments Daemon::verified_environments(const Environments &envs) const
+{
+    Environments verified;
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        map<string, bool>::const_iterator v
+            = verified_envs.find(it->first + "/" + it->second + " " + host_fingerprint);
+
+        if (v != verified_envs.end() && v->second) {
+            verified.push_back(*it);
+        }
+    }
+
+    return verified;
+}
+
 bool Daemon::handle_verify_env(Client *client, VerifyEnvMsg *msg)
 {
     assert(msg);
-    bool ok = verify_env(client->channel, envbasedir, msg->target, msg->environment, user_uid, user_gid);
-    trace() << "Verify environment done, " << (ok ? "success" : "failure") << ", environment " << msg->environment
-            << " (" << msg->target << ")" << endl;
-    VerifyEnvResultMsg resultmsg(ok);
+    string env_key = msg->target + "/" + msg->environment;
+    map<string, bool>::const_iterator it
+        = verified_envs.find(env_key + " " + host_fingerprint);
 
-    if (!client->channel->send_msg(resultmsg)) {
-        log_error() << "sending verify end result failed.." << endl;
-        return false;
+    if (it != verified_envs.end()) {
+        trace() << "Verify environment done, " << (it->second ? "success" : "failure")
+                << ", environment " << env_key << " (cached)" << endl;
+
+        if (!client->channel->send_msg(VerifyEnvResultMsg(it->second))) {
+            log_error() << "sending verify end result failed.." << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    // newer clients send the job right away, it runs bin/true while it compiles
+    if (IS_PROTOCOL_43(client->channel)) {
+        client->verify_env = true;
+        return true;
+    }
+
+    // older ones wait for the result until the child exited
+    if (!start_verify_environment(client, env_key, 0)) {
+        return client->channel->send_msg(VerifyEnvResultMsg(false));
     }
 
     return true;
@@ -1460,6 +2386,18 @@ void Daemon::handle_end(Client *client, int exitcode)
     trace() << dump_internals() << endl;
 #endif
     fd2chan.erase(client->channel->fd);
+    loop.unwatch(client->channel->fd);
+    parked_fds.erase(client->channel->fd);
+
+    if (client->status == Client::WAITFORCHILD && client->pipe_to_child >= 0) {
+        loop.unwatch(client->pipe_to_child);
+        child_pipes.erase(client->pipe_to_child);
+    }
+
+    if (client->slot >= 0) {
+        cpu_slots.release(client->slot);
+        client->slot = -1;
+    }
 
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
         close(client->pipe_to_child);
@@ -1468,7 +2406,13 @@ void Daemon::handle_end(Client *client, int exitcode)
     }
 
     if (client->status == Client::CLIENTWORK) {
-        clients.active_processes--;
+        if (client->job_class == JobLocalBeginMsg::LINK_JOB) {
+            link_jobs--;
+        } else if (client->job_class == JobLocalBeginMsg::HEAVY_JOB) {
+            heavy_jobs--;
+        } else {
+            clients.active_processes--;
+        }
     }
 
     if (client->status == Client::WAITCOMPILE && exitcode == 119) {
@@ -1476,9 +2420,23 @@ void Daemon::handle_end(Client *client, int exitcode)
         client->job_id = 0;
     }
 
+    for (map<pid_t, EnvVerify>::iterator it = env_verifies.begin(); it != env_verifies.end(); ++it) {
+        if (it->second.client == client) {
+            it->second.client = 0;
+        }
+    }
+
+    for (map<string, EnvTarball>::iterator it = env_tarballs.begin(); it != env_tarballs.end(); ) {
+        if (it->second.client == client) {
+            env_tarballs.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
     /* Delete from the clients map before send_scheduler, which causes a
        double deletion. */
-    if (!clients.erase(client->channel)) {
+    if (!clients.remove(client)) {
         log_error() << "client can't be erased: " << client->channel << endl;
         flush_debug();
         log_error() << dump_internals() << endl;
@@ -1516,6 +2474,8 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::LINKJOB:
             case Client::TOINSTALL:
             case Client::WAITCREATEENV:
+            case Client::WAITFETCHENV:
+            case Client::REDIRECTED:
                 assert(false);   // should not have a job_id
                 break;
             case Client::WAITCOMPILE:
@@ -1555,12 +2515,22 @@ void Daemon::clear_children()
         handle_end(cl, 116);
     }
 
+    while (!env_fetches.empty()) {
+        if (!fetch_env_finished(env_fetches.begin()->first)) {
+            trace() << "failed to announce fetched environment" << endl;
+        }
+    }
+
     while (current_kids > 0) {
         int status;
         pid_t child;
 
         while ((child = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
 
+        if (child > 0) {
+            remove_job_cgroup(child);
+        }
+
         current_kids--;
     }
 
@@ -1572,25 +2542,72 @@ void Daemon::clear_children()
     trace() << "cleared children\n";
 }
 
+/* FILE is what a local client claims is the tarball of environment NAME.  As
+   the daemon sends it to whoever asks, only the native environments built in
+   ENVBASEDIR are taken, by their real PATH.  */
+static bool env_tarball_path(const string &envbasedir, const string &name, const string &file,
+                             string &path)
+{
+    char *real_file = realpath(file.c_str(), NULL);
+    char *real_dir = realpath((envbasedir + "/native").c_str(), NULL);
+    bool ok = false;
+
+    if (real_file && real_dir) {
+        string dir = string(real_dir) + '/';
+        string prefix = dir + name + ".tar.";
+        struct stat st;
+        path = real_file;
+        ok = path.size() > prefix.size() && path.compare(0, prefix.size(), prefix) == 0
+             && path.find('/', dir.size()) == string::npos
+             && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    free(real_file);
+    free(real_dir);
+    return ok;
+}
+
 bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
-    client->status = Client::WAITFORCS;
+    clients.set_status(client, Client::WAITFORCS);
     umsg->client_id = client->client_id;
     trace() << "handle_get_cs " << umsg->client_id << endl;
 
+    // remember where the tarballs are, in case a compile server wants to fetch them from us
+    list<string>::const_iterator file = umsg->env_files.begin();
+
+    for (Environments::const_iterator it = umsg->versions.begin();
+            it != umsg->versions.end() && file != umsg->env_files.end(); ++it, ++file) {
+        string tarball;
+
+        if (env_tarball_path(envbasedir, it->second, *file, tarball)) {
+            EnvTarball &entry = env_tarballs[umsg->target + "/" + it->second];
+            entry.file = tarball;
+            entry.client = client;
+        } else {
+            trace() << "not offering " << *file << " to other compile servers" << endl;
+        }
+    }
+
+    umsg->env_files.clear();
+
     if (!scheduler) {
         /* now the thing is this: if there is no scheduler
            there is no point in trying to ask him. So we just
            redefine this as local job */
         client->usecsmsg = new UseCSMsg(umsg->target, "127.0.0.1", daemon_port,
                                         umsg->client_id, true, 1, 0);
-        client->status = Client::PENDING_USE_CS;
+        clients.set_status(client, Client::PENDING_USE_CS);
         client->job_id = umsg->client_id;
         return true;
     }
 
+    if (use_leased_slot(client, umsg)) {
+        return true;
+    }
+
     umsg->client_count = clients.size();
 
     return send_scheduler(*umsg);
@@ -1605,8 +2622,11 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
 
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
-    client->status = Client::LINKJOB;
-    client->outfile = dynamic_cast<JobLocalBeginMsg *>(msg)->outfile;
+    JobLocalBeginMsg *m = dynamic_cast<JobLocalBeginMsg *>(msg);
+    clients.set_job_class(client, JobLocalBeginMsg::job_class(std::min(m->jobclass, uint32_t(JobLocalBeginMsg::HEAVY_JOB))));
+    clients.set_status(client, Client::LINKJOB);
+    client->outfile = m->outfile;
+    client->mem_estimate = m->mem_estimate;
     return true;
 }
 
@@ -1672,6 +2692,12 @@ bool Daemon::handle_activity(Client *client)
         return false;
     }
 
+    if (client->status == Client::REDIRECTED) {
+        // the rest of the job, until the client hangs up
+        delete msg;
+        return true;
+    }
+
     bool ret = false;
 
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
@@ -1712,6 +2738,12 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_FETCH_ENV:
+        ret = handle_fetch_env(client, static_cast<FetchEnvMsg *>(msg));
+        break;
+    case M_GET_ENV:
+        ret = handle_get_env(client, static_cast<GetEnvMsg *>(msg));
+        break;
     default:
         log_error() << "not compile: " << (char)msg->type << "protocol error on client "
                     << client->dump() << endl;
@@ -1724,112 +2756,171 @@ bool Daemon::handle_activity(Client *client)
     return ret;
 }
 
-void Daemon::answer_client_requests()
+/* Clients waiting for a compile job or an environment are not read from
+   until that is done. */
+static bool ignores_input(Client::Status status)
 {
-#ifdef ICECC_DEBUG
+    return status == Client::TOCOMPILE
+           || status == Client::WAITFORCHILD
+           || status == Client::WAITFETCHENV;
+}
 
-    if (clients.size() + current_kids) {
-        log_info() << dump_internals() << endl;
+/* Handles everything CLIENT sent until it has to wait for something. */
+void Daemon::read_client(Client *client)
+{
+    MsgChannel *c = client->channel;
+    int fd = c->fd;
+
+    while (!c->read_a_bit() || c->has_msg()) {
+        if (!handle_activity(client)) {
+            // the client may be gone, otherwise look at it again next time
+            map<int, MsgChannel *>::const_iterator it = fd2chan.find(fd);
+
+            if (it != fd2chan.end() && it->second == c) {
+                park_client(client);
+            }
+
+            return;
+        }
+
+        if (ignores_input(client->status)) {
+            park_client(client);
+            return;
+        }
     }
+}
 
-    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
-               << " (" << max_kids << ")" << endl;
+/* Stops watching the channel of CLIENT, unpark_clients() picks it up again
+   once it may be read from. */
+void Daemon::park_client(Client *client)
+{
+    loop.unwatch(client->channel->fd);
+    parked_fds.insert(client->channel->fd);
+}
 
-#endif
+void Daemon::unpark_clients()
+{
+    // only clients with jobs in flight are parked, so this is short
+    vector<int> parked(parked_fds.begin(), parked_fds.end());
 
-    /* reap zombis */
-    int status;
+    for (vector<int>::const_iterator it = parked.begin(); it != parked.end(); ++it) {
+        map<int, MsgChannel *>::const_iterator chan = fd2chan.find(*it);
 
-    while (waitpid(-1, &status, WNOHANG) < 0 && errno == EINTR) {}
+        if (chan == fd2chan.end()) {
+            parked_fds.erase(*it);
+            continue;
+        }
 
-    handle_old_request();
+        Client *client = clients.find_by_channel(chan->second);
+        assert(client);
 
-    /* collect the stats after the children exited icecream_load */
-    if (scheduler) {
-        maybe_stats();
+        if (ignores_input(client->status)) {
+            continue;
+        }
+
+        parked_fds.erase(*it);
+        loop.watch(*it);
+
+        if (client->channel->has_msg()) {
+            read_client(client);
+        }
     }
+}
 
-    fd_set listen_set;
-    struct timeval tv;
+/* The scheduler or discovery socket may change with every reconnect(). */
+void Daemon::sync_service_fds()
+{
+    // stats, pings and reconnects are due every max_scheduler_pong seconds
+    loop.setInterval(max_scheduler_pong);
+    loop.watch(unix_listen_fd);
+    loop.watch(tcp_listen_fd);
 
-    FD_ZERO(&listen_set);
-    int max_fd = 0;
+    int fd = -1;
 
-    if (tcp_listen_fd != -1) {
-        FD_SET(tcp_listen_fd, &listen_set);
-        max_fd = tcp_listen_fd;
+    if (scheduler) {
+        fd = scheduler->fd;
+    } else if (discover && discover->listen_fd() >= 0) {
+        /* We don't explicitely check for discover->get_fd() being ready
+        below.  If it is, we simply will return and our call will make
+        sure we try to get the scheduler.  */
+        fd = discover->listen_fd();
     }
 
-    FD_SET(unix_listen_fd, &listen_set);
+    if (fd != service_fd) {
+        loop.unwatch(service_fd);
+        loop.watch(fd);
+        service_fd = fd;
+    }
+}
+
+void Daemon::unwatch_service_fd()
+{
+    loop.unwatch(service_fd);
+    service_fd = -1;
+}
+
+void Daemon::answer_client_requests()
+{
+#ifdef ICECC_DEBUG
 
-    if (unix_listen_fd > max_fd) { // very likely
-        max_fd = unix_listen_fd;
+    if (clients.size() + current_kids) {
+        log_info() << dump_internals() << endl;
     }
 
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-            it != fd2chan.end();) {
-        int i = it->first;
-        MsgChannel *c = it->second;
-        ++it;
-        /* don't select on a fd that we're currently not interested in.
-           Avoids that we wake up on an event we're not handling anyway */
-        Client *client = clients.find_by_channel(c);
-        assert(client);
-        int current_status = client->status;
-        bool ignore_channel = current_status == Client::TOCOMPILE
-                              || current_status == Client::WAITFORCHILD;
+    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
+               << " (" << max_kids << ")" << endl;
 
-        if (!ignore_channel && (!c->has_msg() || handle_activity(client))) {
-            if (i > max_fd) {
-                max_fd = i;
-            }
+#endif
 
-            FD_SET(i, &listen_set);
-        }
+    /* reap zombis, several children may have exited since the last time */
+    int status;
 
-        if (current_status == Client::WAITFORCHILD
-                && client->pipe_to_child != -1) {
-            if (client->pipe_to_child > max_fd) {
-                max_fd = client->pipe_to_child;
-            }
+    for (;;) {
+        pid_t child;
 
-            FD_SET(client->pipe_to_child, &listen_set);
+        while ((child = waitpid(-1, &status, WNOHANG)) < 0 && errno == EINTR) {}
+
+        if (child <= 0) {
+            break;
         }
-    }
 
-    if (scheduler) {
-        FD_SET(scheduler->fd, &listen_set);
+        remove_job_cgroup(child);
 
-        if (max_fd < scheduler->fd) {
-            max_fd = scheduler->fd;
+        if (!env_verify_finished(child, status)) {
+            trace() << "failed to announce verified environment" << endl;
         }
-    } else if (discover && discover->listen_fd() >= 0) {
-        /* We don't explicitely check for discover->get_fd() being in
-        the selected set below.  If it's set, we simply will return
-        and our call will make sure we try to get the scheduler.  */
-        FD_SET(discover->listen_fd(), &listen_set);
+    }
 
-        if (max_fd < discover->listen_fd()) {
-            max_fd = discover->listen_fd();
+    for (set<pid_t>::iterator it = env_serves.begin(); it != env_serves.end();) {
+        pid_t pid = *it++;
+
+        // may have been reaped above already
+        if (waitpid(pid, &status, WNOHANG) != 0) {
+            env_serves.erase(pid);
         }
     }
 
-    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
-            it != native_environments.end(); ++it) {
-        if (it->second.create_env_pipe) {
-            FD_SET(it->second.create_env_pipe, &listen_set);
-            if (max_fd < it->second.create_env_pipe)
-                max_fd = it->second.create_env_pipe;
+    sync_service_fds();
+    handle_old_request();
+
+    /* collect the stats after the children exited icecream_load */
+    if (scheduler) {
+        // due every max_scheduler_pong seconds, see sync_service_fds()
+        if (loop.timerExpired()) {
+            maybe_stats(true);
         }
+
+        // these react to freed slots and expiring leases, they check their own times
+        maybe_steal_jobs();
+        return_leases();
     }
 
-    tv.tv_sec = max_scheduler_pong;
-    tv.tv_usec = 0;
+    unpark_clients();
 
-    int ret = select(max_fd + 1, &listen_set, NULL, NULL, &tv);
+    int ret = loop.wait();
 
     if (ret < 0 && errno != EINTR) {
-        log_perror("select");
+        log_perror("wait for events");
         close_scheduler();
         return;
     }
@@ -1843,7 +2934,7 @@ void Daemon::answer_client_requests()
     if (ret > 0) {
         bool had_scheduler = scheduler;
 
-        if (scheduler && FD_ISSET(scheduler->fd, &listen_set)) {
+        if (scheduler && loop.isReady(scheduler->fd)) {
             while (!scheduler->read_a_bit() || scheduler->has_msg()) {
                 Msg *msg = scheduler->get_msg(0, true);
 
@@ -1876,6 +2967,18 @@ void Daemon::answer_client_requests()
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_FETCH_ENV:
+                    ret = scheduler_fetch_env(static_cast<FetchEnvMsg *>(msg));
+                    break;
+                case M_REDIRECT_JOB:
+                    ret = scheduler_redirect_job(static_cast<RedirectJobMsg *>(msg));
+                    break;
+                case M_SLOT_LEASE:
+                    ret = scheduler_slot_lease(static_cast<SlotLeaseMsg *>(msg));
+                    break;
+                case M_LEASE_RETURN:
+                    ret = scheduler_revoke_leases(static_cast<LeaseReturnMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -1892,11 +2995,11 @@ void Daemon::answer_client_requests()
 
         int listen_fd = -1;
 
-        if (tcp_listen_fd != -1 && FD_ISSET(tcp_listen_fd, &listen_set)) {
+        if (tcp_listen_fd != -1 && loop.isReady(tcp_listen_fd)) {
             listen_fd = tcp_listen_fd;
         }
 
-        if (FD_ISSET(unix_listen_fd, &listen_set)) {
+        if (loop.isReady(unix_listen_fd)) {
             listen_fd = unix_listen_fd;
         }
 
@@ -1925,60 +3028,57 @@ void Daemon::answer_client_requests()
             Client *client = new Client;
             client->client_id = ++new_client_id;
             client->channel = c;
-            clients[c] = client;
+            clients.add(client);
 
             fd2chan[c->fd] = c;
+            loop.watch(c->fd);
+            read_client(client);
+        } else {
+            // handlers may end other clients, so look everything up again
+            vector<int> ready = loop.ready();
 
-            while (!c->read_a_bit() || c->has_msg()) {
-                if (!handle_activity(client)) {
-                    break;
+            for (vector<int>::const_iterator it = ready.begin(); it != ready.end(); ++it) {
+                if (!loop.isReady(*it)) {
+                    continue;
                 }
 
-                if (client->status == Client::TOCOMPILE
-                        || client->status == Client::WAITFORCHILD) {
-                    break;
-                }
-            }
-        } else {
-            for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-                    max_fd && it != fd2chan.end();)  {
-                int i = it->first;
-                MsgChannel *c = it->second;
-                Client *client = clients.find_by_channel(c);
-                assert(client);
-                ++it;
+                map<int, Client *>::iterator child = child_pipes.find(*it);
 
-                if (client->status == Client::WAITFORCHILD
-                        && client->pipe_to_child >= 0
-                        && FD_ISSET(client->pipe_to_child, &listen_set)) {
-                    max_fd--;
+                if (child != child_pipes.end()) {
+                    if (!handle_compile_done(child->second)) {
+                        return;
+                    }
+
+                    continue;
+                }
 
-                    if (!handle_compile_done(client)) {
+                if (output_sends.count(*it)) {
+                    if (!handle_output_sent(*it)) {
                         return;
                     }
+
+                    continue;
                 }
 
-                if (FD_ISSET(i, &listen_set)) {
-                    assert(client->status != Client::TOCOMPILE);
+                map<int, MsgChannel *>::const_iterator chan = fd2chan.find(*it);
 
-                    while (!c->read_a_bit() || c->has_msg()) {
-                        if (!handle_activity(client)) {
-                            break;
-                        }
+                if (chan == fd2chan.end()) {
+                    continue;
+                }
 
-                        if (client->status == Client::TOCOMPILE
-                                || client->status == Client::WAITFORCHILD) {
-                            break;
-                        }
-                    }
+                Client *client = clients.find_by_channel(chan->second);
+                assert(client);
 
-                    max_fd--;
+                if (ignores_input(client->status)) {
+                    park_client(client);
+                } else {
+                    read_client(client);
                 }
             }
 
             for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
                  it != native_environments.end(); ) {
-                if (it->second.create_env_pipe && FD_ISSET(it->second.create_env_pipe, &listen_set)) {
+                if (it->second.create_env_pipe && loop.isReady(it->second.create_env_pipe)) {
                     if(!create_env_finished(it->first))
                     {
                         native_environments.erase(it++);
@@ -1988,6 +3088,36 @@ void Daemon::answer_client_requests()
                 ++it;
             }
 
+            for (map<string, int>::iterator it = env_fetches.begin(); it != env_fetches.end(); ) {
+                string env_key = it->first;
+                int pipe = it->second;
+                ++it;
+
+                if (loop.isReady(pipe) && !fetch_env_finished(env_key)) {
+                    return;
+                }
+            }
+
+            for (map<pid_t, EnvVerify>::iterator it = env_verifies.begin();
+                    it != env_verifies.end(); ) {
+                pid_t pid = it->first;
+                EnvVerify &verify = it->second;
+                ++it;
+
+                if (verify.pipe < 0 || !loop.isReady(verify.pipe)) {
+                    continue;
+                }
+
+                // the child is exiting, if it is not gone yet the reaper gets it
+                loop.unwatch(verify.pipe);
+                close(verify.pipe);
+                verify.pipe = -1;
+                int status;
+
+                if (waitpid(pid, &status, WNOHANG) == pid && !env_verify_finished(pid, status)) {
+                    return;
+                }
+            }
         }
 
         if (had_scheduler && !scheduler) {
@@ -2013,6 +3143,9 @@ bool Daemon::reconnect()
     trace() << "reconn " << dump_internals() << endl;
 #endif
 
+    // discovery may close its socket in here
+    unwatch_service_fd();
+
     if (!discover || (NULL == (scheduler = discover->try_get_scheduler()) && discover->timed_out())) {
         delete discover;
         discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
@@ -2037,12 +3170,17 @@ bool Daemon::reconnect()
 
     log_info() << "Connected to scheduler (I am known as " << remote_name << ")" << endl;
     current_load = -1000;
+    current_pressure = 0;
+    reported_max_kids = max_kids;
     gettimeofday(&last_stat, 0);
     icecream_load = 0;
 
     LoginMsg lmsg(daemon_port, determine_nodename(), machine_name);
     lmsg.envs = available_environmnents(envbasedir);
+    lmsg.verified_envs = verified_environments(lmsg.envs);
     lmsg.max_kids = max_kids;
+    lmsg.max_link_jobs = max_link_jobs;
+    lmsg.max_heavy_jobs = max_heavy_jobs;
     lmsg.noremote = noremote;
     return send_scheduler(lmsg);
 }
@@ -2089,6 +3227,10 @@ int main(int argc, char **argv)
             { "user-uid", 1, NULL, 'u'},
             { "cache-limit", 1, NULL, 0},
             { "no-remote", 0, NULL, 0},
+            { "env-upload-limit", 1, NULL, 0},
+            { "max-link-jobs", 1, NULL, 0},
+            { "max-heavy-jobs", 1, NULL, 0},
+            { "object-cache-limit", 1, NULL, 0},
             { "port", 1, NULL, 'p'},
             { 0, 0, 0, 0 }
         };
@@ -2133,6 +3275,38 @@ int main(int argc, char **argv)
                 }
             } else if (optname == "no-remote") {
                 d.noremote = true;
+            } else if (optname == "env-upload-limit") {
+                if (optarg && *optarg) {
+                    char *end;
+                    errno = 0;
+                    unsigned long kb = strtoul(optarg, &end, 10);
+
+                    if (errno || *end || !kb || strchr(optarg, '-')) {
+                        usage("Error: --env-upload-limit requires a positive number");
+                    }
+
+                    env_upload_limit = std::min(kb, (unsigned long)(UINT_MAX / 1024)) * 1024;
+                } else {
+                    usage("Error: --env-upload-limit requires argument");
+                }
+            } else if (optname == "max-link-jobs") {
+                if (optarg && *optarg) {
+                    max_link_jobs = std::max(atoi(optarg), 1);
+                } else {
+                    usage("Error: --max-link-jobs requires argument");
+                }
+            } else if (optname == "max-heavy-jobs") {
+                if (optarg && *optarg) {
+                    max_heavy_jobs = std::max(atoi(optarg), 1);
+                } else {
+                    usage("Error: --max-heavy-jobs requires argument");
+                }
+            } else if (optname == "object-cache-limit") {
+                if (optarg && *optarg) {
+                    object_cache_limit = size_t(std::max(atoi(optarg), 0)) * 1024 * 1024;
+                } else {
+                    usage("Error: --object-cache-limit requires argument");
+                }
             }
 
         }
@@ -2312,17 +3486,45 @@ int main(int argc, char **argv)
             exit(EXIT_DISTCC_FAILED);
         }
 
+    // after detaching, as that changes our pid
+    if (!d.noremote && !init_job_cgroups(nice_level)) {
+        trace() << "compile jobs run without their own cgroups" << endl;
+    }
+
     if (dcc_ncpus(&d.num_cpus) == 0) {
         log_info() << d.num_cpus << " CPU(s) online on this server" << endl;
     }
 
+    // in a container the CPU quota, not the host's CPUs, is what we get
+    int cpu_limit = cgroup_cpu_limit();
+
+    if (cpu_limit > 0 && cpu_limit < d.num_cpus) {
+        log_info() << "cgroup CPU quota allows " << cpu_limit << " CPU(s)" << endl;
+        d.num_cpus = cpu_limit;
+    }
+
     if (max_processes < 0) {
         max_kids = d.num_cpus;
     } else {
         max_kids = max_processes;
     }
 
-    log_info() << "allowing up to " << max_kids << " active jobs" << endl;
+    // an explicit maximum is taken as it is
+    d.tuner.init(max_kids, max_processes < 0);
+    max_kids = d.tuner.limit();
+
+    if (!max_link_jobs) {
+        max_link_jobs = std::max(d.num_cpus / 4, 1);
+    }
+
+    log_info() << "allowing up to " << max_kids << " active jobs, " << max_link_jobs
+               << " link jobs and " << max_heavy_jobs << " heavy jobs" << endl;
+
+    d.cpu_slots.init();
+
+    if (d.cpu_slots.count()) {
+        log_info() << "CPU slots: " << d.cpu_slots.dump() << endl;
+    }
 
     int ret;
 
@@ -2362,6 +3564,10 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (!d.noremote) {
+        d.object_cache.init(d.envbasedir + "/objcache", object_cache_limit, d.user_uid, d.user_gid);
+    }
+
     list<string> nl = get_netnames(200, d.scheduler_port);
     trace() << "Netnames:" << endl;
 
@@ -0,0 +1,396 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "objcache.h"
+#include <comm.h>
+#include <job.h>
+#include <logging.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+// entries are only read back on the machine that wrote them,
+// so the header is in host byte order
+static const uint32_t entry_magic = 0x69636f31;
+
+struct EntryHeader {
+    uint32_t magic;
+    uint32_t out_len;
+    uint32_t err_len;
+    uint32_t obj_len;
+};
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = static_cast<char *>(buf);
+
+    while (len) {
+        ssize_t n = read(fd, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = static_cast<const char *>(buf);
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool copy_data(int from, int to, size_t len)
+{
+    char buffer[65536];
+
+    while (len) {
+        size_t chunk = std::min(len, sizeof(buffer));
+
+        if (!read_all(from, buffer, chunk) || !write_all(to, buffer, chunk)) {
+            return false;
+        }
+
+        len -= chunk;
+    }
+
+    return true;
+}
+
+static void close_fd(int fd)
+{
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+}
+
+ObjectCache::ObjectCache()
+    : m_fd(-1)
+    , m_limit(0)
+    , m_size(0)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evicted(0)
+{
+}
+
+ObjectCache::~ObjectCache()
+{
+    if (m_fd >= 0) {
+        close_fd(m_fd);
+    }
+}
+
+void ObjectCache::init(const string &dir, size_t limit, uid_t uid, gid_t gid)
+{
+    if (!limit) {
+        return;
+    }
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        log_perror("mkdir") << "\t" << dir << endl;
+        return;
+    }
+
+    if (chown(dir.c_str(), uid, gid) < 0) {
+        log_perror("chown") << "\t" << dir << endl;
+        return;
+    }
+
+    m_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (m_fd < 0) {
+        log_perror("open") << "\t" << dir << endl;
+        return;
+    }
+
+    m_dir = dir;
+    m_limit = limit;
+    m_size = 0;
+    // in case the directory survived a restart
+    evict();
+    log_info() << "caching compile results in " << m_dir << " up to "
+               << m_limit / 1024 / 1024 << " MB" << endl;
+}
+
+bool ObjectCache::enabled() const
+{
+    return m_fd >= 0;
+}
+
+int ObjectCache::fd() const
+{
+    return m_fd;
+}
+
+string ObjectCache::dump() const
+{
+    return toString(m_hits) + " hits, " + toString(m_misses) + " misses, "
+           + toString(m_size / 1024) + " of " + toString(m_limit / 1024) + " KiB, "
+           + toString(m_evicted) + " evicted";
+}
+
+void ObjectCache::jobDone(bool hit, bool miss, size_t stored_bytes)
+{
+    if (!enabled()) {
+        return;
+    }
+
+    m_hits += hit;
+    m_misses += miss;
+    m_size += stored_bytes;
+
+    if (m_size > m_limit) {
+        evict();
+    }
+}
+
+void ObjectCache::evict()
+{
+    int dir_fd = dup(m_fd);
+    DIR *d = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+
+    if (!d) {
+        log_perror("fdopendir") << "\t" << m_dir << endl;
+
+        if (dir_fd >= 0) {
+            close_fd(dir_fd);
+        }
+
+        return;
+    }
+
+    rewinddir(d);
+
+    // the children add entries without telling, so start over
+    multimap<time_t, pair<string, size_t> > by_age;
+    m_size = 0;
+
+    while (struct dirent *ent = readdir(d)) {
+        struct stat st;
+
+        if (ent->d_name[0] == '.' || fstatat(m_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+                || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        m_size += st.st_size;
+        by_age.insert(make_pair(st.st_mtime, make_pair(string(ent->d_name), size_t(st.st_size))));
+    }
+
+    closedir(d);
+
+    // leave some room, so that not every job ends up scanning the directory
+    size_t target = m_limit / 10 * 9;
+
+    for (multimap<time_t, pair<string, size_t> >::const_iterator it = by_age.begin();
+            it != by_age.end() && m_size > target; ++it) {
+        if (unlinkat(m_fd, it->second.first.c_str(), 0) < 0) {
+            log_perror("unlink") << "\t" << m_dir << "/" << it->second.first << endl;
+            continue;
+        }
+
+        m_size -= it->second.second;
+        m_evicted++;
+    }
+
+    trace() << "object cache " << dump() << endl;
+}
+
+ObjectCacheKey::ObjectCacheKey(const CompileJob &job, const list<string> &flags)
+{
+    md5_init(&m_state);
+    appendString("icecc object cache 1");
+    appendString(job.targetPlatform());
+    appendString(job.environmentVersion());
+    appendString(job.compilerName());
+    appendString(toString(int(job.language())));
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        appendString(*it);
+    }
+
+    // these end up in the debug info
+    appendString(job.inputFile());
+    appendString(job.workingDirectory());
+}
+
+void ObjectCacheKey::appendString(const string &str)
+{
+    // with the terminating null, so that "a" "bc" is not "ab" "c"
+    md5_append(&m_state, reinterpret_cast<const md5_byte_t *>(str.c_str()), str.size() + 1);
+}
+
+void ObjectCacheKey::append(const unsigned char *data, size_t len)
+{
+    md5_append(&m_state, data, len);
+}
+
+string ObjectCacheKey::finish()
+{
+    md5_byte_t digest[16];
+    md5_finish(&m_state, digest);
+
+    char hex[sizeof(digest) * 2 + 1];
+
+    for (size_t i = 0; i < sizeof(digest); ++i) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+
+    return hex;
+}
+
+int object_cache_open(int dirfd, const string &key)
+{
+    int fd = openat(dirfd, key.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    EntryHeader header;
+    struct stat st;
+
+    if (!read_all(fd, &header, sizeof(header)) || fstat(fd, &st) < 0
+            || header.magic != entry_magic
+            || off_t(sizeof(header)) + header.out_len + header.err_len + header.obj_len != st.st_size) {
+        log_warning() << "removing broken object cache entry " << key << endl;
+        close_fd(fd);
+        (void) unlinkat(dirfd, key.c_str(), 0);
+        return -1;
+    }
+
+    // most recently used for the eviction
+    if (futimens(fd, NULL) < 0) {
+        log_perror("futimens");
+    }
+
+    return fd;
+}
+
+bool object_cache_restore(int fd, CompileResultMsg &msg, const string &obj_file)
+{
+    EntryHeader header;
+
+    if (lseek(fd, 0, SEEK_SET) < 0 || !read_all(fd, &header, sizeof(header))) {
+        return false;
+    }
+
+    msg.out.resize(header.out_len);
+    msg.err.resize(header.err_len);
+
+    if ((header.out_len && !read_all(fd, &msg.out[0], header.out_len))
+            || (header.err_len && !read_all(fd, &msg.err[0], header.err_len))) {
+        return false;
+    }
+
+    int obj_fd = open(obj_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (obj_fd < 0) {
+        log_perror("open") << "\t" << obj_file << endl;
+        return false;
+    }
+
+    bool ok = copy_data(fd, obj_fd, header.obj_len);
+    close_fd(obj_fd);
+    return ok;
+}
+
+size_t object_cache_store(int dirfd, const string &key, const CompileResultMsg &msg,
+                          const string &obj_file)
+{
+    int obj_fd = open(obj_file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (obj_fd < 0 || fstat(obj_fd, &st) < 0) {
+        if (obj_fd >= 0) {
+            close_fd(obj_fd);
+        }
+
+        return 0;
+    }
+
+    EntryHeader header;
+    header.magic = entry_magic;
+    header.out_len = msg.out.size();
+    header.err_len = msg.err.size();
+    header.obj_len = st.st_size;
+
+    // written aside and renamed, so that lookups never see half an entry
+    string tmp_name = "tmp." + toString(getpid());
+    (void) unlinkat(dirfd, tmp_name.c_str(), 0);
+    int fd = openat(dirfd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        log_perror("creating object cache entry");
+        close_fd(obj_fd);
+        return 0;
+    }
+
+    bool ok = write_all(fd, &header, sizeof(header))
+              && write_all(fd, msg.out.data(), msg.out.size())
+              && write_all(fd, msg.err.data(), msg.err.size())
+              && copy_data(obj_fd, fd, header.obj_len);
+
+    close_fd(obj_fd);
+    close_fd(fd);
+
+    if (!ok || renameat(dirfd, tmp_name.c_str(), dirfd, key.c_str()) < 0) {
+        log_perror("storing object cache entry");
+        (void) unlinkat(dirfd, tmp_name.c_str(), 0);
+        return 0;
+    }
+
+    return sizeof(header) + header.out_len + header.err_len + header.obj_len;
+}
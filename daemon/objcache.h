@@ -0,0 +1,97 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_OBJCACHE_H
+#define ICECREAM_OBJCACHE_H
+
+#include <md5.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <list>
+#include <string>
+
+class CompileJob;
+class CompileResultMsg;
+
+/**
+ * Cache of compile results on the compile server, so that the same job
+ * sent again (another developer on the same branch, a rebuild after
+ * "make clean") is answered without running the compiler. Entries are
+ * keyed by a hash of everything the compiler sees: the environment, the
+ * flags and the preprocessed source. The compile children look entries up
+ * and add them, the daemon keeps the total size below the limit by
+ * removing the least recently used ones (hits touch the entries).
+ */
+class ObjectCache
+{
+public:
+    ObjectCache();
+    ~ObjectCache();
+
+    // Creates DIR for the compile jobs running as UID/GID, a limit of 0 disables the cache.
+    void init(const std::string &dir, size_t limit, uid_t uid, gid_t gid);
+
+    bool enabled() const;
+    // Directory handle the compile children inherit, -1 if disabled.
+    int fd() const;
+    std::string dump() const;
+
+    // Accounts for a finished job and evicts if needed.
+    void jobDone(bool hit, bool miss, size_t stored_bytes);
+
+private:
+    void evict();
+
+    std::string m_dir;
+    int m_fd;
+    size_t m_limit;
+    size_t m_size;
+    unsigned int m_hits;
+    unsigned int m_misses;
+    unsigned int m_evicted;
+};
+
+/* Hash of the job, fed with the preprocessed source while it arrives. */
+class ObjectCacheKey
+{
+public:
+    ObjectCacheKey(const CompileJob &job, const std::list<std::string> &flags);
+
+    void append(const unsigned char *data, size_t len);
+    std::string finish();
+
+private:
+    void appendString(const std::string &str);
+
+    md5_state_t m_state;
+};
+
+// Opens the entry KEY in the cache directory DIRFD, -1 if there is none.
+int object_cache_open(int dirfd, const std::string &key);
+
+// Fills MSG and writes OBJ_FILE from the entry opened as FD, false if it is broken.
+bool object_cache_restore(int fd, CompileResultMsg &msg, const std::string &obj_file);
+
+// Adds the successful compile of MSG and OBJ_FILE as KEY, returns the bytes stored.
+size_t object_cache_store(int dirfd, const std::string &key, const CompileResultMsg &msg,
+                          const std::string &obj_file);
+
+#endif
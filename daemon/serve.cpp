@@ -49,6 +49,8 @@
 #include "exitcode.h"
 #include "tempfile.h"
 #include "workit.h"
+#include "cgroup.h"
+#include "cpuslots.h"
 #include "logging.h"
 #include "serve.h"
 #include "util.h"
@@ -132,11 +134,14 @@ static void write_output_file( const string& file, MsgChannel* client )
 }
 
 /**
- * Read a request, run the compiler, and send a response.
+ * Read a request, run the compiler, and send a response.  With VERIFY_ENV
+ * the environment is verified while the job compiles, the client gets that
+ * result before the compile result.
  **/
 int handle_connection(const string &basedir, CompileJob *job,
                       MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const std::vector<int> &cpus, int cache_fd, bool verify_env)
 {
     int socket[2];
 
@@ -173,8 +178,21 @@ int handle_connection(const string &basedir, CompileJob *job,
                       << endl;
     }
 
+    // needs to happen before the chroot
+    int cgroup_fd = enter_job_cgroup(mem_limit);
+
+    // the compiler inherits this
+    pin_to_cpus(cpus);
+
     string tmp_path, obj_file, dwo_file;
     int exit_code = 0;
+    // before the job enters its namespaces, bin/true gets its own
+    pid_t verify_pid = -1;
+
+    if (verify_env) {
+        verify_pid = start_verify_env(0, basedir, job->targetPlatform(),
+                                      job->environmentVersion(), user_uid, user_gid);
+    }
 
     try {
         if (job->environmentVersion().size()) {
@@ -201,7 +219,7 @@ int handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[JobStatistics::num_stats];
         CompileResultMsg rmsg;
         unsigned int job_id = job->jobID();
 
@@ -262,7 +280,7 @@ int handle_connection(const string &basedir, CompileJob *job,
             obj_file = output_dir + '/' + file_name;
             dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd);
+            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, cgroup_fd, -1);
         }
         else if (!job->dwarfFissionEnabled() && (ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
             obj_file = tmp_output;
@@ -270,7 +288,7 @@ int handle_connection(const string &basedir, CompileJob *job,
             string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
             string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd);
+            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, cgroup_fd, cache_fd);
         }
 
         if (ret) {
@@ -286,6 +304,25 @@ int handle_connection(const string &basedir, CompileJob *job,
             }
         }
 
+        if (verify_env) {
+            int status = 1;
+
+            if (verify_pid > 0) {
+                while (waitpid(verify_pid, &status, 0) < 0 && errno == EINTR) {}
+            }
+
+            bool ok = shell_exit_status(status) == 0;
+            job_stat[JobStatistics::env_verified] = ok ? 1 : 2;
+
+            if (!client->send_msg(VerifyEnvResultMsg(ok))) {
+                log_info() << "write of environment verification failed" << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+        }
+
+        struct timeval sendtv;
+        gettimeofday(&sendtv, 0);
+
         if (!client->send_msg(rmsg)) {
             log_info() << "write of result failed" << endl;
             throw myexception(EXIT_DISTCC_FAILED);
@@ -300,21 +337,39 @@ int handle_connection(const string &basedir, CompileJob *job,
             job_stat[JobStatistics::out_uncompressed] += st.st_size;
         }
 
-        /* wake up parent and tell him that compile finished */
+        /* wake up parent and tell him that compile finished, the slot
+           is free while the output goes to the client */
         /* if the write failed, well, doesn't matter */
         ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
-        if ((-1 == close(out_fd)) && (errno != EBADF)){
-            log_perror("close failed");
-        }
+
+        int send_status = 0;
 
         if (rmsg.status == 0) {
-            write_output_file(obj_file, client);
-            if (rmsg.have_dwo_file) {
-                write_output_file(dwo_file, client);
+            try {
+                write_output_file(obj_file, client);
+                if (rmsg.have_dwo_file) {
+                    write_output_file(dwo_file, client);
+                }
+            } catch (const myexception& e) {
+                send_status = e.exitcode();
             }
         }
 
-        throw myexception(rmsg.status);
+        /* how long that took comes after, see Daemon::handle_output_sent() */
+        struct timeval endtv;
+        gettimeofday(&endtv, 0);
+        uint32_t send_msec = ((endtv.tv_sec - sendtv.tv_sec) * 1000)
+                             + ((long(endtv.tv_usec) - long(sendtv.tv_usec)) / 1000);
+
+        if (rmsg.status == 0 && !send_status) {
+            ignore_result(write(out_fd, &send_msec, sizeof(send_msec)));
+        }
+
+        if ((-1 == close(out_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        throw myexception(send_status ? send_status : rmsg.status);
 
     } catch (const myexception& e) {
         delete client;
@@ -67,6 +67,8 @@
 #include "comm.h"
 #include "platform.h"
 #include "util.h"
+#include "cgroup.h"
+#include "objcache.h"
 
 using namespace std;
 
@@ -96,9 +98,38 @@ error_client(MsgChannel *client, string error)
  * (in the error cases which exit quickly).
  */
 
+/* Total wall time of the compiler's -ftime-report output. */
+static unsigned int time_report_msec(const string &err)
+{
+    // GCC: " TOTAL                 :   1.23             0.10             1.40         45512 kB"
+    string::size_type pos = err.rfind("\n TOTAL");
+
+    if (pos != string::npos) {
+        double usr, sys, wall;
+
+        if (sscanf(err.c_str() + pos, " TOTAL : %lf %lf %lf", &usr, &sys, &wall) == 3) {
+            return (unsigned int)(wall * 1000);
+        }
+    }
+
+    // Clang: "  Total Execution Time: 1.2345 seconds (1.3456 wall clock)"
+    pos = err.rfind("Total Execution Time:");
+
+    if (pos != string::npos) {
+        double seconds, wall;
+
+        if (sscanf(err.c_str() + pos, "Total Execution Time: %lf seconds (%lf wall clock)",
+                   &seconds, &wall) == 2) {
+            return (unsigned int)(wall * 1000);
+        }
+    }
+
+    return 0;
+}
+
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd)
+            unsigned long int mem_limit, int client_fd, int cgroup_fd, int cache_fd)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
@@ -120,6 +151,13 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     }
     trace() << "remote compile arguments:" << argstxt << endl;
 
+    // split dwarf has a second output and the time report differs every run
+    bool cacheable = cache_fd >= 0 && !j.dwarfFissionEnabled()
+                     && find(list.begin(), list.end(), "-ftime-report") == list.end();
+    ObjectCacheKey cache_key(j, list);
+    string cache_name;
+    int cache_entry = -1;
+
     int sock_err[2];
     int sock_out[2];
     int sock_in[2];
@@ -210,17 +248,20 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 #endif
 
 #ifndef SANITIZER_USED
-        struct rlimit rlim;
+        // the job's cgroup limits the memory really used instead
+        if (cgroup_fd < 0) {
+            struct rlimit rlim;
 
-        rlim_t lim = mem_limit * 1024 * 1024;
-        rlim.rlim_cur = lim;
-        rlim.rlim_max = lim;
+            rlim_t lim = mem_limit * 1024 * 1024;
+            rlim.rlim_cur = lim;
+            rlim.rlim_max = lim;
 
-        if (setrlimit(RLIMIT_AS, &rlim)) {
-            error_client(client, "setrlimit failed.");
-            log_perror("setrlimit");
-        } else {
-            log_info() << "Compile job memory limit set to " << mem_limit << " megabytes" << endl;
+            if (setrlimit(RLIMIT_AS, &rlim)) {
+                error_client(client, "setrlimit failed.");
+                log_perror("setrlimit");
+            } else {
+                log_info() << "Compile job memory limit set to " << mem_limit << " megabytes" << endl;
+            }
         }
 #endif
 #endif
@@ -438,6 +479,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
     struct timeval starttv;
     gettimeofday(&starttv, 0);
+    struct timeval inputtv = starttv;
 
     int return_value = 0;
     // Got EOF for preprocessed input. stdout send may be still pending.
@@ -462,6 +504,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                 } else {
                     if (msg->type == M_END) {
                         input_complete = true;
+                        gettimeofday(&inputtv, 0);
 
                         if (!fcmsg && sock_in[1] != -1) {
                             if (-1 == close(sock_in[1])){
@@ -470,6 +513,18 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                             sock_in[1] = -1;
                         }
 
+                        if (cacheable) {
+                            cache_name = cache_key.finish();
+                            cache_entry = object_cache_open(cache_fd, cache_name);
+
+                            if (cache_entry >= 0) {
+                                // the result is known, no need to wait for the compiler
+                                kill(pid, SIGTERM);
+                            } else {
+                                job_stat[JobStatistics::cache_miss] = 1;
+                            }
+                        }
+
                         delete msg;
                     } else if (msg->type == M_FILE_CHUNK) {
                         fcmsg = static_cast<FileChunkMsg*>(msg);
@@ -477,6 +532,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+
+                        if (cacheable) {
+                            cache_key.append(fcmsg->buffer, fcmsg->len);
+                        }
                     } else {
                         log_error() << "protocol error while reading preprocessed file" << endl;
                         input_complete = true;
@@ -676,11 +735,54 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                if (cgroup_fd >= 0) {
+                    job_cgroup_stats(cgroup_fd, job_stat);
+                }
+
+                if (cache_entry >= 0) {
+                    rmsg.out.clear();
+                    rmsg.err.clear();
+                    bool restored = return_value == 0
+                                    && object_cache_restore(cache_entry, rmsg,
+                                                            tmp_root + build_path + '/' + file_name);
+
+                    if ((-1 == close(cache_entry)) && (errno != EBADF)){
+                        log_perror("close failed");
+                    }
+
+                    if (return_value) {
+                        return return_value;
+                    }
+
+                    if (!restored) {
+                        // the compiler is gone, let the client compile it again
+                        log_error() << "restoring compile result from the object cache failed" << endl;
+                        return EXIT_IO_ERROR;
+                    }
+
+                    struct timeval endtv;
+                    gettimeofday(&endtv, 0);
+                    rmsg.status = 0;
+                    rmsg.have_dwo_file = false;
+                    job_stat[JobStatistics::exit_code] = 0;
+                    job_stat[JobStatistics::cache_hit] = 1;
+                    job_stat[JobStatistics::real_msec] = ((endtv.tv_sec - starttv.tv_sec) * 1000)
+                                                         + ((long(endtv.tv_usec) - long(starttv.tv_usec)) / 1000);
+                    job_stat[JobStatistics::receive_msec] = ((inputtv.tv_sec - starttv.tv_sec) * 1000)
+                                                            + ((long(inputtv.tv_usec) - long(starttv.tv_usec)) / 1000);
+                    log_info() << "Remote compilation answered from the object cache" << endl;
+                    return 0;
+                }
+
                 if (shell_exit_status(status) != 0) {
                     unsigned long int mem_used = ((ru.ru_minflt + ru.ru_majflt) * getpagesize()) / 1024;
                     rmsg.status = EXIT_OUT_OF_MEMORY;
 
-                    if (((mem_used * 100) > (85 * mem_limit * 1024))
+                    // with a cgroup we know, otherwise guess
+                    bool oom = cgroup_fd >= 0 ? job_cgroup_oom(cgroup_fd)
+                               : (mem_used * 100) > (85 * mem_limit * 1024);
+
+                    if (oom
                             || (rmsg.err.find("memory exhausted") != string::npos)
                             || (rmsg.err.find("out of memory") != string::npos)
                             || (rmsg.err.find("annot allocate memory") != string::npos)
@@ -721,6 +823,31 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     job_stat[JobStatistics::sys_msec] = (ru.ru_stime.tv_sec * 1000)
                                                         + (ru.ru_stime.tv_usec / 1000);
                     job_stat[JobStatistics::sys_pfaults] = ru.ru_majflt + ru.ru_nswap + ru.ru_minflt;
+                    // Linux and the BSDs report KiB, macOS bytes
+#ifdef __APPLE__
+                    job_stat[JobStatistics::max_rss_kb] = ru.ru_maxrss / 1024;
+#else
+                    job_stat[JobStatistics::max_rss_kb] = ru.ru_maxrss;
+#endif
+                    job_stat[JobStatistics::read_kb] = ru.ru_inblock / 2; // 512 byte blocks
+                    job_stat[JobStatistics::write_kb] = ru.ru_oublock / 2;
+                    job_stat[JobStatistics::voluntary_csw] = ru.ru_nvcsw;
+                    job_stat[JobStatistics::involuntary_csw] = ru.ru_nivcsw;
+                    job_stat[JobStatistics::receive_msec] = ((inputtv.tv_sec - starttv.tv_sec) * 1000)
+                                                            + ((long(inputtv.tv_usec) - long(starttv.tv_usec)) / 1000);
+                    job_stat[JobStatistics::compile_msec] = ((endtv.tv_sec - inputtv.tv_sec) * 1000)
+                                                            + ((long(endtv.tv_usec) - long(inputtv.tv_usec)) / 1000);
+
+                    if (find(list.begin(), list.end(), "-ftime-report") != list.end()) {
+                        job_stat[JobStatistics::time_report_msec] = time_report_msec(rmsg.err);
+                    }
+
+                    if (!cache_name.empty() && rmsg.status == 0 && return_value == 0) {
+                        job_stat[JobStatistics::cache_stored_bytes]
+                            = object_cache_store(cache_fd, cache_name, rmsg,
+                                                 tmp_root + build_path + '/' + file_name);
+                    }
+
                     if(rmsg.status != 0) {
                         log_warning() << "Remote compilation exited with exit code " << shell_exit_status(status) << endl;
                     } else {
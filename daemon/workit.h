@@ -47,12 +47,23 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults,
+                       // only known when the job ran in its own cgroup
+                       mem_peak, io_kb, cpu_stall_msec, mem_stall_msec, io_stall_msec,
+                       cpu_usage_msec, cpu_user_msec, cpu_system_msec,
+                       // see JobTelemetry
+                       max_rss_kb, read_kb, write_kb, voluntary_csw, involuntary_csw,
+                       receive_msec, compile_msec, time_report_msec,
+                       // see ObjectCache
+                       cache_hit, cache_miss, cache_stored_bytes,
+                       // 1 if the job verified its environment, 2 if that failed
+                       env_verified,
+                       num_stats
                      };
 }
 
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd);
+                   unsigned long int mem_limit, int client_fd, int cgroup_fd, int cache_fd);
 
 #endif
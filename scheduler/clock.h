@@ -0,0 +1,42 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CLOCK_H
+#define ICECREAM_CLOCK_H
+
+#include <time.h>
+
+/* The clock of the scheduler, in seconds. icecc-scheduler-sim runs it on
+   the time of the simulation.  */
+#ifdef SCHEDULER_SIMULATOR
+extern time_t simulated_now;
+
+inline time_t now()
+{
+    return simulated_now;
+}
+#else
+inline time_t now()
+{
+    return time(0);
+}
+#endif
+
+#endif
@@ -32,6 +32,7 @@
 #include "../services/logging.h"
 #include "../services/job.h"
 
+#include "clock.h"
 #include "job.h"
 
 
@@ -45,7 +46,15 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_busyInstalling(0)
     , m_hostPlatform()
     , m_load(1000)
+    , m_cpuPressure(0)
+    , m_memPressure(0)
+    , m_ioPressure(0)
+    , m_slotSpeeds()
     , m_maxJobs(0)
+    , m_maxLinkJobs(0)
+    , m_maxHeavyJobs(0)
+    , m_linkJobs(0)
+    , m_heavyJobs(0)
     , m_noRemote(false)
     , m_jobList()
     , m_state(CONNECTED)
@@ -55,10 +64,19 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_submittedJobsCount(0)
     , m_lastPickId(0)
     , m_compilerVersions()
+    , m_verifiedVersions()
+    , m_stagedEnvironments()
+    , m_failedStagedEnvironments()
     , m_lastCompiledJobs()
     , m_lastRequestedJobs()
     , m_cumCompiled()
     , m_cumRequested()
+    , m_lastTelemetry()
+    , m_requestWindow(0)
+    , m_requests(0)
+    , m_lastWindowRequests(0)
+    , m_requestedVersions()
+    , m_requestedTarget()
     , m_clientMap()
     , m_blacklist()
     , m_inFd(-1)
@@ -136,7 +154,7 @@ string CompileServer::can_install(const Job *job)
     //         << job->target_platform << "'" << endl;
     if (busyInstalling()) {
 #if DEBUG_SCHEDULER > 0
-        trace() << nodeName() << " is busy installing since " << time(0) - cs->busyInstalling()
+        trace() << nodeName() << " is busy installing since " << now() - cs->busyInstalling()
                 << " seconds." << endl;
 #endif
         return string();
@@ -156,7 +174,8 @@ string CompileServer::can_install(const Job *job)
 bool CompileServer::is_eligible(const Job *job)
 {
     bool jobs_okay = int(m_jobList.size()) < m_maxJobs;
-    bool load_okay = m_load < 1000;
+    // a node thrashing on memory or IO only gets slower with more jobs
+    bool load_okay = m_load < 1000 && m_memPressure < 500 && m_ioPressure < 500;
     bool version_okay = job->minimalHostVersion() <= protocol;
     return jobs_okay
            && (m_chrootPossible || job->submitter() == this)
@@ -232,6 +251,38 @@ void CompileServer::setLoad(unsigned int load)
     m_load = load;
 }
 
+unsigned int CompileServer::cpuPressure() const
+{
+    return m_cpuPressure;
+}
+
+unsigned int CompileServer::memPressure() const
+{
+    return m_memPressure;
+}
+
+unsigned int CompileServer::ioPressure() const
+{
+    return m_ioPressure;
+}
+
+void CompileServer::setPressure(const unsigned int cpu, const unsigned int memory, const unsigned int io)
+{
+    m_cpuPressure = cpu;
+    m_memPressure = memory;
+    m_ioPressure = io;
+}
+
+const vector<uint32_t> &CompileServer::slotSpeeds() const
+{
+    return m_slotSpeeds;
+}
+
+void CompileServer::setSlotSpeeds(const vector<uint32_t> &speeds)
+{
+    m_slotSpeeds = speeds;
+}
+
 int CompileServer::maxJobs() const
 {
     return m_maxJobs;
@@ -242,6 +293,38 @@ void CompileServer::setMaxJobs(int jobs)
     m_maxJobs = jobs;
 }
 
+unsigned int CompileServer::maxLinkJobs() const
+{
+    return m_maxLinkJobs;
+}
+
+unsigned int CompileServer::maxHeavyJobs() const
+{
+    return m_maxHeavyJobs;
+}
+
+void CompileServer::setMaxLinkJobs(unsigned int links, unsigned int heavy)
+{
+    m_maxLinkJobs = links;
+    m_maxHeavyJobs = heavy;
+}
+
+unsigned int CompileServer::linkJobs() const
+{
+    return m_linkJobs;
+}
+
+unsigned int CompileServer::heavyJobs() const
+{
+    return m_heavyJobs;
+}
+
+void CompileServer::setLinkJobs(unsigned int links, unsigned int heavy)
+{
+    m_linkJobs = links;
+    m_heavyJobs = heavy;
+}
+
 bool CompileServer::noRemote() const
 {
     return m_noRemote;
@@ -261,6 +344,7 @@ void CompileServer::appendJob(Job *job)
 {
     m_lastPickId = job->id();
     m_jobList.push_back(job);
+    job->setConcurrency(m_jobList.size());
 }
 
 void CompileServer::removeJob(Job *job)
@@ -338,6 +422,62 @@ void CompileServer::setCompilerVersions(const Environments &environments)
     m_compilerVersions = environments;
 }
 
+Environments CompileServer::verifiedVersions() const
+{
+    return m_verifiedVersions;
+}
+
+void CompileServer::setVerifiedVersions(const Environments &environments)
+{
+    m_verifiedVersions = environments;
+}
+
+bool CompileServer::environmentStaging(const pair<string, string> &env) const
+{
+    map<pair<string, string>, time_t>::const_iterator it = m_stagedEnvironments.find(env);
+    return it != m_stagedEnvironments.end() && now() - it->second < MAX_BUSY_INSTALLING;
+}
+
+bool CompileServer::environmentStagingFailed(const pair<string, string> &env) const
+{
+    map<pair<string, string>, time_t>::const_iterator it = m_stagedEnvironments.find(env);
+
+    if (it != m_stagedEnvironments.end()) {
+        return now() - it->second >= MAX_BUSY_INSTALLING;
+    }
+
+    it = m_failedStagedEnvironments.find(env);
+    return it != m_failedStagedEnvironments.end() && now() - it->second < MAX_BUSY_INSTALLING;
+}
+
+void CompileServer::stageEnvironment(const pair<string, string> &env)
+{
+    m_stagedEnvironments[env] = now();
+}
+
+void CompileServer::finishStagingEnvironment(const pair<string, string> &env, const bool ok)
+{
+    m_stagedEnvironments.erase(env);
+
+    if (ok) {
+        m_failedStagedEnvironments.erase(env);
+        return;
+    }
+
+    time_t t = now();
+
+    for (map<pair<string, string>, time_t>::iterator it = m_failedStagedEnvironments.begin();
+            it != m_failedStagedEnvironments.end(); ) {
+        if (t - it->second >= MAX_BUSY_INSTALLING) {
+            m_failedStagedEnvironments.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    m_failedStagedEnvironments[env] = t;
+}
+
 list<JobStat> CompileServer::lastCompiledJobs() const
 {
     return m_lastCompiledJobs;
@@ -353,6 +493,30 @@ void CompileServer::popCompiledJob()
     m_lastCompiledJobs.pop_front();
 }
 
+const map<unsigned int, map<uint32_t, uint32_t> > &CompileServer::lastTelemetry() const
+{
+    return m_lastTelemetry;
+}
+
+void CompileServer::appendTelemetry(unsigned int job_id, const map<uint32_t, uint32_t> &telemetry)
+{
+    m_lastTelemetry[job_id] = telemetry;
+
+    // the oldest jobs have the lowest ids
+    if (m_lastTelemetry.size() > 100) {
+        m_lastTelemetry.erase(m_lastTelemetry.begin());
+    }
+}
+
+void CompileServer::addTelemetry(unsigned int job_id, uint32_t key, uint32_t value)
+{
+    map<unsigned int, map<uint32_t, uint32_t> >::iterator it = m_lastTelemetry.find(job_id);
+
+    if (it != m_lastTelemetry.end()) {
+        it->second[key] = value;
+    }
+}
+
 list<JobStat> CompileServer::lastRequestedJobs() const
 {
     return m_lastRequestedJobs;
@@ -368,6 +532,45 @@ void CompileServer::popRequestedJobs()
     m_lastRequestedJobs.pop_front();
 }
 
+// requests are counted in windows of that many seconds
+static const time_t request_window = 10;
+
+void CompileServer::noteRequest(const time_t now, const Environments &versions, const string &target)
+{
+    if (now - m_requestWindow >= request_window) {
+        m_lastWindowRequests = now - m_requestWindow < 2 * request_window ? m_requests : 0;
+        m_requests = 0;
+        m_requestWindow = now;
+    }
+
+    m_requests++;
+    m_requestedVersions = versions;
+    m_requestedTarget = target;
+}
+
+unsigned int CompileServer::recentRequests(const time_t now) const
+{
+    if (now - m_requestWindow >= 2 * request_window) {
+        return 0;
+    }
+
+    if (now - m_requestWindow >= request_window) {
+        return m_requests;
+    }
+
+    return max(m_requests, m_lastWindowRequests);
+}
+
+Environments CompileServer::requestedVersions() const
+{
+    return m_requestedVersions;
+}
+
+string CompileServer::requestedTarget() const
+{
+    return m_requestedTarget;
+}
+
 JobStat CompileServer::cumCompiled() const
 {
     return m_cumCompiled;
@@ -436,7 +639,7 @@ int CompileServer::getInFd() const
 
 void CompileServer::startInConnectionTest()
 {
-    if (m_noRemote || getConnectionInProgress() || (m_nextConnTime > time(0)))
+    if (m_noRemote || getConnectionInProgress() || (m_nextConnTime > now()))
     {
         return;
     }
@@ -461,7 +664,7 @@ void CompileServer::startInConnectionTest()
     {
         updateInConnectivity(false);
     }
-    m_lastConnStartTime=time(0);
+    m_lastConnStartTime=now();
 }
 
 void CompileServer::updateInConnectivity(bool acceptingIn)
@@ -487,7 +690,7 @@ void CompileServer::updateInConnectivity(bool acceptingIn)
                 ":" << m_remotePort <<
                 ") is accepting incoming connections." << endl;
         }
-        m_nextConnTime = time(0) + check_back_time;
+        m_nextConnTime = now() + check_back_time;
         close(m_inFd);
         m_inFd = -1;
     }
@@ -501,12 +704,12 @@ void CompileServer::updateInConnectivity(bool acceptingIn)
                 ":" << m_remotePort <<
                 ") connected but is not able to accept incoming connections." << endl;
         }
-        m_nextConnTime = time(0) + time_offset_table[m_inConnAttempt];
+        m_nextConnTime = now() + time_offset_table[m_inConnAttempt];
         if(m_inConnAttempt < (table_size - 1))
             m_inConnAttempt++;
         trace()  << nodeName() << " failed to accept an incoming connection on "
             << name << ":" << m_remotePort << " attempting again in "
-            << m_nextConnTime - time(0) << " seconds" << endl;
+            << m_nextConnTime - now() << " seconds" << endl;
         close(m_inFd);
         m_inFd = -1;
     }
@@ -535,7 +738,7 @@ bool CompileServer::isConnected()
 
 time_t CompileServer::getConnectionTimeout()
 {
-    time_t now = time(0);
+    time_t now = ::now();
     time_t elapsed_time = now - m_lastConnStartTime;
     time_t max_timeout = 5;
     return (elapsed_time < max_timeout) ? max_timeout - elapsed_time : 0;
@@ -556,6 +759,6 @@ time_t CompileServer::getNextTimeout()
     {
         return getConnectionTimeout();
     }
-    time_t until_connect = m_nextConnTime - time(0);
+    time_t until_connect = m_nextConnTime - now();
     return (until_connect > 0) ? until_connect : 0;
 }
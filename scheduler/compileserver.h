@@ -27,6 +27,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 #include "../services/comm.h"
 #include "jobstat.h"
@@ -80,9 +81,25 @@ public:
     unsigned int load() const;
     void setLoad(const unsigned int load);
 
+    unsigned int cpuPressure() const;
+    unsigned int memPressure() const;
+    unsigned int ioPressure() const;
+    void setPressure(const unsigned int cpu, const unsigned int memory, const unsigned int io);
+
+    const vector<uint32_t> &slotSpeeds() const;
+    void setSlotSpeeds(const vector<uint32_t> &speeds);
+
     int maxJobs() const;
     void setMaxJobs(const int jobs);
 
+    unsigned int maxLinkJobs() const;
+    unsigned int maxHeavyJobs() const;
+    void setMaxLinkJobs(const unsigned int links, const unsigned int heavy);
+
+    unsigned int linkJobs() const;
+    unsigned int heavyJobs() const;
+    void setLinkJobs(const unsigned int links, const unsigned int heavy);
+
     bool noRemote() const;
     void setNoRemote(const bool value);
 
@@ -109,6 +126,16 @@ public:
     Environments compilerVersions() const;
     void setCompilerVersions(const Environments &environments);
 
+    /* Those of compilerVersions() known to work on the host.  */
+    Environments verifiedVersions() const;
+    void setVerifiedVersions(const Environments &environments);
+
+    /* Environments the daemon was told to fetch in the background.  */
+    bool environmentStaging(const pair<string, string> &env) const;
+    bool environmentStagingFailed(const pair<string, string> &env) const;
+    void stageEnvironment(const pair<string, string> &env);
+    void finishStagingEnvironment(const pair<string, string> &env, const bool ok);
+
     list<JobStat> lastCompiledJobs() const;
     void appendCompiledJob(const JobStat &stats);
     void popCompiledJob();
@@ -117,12 +144,25 @@ public:
     void appendRequestedJobs(const JobStat &stats);
     void popRequestedJobs();
 
+    /* Counts the requests for compile servers of its clients, the
+       environments of the last one are what slot leases are for.  */
+    void noteRequest(const time_t now, const Environments &versions, const string &target);
+    unsigned int recentRequests(const time_t now) const;
+    Environments requestedVersions() const;
+    string requestedTarget() const;
+
     JobStat cumCompiled() const;
     void setCumCompiled(const JobStat &stats);
 
     JobStat cumRequested() const;
     void setCumRequested(const JobStat &stats);
 
+    // JobTelemetry of the last jobs compiled here, by job id
+    const map<unsigned int, map<uint32_t, uint32_t> > &lastTelemetry() const;
+    void appendTelemetry(unsigned int job_id, const map<uint32_t, uint32_t> &telemetry);
+    // for what is reported after the job is done
+    void addTelemetry(unsigned int job_id, uint32_t key, uint32_t value);
+
 
     unsigned int hostidCounter() const;
 
@@ -155,7 +195,18 @@ private:
 
     // LOAD is load * 1000
     unsigned int m_load;
+    // share of time stalled, 0-1000
+    unsigned int m_cpuPressure;
+    unsigned int m_memPressure;
+    unsigned int m_ioPressure;
+    // per mille speed of the n-th concurrent job, as measured by the daemon
+    vector<uint32_t> m_slotSpeeds;
     int m_maxJobs;
+    // local jobs that are not compiles run in their own pools on the daemon
+    unsigned int m_maxLinkJobs;
+    unsigned int m_maxHeavyJobs;
+    unsigned int m_linkJobs;
+    unsigned int m_heavyJobs;
     bool m_noRemote;
     list<Job *> m_jobList;
     State m_state;
@@ -166,11 +217,20 @@ private:
     unsigned int m_lastPickId;
 
     Environments m_compilerVersions;  // Available compilers
+    Environments m_verifiedVersions;
+    map<pair<string, string>, time_t> m_stagedEnvironments;
+    map<pair<string, string>, time_t> m_failedStagedEnvironments; // until it's worth a retry
 
     list<JobStat> m_lastCompiledJobs;
     list<JobStat> m_lastRequestedJobs;
     JobStat m_cumCompiled;  // cumulated
     JobStat m_cumRequested;
+    map<unsigned int, map<uint32_t, uint32_t> > m_lastTelemetry;
+    time_t m_requestWindow; // start of the window m_requests are counted in
+    unsigned int m_requests;
+    unsigned int m_lastWindowRequests;
+    Environments m_requestedVersions;
+    string m_requestedTarget;
 
     static unsigned int s_hostIdCounter;
     map<int, int> m_clientMap; // map client ID for daemon to our IDs
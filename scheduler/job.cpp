@@ -33,6 +33,8 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_submitter(subm)
     , m_startTime(0)
     , m_startOnScheduler(0)
+    , m_assignTime(0)
+    , m_hostPlatform()
     , m_doneTime(0)
     , m_targetPlatform()
     , m_fileName()
@@ -41,6 +43,10 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_language()
     , m_preferredHost()
     , m_minimalHostVersion(0)
+    , m_user()
+    , m_priority(0)
+    , m_concurrency(0)
+    , m_leaseExpires(0)
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -138,6 +144,26 @@ void Job::setStartOnScheduler(const time_t time)
     m_startOnScheduler = time;
 }
 
+time_t Job::assignTime() const
+{
+    return m_assignTime;
+}
+
+void Job::setAssignTime(const time_t time)
+{
+    m_assignTime = time;
+}
+
+std::string Job::hostPlatform() const
+{
+    return m_hostPlatform;
+}
+
+void Job::setHostPlatform(const std::string &platform)
+{
+    m_hostPlatform = platform;
+}
+
 time_t Job::doneTime() const
 {
     return m_doneTime;
@@ -217,3 +243,43 @@ void Job::setMinimalHostVersion(int version)
 {
     m_minimalHostVersion = version;
 }
+
+std::string Job::user() const
+{
+    return m_user;
+}
+
+void Job::setUser(const std::string &user)
+{
+    m_user = user;
+}
+
+int Job::priority() const
+{
+    return m_priority;
+}
+
+void Job::setPriority(int priority)
+{
+    m_priority = priority;
+}
+
+unsigned int Job::concurrency() const
+{
+    return m_concurrency;
+}
+
+void Job::setConcurrency(unsigned int concurrency)
+{
+    m_concurrency = concurrency;
+}
+
+time_t Job::leaseExpires() const
+{
+    return m_leaseExpires;
+}
+
+void Job::setLeaseExpires(time_t time)
+{
+    m_leaseExpires = time;
+}
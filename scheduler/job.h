@@ -69,6 +69,14 @@ public:
     time_t startOnScheduler() const;
     void setStartOnScheduler(const time_t time);
 
+    // when it was given to its server
+    time_t assignTime() const;
+    void setAssignTime(const time_t time);
+
+    // of the environment the submitter was told to use
+    std::string hostPlatform() const;
+    void setHostPlatform(const std::string &platform);
+
     time_t doneTime() const;
     void setDoneTime(const time_t time);
 
@@ -93,6 +101,22 @@ public:
     int minimalHostVersion() const;
     void setMinimalHostVersion( int version );
 
+    // who asked for it, empty if the client did not say
+    std::string user() const;
+    void setUser(const std::string &user);
+
+    // higher goes first, 0 is normal
+    int priority() const;
+    void setPriority(int priority);
+
+    // jobs its server had when it got this one, including it
+    unsigned int concurrency() const;
+    void setConcurrency(unsigned int concurrency);
+
+    // until when the submitter may hand it to a client, 0 if not leased or used
+    time_t leaseExpires() const;
+    void setLeaseExpires(time_t time);
+
 private:
     const unsigned int m_id;
     unsigned int m_localClientId;
@@ -102,6 +126,8 @@ private:
     Environments m_environments;
     time_t m_startTime;  // _local_ to the compiler server
     time_t m_startOnScheduler;  // starttime local to scheduler
+    time_t m_assignTime;
+    std::string m_hostPlatform;
     /**
      * the end signal from client and daemon is a bit of a race and
      * in 99.9% of all cases it's catched correctly. But for the remaining
@@ -117,6 +143,10 @@ private:
     std::string m_language; // for debugging
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
+    std::string m_user;
+    int m_priority;
+    unsigned int m_concurrency;
+    time_t m_leaseExpires;
 };
 
 #endif
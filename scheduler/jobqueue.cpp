@@ -0,0 +1,212 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "jobqueue.h"
+#include "job.h"
+#include <logging.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+JobQueue::JobQueue()
+    : m_virtualTime(0)
+{
+}
+
+/* Lines are "share FLOW WEIGHT" or "member ID FLOW", # starts a comment. */
+bool JobQueue::loadShares(const string &file)
+{
+    ifstream in(file.c_str());
+
+    if (!in) {
+        log_perror("open") << "\t" << file << endl;
+        return false;
+    }
+
+    m_weights.clear();
+    m_members.clear();
+
+    string line;
+    int lineno = 0;
+
+    while (getline(in, line)) {
+        ++lineno;
+        line = line.substr(0, line.find('#'));
+
+        istringstream words(line);
+        string keyword, first, second;
+
+        if (!(words >> keyword)) {
+            continue;
+        }
+
+        if (!(words >> first >> second)) {
+            keyword.clear();
+        }
+
+        if (keyword == "share" && atoi(second.c_str()) > 0) {
+            m_weights[first] = atoi(second.c_str());
+        } else if (keyword == "member") {
+            m_members[first] = second;
+        } else {
+            log_error() << file << ":" << lineno << ": cannot parse '" << line << "'" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+string JobQueue::flow(const string &id) const
+{
+    map<string, string>::const_iterator it = m_members.find(id);
+    return it != m_members.end() ? it->second : id;
+}
+
+unsigned int JobQueue::weight(const string &flow) const
+{
+    map<string, unsigned int>::const_iterator it = m_weights.find(flow);
+    return it != m_weights.end() ? it->second : 1;
+}
+
+void JobQueue::push(Job *job, const string &flowname, time_t now)
+{
+    assert(m_index.find(job) == m_index.end());
+
+    Flow &f = m_flows[flowname];
+
+    if (f.jobs.empty()) {
+        // an idle flow starts at the current virtual time, it can't save up
+        f.finish = max(f.finish, m_virtualTime) + 1.0 / weight(flowname);
+        m_heads.insert(make_pair(f.finish, flowname));
+    }
+
+    Rank rank(double(now) / aging_seconds - job->priority(), job->id());
+    f.jobs[rank] = job;
+    m_index[job] = make_pair(flowname, rank);
+}
+
+Job *JobQueue::front() const
+{
+    if (m_heads.empty()) {
+        return 0;
+    }
+
+    return m_flows.find(m_heads.begin()->second)->second.jobs.begin()->second;
+}
+
+Job *JobQueue::nextFlow(Job *job) const
+{
+    map<Job *, pair<string, Rank> >::const_iterator it = m_index.find(job);
+
+    if (it == m_index.end()) {
+        return 0;
+    }
+
+    const string &flowname = it->second.first;
+    set<pair<double, string> >::const_iterator head
+        = m_heads.upper_bound(make_pair(m_flows.find(flowname)->second.finish, flowname));
+
+    if (head == m_heads.end()) {
+        return 0;
+    }
+
+    return m_flows.find(head->second)->second.jobs.begin()->second;
+}
+
+void JobQueue::pop(Job *job)
+{
+    unlink(job, true);
+}
+
+bool JobQueue::remove(Job *job)
+{
+    if (m_index.find(job) == m_index.end()) {
+        return false;
+    }
+
+    unlink(job, false);
+    return true;
+}
+
+void JobQueue::unlink(Job *job, bool served)
+{
+    map<Job *, pair<string, Rank> >::iterator it = m_index.find(job);
+    assert(it != m_index.end());
+
+    const string flowname = it->second.first;
+    map<string, Flow>::iterator fit = m_flows.find(flowname);
+    Flow &f = fit->second;
+
+    f.jobs.erase(it->second.second);
+    m_index.erase(it);
+
+    if (!served && !f.jobs.empty()) {
+        // the flow's turn is still the same
+        return;
+    }
+
+    m_heads.erase(make_pair(f.finish, flowname));
+    double step = 1.0 / weight(flowname);
+
+    if (served) {
+        // start-time fair queueing: virtual time is the start of the job in service
+        m_virtualTime = max(m_virtualTime, f.finish - step);
+    } else {
+        // the turn was not used
+        f.finish -= step;
+    }
+
+    if (!f.jobs.empty()) {
+        f.finish += step;
+        m_heads.insert(make_pair(f.finish, flowname));
+    } else if (f.finish <= m_virtualTime) {
+        // nothing to remember
+        m_flows.erase(fit);
+    }
+}
+
+bool JobQueue::empty() const
+{
+    return m_index.empty();
+}
+
+size_t JobQueue::size() const
+{
+    return m_index.size();
+}
+
+map<string, size_t> JobQueue::depths() const
+{
+    map<string, size_t> result;
+
+    for (map<string, Flow>::const_iterator it = m_flows.begin(); it != m_flows.end(); ++it) {
+        if (!it->second.jobs.empty()) {
+            result[it->first] = it->second.jobs.size();
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,98 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_JOBQUEUE_H
+#define ICECREAM_JOBQUEUE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <time.h>
+#include <utility>
+
+class Job;
+
+/**
+ * The jobs waiting for a compile server, served by start-time fair
+ * queueing: every flow (a submitting host, user or group of them) gets
+ * jobs in proportion to its weight, however many it queues up. A flow's
+ * next job is tagged with the flow's virtual finish time, and the flow
+ * with the smallest tag goes first. Within a flow the job with the
+ * highest priority goes first, and waiting raises the priority by one
+ * every aging_seconds so that nothing starves. Everything is O(log n).
+ */
+class JobQueue
+{
+public:
+    JobQueue();
+
+    // Reads the shares from FILE, see icecc-scheduler(1).
+    bool loadShares(const std::string &file);
+
+    // The flow identity ID belongs to.
+    std::string flow(const std::string &id) const;
+    unsigned int weight(const std::string &flow) const;
+
+    void push(Job *job, const std::string &flow, time_t now);
+
+    // The job to serve next, 0 if there is none.
+    Job *front() const;
+
+    // The first job of the flow after the one of JOB, 0 if it is the last,
+    // to look for something else if JOB can't be placed right now.
+    Job *nextFlow(Job *job) const;
+
+    // JOB is given to a server.
+    void pop(Job *job);
+    // JOB is gone before it got a server, returns false if it was not queued.
+    bool remove(Job *job);
+
+    bool empty() const;
+    size_t size() const;
+
+    // queued jobs per flow
+    std::map<std::string, size_t> depths() const;
+
+    static const int aging_seconds = 10;
+
+private:
+    // minus the priority the job would have at time 0, job id: the order
+    // does not change with aging, all jobs rise by the same
+    typedef std::pair<double, unsigned int> Rank;
+
+    struct Flow {
+        Flow() : finish(0) {}
+        double finish; // tag of the next job, or of the last one if empty
+        std::map<Rank, Job *> jobs;
+    };
+
+    void unlink(Job *job, bool served);
+
+    std::map<std::string, unsigned int> m_weights;
+    std::map<std::string, std::string> m_members;
+    std::map<std::string, Flow> m_flows;
+    // finish tag and name of every flow that has jobs
+    std::set<std::pair<double, std::string> > m_heads;
+    std::map<Job *, std::pair<std::string, Rank> > m_index;
+    double m_virtualTime;
+};
+
+#endif
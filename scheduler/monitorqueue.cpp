@@ -0,0 +1,202 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "monitorqueue.h"
+#include <sys/time.h>
+
+using namespace std;
+
+// job events of one window, a busy farm has a few hundred a second
+static const size_t max_events = 20000;
+
+static unsigned long long now_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+MonitorQueue::MonitorQueue(unsigned int batch_msec)
+    : m_batchMsec(batch_msec)
+    , m_windowEnd(0)
+    , m_events(0)
+{
+}
+
+void MonitorQueue::add(const Msg &m)
+{
+    if (m_events >= max_events) {
+        m_jobs.dropped++;
+        return;
+    }
+
+    switch (m.type) {
+    case M_MON_GET_CS: {
+        const MonGetCSMsg &gm = static_cast<const MonGetCSMsg &>(m);
+        MonBatchMsg::JobRequest request;
+        request.job_id = gm.job_id;
+        request.hostid = gm.clientid;
+        request.lang = gm.lang;
+        request.filename = gm.filename;
+        m_jobs.requests.push_back(request);
+        break;
+    }
+    case M_MON_JOB_BEGIN: {
+        const MonJobBeginMsg &bm = static_cast<const MonJobBeginMsg &>(m);
+        MonBatchMsg::JobStart start;
+        start.job_id = bm.job_id;
+        start.hostid = bm.hostid;
+        start.stime = bm.stime;
+        m_jobs.begins.push_back(start);
+        break;
+    }
+    case M_MON_LOCAL_JOB_BEGIN: {
+        const MonLocalJobBeginMsg &lm = static_cast<const MonLocalJobBeginMsg &>(m);
+        MonBatchMsg::JobStart start;
+        start.job_id = lm.job_id;
+        start.hostid = lm.hostid;
+        start.stime = lm.stime;
+        start.file = lm.file;
+        m_jobs.local_begins.push_back(start);
+        break;
+    }
+    case M_MON_JOB_DONE: {
+        const MonJobDoneMsg &dm = static_cast<const MonJobDoneMsg &>(m);
+        MonBatchMsg::JobEnd end;
+        end.job_id = dm.job_id;
+        end.exitcode = dm.exitcode;
+        end.flags = dm.flags;
+        end.real_msec = dm.real_msec;
+        end.user_msec = dm.user_msec;
+        end.sys_msec = dm.sys_msec;
+        end.pfaults = dm.pfaults;
+        end.in_uncompressed = dm.in_uncompressed;
+        end.out_uncompressed = dm.out_uncompressed;
+        m_jobs.ends.push_back(end);
+        break;
+    }
+    case M_JOB_LOCAL_DONE:
+        m_jobs.local_ends.push_back(static_cast<const JobLocalDoneMsg &>(m).job_id);
+        break;
+    default:
+        return;
+    }
+
+    m_events++;
+}
+
+void MonitorQueue::setHost(uint32_t hostid, const map<uint32_t, uint32_t> &values,
+                           const map<uint32_t, string> &texts)
+{
+    static const MonBatchMsg::Host none = MonBatchMsg::Host();
+    map<uint32_t, MonBatchMsg::Host>::const_iterator known = m_sent.find(hostid);
+    const MonBatchMsg::Host &sent = known != m_sent.end() ? known->second : none;
+    MonBatchMsg::Host &changed = m_changed[hostid];
+    changed.hostid = hostid;
+
+    for (map<uint32_t, uint32_t>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        map<uint32_t, uint32_t>::const_iterator old = sent.values.find(it->first);
+
+        if (old != sent.values.end() && old->second == it->second) {
+            changed.values.erase(it->first);
+        } else {
+            changed.values[it->first] = it->second;
+        }
+    }
+
+    for (map<uint32_t, string>::const_iterator it = texts.begin(); it != texts.end(); ++it) {
+        map<uint32_t, string>::const_iterator old = sent.texts.find(it->first);
+
+        if (old != sent.texts.end() && old->second == it->second) {
+            changed.texts.erase(it->first);
+        } else {
+            changed.texts[it->first] = it->second;
+        }
+    }
+
+    if (changed.values.empty() && changed.texts.empty()) {
+        m_changed.erase(hostid);
+    }
+}
+
+void MonitorQueue::hostOffline(uint32_t hostid)
+{
+    MonBatchMsg::Host &changed = m_changed[hostid];
+    changed.hostid = hostid;
+    changed.values.clear();
+    changed.texts.clear();
+    changed.values[MonBatchMsg::HostOffline] = 1;
+}
+
+unsigned int MonitorQueue::msecToDue() const
+{
+    unsigned long long now = now_msec();
+    return m_windowEnd > now ? m_windowEnd - now : 0;
+}
+
+void MonitorQueue::take(MonBatchMsg &batch)
+{
+    batch = m_jobs;
+
+    for (map<uint32_t, MonBatchMsg::Host>::const_iterator it = m_changed.begin();
+            it != m_changed.end(); ++it) {
+        batch.hosts.push_back(it->second);
+        map<uint32_t, uint32_t>::const_iterator offline
+            = it->second.values.find(MonBatchMsg::HostOffline);
+
+        if (offline != it->second.values.end() && offline->second) {
+            // the id may be given to another host, which starts from nothing
+            m_sent.erase(it->first);
+            continue;
+        }
+
+        MonBatchMsg::Host &sent = m_sent[it->first];
+        sent.hostid = it->first;
+
+        for (map<uint32_t, uint32_t>::const_iterator vit = it->second.values.begin();
+                vit != it->second.values.end(); ++vit) {
+            sent.values[vit->first] = vit->second;
+        }
+
+        for (map<uint32_t, string>::const_iterator tit = it->second.texts.begin();
+                tit != it->second.texts.end(); ++tit) {
+            sent.texts[tit->first] = tit->second;
+        }
+    }
+
+    m_changed.clear();
+    m_jobs = MonBatchMsg();
+    nextWindow();
+}
+
+void MonitorQueue::drop()
+{
+    uint32_t dropped = m_jobs.dropped + m_events;
+    m_jobs = MonBatchMsg();
+    m_jobs.dropped = dropped;
+    nextWindow();
+}
+
+void MonitorQueue::nextWindow()
+{
+    m_events = 0;
+    m_windowEnd = now_msec() + m_batchMsec;
+}
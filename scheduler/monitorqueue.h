@@ -0,0 +1,68 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_MONITORQUEUE_H
+#define ICECREAM_MONITORQUEUE_H
+
+#include "../services/comm.h"
+#include <map>
+#include <string>
+
+/**
+ * What a monitor that takes batches (protocol 54) was not sent yet: the job
+ * events of the current window and the host values that changed since it
+ * got them last. The queue is bounded; events beyond that, and those of
+ * windows the monitor was too far behind for, are only counted. Host values
+ * coalesce, so after falling behind the monitor gets the latest ones.
+ */
+class MonitorQueue
+{
+public:
+    explicit MonitorQueue(unsigned int batch_msec = 1000);
+
+    // One of the M_MON_* job messages or M_JOB_LOCAL_DONE, others are ignored.
+    void add(const Msg &m);
+
+    // All current values of a host, only the ones that differ from what the
+    // monitor has are queued.
+    void setHost(uint32_t hostid, const std::map<uint32_t, uint32_t> &values,
+                 const std::map<uint32_t, std::string> &texts);
+    void hostOffline(uint32_t hostid);
+
+    // msec until the window ends, 0 if it has
+    unsigned int msecToDue() const;
+
+    // Moves what is queued into BATCH, the monitor has it then.
+    void take(MonBatchMsg &batch);
+    // Drops the job events of the window, the monitor could not take them.
+    void drop();
+
+private:
+    void nextWindow();
+
+    unsigned int m_batchMsec;
+    unsigned long long m_windowEnd;
+    size_t m_events;
+    MonBatchMsg m_jobs;
+    std::map<uint32_t, MonBatchMsg::Host> m_changed;
+    std::map<uint32_t, MonBatchMsg::Host> m_sent;
+};
+
+#endif
@@ -0,0 +1,91 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "netmodel.h"
+#include <stdio.h>
+
+using namespace std;
+
+// transfers between two hosts before we trust the fit
+static const unsigned int min_link_samples = 3;
+
+NetworkModel::NetworkModel()
+    : m_inRatio(0.25)
+    , m_outRatio(0.1)
+{
+}
+
+void NetworkModel::learn(const string &submitter, const string &server, unsigned int bytes,
+                         unsigned int msec)
+{
+    m_links[make_pair(submitter, server)].add(bytes / 1024.0, msec);
+}
+
+void NetworkModel::learnSizes(unsigned int in_uncompressed, unsigned int in_compressed,
+                              unsigned int out_compressed)
+{
+    if (!in_uncompressed) {
+        return;
+    }
+
+    m_inRatio = 0.95 * m_inRatio + 0.05 * in_compressed / in_uncompressed;
+    m_outRatio = 0.95 * m_outRatio + 0.05 * out_compressed / in_uncompressed;
+}
+
+unsigned int NetworkModel::transferTime(const string &submitter, const string &server,
+                                        unsigned int bytes) const
+{
+    map<pair<string, string>, LinearFit>::const_iterator it
+        = m_links.find(make_pair(submitter, server));
+
+    if (it == m_links.end() || it->second.count < min_link_samples) {
+        return 0;
+    }
+
+    return (unsigned int) it->second.predict(bytes / 1024.0);
+}
+
+unsigned int NetworkModel::jobTraffic(unsigned int in_bytes) const
+{
+    return (unsigned int)(in_bytes * (m_inRatio + m_outRatio));
+}
+
+list<string> NetworkModel::dump() const
+{
+    list<string> lines;
+    char buffer[100];
+
+    snprintf(buffer, sizeof(buffer), " compressed input %.0f%%, output %.0f%% of the input",
+             m_inRatio * 100, m_outRatio * 100);
+    lines.push_back(buffer);
+
+    for (map<pair<string, string>, LinearFit>::const_iterator it = m_links.begin();
+            it != m_links.end(); ++it) {
+        double latency, msec_per_kib;
+        it->second.coefficients(latency, msec_per_kib);
+        snprintf(buffer, sizeof(buffer), ": jobs=%u latency=%.0fms bandwidth=%.0fKiB/s",
+                 it->second.count, latency, msec_per_kib > 0 ? 1000 / msec_per_kib : 0.0);
+        lines.push_back(" " + it->first.first + " <-> " + it->first.second + buffer);
+    }
+
+    return lines;
+}
@@ -0,0 +1,64 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_NETMODEL_H
+#define ICECREAM_NETMODEL_H
+
+#include "timemodel.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+/**
+ * What moving data between a submitter and a compile server costs, learnt
+ * passively from the jobs: the servers report how long sending the result
+ * back took, which gives a fit of transfer time to size for every pair of
+ * hosts. Its intercept is about the round trip time, its slope the inverse
+ * of the bandwidth. The input is not used, the client sends it while it is
+ * still preprocessing.
+ */
+class NetworkModel
+{
+public:
+    NetworkModel();
+
+    void learn(const std::string &submitter, const std::string &server, unsigned int bytes,
+               unsigned int msec);
+    void learnSizes(unsigned int in_uncompressed, unsigned int in_compressed,
+                    unsigned int out_compressed);
+
+    // msec to move BYTES between the hosts, 0 if not known
+    unsigned int transferTime(const std::string &submitter, const std::string &server,
+                              unsigned int bytes) const;
+    // compressed bytes of input and output of a job with IN_BYTES of preprocessed input
+    unsigned int jobTraffic(unsigned int in_bytes) const;
+
+    std::list<std::string> dump() const;
+
+private:
+    std::map<std::pair<std::string, std::string>, LinearFit> m_links;
+    double m_inRatio; // compressed / uncompressed input
+    double m_outRatio; // compressed output / uncompressed input
+};
+
+#endif
@@ -43,7 +43,9 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <vector>
 #include <algorithm>
+#include <cmath>
 #include <cassert>
 #include <fstream>
 #include <string>
@@ -55,8 +57,19 @@
 #include "../services/util.h"
 #include "config.h"
 
+#include "clock.h"
 #include "compileserver.h"
 #include "job.h"
+#include "jobqueue.h"
+#include "monitorqueue.h"
+#include "netmodel.h"
+#include "statsfile.h"
+#include "timemodel.h"
+#include "tracefile.h"
+
+#ifdef SCHEDULER_SIMULATOR
+#include "simulator.h"
+#endif
 
 // Values 0 to 3.
 #define DEBUG_SCHEDULER 0
@@ -100,44 +113,49 @@ static volatile sig_atomic_t exit_main_loop = false;
 
 time_t starttime;
 time_t last_announce;
+#ifndef SCHEDULER_SIMULATOR
 static unsigned int scheduler_port = 8765;
+#endif
 
 // A subset of connected_hosts representing the compiler servers
 static list<CompileServer *> css;
 static list<CompileServer *> monitors;
+// those of the monitors that take batches
+static map<CompileServer *, MonitorQueue> monitor_queues;
 static list<CompileServer *> controls;
 static list<string> block_css;
 static unsigned int new_job_id;
 static map<unsigned int, Job *> jobs;
 
-/* XXX Uah.  Don't use a queue for the job requests.  It's a hell
-   to delete anything out of them (for clean up).  */
-struct UnansweredList {
-    list<Job *> l;
-    CompileServer *server;
-    bool remove_job(Job *);
-};
-static list<UnansweredList *> toanswer;
+// the jobs waiting for a server, shared fairly between hosts or users
+static JobQueue job_queue;
+static bool share_by_user = false;
+
+/* Jobs the server they wait on was asked to pass on, and where to.  */
+static map<unsigned int, CompileServer *> redirects;
 
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
+static CompileTimeModel time_model;
+static NetworkModel network_model;
 
-static float server_speed(CompileServer *cs, Job *job = 0, bool blockDebug = false);
+// the speed statistics survive restarts in this file, if set
+static string stats_file;
+static StatsFile saved_stats;
+static const time_t stats_save_interval = 5 * 60;
+// a server logged out since the last save, what it learned is saved sooner
+static bool stats_dirty = false;
+static const time_t stats_dirty_save_interval = 10;
+// forget about nodes not seen for that long
+static const time_t stats_max_age = 7 * 24 * 60 * 60;
 
-/* Searches the queue for JOB and removes it.
-   Returns true if something was deleted.  */
-bool UnansweredList::remove_job(Job *job)
-{
-    list<Job *>::iterator it;
+// what the daemons tell about jobs is recorded here, if set, see icecc-scheduler-sim
+static TraceFile trace_file;
 
-    for (it = l.begin(); it != l.end(); ++it)
-        if (*it == job) {
-            l.erase(it);
-            return true;
-        }
+// what sending an environment probably costs, we don't know the size of the tarballs
+static const unsigned int env_size_estimate = 64 * 1024 * 1024;
 
-    return false;
-}
+static float server_speed(CompileServer *cs, Job *job = 0, bool blockDebug = false);
 
 static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
@@ -149,6 +167,11 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
         return;
     }
 
+    /* Nor on results the server had cached. */
+    if (msg->telemetry.find(JobTelemetry::cache_hit) != msg->telemetry.end()) {
+        return;
+    }
+
     st.setOutputSize(msg->out_uncompressed);
     st.setCompileTimeReal(msg->real_msec);
     st.setCompileTimeUser(msg->user_msec);
@@ -211,7 +234,7 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 #if DEBUG_SCHEDULER > 1
     if (job->argFlags() < 7000) {
         trace() << "add_job_stats " << job->language() << " "
-                << (time(0) - starttime) << " "
+                << (now() - starttime) << " "
                 << st.compileTimeUser() << " "
                 << (job->argFlags() & CompileJob::Flag_g ? '1' : '0')
                 << (job->argFlags() & CompileJob::Flag_g3 ? '1' : '0')
@@ -226,8 +249,138 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 #endif
 }
 
+/* What learn_transfer() needs of finished jobs whose server did not tell
+   yet how long sending the output took, by job id.  */
+struct PendingTransfer {
+    string submitter;
+    string server;
+    unsigned int out_compressed;
+};
+
+static map<unsigned int, PendingTransfer> pending_transfers;
+// the rest did not get their output
+static const size_t max_pending_transfers = 1000;
+
+static void learn_transfer(Job *job, JobDoneMsg *msg)
+{
+    if (!msg->is_from_server() || msg->exitcode != 0 || !job->server()
+            || job->server() == job->submitter() || !IS_PROTOCOL_49(job->server())) {
+        return;
+    }
+
+    // the send time comes with M_JOB_SENT
+    PendingTransfer &transfer = pending_transfers[job->id()];
+    transfer.submitter = job->submitter()->nodeName();
+    transfer.server = job->server()->nodeName();
+    transfer.out_compressed = msg->out_compressed;
+
+    if (pending_transfers.size() > max_pending_transfers) {
+        pending_transfers.erase(pending_transfers.begin());
+    }
+
+    network_model.learnSizes(msg->in_uncompressed, msg->in_compressed, msg->out_compressed);
+}
+
+static void learn_job_time(Job *job, JobDoneMsg *msg)
+{
+    if (!msg->is_from_server() || msg->exitcode != 0 || !msg->in_uncompressed
+            || !msg->user_msec || !job->server()
+            || msg->telemetry.find(JobTelemetry::cache_hit) != msg->telemetry.end()) {
+        return;
+    }
+
+    string jobClass = CompileTimeModel::jobClass(job->language(), job->argFlags());
+    time_model.learn(job->server()->nodeName(), jobClass, msg->in_uncompressed,
+                     msg->user_msec + msg->sys_msec);
+    time_model.learnScaling(job->server()->nodeName(), jobClass, msg->in_uncompressed,
+                            job->concurrency(), msg->real_msec);
+    time_model.setInputSize(job->fileName(), msg->in_uncompressed);
+}
+
+static void remember_speed(CompileServer *cs)
+{
+    if (!cs->lastCompiledJobs().empty()) {
+        saved_stats.update(cs->nodeName(), cs->hostPlatform(), now(),
+                           cs->lastCompiledJobs().size(), cs->cumCompiled());
+    }
+}
+
+#ifndef SCHEDULER_SIMULATOR
+static void save_speeds()
+{
+    if (stats_file.empty()) {
+        return;
+    }
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        remember_speed(*it);
+    }
+
+    (void) saved_stats.save(stats_file, now(), stats_max_age);
+    stats_dirty = false;
+}
+#endif
+
+/* Starts a server that logged in with the speed it had before a restart
+   of the scheduler, instead of having it compile test jobs.  */
+static void restore_speed(CompileServer *cs)
+{
+    const StatsFile::Record *record = saved_stats.find(cs->nodeName(), cs->hostPlatform());
+
+    if (!record || !cs->lastCompiledJobs().empty()) {
+        return;
+    }
+
+    // enough average jobs to count as known, new ones soon outweigh them
+    unsigned int count = min(record->jobs, 10U);
+    JobStat average = record->cum / record->jobs;
+
+    for (unsigned int i = 0; i < count; ++i) {
+        cs->appendCompiledJob(average);
+        cs->setCumCompiled(cs->cumCompiled() + average);
+        all_job_stats.push_back(average);
+        cum_job_stats += average;
+    }
+
+    trace() << "restored speed of " << cs->nodeName() << " from " << record->jobs << " jobs" << endl;
+}
+
 static bool handle_end(CompileServer *cs, Msg *);
 
+static TraceEvent trace_event(TraceEvent::Type type, CompileServer *cs)
+{
+    TraceEvent event;
+    event.type = type;
+    event.msec = TraceFile::now();
+    event.host = cs->nodeName();
+    return event;
+}
+
+static void trace_cs_request(CompileServer *submitter, Job *job, const GetCSMsg *m)
+{
+    TraceEvent event = trace_event(TraceEvent::GetCS, submitter);
+    event.jobId = job->id();
+    event.language = m->lang;
+    event.argFlags = m->arg_flags;
+    event.priority = m->priority;
+    event.user = m->user;
+    event.fileName = m->filename;
+    trace_file.write(event);
+}
+
+/* Unsent output at which a monitor gets nothing more until it took it,
+   rather than buffering without limit for one that stopped reading.  */
+static const size_t monitor_max_pending = 256 * 1024;
+// shortest batch window a monitor may ask for
+static const unsigned int monitor_min_batch_msec = 100;
+
+/* Only sending flushes what a monitor did not take yet, returns false if
+   the monitor is gone.  */
+static bool flush_monitor(CompileServer *monitor)
+{
+    return !monitor->pending_output() || monitor->flush_output();
+}
+
 static void notify_monitors(Msg *m)
 {
     list<CompileServer *>::iterator it;
@@ -235,6 +388,16 @@ static void notify_monitors(Msg *m)
 
     for (it = monitors.begin(); it != monitors.end();) {
         it_old = it++;
+        map<CompileServer *, MonitorQueue>::iterator queue = monitor_queues.find(*it_old);
+
+        if (queue != monitor_queues.end()) {
+            queue->second.add(*m);
+            continue;
+        }
+
+        if (flush_monitor(*it_old) && (*it_old)->pending_output() > monitor_max_pending) {
+            continue;
+        }
 
         /* If we can't send it, don't be clever, simply close this monitor.  */
         if (!(*it_old)->send_msg(*m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
@@ -246,6 +409,65 @@ static void notify_monitors(Msg *m)
     delete m;
 }
 
+#ifndef SCHEDULER_SIMULATOR
+/* Sends the batches that are due, returns the msec until the next one is
+   or -1 without monitors that take batches. A monitor that did not take its
+   last output yet keeps queueing, the main loop waits for it to be writable.  */
+static int flush_monitor_batches()
+{
+    int wait = -1;
+
+    for (map<CompileServer *, MonitorQueue>::iterator it = monitor_queues.begin();
+            it != monitor_queues.end();) {
+        CompileServer *monitor = it->first;
+        MonitorQueue &queue = it->second;
+        ++it; // handle_end() removes the monitor
+
+        if (!queue.msecToDue()) {
+            if (!flush_monitor(monitor)) {
+                handle_end(monitor, 0);
+                continue;
+            }
+
+            if (monitor->pending_output() > monitor_max_pending) {
+                queue.drop();
+            } else if (monitor->pending_output()) {
+                continue;
+            } else {
+                MonBatchMsg batch;
+                queue.take(batch);
+
+                if (!batch.empty() && !monitor->send_msg(batch, MsgChannel::SendNonBlocking)) {
+                    trace() << "monitor is blocking... removing" << endl;
+                    handle_end(monitor, 0);
+                    continue;
+                }
+            }
+        }
+
+        int due = queue.msecToDue();
+
+        if (wait < 0 || due < wait) {
+            wait = due;
+        }
+    }
+
+    return wait;
+}
+#endif
+
+static void notify_monitors_offline(CompileServer *cs)
+{
+    for (map<CompileServer *, MonitorQueue>::iterator it = monitor_queues.begin();
+            it != monitor_queues.end(); ++it) {
+        it->second.hostOffline(cs->hostId());
+    }
+
+    if (monitors.size() > monitor_queues.size()) {
+        notify_monitors(new MonStatsMsg(cs->hostId(), "State:Offline\n"));
+    }
+}
+
 static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
 {
 #if DEBUG_SCHEDULER <= 2
@@ -304,13 +526,46 @@ static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
                 // ignoring load for submitter - assuming the load is our own
             } else {
                 f *= float(1000 - cs->load()) / 1000;
+
+                // Load can look low while tasks are stalled on contention. Our own jobs
+                // stall each other on the CPUs the more slots they fill, the load covers
+                // that already, so only CPU pressure beyond their share counts.
+                unsigned int jobs_pressure = cs->maxJobs() > 0
+                                             ? 1000 * min(cs->jobList().size(), size_t(cs->maxJobs()))
+                                               / cs->maxJobs()
+                                             : 0;
+                unsigned int cpu_pressure = cs->cpuPressure() > jobs_pressure
+                                            ? cs->cpuPressure() - jobs_pressure : 0;
+                unsigned int pressure = max(cpu_pressure, max(cs->memPressure(), cs->ioPressure()));
+                f *= float(1000 - min(pressure, 1000U)) / 1000;
+
+                // links and LTO runs there have their own slots, but
+                // compete for memory bandwidth and the CPU caches
+                if (cs->heavyJobs()) {
+                    f *= 0.5;
+                }
+
+                if (cs->linkJobs() && cs->maxLinkJobs()) {
+                    f *= 1.0f - 0.5f * min(cs->linkJobs(), cs->maxLinkJobs()) / cs->maxLinkJobs();
+                }
             }
 
-            /* Gradually throttle with the number of assigned jobs. This
-             * takes care of the fact that not all slots are equally fast on
-             * CPUs with SMT and dynamic clock ramping.
+            /* Not all slots are equally fast on CPUs with SMT and dynamic
+             * clock ramping. Once we have seen how the throughput of the
+             * server grows with its jobs, take what one more adds; before
+             * that newer daemons tell how fast the next slot is, for others
+             * gradually throttle with the number of assigned jobs.
              */
-            f *= (1.0f - (0.5f * cs->jobList().size() / cs->maxJobs()));
+            size_t assigned = cs->jobList().size();
+            double marginal = time_model.marginalSpeed(cs->nodeName(), assigned);
+
+            if (marginal > 0) {
+                f *= marginal;
+            } else if (assigned < cs->slotSpeeds().size()) {
+                f *= cs->slotSpeeds()[assigned] / 1000.0f;
+            } else {
+                f *= (1.0f - (0.5f * assigned / cs->maxJobs()));
+            }
         }
 
         // below we add a pessimism factor - assuming the first job a computer got is not representative
@@ -322,9 +577,92 @@ static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
     }
 }
 
+static string envs_match(CompileServer *cs, const Job *job);
+
+/* Milliseconds JOB would take on CS as it is loaded now, with sending it
+   there and the results back, 0 if we can't tell.  */
+static float projected_time(CompileServer *cs, Job *job)
+{
+    string jobClass = CompileTimeModel::jobClass(job->language(), job->argFlags());
+    unsigned int in_bytes = time_model.inputSize(job->fileName(), jobClass);
+    unsigned int msec = time_model.predict(cs->nodeName(), jobClass, in_bytes);
+    float idle_speed = server_speed(cs);
+
+    if (!msec || idle_speed <= 0) {
+        return 0;
+    }
+
+    // the speed for JOB has the adjustments for load and the slot it gets
+    float speed = server_speed(cs, job);
+
+    if (speed <= 0) {
+        return 1e9;
+    }
+
+    float result = msec * idle_speed / speed;
+
+    if (cs != job->submitter()) {
+        unsigned int bytes = network_model.jobTraffic(in_bytes);
+
+        if (envs_match(cs, job).empty()) {
+            bytes += env_size_estimate;
+        }
+
+        result += network_model.transferTime(job->submitter()->nodeName(), cs->nodeName(), bytes);
+    }
+
+    return result;
+}
+
+/* Whether JOB would be done earlier on CS than on BEST.  */
+static bool done_earlier(CompileServer *best, CompileServer *cs, Job *job)
+{
+    float best_time = projected_time(best, job);
+    float cs_time = projected_time(cs, job);
+
+    if (best_time > 0 && cs_time > 0) {
+        return cs_time < best_time;
+    }
+
+    return server_speed(best, job) < server_speed(cs, job);
+}
+
 static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
 {
-    if (monitors.empty()) {
+    if (!monitor_queues.empty()) {
+        map<uint32_t, uint32_t> values;
+        map<uint32_t, string> texts;
+        texts[MonBatchMsg::HostName] = cs->nodeName();
+        texts[MonBatchMsg::HostIP] = cs->name;
+        texts[MonBatchMsg::HostPlatform] = cs->hostPlatform();
+        values[MonBatchMsg::HostOffline] = 0;
+        values[MonBatchMsg::HostMaxJobs] = cs->maxJobs();
+        values[MonBatchMsg::HostNoRemote] = cs->noRemote();
+        values[MonBatchMsg::HostSpeed] = uint32_t(server_speed(cs) * 1000);
+
+        if (m) {
+            values[MonBatchMsg::HostLoad] = m->load;
+            values[MonBatchMsg::HostLoadAvg1] = m->loadAvg1;
+            values[MonBatchMsg::HostLoadAvg5] = m->loadAvg5;
+            values[MonBatchMsg::HostLoadAvg10] = m->loadAvg10;
+            values[MonBatchMsg::HostFreeMem] = m->freeMem;
+            values[MonBatchMsg::HostCPUPressure] = m->cpuPressure;
+            values[MonBatchMsg::HostMemPressure] = m->memPressure;
+            values[MonBatchMsg::HostIOPressure] = m->ioPressure;
+            values[MonBatchMsg::HostLinkJobs] = m->linkJobs;
+            values[MonBatchMsg::HostHeavyJobs] = m->heavyJobs;
+        } else {
+            values[MonBatchMsg::HostLoad] = cs->load();
+        }
+
+        for (map<CompileServer *, MonitorQueue>::iterator it = monitor_queues.begin();
+                it != monitor_queues.end(); ++it) {
+            it->second.setHost(cs->hostId(), values, texts);
+        }
+    }
+
+    // the text is only for the monitors that take one message per event
+    if (monitors.size() == monitor_queues.size()) {
         return;
     }
 
@@ -354,6 +692,16 @@ static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
         msg += buffer;
         sprintf(buffer, "FreeMem:%u\n", m->freeMem);
         msg += buffer;
+        sprintf(buffer, "CPUPressure:%u\n", m->cpuPressure);
+        msg += buffer;
+        sprintf(buffer, "MemPressure:%u\n", m->memPressure);
+        msg += buffer;
+        sprintf(buffer, "IOPressure:%u\n", m->ioPressure);
+        msg += buffer;
+        sprintf(buffer, "LinkJobs:%u\n", m->linkJobs);
+        msg += buffer;
+        sprintf(buffer, "HeavyJobs:%u\n", m->heavyJobs);
+        msg += buffer;
     } else {
         sprintf(buffer, "Load:%u\n", cs->load());
         msg += buffer;
@@ -372,49 +720,59 @@ static Job *create_new_job(CompileServer *submitter)
     return job;
 }
 
-static void enqueue_job_request(Job *job)
-{
-    if (!toanswer.empty() && toanswer.back()->server == job->submitter()) {
-        toanswer.back()->l.push_back(job);
-    } else {
-        UnansweredList *newone = new UnansweredList();
-        newone->server = job->submitter();
-        newone->l.push_back(job);
-        toanswer.push_back(newone);
-    }
-}
-
-static Job *get_job_request(void)
+/* The flow of the queue JOB counts against: its user (if the client told
+   us) or submitting host, or the group that one is a member of.  */
+static string job_flow(Job *job)
 {
-    if (toanswer.empty()) {
-        return 0;
+    if (share_by_user && !job->user().empty()) {
+        return job_queue.flow(job->user());
     }
 
-    UnansweredList *first = toanswer.front();
-    assert(!first->l.empty());
-    return first->l.front();
+    return job_queue.flow(job->submitter()->nodeName());
 }
 
-/* Removes the first job request (the one returned by get_job_request()) */
-static void remove_job_request(void)
+static void enqueue_job_request(Job *job)
 {
-    if (toanswer.empty()) {
-        return;
-    }
+    job_queue.push(job, job_flow(job), now());
+}
 
-    UnansweredList *first = toanswer.front();
-    toanswer.pop_front();
-    first->l.pop_front();
+static string dump_job(Job *job);
+static void note_env_demand(CompileServer *submitter, const GetCSMsg *m);
 
-    if (first->l.empty()) {
-        delete first;
-    } else {
-        toanswer.push_back(first);
+/* Sets what the request M tells about the job.  */
+static void fill_job(Job *job, const GetCSMsg *m)
+{
+    job->setEnvironments(m->versions);
+    job->setTargetPlatform(m->target);
+    job->setArgFlags(m->arg_flags);
+    switch(m->lang) {
+        case CompileJob::Lang_C:
+            job->setLanguage("C");
+            break;
+        case CompileJob::Lang_CXX:
+            job->setLanguage("C++");
+            break;
+        case CompileJob::Lang_OBJC:
+            job->setLanguage("ObjC");
+            break;
+        case CompileJob::Lang_OBJCXX:
+            job->setLanguage("ObjC++");
+            break;
+        case CompileJob::Lang_Custom:
+            job->setLanguage("<custom>");
+            break;
+        default:
+            job->setLanguage("???"); // presumably newer client?
+            break;
     }
+    job->setFileName(m->filename);
+    job->setLocalClientId(m->client_id);
+    job->setPreferredHost(m->preferred_host);
+    job->setMinimalHostVersion(m->minimal_host_version);
+    job->setUser(m->user);
+    job->setPriority(m->priority);
 }
 
-static string dump_job(Job *job);
-
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 {
     GetCSMsg *m = dynamic_cast<GetCSMsg *>(_m);
@@ -426,39 +784,19 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
     CompileServer *submitter = static_cast<CompileServer *>(cs);
 
     submitter->setClientCount(m->client_count);
+    submitter->noteRequest(now(), m->versions, m->target);
 
     Job *master_job = 0;
 
     for (unsigned int i = 0; i < m->count; ++i) {
         Job *job = create_new_job(submitter);
-        job->setEnvironments(m->versions);
-        job->setTargetPlatform(m->target);
-        job->setArgFlags(m->arg_flags);
-        switch(m->lang) {
-            case CompileJob::Lang_C:
-                job->setLanguage("C");
-                break;
-            case CompileJob::Lang_CXX:
-                job->setLanguage("C++");
-                break;
-            case CompileJob::Lang_OBJC:
-                job->setLanguage("ObjC");
-                break;
-            case CompileJob::Lang_OBJCXX:
-                job->setLanguage("ObjC++");
-                break;
-            case CompileJob::Lang_Custom:
-                job->setLanguage("<custom>");
-                break;
-            default:
-                job->setLanguage("???"); // presumably newer client?
-                break;
-        }
-        job->setFileName(m->filename);
-        job->setLocalClientId(m->client_id);
-        job->setPreferredHost(m->preferred_host);
-        job->setMinimalHostVersion(m->minimal_host_version);
+        fill_job(job, m);
         enqueue_job_request(job);
+
+        if (trace_file.isOpen()) {
+            trace_cs_request(submitter, job, m);
+        }
+
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
@@ -484,6 +822,7 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         }
     }
 
+    note_env_demand(submitter, m);
     return true;
 }
 
@@ -496,7 +835,8 @@ static bool handle_local_job(CompileServer *cs, Msg *_m)
     }
 
     ++new_job_id;
-    trace() << "handle_local_job " << m->outfile << " " << m->id << endl;
+    trace() << "handle_local_job " << m->outfile << " " << m->id << " class " << m->jobclass
+            << " mem " << m->mem_estimate << endl;
     cs->insertClientJobId(m->id, new_job_id);
     notify_monitors(new MonLocalJobBeginMsg(new_job_id, m->outfile, m->stime, cs->hostId()));
     return true;
@@ -550,7 +890,273 @@ static string envs_match(CompileServer *cs, const Job *job)
         }
     }
 
-    return string();
+    return string();
+}
+
+/* The name of the environment JOB comes with for HOST_PLATFORM.  */
+static string env_version(const Job *job, const string &host_platform)
+{
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == host_platform) {
+            return it->second;
+        }
+    }
+
+    return string();
+}
+
+static bool less_busy(CompileServer *a, CompileServer *b)
+{
+    return a->jobList().size() * b->maxJobs() < b->jobList().size() * a->maxJobs();
+}
+
+static bool has_environment(CompileServer *cs, const pair<string, string> &env)
+{
+    Environments compilerVersions = cs->compilerVersions();
+    return find(compilerVersions.begin(), compilerVersions.end(), env) != compilerVersions.end();
+}
+
+struct VerifiedEnvironment {
+    VerifiedEnvironment(const pair<string, string> &_env)
+        : env(_env) {}
+
+    bool operator()(CompileServer *cs) const {
+        Environments verified = cs->verifiedVersions();
+        return find(verified.begin(), verified.end(), env) != verified.end();
+    }
+
+    pair<string, string> env;
+};
+
+/* The compile servers other than CS that can send ENV to others, least busy first.  */
+static vector<CompileServer *> env_holders(CompileServer *cs, const pair<string, string> &env)
+{
+    vector<CompileServer *> holders;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *holder = *it;
+
+        if (holder == cs || !IS_PROTOCOL_41(holder) || holder->noRemote()
+                || !holder->remotePort()) {
+            continue;
+        }
+
+        if (has_environment(holder, env)) {
+            holders.push_back(holder);
+        }
+    }
+
+    sort(holders.begin(), holders.end(), less_busy);
+    // prefer copies that are known to work
+    stable_partition(holders.begin(), holders.end(), VerifiedEnvironment(env));
+    return holders;
+}
+
+/* CS is going to install the environment for JOB that runs on HOST_PLATFORM.
+   Return the address of compile servers that have it installed already, so that
+   CS can get it from them instead of the client uploading it.  The least busy ones
+   come first.  */
+static list<string> env_peers(CompileServer *cs, const Job *job, const string &host_platform)
+{
+    list<string> peers;
+
+    if (!IS_PROTOCOL_41(cs)) {
+        return peers;
+    }
+
+    string version = env_version(job, host_platform);
+
+    if (version.empty()) {
+        return peers;
+    }
+
+    vector<CompileServer *> holders = env_holders(cs, make_pair(job->targetPlatform(), version));
+
+    for (vector<CompileServer *>::const_iterator it = holders.begin();
+            it != holders.end() && peers.size() < 3; ++it) {
+        peers.push_back((*it)->name + ":" + toString((*it)->remotePort()));
+    }
+
+    return peers;
+}
+
+// how many compile servers get an environment at once, to not flood the network
+static const unsigned int stage_max_servers = 2;
+
+/* Instead of making JOB wait until CS has installed the environment, have CS
+   fetch it in the background (from the submitter, or other compile servers
+   that have it) while JOB stays queued, the submitter compiles it if it has
+   a free slot.  CS only gets jobs for that environment once it has announced
+   it.  Return false if that's not possible.  */
+static bool stage_environment(CompileServer *cs, Job *job)
+{
+    CompileServer *submitter = job->submitter();
+
+    if (cs == submitter || !IS_PROTOCOL_42(cs) || !IS_PROTOCOL_42(submitter)
+            || submitter->noRemote() || !submitter->remotePort()) {
+        return false;
+    }
+
+    string host_platform = cs->can_install(job);
+    pair<string, string> env(job->targetPlatform(), env_version(job, host_platform));
+
+    if (env.second.empty() || cs->environmentStagingFailed(env)) {
+        return false;
+    }
+
+    if (cs->environmentStaging(env)) {
+        return true;
+    }
+
+    unsigned int staging = 0;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        if ((*it)->environmentStaging(env) && ++staging >= stage_max_servers) {
+            return true;    // on its way to enough servers already
+        }
+    }
+
+    list<string> peers = env_peers(cs, job, host_platform);
+    peers.push_back(submitter->name + ":" + toString(submitter->remotePort()));
+
+    if (!cs->send_msg(FetchEnvMsg(env.first, env.second, peers))) {
+        return false;
+    }
+
+    trace() << "staging " << env.second << "(" << env.first << ") on " << cs->nodeName() << endl;
+    cs->stageEnvironment(env);
+    return true;
+}
+
+/* How much the environments are asked for, to spread them over idle compile
+   servers before the jobs needing them come in.  */
+struct EnvDemand {
+    EnvDemand()
+        : rate(0)
+        , last_request(0)
+        , last_prestage(0) {}
+
+    string host_platform;
+    string source;      // host:port of the last submitter that can send it
+    double rate;        // requests per minute
+    time_t last_request;
+    time_t last_prestage;
+};
+
+static map<pair<string, string>, EnvDemand> env_demands;
+
+// how many requests per minute one compile server is supposed to handle
+static const double prestage_rate_per_server = 20;
+// how often the demand for one environment is looked at, in seconds
+static const time_t prestage_interval = 10;
+// how many compile servers get an environment at once, to not flood the network
+static const unsigned int prestage_max_servers = 2;
+
+/* Tell idle compile servers to fetch ENV if it's asked for more than the
+   servers that have it can handle.  The daemons refuse if they're out of
+   cache space.  */
+static void prestage_environment(const pair<string, string> &env, EnvDemand &demand)
+{
+    time_t now = ::now();
+
+    if (now - demand.last_prestage < prestage_interval) {
+        return;
+    }
+
+    demand.last_prestage = now;
+
+    vector<CompileServer *> idle;
+    unsigned int holders = 0;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (!cs->platforms_compatible(demand.host_platform)) {
+            continue;
+        }
+
+        if (has_environment(cs, env) || cs->environmentStaging(env)) {
+            holders++;
+            continue;
+        }
+
+        if (IS_PROTOCOL_42(cs) && !cs->noRemote() && cs->remotePort() && cs->maxJobs() > 0
+                && cs->chrootPossible() && cs->jobList().empty() && !cs->busyInstalling()
+                && !cs->environmentStagingFailed(env)) {
+            idle.push_back(cs);
+        }
+    }
+
+    unsigned int wanted = 1 + (unsigned int)(demand.rate / prestage_rate_per_server);
+
+    if (holders >= wanted || idle.empty()) {
+        return;
+    }
+
+    list<string> peers;
+    vector<CompileServer *> sources = env_holders(0, env);
+
+    for (vector<CompileServer *>::const_iterator it = sources.begin();
+            it != sources.end() && peers.size() < 3; ++it) {
+        peers.push_back((*it)->name + ":" + toString((*it)->remotePort()));
+    }
+
+    if (!demand.source.empty()) {
+        peers.push_back(demand.source);
+    }
+
+    if (peers.empty()) {
+        return;
+    }
+
+    sort(idle.begin(), idle.end(), less_busy);
+
+    for (unsigned int i = 0; i < idle.size() && i < prestage_max_servers && holders < wanted;
+            ++i, ++holders) {
+        CompileServer *cs = idle[i];
+
+        if (cs->send_msg(FetchEnvMsg(env.first, env.second, peers))) {
+            trace() << "prestaging " << env.second << "(" << env.first << ") on "
+                    << cs->nodeName() << ", " << demand.rate << " requests/min" << endl;
+            cs->stageEnvironment(env);
+        }
+    }
+}
+
+static void note_env_demand(CompileServer *submitter, const GetCSMsg *m)
+{
+    time_t now = ::now();
+
+    for (Environments::const_iterator it = m->versions.begin(); it != m->versions.end(); ++it) {
+        pair<string, string> env(m->target, it->second);
+        EnvDemand &demand = env_demands[env];
+
+        if (demand.last_request) {
+            demand.rate *= exp(-double(now - demand.last_request) / 60);
+        }
+
+        demand.rate += m->count;
+        demand.last_request = now;
+        demand.host_platform = it->first;
+
+        if (IS_PROTOCOL_42(submitter) && !submitter->noRemote() && submitter->remotePort()) {
+            demand.source = submitter->name + ":" + toString(submitter->remotePort());
+        }
+
+        prestage_environment(env, demand);
+    }
+
+    // forget about what nobody asked for in a long time
+    for (map<pair<string, string>, EnvDemand>::iterator it = env_demands.begin();
+            it != env_demands.end();) {
+        if (now - it->second.last_request > 3600) {
+            env_demands.erase(it++);
+        } else {
+            ++it;
+        }
+    }
 }
 
 static CompileServer *pick_server(Job *job)
@@ -618,6 +1224,7 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
+    bool urgent = job->priority() > 0;
     CompileServer *best = 0;
     // best uninstalled
     CompileServer *bestui = 0;
@@ -673,7 +1280,10 @@ static CompileServer *pick_server(Job *job)
                 " client count: " << cs->clientCount() << endl;
 #endif
 
-        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
+        /* Jobs others wait for should not be used to find out how fast
+           servers are, they take the fastest we know of.  */
+        if (!urgent && (cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0)
+                && cs->maxJobs()) {
             /* Make all servers compile a job at least once, so we'll get an
                idea about their speed.  */
             if (!envs_match(cs, job).empty()) {
@@ -691,8 +1301,8 @@ static CompileServer *pick_server(Job *job)
         /* Distribute 5% of our jobs to servers which haven't been picked in a
            long time. This gives us a chance to adjust the server speed rating,
            which may change due to external influences out of our control. */
-        if (!cs->lastPickedId() ||
-            ((job->id() - cs->lastPickedId()) > (20 * css.size()))) {
+        if (!urgent && (!cs->lastPickedId() ||
+            ((job->id() - cs->lastPickedId()) > (20 * css.size())))) {
             best = cs;
             break;
         }
@@ -700,11 +1310,14 @@ static CompileServer *pick_server(Job *job)
         if (!envs_match(cs, job).empty()) {
             if (!best) {
                 best = cs;
+            } else if (urgent && best->lastCompiledJobs().empty() && !cs->lastCompiledJobs().empty()
+                       && int(cs->jobList().size()) < cs->maxJobs()) {
+                best = cs;
             }
             /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
+               the job.  */
             else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
+                     && done_earlier(best, cs, job)) {
                 if (int(cs->jobList().size()) < cs->maxJobs()) {
                     best = cs;
                 } else {
@@ -718,9 +1331,9 @@ static CompileServer *pick_server(Job *job)
                 bestui = cs;
             }
             /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
+               the job.  */
             else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
+                     && done_earlier(bestui, cs, job)) {
                 if (int(cs->jobList().size()) < cs->maxJobs()) {
                     bestui = cs;
                 } else {
@@ -738,6 +1351,15 @@ static CompileServer *pick_server(Job *job)
     }
 
     if (bestui) {
+        /* The caller falls back to the submitter if it has a free slot,
+           else the job waits for the installation.  */
+        if (stage_environment(bestui, job)) {
+#if DEBUG_SCHEDULER > 1
+            trace() << "queueing while " << bestui->nodeName() << " installs" << endl;
+#endif
+            return 0;
+        }
+
 #if DEBUG_SCHEDULER > 1
         trace() << "taking best uninstalled " << bestui->nodeName() << " " <<  server_speed(bestui, job, true) << endl;
 #endif
@@ -753,6 +1375,7 @@ static CompileServer *pick_server(Job *job)
     return bestpre;
 }
 
+#ifndef SCHEDULER_SIMULATOR
 /* Prunes the list of connected servers by those which haven't
    answered for a long time. Return the number of seconds when
    we have to cleanup next time. */
@@ -760,7 +1383,7 @@ static time_t prune_servers()
 {
     list<CompileServer *>::iterator it;
 
-    time_t now = time(0);
+    time_t now = ::now();
     time_t min_time = MAX_SCHEDULER_PING;
 
     for (it = controls.begin(); it != controls.end();) {
@@ -804,7 +1427,7 @@ static time_t prune_servers()
 
                 if ((*it)->send_msg(PingMsg())) {
                     // give it MAX_SCHEDULER_PONG to answer a ping
-                    (*it)->last_talk = time(0) - MAX_SCHEDULER_PING
+                    (*it)->last_talk = now - MAX_SCHEDULER_PING
                                        + 2 * MAX_SCHEDULER_PONG;
                     min_time = min(min_time, (time_t) 2 * MAX_SCHEDULER_PONG);
                     ++it;
@@ -838,24 +1461,11 @@ static time_t prune_servers()
 
     return min_time;
 }
-
-static Job *delay_current_job()
-{
-    assert(!toanswer.empty());
-
-    if (toanswer.size() == 1) {
-        return 0;
-    }
-
-    UnansweredList *first = toanswer.front();
-    toanswer.pop_front();
-    toanswer.push_back(first);
-    return get_job_request();
-}
+#endif
 
 static bool empty_queue()
 {
-    Job *job = get_job_request();
+    Job *job = job_queue.front();
 
     if (!job) {
         return false;
@@ -863,7 +1473,6 @@ static bool empty_queue()
 
     assert(!css.empty());
 
-    Job *first_job = job;
     CompileServer *cs = 0;
 
     while (true) {
@@ -881,9 +1490,10 @@ static bool empty_queue()
                 && job->preferredHost().empty()
                 /* This should be trivially true.  */
                 && cs->can_install(job).size())) {
-            job = delay_current_job();
+            // try the next in line of the other flows
+            job = job_queue.nextFlow(job);
 
-            if ((job == first_job) || !job) { // no job found in the whole toanswer list
+            if (!job) { // no job found in the whole queue
                 trace() << "No suitable host found, delaying" << endl;
                 return false;
             }
@@ -892,10 +1502,11 @@ static bool empty_queue()
         }
     }
 
-    remove_job_request();
+    job_queue.pop(job);
 
     job->setState(Job::WAITINGFORCS);
     job->setServer(cs);
+    job->setAssignTime(now());
 
     string host_platform = envs_match(cs, job);
     bool gotit = true;
@@ -905,6 +1516,8 @@ static bool empty_queue()
         host_platform = cs->can_install(job);
     }
 
+    job->setHostPlatform(host_platform);
+
     // mix and match between job ids
     unsigned matched_job_id = 0;
     unsigned count = 0;
@@ -943,6 +1556,10 @@ static bool empty_queue()
     {
         UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
+        if (!gotit) {
+            m2.env_peers = env_peers(cs, job, host_platform);
+        }
+
         if (!job->submitter()->send_msg(m2)) {
             trace() << "failed to deliver job " << job->id() << endl;
             handle_end(job->submitter(), 0);   // will care for the rest
@@ -962,7 +1579,7 @@ static bool empty_queue()
 
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
-        cs->setBusyInstalling(time(0));
+        cs->setBusyInstalling(now());
     }
 
     string env;
@@ -1001,7 +1618,9 @@ static bool handle_login(CompileServer *cs, Msg *_m)
 
     cs->setRemotePort(m->port);
     cs->setCompilerVersions(m->envs);
+    cs->setVerifiedVersions(m->verified_envs);
     cs->setMaxJobs(m->max_kids);
+    cs->setMaxLinkJobs(m->max_link_jobs, m->max_heavy_jobs);
     cs->setNoRemote(m->noremote);
 
     if (m->nodename.length()) {
@@ -1030,8 +1649,17 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     dbg << "]" << endl;
 #endif
 
+    restore_speed(cs);
     handle_monitor_stats(cs);
 
+    if (trace_file.isOpen()) {
+        TraceEvent event = trace_event(TraceEvent::Login, cs);
+        event.platform = m->host_platform;
+        event.maxJobs = m->max_kids;
+        event.noRemote = m->noremote;
+        trace_file.write(event);
+    }
+
     /* remove any other clients with the same IP and name, they must be stale */
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end();) {
         if (cs->eq_ip(*(*it)) && cs->nodeName() == (*it)->nodeName()) {
@@ -1064,8 +1692,13 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
 
     CompileServer *cs = static_cast<CompileServer *>(mc);
     cs->setCompilerVersions(m->envs);
+    cs->setVerifiedVersions(m->verified_envs);
     cs->setBusyInstalling(0);
 
+    for (Environments::const_iterator it = m->envs.begin(); it != m->envs.end(); ++it) {
+        cs->finishStagingEnvironment(*it, true);
+    }
+
     std::ostream &dbg = trace();
     dbg << "RELOGIN " << cs->nodeName() << "(" << cs->hostPlatform() << "): [";
 
@@ -1083,6 +1716,41 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
     return false;
 }
 
+static bool handle_fetch_env_result(CompileServer *cs, Msg *_m)
+{
+    FetchEnvResultMsg *m = dynamic_cast<FetchEnvResultMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    trace() << "staging " << m->name << "(" << m->target << ") on " << cs->nodeName()
+            << (m->ok ? " done" : " failed") << endl;
+    cs->finishStagingEnvironment(make_pair(m->target, m->name), m->ok);
+    return true;
+}
+
+/* CS sent the output of a finished job to its client.  */
+static bool handle_job_sent(CompileServer *cs, Msg *_m)
+{
+    JobSentMsg *m = dynamic_cast<JobSentMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    cs->addTelemetry(m->job_id, JobTelemetry::send_msec, m->send_msec);
+    map<unsigned int, PendingTransfer>::iterator it = pending_transfers.find(m->job_id);
+
+    if (it != pending_transfers.end() && it->second.server == cs->nodeName()) {
+        network_model.learn(it->second.submitter, it->second.server, it->second.out_compressed,
+                            m->send_msec);
+        pending_transfers.erase(it);
+    }
+
+    return true;
+}
+
 static bool handle_mon_login(CompileServer *cs, Msg *_m)
 {
     MonLoginMsg *m = dynamic_cast<MonLoginMsg *>(_m);
@@ -1095,6 +1763,10 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
     // monitors really want to be fed lazily
     cs->setBulkTransfer();
 
+    if (m->batch_msec) {
+        monitor_queues[cs] = MonitorQueue(max(m->batch_msec, monitor_min_batch_msec));
+    }
+
     for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
         handle_monitor_stats(*it);
     }
@@ -1103,6 +1775,32 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
     return true;
 }
 
+/* Moves JOB to the server it was redirected to.  */
+static void move_job(Job *job, CompileServer *to)
+{
+    trace() << "moved job " << job->id() << " from " << job->server()->nodeName() << " to "
+            << to->nodeName() << endl;
+    job->server()->removeJob(job);
+    job->setServer(to);
+    job->setAssignTime(now());
+    to->appendJob(job);
+}
+
+/* The client of a redirected job may get to CS before the old server
+   confirms the redirect, the job is CS's then already.  */
+static bool take_redirected_job(Job *job, CompileServer *cs)
+{
+    map<unsigned int, CompileServer *>::iterator rit = redirects.find(job->id());
+
+    if (rit == redirects.end() || rit->second != cs || !job->server()) {
+        return false;
+    }
+
+    redirects.erase(rit);
+    move_job(job, cs);
+    return true;
+}
+
 static bool handle_job_begin(CompileServer *cs, Msg *_m)
 {
     JobBeginMsg *m = dynamic_cast<JobBeginMsg *>(_m);
@@ -1118,16 +1816,22 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
 
     Job *job = jobs[m->job_id];
 
-    if (job->server() != cs) {
+    if (job->server() != cs && !take_redirected_job(job, cs)) {
         trace() << "that job isn't handled by " << cs->name << endl;
         return false;
     }
 
     cs->setClientCount(m->client_count);
 
+    if (trace_file.isOpen()) {
+        TraceEvent event = trace_event(TraceEvent::JobBegin, cs);
+        event.jobId = job->id();
+        trace_file.write(event);
+    }
+
     job->setState(Job::COMPILING);
     job->setStartTime(m->stime);
-    job->setStartOnScheduler(time(0));
+    job->setStartOnScheduler(now());
     notify_monitors(new MonJobBeginMsg(m->job_id, m->stime, cs->hostId()));
 #if DEBUG_SCHEDULER >= 0
     trace() << "BEGIN: " << m->job_id << " client=" << job->submitter()->nodeName()
@@ -1161,108 +1865,429 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
                     << " " << job->state() << " " << job->localClientId() << " " << clientId
                     << endl;
 
-            if (job->server() == 0 && job->submitter() == cs && job->localClientId() == clientId) {
-                trace() << "STOP (WAITFORCS) FOR " << mit->first << endl;
-                j = job;
-                m->set_job_id( j->id()); // Now we know the job's id.
+            if (job->server() == 0 && job->submitter() == cs && job->localClientId() == clientId) {
+                trace() << "STOP (WAITFORCS) FOR " << mit->first << endl;
+                j = job;
+                m->set_job_id( j->id()); // Now we know the job's id.
+                job_queue.remove(j);
+            }
+        }
+    } else if (jobs.find(m->job_id) != jobs.end()) {
+        j = jobs[m->job_id];
+    }
+
+    if (!j) {
+        trace() << "job ID not present " << m->job_id << endl;
+        return false;
+    }
+
+    if (m->is_from_server() && j->server() != cs && !take_redirected_job(j, cs)) {
+        log_info() << "the server isn't the same for job " << m->job_id << endl;
+        log_info() << "server: " << j->server()->nodeName() << endl;
+        log_info() << "msg came from: " << cs->nodeName() << endl;
+        // the daemon is not following matz's rules: kick him
+        handle_end(cs, 0);
+        return false;
+    }
+
+    if (!m->is_from_server() && (j->submitter() != cs)) {
+        log_info() << "the submitter isn't the same for job " << m->job_id << endl;
+        log_info() << "submitter: " << j->submitter()->nodeName() << endl;
+        log_info() << "msg came from: " << cs->nodeName() << endl;
+        // the daemon is not following matz's rules: kick him
+        handle_end(cs, 0);
+        return false;
+    }
+
+    cs->setClientCount(m->client_count);
+
+    if (trace_file.isOpen()) {
+        TraceEvent event = trace_event(TraceEvent::JobDone, cs);
+        event.jobId = j->id();
+        event.exitCode = m->exitcode;
+        event.fromServer = m->is_from_server();
+        event.realMsec = m->real_msec;
+        event.userMsec = m->user_msec;
+        event.sysMsec = m->sys_msec;
+        event.inBytes = m->in_uncompressed;
+        event.outBytes = m->out_uncompressed;
+        trace_file.write(event);
+    }
+
+    if (m->exitcode == 0) {
+        std::ostream &dbg = trace();
+        dbg << "END " << m->job_id
+            << " status=" << m->exitcode;
+
+        if (m->in_uncompressed)
+            dbg << " in=" << m->in_uncompressed
+                << "(" << int(m->in_compressed * 100 / m->in_uncompressed) << "%)";
+        else {
+            dbg << " in=0(0%)";
+        }
+
+        if (m->out_uncompressed)
+            dbg << " out=" << m->out_uncompressed
+                << "(" << int(m->out_compressed * 100 / m->out_uncompressed) << "%)";
+        else {
+            dbg << " out=0(0%)";
+        }
+
+        dbg << " real=" << m->real_msec
+            << " user=" << m->user_msec
+            << " sys=" << m->sys_msec
+            << " pfaults=" << m->pfaults;
+
+        if (m->mem_peak)
+            dbg << " mem=" << m->mem_peak
+                << " io=" << m->io_kb
+                << " stall=" << m->cpu_stall_msec << "/" << m->mem_stall_msec << "/" << m->io_stall_msec;
+
+        for (map<uint32_t, uint32_t>::const_iterator it = m->telemetry.begin();
+                it != m->telemetry.end(); ++it) {
+            dbg << " " << JobTelemetry::name(it->first) << "=" << it->second;
+        }
+
+        dbg << " server=" << j->server()->nodeName()
+            << endl;
+    } else {
+        trace() << "END " << m->job_id
+                << " status=" << m->exitcode << endl;
+    }
+
+    if (j->server()) {
+        j->server()->removeJob(j);
+
+        if (m->is_from_server() && !m->telemetry.empty()) {
+            j->server()->appendTelemetry(m->job_id, m->telemetry);
+        }
+    }
+
+    learn_transfer(j, m);
+    learn_job_time(j, m);
+    add_job_stats(j, m);
+    notify_monitors(new MonJobDoneMsg(*m));
+    jobs.erase(m->job_id);
+    redirects.erase(m->job_id);
+    delete j;
+
+    return true;
+}
+
+// a job that has not started for that long is probably stuck in the queue of its server
+static const time_t steal_min_wait = 2;
+
+/* CS has free slots, take jobs from servers that have not started them yet.
+   The loads we know are a few seconds old, so servers that got too much get
+   their queues drained by the others.  */
+static bool handle_steal_jobs(CompileServer *cs, Msg *_m)
+{
+    StealJobsMsg *m = dynamic_cast<StealJobsMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    if (cs->noRemote() || !cs->remotePort()) {
+        return true;
+    }
+
+    time_t now = ::now();
+    unsigned int wanted = m->free_slots;
+
+    // the oldest jobs first
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end() && wanted; ++it) {
+        Job *job = it->second;
+        CompileServer *server = job->server();
+
+        if (job->state() != Job::WAITINGFORCS || !server || server == cs
+                || server == job->submitter() || !IS_PROTOCOL_50(server) || job->leaseExpires()
+                || now - job->assignTime() < steal_min_wait
+                || redirects.find(job->id()) != redirects.end()
+                || !job->preferredHost().empty()
+                || !cs->is_eligible(job)) {
+            continue;
+        }
+
+        // the client keeps its environment, so CS must have that one
+        string version = env_version(job, job->hostPlatform());
+
+        if (version.empty() || !cs->platforms_compatible(job->hostPlatform())
+                || !has_environment(cs, make_pair(job->targetPlatform(), version))) {
+            continue;
+        }
+
+        RedirectJobMsg msg(job->hostPlatform(), cs->name, cs->remotePort(), job->id(),
+                           job->localClientId());
+
+        if (!server->send_msg(msg)) {
+            continue;
+        }
+
+        trace() << "asking " << server->nodeName() << " to pass job " << job->id() << " on to "
+                << cs->nodeName() << endl;
+        redirects[job->id()] = cs;
+        --wanted;
+    }
+
+    return true;
+}
+
+static bool handle_job_redirected(CompileServer *cs, Msg *_m)
+{
+    JobRedirectedMsg *m = dynamic_cast<JobRedirectedMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<unsigned int, CompileServer *>::iterator rit = redirects.find(m->job_id);
+    map<unsigned int, Job *>::iterator jit = jobs.find(m->job_id);
+
+    if (rit == redirects.end() || jit == jobs.end() || jit->second->server() != cs) {
+        // the job or the new server are gone meanwhile, or the job began there already
+        trace() << "redirect of unknown job " << m->job_id << endl;
+
+        if (rit != redirects.end()) {
+            redirects.erase(rit);
+        }
+
+        return true;
+    }
+
+    Job *job = jit->second;
+    CompileServer *to = rit->second;
+    redirects.erase(rit);
+
+    if (!m->ok) {
+        trace() << "job " << job->id() << " stays on " << cs->nodeName() << endl;
+        return true;
+    }
+
+    move_job(job, to);
+    return true;
+}
+
+// how long leased slots are valid, and how long after that a use may still be reported
+static const time_t lease_duration = 10;
+static const time_t lease_grace = 10;
+// daemons get leases once their clients ask for that many servers in 10 seconds
+static const unsigned int lease_min_requests = 8;
+static const unsigned int lease_max_slots = 16;
+
+/* A leased slot its submitter did not use.  */
+static void drop_lease(Job *job)
+{
+    trace() << "lease " << job->id() << " on " << job->server()->nodeName() << " not used" << endl;
+    job->server()->removeJob(job);
+    jobs.erase(job->id());
+    redirects.erase(job->id());
+    delete job;
+}
+
+#ifndef SCHEDULER_SIMULATOR
+/* Reserves up to SIZE slots for the clients of SUBMITTER on the fastest
+   servers that have the environment they used last.  */
+static void grant_lease(CompileServer *submitter, unsigned int size, time_t now)
+{
+    vector<pair<float, CompileServer *> > servers;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (cs != submitter && cs->remotePort() && !cs->noRemote() && !cs->busyInstalling()) {
+            servers.push_back(make_pair(server_speed(cs), cs));
+        }
+    }
+
+    sort(servers.rbegin(), servers.rend());
+
+    SlotLeaseMsg msg;
+    msg.duration = lease_duration;
+    msg.target = submitter->requestedTarget();
+    Job *job = 0;
+
+    for (vector<pair<float, CompileServer *> >::const_iterator it = servers.begin();
+            it != servers.end() && msg.slots.size() < size; ++it) {
+        CompileServer *cs = it->second;
+
+        while (msg.slots.size() < size) {
+            if (!job) {
+                job = create_new_job(submitter);
+                job->setEnvironments(submitter->requestedVersions());
+                job->setTargetPlatform(msg.target);
+                job->setLanguage("<leased>");
+            }
+
+            // the clients get no environment transfers, all slots are for one environment
+            string host_platform = envs_match(cs, job);
+
+            if (host_platform.empty() || !cs->is_eligible(job)
+                    || (!msg.host_platform.empty() && host_platform != msg.host_platform)) {
+                break;
+            }
+
+            msg.host_platform = host_platform;
+            msg.version = env_version(job, host_platform);
+
+            job->setState(Job::WAITINGFORCS);
+            job->setServer(cs);
+            job->setAssignTime(now);
+            job->setHostPlatform(host_platform);
+            job->setLeaseExpires(now + lease_duration);
+            cs->appendJob(job);
+
+            SlotLeaseMsg::Slot slot;
+            slot.job_id = job->id();
+            slot.hostname = cs->name;
+            slot.port = cs->remotePort();
+            msg.slots.push_back(slot);
+            job = 0;
+        }
+    }
+
+    if (job) {
+        jobs.erase(job->id());
+        delete job;
+    }
+
+    if (msg.slots.empty()) {
+        return;
+    }
+
+    trace() << "leasing " << msg.slots.size() << " slots to " << submitter->nodeName() << endl;
+
+    if (!submitter->send_msg(msg)) {
+        for (vector<SlotLeaseMsg::Slot>::const_iterator it = msg.slots.begin();
+                it != msg.slots.end(); ++it) {
+            drop_lease(jobs[it->job_id]);
+        }
+    }
+}
+
+/* Daemons whose clients keep asking for compile servers get slots to hand out
+   themselves for a while.  That is only done while no job waits in the queue,
+   the idle slots are split by demand then; with contention the fair queue
+   decides again once the leases expired.  */
+static void grant_leases()
+{
+    static time_t last_run = 0;
+    time_t now = ::now();
+
+    if (now == last_run) {
+        return;
+    }
+
+    last_run = now;
+
+    map<CompileServer *, unsigned int> leased;
+
+    for (map<unsigned int, Job *>::iterator it = jobs.begin(); it != jobs.end();) {
+        Job *job = (it++)->second;
+
+        // the server may tell about the job before its submitter does
+        if (!job->leaseExpires() || job->state() != Job::WAITINGFORCS) {
+            continue;
+        }
+
+        if (job->leaseExpires() + lease_grace < now) {
+            drop_lease(job);
+        } else {
+            leased[job->submitter()]++;
+        }
+    }
+
+    if (!job_queue.empty()) {
+        return;
+    }
+
+    unsigned int idle = 0;
+    map<CompileServer *, unsigned int> demand;
+    unsigned int total_demand = 0;
 
-                /* Unfortunately the toanswer queues are also tagged based on the daemon,
-                so we need to clean them up also.  */
-                list<UnansweredList *>::iterator it;
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
 
-                for (it = toanswer.begin(); it != toanswer.end(); ++it)
-                    if ((*it)->server == cs) {
-                        UnansweredList *l = *it;
-                        list<Job *>::iterator jit;
+        if (!cs->noRemote() && cs->load() < 1000 && int(cs->jobList().size()) < cs->maxJobs()) {
+            idle += cs->maxJobs() - cs->jobList().size();
+        }
 
-                        for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
-                            if (*jit == j) {
-                                l->l.erase(jit);
-                                break;
-                            }
-                        }
+        unsigned int requests = cs->recentRequests(now);
 
-                        if (l->l.empty()) {
-                            it = toanswer.erase(it);
-                            break;
-                        }
-                    }
-            }
+        if (IS_PROTOCOL_53(cs) && requests >= lease_min_requests && !leased.count(cs)) {
+            demand[cs] = requests;
+            total_demand += requests;
         }
-    } else if (jobs.find(m->job_id) != jobs.end()) {
-        j = jobs[m->job_id];
     }
 
-    if (!j) {
-        trace() << "job ID not present " << m->job_id << endl;
-        return false;
+    for (map<CompileServer *, unsigned int>::const_iterator it = demand.begin();
+            it != demand.end(); ++it) {
+        unsigned int size = min(lease_max_slots, min(it->second, idle * it->second / total_demand));
+
+        if (size >= 2) {
+            grant_lease(it->first, size, now);
+        }
     }
+}
+#endif
 
-    if (m->is_from_server() && (j->server() != cs)) {
-        log_info() << "the server isn't the same for job " << m->job_id << endl;
-        log_info() << "server: " << j->server()->nodeName() << endl;
-        log_info() << "msg came from: " << cs->nodeName() << endl;
-        // the daemon is not following matz's rules: kick him
-        handle_end(cs, 0);
+/* The submitter gave a leased slot to a client, M is what the client asked for.  */
+static bool handle_lease_used(CompileServer *cs, Msg *_m)
+{
+    LeaseUsedMsg *m = dynamic_cast<LeaseUsedMsg *>(_m);
+
+    if (!m) {
         return false;
     }
 
-    if (!m->is_from_server() && (j->submitter() != cs)) {
-        log_info() << "the submitter isn't the same for job " << m->job_id << endl;
-        log_info() << "submitter: " << j->submitter()->nodeName() << endl;
-        log_info() << "msg came from: " << cs->nodeName() << endl;
-        // the daemon is not following matz's rules: kick him
-        handle_end(cs, 0);
-        return false;
+    map<unsigned int, Job *>::iterator it = jobs.find(m->job_id);
+
+    /* The server may have logged out since, the client finds out when it
+       connects to it.  */
+    if (it == jobs.end() || it->second->submitter() != cs || !it->second->leaseExpires()) {
+        trace() << "handle_lease_used: no lease " << m->job_id << endl;
+        return true;
     }
 
+    Job *job = it->second;
+    fill_job(job, m);
+    job->setLeaseExpires(0);
     cs->setClientCount(m->client_count);
+    cs->noteRequest(now(), m->versions, m->target);
 
-    if (m->exitcode == 0) {
-        std::ostream &dbg = trace();
-        dbg << "END " << m->job_id
-            << " status=" << m->exitcode;
+    if (trace_file.isOpen()) {
+        trace_cs_request(cs, job, m);
+    }
 
-        if (m->in_uncompressed)
-            dbg << " in=" << m->in_uncompressed
-                << "(" << int(m->in_compressed * 100 / m->in_uncompressed) << "%)";
-        else {
-            dbg << " in=0(0%)";
-        }
+    trace() << "NEW " << job->id() << " client=" << cs->nodeName() << " leased on "
+            << job->server()->nodeName() << " " << m->filename << " " << job->language() << endl;
+    notify_monitors(new MonGetCSMsg(job->id(), cs->hostId(), m));
+    return true;
+}
 
-        if (m->out_uncompressed)
-            dbg << " out=" << m->out_uncompressed
-                << "(" << int(m->out_compressed * 100 / m->out_uncompressed) << "%)";
-        else {
-            dbg << " out=0(0%)";
-        }
+static bool handle_lease_return(CompileServer *cs, Msg *_m)
+{
+    LeaseReturnMsg *m = dynamic_cast<LeaseReturnMsg *>(_m);
 
-        dbg << " real=" << m->real_msec
-            << " user=" << m->user_msec
-            << " sys=" << m->sys_msec
-            << " pfaults=" << m->pfaults
-            << " server=" << j->server()->nodeName()
-            << endl;
-    } else {
-        trace() << "END " << m->job_id
-                << " status=" << m->exitcode << endl;
+    if (!m) {
+        return false;
     }
 
-    if (j->server()) {
-        j->server()->removeJob(j);
-    }
+    for (vector<uint32_t>::const_iterator it = m->job_ids.begin(); it != m->job_ids.end(); ++it) {
+        map<unsigned int, Job *>::iterator jit = jobs.find(*it);
 
-    add_job_stats(j, m);
-    notify_monitors(new MonJobDoneMsg(*m));
-    jobs.erase(m->job_id);
-    delete j;
+        if (jit != jobs.end() && jit->second->submitter() == cs && jit->second->leaseExpires()
+                && jit->second->state() == Job::WAITINGFORCS) {
+            drop_lease(jit->second);
+        }
+    }
 
     return true;
 }
 
 static bool handle_ping(CompileServer *cs, Msg * /*_m*/)
 {
-    cs->last_talk = time(0);
+    cs->last_talk = now();
 
     if (cs->maxJobs() < 0) {
         cs->setMaxJobs(cs->maxJobs() * -1);
@@ -1282,7 +2307,7 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
     /* Before protocol 25, ping and stat handling was
        clutched together.  */
     if (!IS_PROTOCOL_25(cs)) {
-        cs->last_talk = time(0);
+        cs->last_talk = now();
 
         if (cs && (cs->maxJobs() < 0)) {
             cs->setMaxJobs(cs->maxJobs() * -1);
@@ -1291,7 +2316,21 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
 
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
         if (*it == cs) {
+            if (trace_file.isOpen()) {
+                TraceEvent event = trace_event(TraceEvent::Stats, cs);
+                event.load = m->load;
+                trace_file.write(event);
+            }
+
             (*it)->setLoad(m->load);
+            (*it)->setPressure(m->cpuPressure, m->memPressure, m->ioPressure);
+            (*it)->setSlotSpeeds(m->slotSpeeds);
+            (*it)->setLinkJobs(m->linkJobs, m->heavyJobs);
+
+            if (m->maxJobs && int(m->maxJobs) != (*it)->maxJobs()) {
+                trace() << (*it)->nodeName() << " now accepts " << m->maxJobs << " jobs" << endl;
+                (*it)->setMaxJobs(m->maxJobs);
+            }
             (*it)->setClientCount(m->client_count);
             handle_monitor_stats(*it, m);
             return true;
@@ -1344,6 +2383,15 @@ static string dump_job(Job *job)
              job->server() ? job->server()->nodeName().c_str() : "<unknown>");
     buffer[sizeof(buffer) - 1] = 0;
     line = buffer;
+
+    if (job->priority()) {
+        line += "prio:" + toString(job->priority()) + " ";
+    }
+
+    if (job->leaseExpires()) {
+        line += "leased ";
+    }
+
     line = line + job->fileName();
     return line;
 }
@@ -1373,10 +2421,11 @@ static void split_string(const string &s, const char *set, list<string> &l)
     }
 }
 
+#ifndef SCHEDULER_SIMULATOR
 static bool handle_control_login(CompileServer *cs)
 {
     cs->setType(CompileServer::LINE);
-    cs->last_talk = time(0);
+    cs->last_talk = now();
     cs->setBulkTransfer();
     cs->setState(CompileServer::LOGGEDIN);
     assert(find(controls.begin(), controls.end(), cs) == controls.end());
@@ -1384,13 +2433,30 @@ static bool handle_control_login(CompileServer *cs)
 
     std::ostringstream o;
     o << "200-ICECC " VERSION ": "
-      << time(0) - starttime << "s uptime, "
+      << now() - starttime << "s uptime, "
       << css.size() << " hosts, "
       << jobs.size() << " jobs in queue "
       << "(" << new_job_id << " total)." << endl;
     o << "200 Use 'help' for help and 'quit' to quit." << endl;
     return cs->send_msg(TextMsg(o.str()));
 }
+#endif
+
+/* Whether CS is one of the HOSTS given to a command, or no hosts were given. */
+static bool matches_any(CompileServer *cs, const list<string> &hosts)
+{
+    if (hosts.empty()) {
+        return true;
+    }
+
+    for (list<string>::const_iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        if (cs->matches(*it)) {
+            return true;
+        }
+    }
+
+    return false;
+}
 
 static bool handle_line(CompileServer *cs, Msg *_m)
 {
@@ -1405,7 +2471,7 @@ static bool handle_line(CompileServer *cs, Msg *_m)
     split_string(m->text, " \t\n", l);
     string cmd;
 
-    cs->last_talk = time(0);
+    cs->last_talk = now();
 
     if (l.empty()) {
         cmd = "";
@@ -1425,8 +2491,20 @@ static bool handle_line(CompileServer *cs, Msg *_m)
                     (int)(*it)->jobList().size(), (*it)->maxJobs(), (*it)->load());
             line += buffer;
 
+            if ((*it)->maxLinkJobs()) {
+                sprintf(buffer, " links=%u/%u heavy=%u/%u", (*it)->linkJobs(), (*it)->maxLinkJobs(),
+                        (*it)->heavyJobs(), (*it)->maxHeavyJobs());
+                line += buffer;
+            }
+
             if ((*it)->busyInstalling()) {
-                sprintf(buffer, " busy installing since %ld s",  time(0) - (*it)->busyInstalling());
+                sprintf(buffer, " busy installing since %ld s",  now() - (*it)->busyInstalling());
+                line += buffer;
+            }
+
+            if (!(*it)->compilerVersions().empty()) {
+                sprintf(buffer, " envs=%d verified=%d", (int)(*it)->compilerVersions().size(),
+                        (int)(*it)->verifiedVersions().size());
                 line += buffer;
             }
 
@@ -1523,9 +2601,93 @@ static bool handle_line(CompileServer *cs, Msg *_m)
 
             delete msg;
         }
+    } else if (cmd == "telemetry") {
+        // averages over the last jobs, to see where they spend their time
+        for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+            const map<unsigned int, map<uint32_t, uint32_t> > &records = (*it)->lastTelemetry();
+
+            if (records.empty() || !matches_any(*it, l)) {
+                continue;
+            }
+
+            // the records only have the keys that were not 0
+            map<uint32_t, unsigned long long> sums;
+            map<uint32_t, unsigned int> counts;
+
+            for (map<unsigned int, map<uint32_t, uint32_t> >::const_iterator rit = records.begin();
+                    rit != records.end(); ++rit) {
+                for (map<uint32_t, uint32_t>::const_iterator kit = rit->second.begin();
+                        kit != rit->second.end(); ++kit) {
+                    sums[kit->first] += kit->second;
+                    counts[kit->first]++;
+                }
+            }
+
+            line = " " + (*it)->nodeName() + " jobs=" + toString(records.size());
+
+            for (map<uint32_t, unsigned long long>::const_iterator sit = sums.begin();
+                    sit != sums.end(); ++sit) {
+                line += " " + JobTelemetry::name(sit->first) + "=" + toString(sit->second / counts[sit->first]);
+            }
+
+            if (!cs->send_msg(TextMsg(line))) {
+                return false;
+            }
+        }
+    } else if (cmd == "model") {
+        list<string> lines = time_model.dump();
+
+        for (list<string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            if (!cs->send_msg(TextMsg(*it))) {
+                return false;
+            }
+        }
+    } else if (cmd == "scaling") {
+        // throughput by number of jobs, relative to one job alone
+        list<string> lines = time_model.dumpScaling();
+
+        for (list<string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            if (!cs->send_msg(TextMsg(*it))) {
+                return false;
+            }
+        }
+    } else if (cmd == "network") {
+        list<string> lines = network_model.dump();
+
+        for (list<string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            if (!cs->send_msg(TextMsg(*it))) {
+                return false;
+            }
+        }
+    } else if (cmd == "queue") {
+        map<string, size_t> depths = job_queue.depths();
+
+        for (map<string, size_t>::const_iterator it = depths.begin(); it != depths.end(); ++it) {
+            line = " flow " + it->first + " weight=" + toString(job_queue.weight(it->first))
+                   + " queued=" + toString(it->second);
+
+            if (!cs->send_msg(TextMsg(line))) {
+                return false;
+            }
+        }
+
+        // a flow can be a user or group submitting from several hosts
+        map<string, size_t> submitters;
+
+        for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            if (it->second->state() == Job::PENDING) {
+                submitters[it->second->submitter()->nodeName()]++;
+            }
+        }
+
+        for (map<string, size_t>::const_iterator it = submitters.begin(); it != submitters.end(); ++it) {
+            if (!cs->send_msg(TextMsg(" submitter " + it->first + " queued=" + toString(it->second)))) {
+                return false;
+            }
+        }
     } else if (cmd == "help") {
         if (!cs->send_msg(TextMsg(
-                             "listcs\nlistblocks\nlistjobs\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
+                             "listcs\nlistblocks\nlistjobs\nremovecs\nblockcs\nunblockcs\ninternals\ntelemetry\nqueue\nmodel\nscaling\nnetwork\nhelp\nquit"))) {
             return false;
         }
     } else {
@@ -1583,14 +2745,21 @@ static bool handle_end(CompileServer *toremove, Msg *m)
     case CompileServer::MONITOR:
         assert(find(monitors.begin(), monitors.end(), toremove) != monitors.end());
         monitors.remove(toremove);
+        monitor_queues.erase(toremove);
 #if DEBUG_SCHEDULER > 1
         trace() << "handle_end(moni) " << monitors.size() << endl;
 #endif
         break;
-    case CompileServer::DAEMON:
+    case CompileServer::DAEMON: {
         log_info() << "remove daemon " << toremove->nodeName() << endl;
 
-        notify_monitors(new MonStatsMsg(toremove->hostId(), "State:Offline\n"));
+        notify_monitors_offline(toremove);
+        remember_speed(toremove);
+        stats_dirty = true;
+
+        if (trace_file.isOpen()) {
+            trace_file.write(trace_event(TraceEvent::Logout, toremove));
+        }
 
         /* A daemon disconnected.  We must remove it from the css list,
            and we have to delete all jobs scheduled on that daemon.
@@ -1599,36 +2768,37 @@ static bool handle_end(CompileServer *toremove, Msg *m)
          disconnect soon too.  */
         css.remove(toremove);
 
-        /* Unfortunately the toanswer queues are also tagged based on the daemon,
-           so we need to clean them up also.  */
-
-        for (list<UnansweredList *>::iterator it = toanswer.begin(); it != toanswer.end();) {
-            if ((*it)->server == toremove) {
-                UnansweredList *l = *it;
-                list<Job *>::iterator jit;
-
-                for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
-                    trace() << "STOP (DAEMON) FOR " << (*jit)->id() << endl;
-                    notify_monitors(new MonJobDoneMsg(JobDoneMsg((*jit)->id(),  255)));
+        /* The jobs it still waits a server for are queued too.  */
+        for (map<unsigned int, Job *>::iterator mit = jobs.begin(); mit != jobs.end();) {
+            Job *job = mit->second;
 
-                    if ((*jit)->server()) {
-                        (*jit)->server()->setBusyInstalling(0);
-                    }
+            if (job->submitter() == toremove && job_queue.remove(job)) {
+                trace() << "STOP (DAEMON) FOR " << job->id() << endl;
+                notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
 
-                    jobs.erase((*jit)->id());
-                    delete(*jit);
+                if (job->server()) {
+                    job->server()->setBusyInstalling(0);
                 }
 
-                delete l;
-                it = toanswer.erase(it);
+                jobs.erase(mit++);
+                delete job;
             } else {
-                ++it;
+                ++mit;
             }
         }
 
+        /* The submitters of the slots leased on it must not hand them out
+           anymore.  */
+        map<CompileServer *, LeaseReturnMsg> revoked;
+
         for (map<unsigned int, Job *>::iterator mit = jobs.begin(); mit != jobs.end();) {
             Job *job = mit->second;
 
+            if (job->server() == toremove && job->submitter() != toremove
+                    && job->leaseExpires()) {
+                revoked[job->submitter()].job_ids.push_back(job->id());
+            }
+
             if (job->server() == toremove || job->submitter() == toremove) {
                 trace() << "STOP (DAEMON2) FOR " << mit->first << endl;
                 notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
@@ -1650,11 +2820,26 @@ static bool handle_end(CompileServer *toremove, Msg *m)
             }
         }
 
+        for (map<unsigned int, CompileServer *>::iterator rit = redirects.begin();
+                rit != redirects.end();) {
+            if (rit->second == toremove || jobs.find(rit->first) == jobs.end()) {
+                redirects.erase(rit++);
+            } else {
+                ++rit;
+            }
+        }
+
+        for (map<CompileServer *, LeaseReturnMsg>::const_iterator lit = revoked.begin();
+                lit != revoked.end(); ++lit) {
+            lit->first->send_msg(lit->second);
+        }
+
         for (list<CompileServer *>::iterator itr = css.begin(); itr != css.end(); ++itr) {
             (*itr)->eraseCSFromBlacklist(toremove);
         }
 
         break;
+    }
     case CompileServer::LINE:
         toremove->send_msg(TextMsg("200 Good Bye!"));
         controls.remove(toremove);
@@ -1671,16 +2856,9 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 }
 
 /* Returns TRUE if C was not closed.  */
-static bool handle_activity(CompileServer *cs)
+static bool handle_msg(CompileServer *cs, Msg *m)
 {
-    Msg *m;
     bool ret = true;
-    m = cs->get_msg(0, true);
-
-    if (!m) {
-        handle_end(cs, m);
-        return false;
-    }
 
     /* First we need to login.  */
     if (cs->state() == CompileServer::CONNECTED) {
@@ -1722,6 +2900,24 @@ static bool handle_activity(CompileServer *cs)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case M_FETCH_ENV_RESULT:
+        ret = handle_fetch_env_result(cs, m);
+        break;
+    case M_JOB_SENT:
+        ret = handle_job_sent(cs, m);
+        break;
+    case M_STEAL_JOBS:
+        ret = handle_steal_jobs(cs, m);
+        break;
+    case M_JOB_REDIRECTED:
+        ret = handle_job_redirected(cs, m);
+        break;
+    case M_LEASE_USED:
+        ret = handle_lease_used(cs, m);
+        break;
+    case M_LEASE_RETURN:
+        ret = handle_lease_return(cs, m);
+        break;
     default:
         log_info() << "Invalid message type arrived " << (char)m->type << endl;
         handle_end(cs, m);
@@ -1733,6 +2929,21 @@ static bool handle_activity(CompileServer *cs)
     return ret;
 }
 
+#ifndef SCHEDULER_SIMULATOR
+
+/* Returns TRUE if C was not closed.  */
+static bool handle_activity(CompileServer *cs)
+{
+    Msg *m = cs->get_msg(0, true);
+
+    if (!m) {
+        handle_end(cs, m);
+        return false;
+    }
+
+    return handle_msg(cs, m);
+}
+
 static int open_broad_listener(int port)
 {
     int listen_fd;
@@ -1821,6 +3032,10 @@ static void usage(const char *reason = 0)
          << "  -u, --user-uid\n"
          << "  -v[v[v]]]\n"
          << "  -r, --persistent-client-connection\n"
+         << "  --fair-share <host|user>\n"
+         << "  --fair-share-file <file>\n"
+         << "  --stats-file <file>\n"
+         << "  --trace-file <file>\n"
          << endl;
 
     exit(1);
@@ -1890,6 +3105,7 @@ int main(int argc, char *argv[])
     bool persistent_clients = false;
     int debug_level = Error;
     string logfile;
+    string trace_path;
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno = 0;
@@ -1920,6 +3136,10 @@ int main(int argc, char *argv[])
             { "daemonize", 0, NULL, 'd'},
             { "log-file", 1, NULL, 'l'},
             { "user-uid", 1, NULL, 'u'},
+            { "fair-share", 1, NULL, 0 },
+            { "fair-share-file", 1, NULL, 0 },
+            { "stats-file", 1, NULL, 0 },
+            { "trace-file", 1, NULL, 0 },
             { 0, 0, 0, 0 }
         };
 
@@ -1930,8 +3150,35 @@ int main(int argc, char *argv[])
         }
 
         switch (c) {
-        case 0:
-            (void) long_options[option_index].name;
+        case 0: {
+            string optname = long_options[option_index].name;
+
+            if (optname == "fair-share") {
+                if (optarg && !strcmp(optarg, "user")) {
+                    share_by_user = true;
+                } else if (optarg && !strcmp(optarg, "host")) {
+                    share_by_user = false;
+                } else {
+                    usage("Error: --fair-share requires host or user");
+                }
+            } else if (optname == "fair-share-file") {
+                if (!optarg || !*optarg || !job_queue.loadShares(optarg)) {
+                    usage("Error: --fair-share-file requires a valid file");
+                }
+            } else if (optname == "stats-file") {
+                if (optarg && *optarg) {
+                    stats_file = optarg;
+                } else {
+                    usage("Error: --stats-file requires argument");
+                }
+            } else if (optname == "trace-file") {
+                if (optarg && *optarg) {
+                    trace_path = optarg;
+                } else {
+                    usage("Error: --trace-file requires argument");
+                }
+            }
+        }
             break;
         case 'd':
             detach = true;
@@ -2044,6 +3291,14 @@ int main(int argc, char *argv[])
 
     log_info() << "ICECREAM scheduler " VERSION " starting up, port " << scheduler_port << endl;
 
+    if (!stats_file.empty()) {
+        (void) saved_stats.load(stats_file, now(), stats_max_age);
+    }
+
+    if (!trace_path.empty() && !trace_file.open(trace_path)) {
+        return 1;
+    }
+
     if (detach) {
         if (daemon(0, 0) != 0) {
             log_errno("Failed to detach.", errno);
@@ -2074,7 +3329,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    starttime = time(0);
+    starttime = now();
     if( getenv( "ICECC_FAKE_STARTTIME" ) != NULL )
         starttime -= 1000;
 
@@ -2096,6 +3351,7 @@ int main(int argc, char *argv[])
 
     Broadcasts::broadcastSchedulerVersion(scheduler_port, netname, starttime);
     last_announce = starttime;
+    time_t last_stats_save = starttime;
 
     while (!exit_main_loop) {
         struct timeval tv;
@@ -2106,12 +3362,27 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        grant_leases();
+
+        int batch_wait = flush_monitor_batches();
+
+        if (batch_wait >= 0 && batch_wait < tv.tv_sec * 1000) {
+            tv.tv_sec = batch_wait / 1000;
+            tv.tv_usec = (batch_wait % 1000) * 1000;
+        }
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
-        if (last_announce + 120 < time(NULL)) {
+        if (last_announce + 120 < now()) {
             Broadcasts::broadcastSchedulerVersion(scheduler_port, netname, starttime);
-            last_announce = time(NULL);
+            last_announce = now();
+        }
+
+        if (last_stats_save + stats_save_interval < now()
+                || (stats_dirty && last_stats_save + stats_dirty_save_interval < now())) {
+            save_speeds();
+            last_stats_save = now();
         }
 
         fd_set read_set, write_set;
@@ -2119,7 +3390,7 @@ int main(int argc, char *argv[])
         FD_ZERO(&read_set);
         FD_ZERO(&write_set);
 
-        if (time(0) >= next_listen) {
+        if (now() >= next_listen) {
             max_fd = listen_fd;
             FD_SET(listen_fd, &read_set);
 
@@ -2175,6 +3446,17 @@ int main(int argc, char *argv[])
             }
         }
 
+        // monitors get the rest of their output once they can take it
+        list<CompileServer *> flushing_monitors;
+
+        for (list<CompileServer *>::const_iterator it = monitors.begin(); it != monitors.end(); ++it) {
+            if ((*it)->pending_output()) {
+                flushing_monitors.push_back(*it);
+                max_fd = max(max_fd, (*it)->fd);
+                FD_SET((*it)->fd, &write_set);
+            }
+        }
+
         int active_fds = select(max_fd + 1, &read_set, &write_set, NULL, &tv);
 
         if (active_fds < 0 && errno == EINTR) {
@@ -2188,6 +3470,17 @@ int main(int argc, char *argv[])
             return 1;
         }
 
+        for (list<CompileServer *>::const_iterator it = flushing_monitors.begin();
+                it != flushing_monitors.end(); ++it) {
+            if (FD_ISSET((*it)->fd, &write_set)) {
+                active_fds--;
+
+                if (!flush_monitor(*it)) {
+                    handle_end(*it, 0);
+                }
+            }
+        }
+
         if (FD_ISSET(listen_fd, &read_set)) {
             active_fds--;
             bool pending_connections = true;
@@ -2212,7 +3505,7 @@ int main(int argc, char *argv[])
                 if (remote_fd >= 0) {
                     CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
                     trace() << "accepted " << cs->name << endl;
-                    cs->last_talk = time(0);
+                    cs->last_talk = now();
 
                     if (!cs->protocol) { // protocol mismatch
                         delete cs;
@@ -2229,7 +3522,7 @@ int main(int argc, char *argv[])
                 }
             }
 
-            next_listen = time(0) + 1;
+            next_listen = now() + 1;
         }
 
         if (active_fds && FD_ISSET(text_fd, &read_set)) {
@@ -2344,6 +3637,7 @@ int main(int argc, char *argv[])
     }
 
     shutdown(broad_fd, SHUT_RDWR);
+    save_speeds();
     while (!css.empty())
         handle_end(css.front(), NULL);
     while (!monitors.empty())
@@ -2356,3 +3650,78 @@ int main(int argc, char *argv[])
     }
     return 0;
 }
+
+#else // SCHEDULER_SIMULATOR
+
+// the other ends of the channels of the simulated daemons, what is sent there gets dropped
+static vector<int> simulated_peers;
+
+/* Nothing reads the peers, the scheduler would block in send_msg() once
+   their socket buffers are full.  */
+static void drain_simulated_peers()
+{
+    char buffer[64 * 1024];
+
+    for (vector<int>::const_iterator it = simulated_peers.begin();
+            it != simulated_peers.end(); ++it) {
+        while (read(*it, buffer, sizeof(buffer)) > 0) {
+            continue;
+        }
+    }
+}
+
+CompileServer *simulated_login(LoginMsg *m, unsigned int address)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(address);
+
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        log_perror("socketpair()");
+        delete m;
+        return 0;
+    }
+
+    if (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        log_perror("fcntl()");
+    }
+
+    simulated_peers.push_back(fds[1]);
+
+    CompileServer *cs = new CompileServer(fds[0], (struct sockaddr *) &addr, sizeof(addr), true);
+    fd2cs[fds[0]] = cs;
+    bool ok = handle_msg(cs, m);
+    drain_simulated_peers();
+    return ok ? cs : 0;
+}
+
+bool simulated_receive(CompileServer *cs, Msg *m)
+{
+    bool ok = handle_msg(cs, m);
+    drain_simulated_peers();
+    return ok;
+}
+
+vector<Job *> simulated_dispatch()
+{
+    while (empty_queue()) {
+        drain_simulated_peers();
+    }
+
+    drain_simulated_peers();
+
+    vector<Job *> waiting;
+
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (it->second->state() == Job::WAITINGFORCS && !it->second->leaseExpires()) {
+            waiting.push_back(it->second);
+        }
+    }
+
+    return waiting;
+}
+
+#endif
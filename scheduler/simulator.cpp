@@ -0,0 +1,500 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Replays the job requests of a scheduler trace (icecc-scheduler --trace-file)
+   against a model of a farm, with the placement code of the scheduler, and
+   tells how long the jobs took. Each job takes as long as it did in the trace,
+   scaled by the speed of the node it ran on against the one it runs on now.  */
+
+#ifndef _GNU_SOURCE
+// getopt_long
+#define _GNU_SOURCE 1
+#endif
+
+#include "config.h"
+#include "simulator.h"
+#include "compileserver.h"
+#include "job.h"
+#include "tracefile.h"
+#include "../services/comm.h"
+#include "../services/logging.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// all nodes have the one environment, transfers are not simulated
+static const char sim_platform[] = "sim";
+static const char sim_environment[] = "sim-env";
+
+time_t simulated_now = 0;
+
+struct SimNode {
+    string name;
+    unsigned int slots;
+    double speed;
+    bool noRemote;
+    CompileServer *cs;
+    unsigned int running;
+    unsigned int jobs;
+    unsigned long long busyMsec;
+};
+
+struct SimJob {
+    TraceEvent request;
+    string tracedServer;
+    TraceEvent done;
+    bool complete;
+
+    SimNode *submitter;
+    SimNode *node;
+    unsigned int schedulerId;
+    unsigned long long arrival;
+    unsigned long long start;
+    unsigned int duration;
+};
+
+struct SimEvent {
+    enum Type {
+        Arrive,
+        Start,
+        Finish,
+        Stats
+    };
+
+    SimEvent(Type _type, size_t _job = 0)
+        : type(_type)
+        , job(_job) {}
+
+    Type type;
+    size_t job;
+};
+
+static list<SimNode> nodes;
+static map<string, SimNode *> node_by_name;
+static map<CompileServer *, SimNode *> node_of;
+static vector<SimJob> sim_jobs;
+static multimap<unsigned long long, SimEvent> events;
+
+static void usage(const char *reason = 0)
+{
+    if (reason) {
+        cerr << reason << endl;
+    }
+
+    cerr << "usage: icecc-scheduler-sim [options] <trace>\n"
+         << "Options:\n"
+         << "  -c, --cluster <file>  nodes to simulate: name slots speed [noremote] per line\n"
+         << "  -l, --latency <msec>  until a job starts on another node than its submitter\n"
+         << "  -h, --help\n"
+         << "  -v[v[v]]]\n"
+         << endl;
+
+    exit(1);
+}
+
+static SimNode *add_node(const string &name, unsigned int slots, double speed, bool noRemote)
+{
+    map<string, SimNode *>::const_iterator it = node_by_name.find(name);
+
+    if (it != node_by_name.end()) {
+        return it->second;
+    }
+
+    SimNode node;
+    node.name = name;
+    node.slots = slots;
+    node.speed = speed > 0 ? speed : 1;
+    node.noRemote = noRemote;
+    node.cs = 0;
+    node.running = 0;
+    node.jobs = 0;
+    node.busyMsec = 0;
+    nodes.push_back(node);
+    node_by_name[name] = &nodes.back();
+    return &nodes.back();
+}
+
+static bool read_cluster(const string &file)
+{
+    ifstream in(file.c_str());
+
+    if (!in) {
+        log_perror("open") << "\t" << file << endl;
+        return false;
+    }
+
+    string line;
+
+    while (getline(in, line)) {
+        istringstream words(line);
+        string name, flag;
+        unsigned int slots;
+        double speed;
+
+        if (!(words >> name) || name[0] == '#') {
+            continue;
+        }
+
+        if (!(words >> slots >> speed)) {
+            log_error() << file << ": cannot parse '" << line << "'" << endl;
+            return false;
+        }
+
+        words >> flag;
+        add_node(name, slots, speed, flag == "noremote");
+    }
+
+    return true;
+}
+
+/* The jobs of the trace with all we need to know of them, and the nodes from
+   the trace if no cluster was given.  */
+static void read_jobs(const vector<TraceEvent> &trace, bool add_nodes)
+{
+    map<unsigned int, size_t> by_id;
+
+    for (vector<TraceEvent>::const_iterator it = trace.begin(); it != trace.end(); ++it) {
+        if (it->type == TraceEvent::Login && add_nodes) {
+            add_node(it->host, it->maxJobs, 1, it->noRemote);
+        } else if (it->type == TraceEvent::GetCS) {
+            SimJob job;
+            job.request = *it;
+            job.complete = false;
+            job.submitter = job.node = 0;
+            job.schedulerId = 0;
+            job.arrival = job.start = 0;
+            job.duration = 0;
+            by_id[it->jobId] = sim_jobs.size();
+            sim_jobs.push_back(job);
+        } else if (it->type == TraceEvent::JobBegin || it->type == TraceEvent::JobDone) {
+            map<unsigned int, size_t>::const_iterator job = by_id.find(it->jobId);
+
+            if (job == by_id.end()) {
+                continue;
+            }
+
+            if (it->type == TraceEvent::JobBegin) {
+                sim_jobs[job->second].tracedServer = it->host;
+            } else if (it->fromServer && !sim_jobs[job->second].tracedServer.empty()) {
+                sim_jobs[job->second].done = *it;
+                sim_jobs[job->second].complete = true;
+            }
+
+            // the ids start over with every scheduler run
+            if (it->type == TraceEvent::JobDone) {
+                by_id.erase(it->jobId);
+            }
+        }
+    }
+}
+
+static CompileServer *login(SimNode &node, unsigned int address)
+{
+    LoginMsg *m = new LoginMsg(10245, node.name, sim_platform);
+    m->envs.push_back(make_pair(string(sim_platform), string(sim_environment)));
+    m->verified_envs = m->envs;
+    m->max_kids = node.slots;
+    m->noremote = node.noRemote;
+    m->chroot_possible = true;
+    node.cs = simulated_login(m, address);
+
+    if (node.cs) {
+        node_of[node.cs] = &node;
+    }
+
+    return node.cs;
+}
+
+static void send_stats()
+{
+    for (list<SimNode>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        StatsMsg *m = new StatsMsg;
+        m->load = it->slots ? min(1000U, it->running * 1000 / it->slots) : 1000;
+        m->maxJobs = it->slots;
+        simulated_receive(it->cs, m);
+    }
+}
+
+static void arrive(size_t index, unsigned long long now)
+{
+    SimJob &job = sim_jobs[index];
+    Environments envs;
+    envs.push_back(make_pair(string(sim_platform), string(sim_environment)));
+
+    GetCSMsg *m = new GetCSMsg(envs, job.request.fileName,
+                               CompileJob::Language(job.request.language), 1, sim_platform,
+                               job.request.argFlags, string(), 0);
+    m->client_id = index + 1;
+    m->user = job.request.user;
+    m->priority = job.request.priority;
+
+    job.arrival = now;
+    simulated_receive(job.submitter->cs, m);
+}
+
+/* How much longer the job takes on its node than on the one it ran on in the trace.  */
+static double speed_scale(const SimJob &job)
+{
+    map<string, SimNode *>::const_iterator traced = node_by_name.find(job.tracedServer);
+    return (traced != node_by_name.end() ? traced->second->speed : 1) / job.node->speed;
+}
+
+static void start(size_t index, unsigned long long now)
+{
+    SimJob &job = sim_jobs[index];
+    double scale = speed_scale(job);
+
+    job.start = now;
+    job.duration = (unsigned int)(job.done.realMsec * scale);
+    job.node->running++;
+
+    JobBeginMsg *m = new JobBeginMsg(job.schedulerId, 0);
+    m->stime = simulated_now;
+    simulated_receive(job.node->cs, m);
+    events.insert(make_pair(now + job.duration, SimEvent(SimEvent::Finish, index)));
+}
+
+static void finish(size_t index)
+{
+    SimJob &job = sim_jobs[index];
+    double scale = speed_scale(job);
+
+    job.node->running--;
+    job.node->jobs++;
+    job.node->busyMsec += job.duration;
+
+    JobDoneMsg *m = new JobDoneMsg(job.schedulerId, job.done.exitCode, JobDoneMsg::FROM_SERVER);
+    m->real_msec = job.duration;
+    m->user_msec = (unsigned int)(job.done.userMsec * scale);
+    m->sys_msec = (unsigned int)(job.done.sysMsec * scale);
+    m->in_uncompressed = m->in_compressed = job.done.inBytes;
+    m->out_uncompressed = m->out_compressed = job.done.outBytes;
+    simulated_receive(job.node->cs, m);
+}
+
+static unsigned long long percentile(vector<unsigned long long> values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+
+    sort(values.begin(), values.end());
+    size_t i = size_t(p * values.size());
+    return values[min(i, values.size() - 1)];
+}
+
+static unsigned long long mean(const vector<unsigned long long> &values)
+{
+    unsigned long long sum = 0;
+
+    for (vector<unsigned long long>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        sum += *it;
+    }
+
+    return values.empty() ? 0 : sum / values.size();
+}
+
+int main(int argc, char *argv[])
+{
+    string cluster;
+    unsigned int latency = 100;
+    int debug_level = Error;
+
+    while (true) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            { "cluster", 1, NULL, 'c' },
+            { "latency", 1, NULL, 'l' },
+            { "help", 0, NULL, 'h' },
+            { 0, 0, 0, 0 }
+        };
+
+        const int c = getopt_long(argc, argv, "c:l:hv", long_options, &option_index);
+
+        if (c == -1) {
+            break;    // eoo
+        }
+
+        switch (c) {
+        case 'c':
+            cluster = optarg;
+            break;
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 'v':
+
+            if (debug_level < MaxVerboseLevel) {
+                debug_level++;
+            }
+
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage("Error: one trace file is required");
+    }
+
+    setup_debug(debug_level);
+
+    vector<TraceEvent> trace;
+
+    if (!TraceFile::read(argv[optind], trace)) {
+        return 1;
+    }
+
+    if (!cluster.empty() && !read_cluster(cluster)) {
+        return 1;
+    }
+
+    read_jobs(trace, cluster.empty());
+
+    // the submitters that are no compile servers in the model only submit
+    for (vector<SimJob>::iterator it = sim_jobs.begin(); it != sim_jobs.end(); ++it) {
+        it->submitter = add_node(it->request.host, 0, 1, true);
+    }
+
+    if (sim_jobs.empty()) {
+        cerr << "no jobs in the trace" << endl;
+        return 1;
+    }
+
+    unsigned long long first = sim_jobs.front().request.msec;
+    simulated_now = first / 1000;
+
+    unsigned int address = 10U << 24;
+
+    for (list<SimNode>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        if (!login(*it, ++address)) {
+            cerr << "the scheduler did not take node " << it->name << endl;
+            return 1;
+        }
+    }
+
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < sim_jobs.size(); ++i) {
+        if (sim_jobs[i].complete) {
+            events.insert(make_pair(sim_jobs[i].request.msec, SimEvent(SimEvent::Arrive, i)));
+        } else {
+            skipped++;
+        }
+    }
+
+    size_t pending = sim_jobs.size() - skipped;
+    events.insert(make_pair(first, SimEvent(SimEvent::Stats)));
+    set<unsigned int> placed;
+    unsigned long long now = first;
+    vector<unsigned long long> latencies, waits;
+
+    while (!events.empty() && pending) {
+        multimap<unsigned long long, SimEvent>::iterator next = events.begin();
+        SimEvent event = next->second;
+        now = next->first;
+        events.erase(next);
+        simulated_now = now / 1000;
+
+        switch (event.type) {
+        case SimEvent::Arrive:
+            arrive(event.job, now);
+            break;
+        case SimEvent::Start:
+            start(event.job, now);
+            break;
+        case SimEvent::Finish:
+            finish(event.job);
+            placed.erase(sim_jobs[event.job].schedulerId);
+            latencies.push_back(now - sim_jobs[event.job].arrival);
+            waits.push_back(sim_jobs[event.job].start - sim_jobs[event.job].arrival);
+            pending--;
+            break;
+        case SimEvent::Stats:
+            // the daemons send them every second while there are jobs
+            send_stats();
+            events.insert(make_pair(now + 1000, SimEvent(SimEvent::Stats)));
+            break;
+        }
+
+        vector<Job *> waiting = simulated_dispatch();
+
+        for (vector<Job *>::const_iterator it = waiting.begin(); it != waiting.end(); ++it) {
+            Job *job = *it;
+
+            if (!placed.insert(job->id()).second) {
+                continue;
+            }
+
+            size_t index = job->localClientId() - 1;
+            SimJob &sim_job = sim_jobs[index];
+            sim_job.schedulerId = job->id();
+            sim_job.node = node_of[job->server()];
+            unsigned long long begin = now + (sim_job.node == sim_job.submitter ? 0 : latency);
+            events.insert(make_pair(begin, SimEvent(SimEvent::Start, index)));
+        }
+    }
+
+    if (pending) {
+        cerr << pending << " jobs never got a compile server" << endl;
+    }
+
+    double makespan = (now - first) / 1000.0;
+    unsigned long long busy = 0;
+    unsigned int slots = 0;
+
+    printf("jobs:         %zu (%zu incomplete in the trace)\n", latencies.size(), skipped);
+    printf("makespan:     %.1f s\n", makespan);
+    printf("latency:      mean %llu ms, p99 %llu ms\n", mean(latencies),
+           percentile(latencies, 0.99));
+    printf("queue wait:   mean %llu ms, p99 %llu ms\n", mean(waits), percentile(waits, 0.99));
+
+    for (list<SimNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        busy += it->busyMsec;
+        slots += it->slots;
+    }
+
+    printf("utilization:  %.1f%% of %u slots\n",
+           makespan > 0 && slots ? 100 * busy / (makespan * 1000 * slots) : 0.0, slots);
+
+    for (list<SimNode>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        if (!it->slots) {
+            continue;
+        }
+
+        printf("  %-24s %6u jobs  %5.1f%%\n", it->name.c_str(), it->jobs,
+               makespan > 0 ? 100 * it->busyMsec / (makespan * 1000 * it->slots) : 0.0);
+    }
+
+    return pending ? 1 : 0;
+}
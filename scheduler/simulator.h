@@ -0,0 +1,47 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_SIMULATOR_H
+#define ICECREAM_SIMULATOR_H
+
+#include <time.h>
+#include <vector>
+
+class CompileServer;
+class Job;
+class LoginMsg;
+class Msg;
+
+/* icecc-scheduler-sim builds scheduler.cpp with SCHEDULER_SIMULATOR, which
+   makes it run on the clock of the simulation and adds the functions below
+   instead of main().  The simulator plays the daemons and clients of a
+   trace; the scheduler sees the same messages as in a real farm.  */
+
+// the clock of the scheduler, see clock.h
+extern time_t simulated_now;
+
+// Logs in a daemon whose channel discards everything, ADDRESS (IPv4) tells it from the others.
+CompileServer *simulated_login(LoginMsg *m, unsigned int address);
+// Handles M from CS as if it had been received, M is deleted. False if CS got dropped.
+bool simulated_receive(CompileServer *cs, Msg *m);
+// Places what it can of the queue, returns the jobs whose clients were sent to a server.
+std::vector<Job *> simulated_dispatch();
+
+#endif
@@ -0,0 +1,135 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "statsfile.h"
+#include "../services/logging.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+static const char header[] = "icecream-scheduler-stats 1";
+
+bool StatsFile::load(const string &file, time_t now, time_t maxAge)
+{
+    ifstream in(file.c_str());
+
+    if (!in) {
+        if (errno != ENOENT) {
+            log_perror("open") << "\t" << file << endl;
+        }
+
+        return false;
+    }
+
+    string line;
+
+    if (!getline(in, line) || line != header) {
+        log_error() << file << " is not a scheduler statistics file" << endl;
+        return false;
+    }
+
+    while (getline(in, line)) {
+        istringstream words(line);
+        string node, platform;
+        Record record;
+        unsigned long size, real, user, sys;
+
+        if (!(words >> node >> platform >> record.lastSeen >> record.jobs
+                >> size >> real >> user >> sys)) {
+            log_error() << file << ": cannot parse '" << line << "'" << endl;
+            continue;
+        }
+
+        if (now - record.lastSeen > maxAge || !record.jobs || !user) {
+            continue;
+        }
+
+        record.cum.setOutputSize(size);
+        record.cum.setCompileTimeReal(real);
+        record.cum.setCompileTimeUser(user);
+        record.cum.setCompileTimeSys(sys);
+        m_records[make_pair(node, platform)] = record;
+    }
+
+    log_info() << "loaded speed statistics of " << m_records.size() << " nodes from " << file << endl;
+    return true;
+}
+
+bool StatsFile::save(const string &file, time_t now, time_t maxAge)
+{
+    string tmp = file + ".tmp";
+    ofstream out(tmp.c_str());
+
+    out << header << "\n";
+
+    for (map<pair<string, string>, Record>::iterator it = m_records.begin();
+            it != m_records.end();) {
+        const Record &record = it->second;
+
+        if (now - record.lastSeen > maxAge) {
+            m_records.erase(it++);
+            continue;
+        }
+
+        out << it->first.first << " " << it->first.second << " " << record.lastSeen << " "
+            << record.jobs << " " << record.cum.outputSize() << " "
+            << record.cum.compileTimeReal() << " " << record.cum.compileTimeUser() << " "
+            << record.cum.compileTimeSys() << "\n";
+        ++it;
+    }
+
+    out.close();
+
+    if (!out) {
+        log_error() << "could not write " << tmp << endl;
+        (void) unlink(tmp.c_str());
+        return false;
+    }
+
+    // never leave a half written file behind
+    if (rename(tmp.c_str(), file.c_str()) < 0) {
+        log_perror("rename") << "\t" << tmp << " -> " << file << endl;
+        (void) unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void StatsFile::update(const string &node, const string &platform, time_t now,
+                       unsigned int jobs, const JobStat &cum)
+{
+    Record &record = m_records[make_pair(node, platform)];
+    record.lastSeen = now;
+    record.jobs = jobs;
+    record.cum = cum;
+}
+
+const StatsFile::Record *StatsFile::find(const string &node, const string &platform) const
+{
+    map<pair<string, string>, Record>::const_iterator it = m_records.find(make_pair(node, platform));
+    return it != m_records.end() ? &it->second : 0;
+}
@@ -0,0 +1,59 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_STATSFILE_H
+#define ICECREAM_STATSFILE_H
+
+#include "jobstat.h"
+
+#include <map>
+#include <string>
+#include <time.h>
+#include <utility>
+
+/**
+ * The speed statistics of the compile servers, kept on disk so that a
+ * restarted scheduler does not have to learn them again. They are keyed
+ * by node name and platform, and dropped when the node has not been seen
+ * for a while.
+ */
+class StatsFile
+{
+public:
+    struct Record {
+        time_t lastSeen;
+        unsigned int jobs;
+        JobStat cum; // of the last jobs
+    };
+
+    bool load(const std::string &file, time_t now, time_t maxAge);
+    bool save(const std::string &file, time_t now, time_t maxAge);
+
+    void update(const std::string &node, const std::string &platform, time_t now,
+                unsigned int jobs, const JobStat &cum);
+    // 0 if nothing is known about the node
+    const Record *find(const std::string &node, const std::string &platform) const;
+
+private:
+    std::map<std::pair<std::string, std::string>, Record> m_records;
+};
+
+#endif
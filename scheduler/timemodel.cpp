@@ -0,0 +1,310 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "timemodel.h"
+#include "../services/job.h"
+#include "../services/util.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+using namespace std;
+
+// weight of a job after the next one, jobs are forgotten after about 50
+static const double fit_decay = 0.98;
+// jobs of a class a server needs to get its own fit
+static const unsigned int min_server_samples = 10;
+// and before its ratio to the class fit counts
+static const unsigned int min_ratio_samples = 3;
+// files remembered for their input sizes
+static const size_t max_input_sizes = 50000;
+// jobs at a concurrency before its speed counts
+static const unsigned int min_scaling_samples = 5;
+
+LinearFit::LinearFit()
+    : n(0)
+    , sx(0)
+    , sy(0)
+    , sxx(0)
+    , sxy(0)
+    , mse(0)
+    , count(0)
+{
+}
+
+void LinearFit::add(double x, double y)
+{
+    if (count >= 2) {
+        double error = y - predict(x);
+        mse = count == 2 ? error * error : 0.9 * mse + 0.1 * error * error;
+    }
+
+    n = n * fit_decay + 1;
+    sx = sx * fit_decay + x;
+    sy = sy * fit_decay + y;
+    sxx = sxx * fit_decay + x * x;
+    sxy = sxy * fit_decay + x * y;
+    count++;
+}
+
+void LinearFit::coefficients(double &a, double &b) const
+{
+    double denom = n * sxx - sx * sx;
+    // compile time does not go down with more input, that's noise
+    b = fabs(denom) > 1e-9 * n * sxx ? max(0.0, (n * sxy - sx * sy) / denom) : 0;
+    a = n ? (sy - b * sx) / n : 0;
+}
+
+double LinearFit::predict(double x) const
+{
+    if (!count) {
+        return 0;
+    }
+
+    double a, b;
+    coefficients(a, b);
+    return max(1.0, a + b * x);
+}
+
+double LinearFit::deviation() const
+{
+    return sqrt(mse);
+}
+
+double LinearFit::meanX() const
+{
+    return n ? sx / n : 0;
+}
+
+string LinearFit::dump() const
+{
+    char buffer[200];
+    double a, b;
+    coefficients(a, b);
+    snprintf(buffer, sizeof(buffer), "jobs=%u msec=%.0f+%.2f*KiB dev=%.0f in=%.0fKiB",
+             count, a, b, deviation(), meanX());
+    return buffer;
+}
+
+string CompileTimeModel::jobClass(const string &language, unsigned int argFlags)
+{
+    string result = language;
+    result += argFlags & (CompileJob::Flag_O | CompileJob::Flag_O2 | CompileJob::Flag_Ol2) ? " -O" : " -O0";
+
+    if (argFlags & (CompileJob::Flag_g | CompileJob::Flag_g3)) {
+        result += " -g";
+    }
+
+    return result;
+}
+
+unsigned int CompileTimeModel::predict(const string &server, const string &jobClass,
+                                       unsigned int in_bytes) const
+{
+    double x = in_bytes / 1024.0;
+    map<pair<string, string>, LinearFit>::const_iterator sit
+        = m_servers.find(make_pair(server, jobClass));
+
+    if (sit != m_servers.end() && sit->second.count >= min_server_samples) {
+        return (unsigned int) sit->second.predict(x);
+    }
+
+    map<string, LinearFit>::const_iterator cit = m_classes.find(jobClass);
+
+    if (cit == m_classes.end()) {
+        return 0;
+    }
+
+    map<string, Ratio>::const_iterator rit = m_ratios.find(server);
+    double ratio = rit != m_ratios.end() && rit->second.count >= min_ratio_samples
+                   ? rit->second.value : 1;
+    return (unsigned int) max(1.0, cit->second.predict(x) * ratio);
+}
+
+void CompileTimeModel::learn(const string &server, const string &jobClass, unsigned int in_bytes,
+                             unsigned int msec)
+{
+    double x = in_bytes / 1024.0;
+    double y = msec;
+    LinearFit &cls = m_classes[jobClass];
+    LinearFit &own = m_servers[make_pair(server, jobClass)];
+
+    if (own.count >= min_server_samples) {
+        double limit = 3 * own.deviation();
+        double expected = own.predict(x);
+        y = max(expected - limit, min(expected + limit, y));
+    }
+
+    if (cls.count >= min_ratio_samples) {
+        Ratio &ratio = m_ratios[server];
+        double r = y / cls.predict(x);
+        ratio.value = ratio.count ? 0.9 * ratio.value + 0.1 * r : r;
+        ratio.count++;
+    }
+
+    cls.add(x, y);
+    own.add(x, y);
+}
+
+unsigned int CompileTimeModel::inputSize(const string &file, const string &jobClass) const
+{
+    map<string, unsigned int>::const_iterator it = m_inputSizes.find(file);
+
+    if (it != m_inputSizes.end()) {
+        return it->second;
+    }
+
+    map<string, LinearFit>::const_iterator cit = m_classes.find(jobClass);
+    return cit != m_classes.end() ? (unsigned int)(cit->second.meanX() * 1024) : 0;
+}
+
+void CompileTimeModel::setInputSize(const string &file, unsigned int in_bytes)
+{
+    if (m_inputSizes.size() >= max_input_sizes && m_inputSizes.find(file) == m_inputSizes.end()) {
+        // a new build tree probably, start over
+        m_inputSizes.clear();
+    }
+
+    m_inputSizes[file] = in_bytes;
+}
+
+list<string> CompileTimeModel::dump() const
+{
+    list<string> lines;
+
+    for (map<string, LinearFit>::const_iterator it = m_classes.begin(); it != m_classes.end(); ++it) {
+        lines.push_back(" class " + it->first + ": " + it->second.dump());
+    }
+
+    for (map<string, Ratio>::const_iterator it = m_ratios.begin(); it != m_ratios.end(); ++it) {
+        char buffer[100];
+        snprintf(buffer, sizeof(buffer), ": %.2f of the class time (jobs=%u)", it->second.value,
+                 it->second.count);
+        lines.push_back(" server " + it->first + buffer);
+    }
+
+    for (map<pair<string, string>, LinearFit>::const_iterator it = m_servers.begin();
+            it != m_servers.end(); ++it) {
+        if (it->second.count >= min_server_samples) {
+            lines.push_back(" server " + it->first.first + " " + it->first.second + ": "
+                            + it->second.dump());
+        }
+    }
+
+    return lines;
+}
+
+void CompileTimeModel::learnScaling(const string &server, const string &jobClass,
+                                    unsigned int in_bytes, unsigned int concurrency,
+                                    unsigned int real_msec)
+{
+    map<string, LinearFit>::const_iterator cit = m_classes.find(jobClass);
+
+    if (!concurrency || !real_msec || cit == m_classes.end()
+            || cit->second.count < min_ratio_samples) {
+        return;
+    }
+
+    Ratio &speed = m_curves[server][concurrency];
+    double s = cit->second.predict(in_bytes / 1024.0) / real_msec;
+    speed.value = speed.count ? 0.9 * speed.value + 0.1 * s : s;
+    speed.count++;
+}
+
+double CompileTimeModel::speedAt(const Curve &curve, unsigned int concurrency)
+{
+    Curve::const_iterator it = curve.find(concurrency);
+    return it != curve.end() && it->second.count >= min_scaling_samples ? it->second.value : 0;
+}
+
+/* The speed of a job running alone. Busy servers may never run just one,
+   then take the fewest jobs measured and assume it scales linearly so far. */
+double CompileTimeModel::reference(const Curve &curve)
+{
+    for (Curve::const_iterator it = curve.begin(); it != curve.end(); ++it) {
+        if (it->second.count >= min_scaling_samples) {
+            return it->second.value;
+        }
+    }
+
+    return 0;
+}
+
+double CompileTimeModel::marginalSpeed(const string &server, unsigned int concurrency) const
+{
+    map<string, Curve>::const_iterator it = m_curves.find(server);
+
+    if (it == m_curves.end()) {
+        return 0;
+    }
+
+    double ref = reference(it->second);
+    double next = speedAt(it->second, concurrency + 1);
+
+    if (ref <= 0 || next <= 0) {
+        return 0;
+    }
+
+    if (!concurrency) {
+        return next / ref;
+    }
+
+    double now = speedAt(it->second, concurrency);
+
+    if (now <= 0) {
+        return 0;
+    }
+
+    // throughput is concurrency times the speed of each job
+    double marginal = ((concurrency + 1) * next - concurrency * now) / ref;
+    return max(0.05, min(1.0, marginal));
+}
+
+list<string> CompileTimeModel::dumpScaling() const
+{
+    list<string> lines;
+
+    for (map<string, Curve>::const_iterator it = m_curves.begin(); it != m_curves.end(); ++it) {
+        double ref = reference(it->second);
+
+        if (ref <= 0) {
+            continue;
+        }
+
+        string line = " " + it->first + " throughput:";
+
+        for (Curve::const_iterator cit = it->second.begin(); cit != it->second.end(); ++cit) {
+            if (cit->second.count < min_scaling_samples) {
+                continue;
+            }
+
+            char buffer[100];
+            snprintf(buffer, sizeof(buffer), " %u=%.2f", cit->first,
+                     cit->first * cit->second.value / ref);
+            line += buffer;
+        }
+
+        lines.push_back(line);
+    }
+
+    return lines;
+}
@@ -0,0 +1,108 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_TIMEMODEL_H
+#define ICECREAM_TIMEMODEL_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+/**
+ * Least squares fit of msec = a + b * KiB, older samples weighted down so
+ * that it follows changes.
+ */
+struct LinearFit {
+    LinearFit();
+    void add(double x, double y);
+    void coefficients(double &a, double &b) const;
+    double predict(double x) const;
+    double deviation() const;
+    double meanX() const;
+    std::string dump() const;
+
+    // exponentially weighted sums
+    double n, sx, sy, sxx, sxy;
+    double mse; // of the predictions before learning
+    unsigned int count;
+};
+
+/**
+ * Predicts the CPU time of compile jobs, learnt from the finished ones.
+ * For every class of jobs (language, optimization, debug info) it fits
+ * the time to the input size. Every server gets such a fit of its own once it
+ * compiled enough jobs of a class; until then the class fit is scaled by
+ * how much slower or faster than predicted the server was so far. Jobs far
+ * off the fit are clamped before they are learnt, one odd job should not
+ * change much.
+ *
+ * It also learns how the throughput of every server scales with the number
+ * of jobs it runs: the speed of a job is the work the class fit expects
+ * from it per wall clock msec, averaged per number of jobs the server had
+ * when it got the job. Some servers scale up to all their hardware
+ * threads, others flatten early because of SMT or memory bandwidth.
+ */
+class CompileTimeModel
+{
+public:
+    // 0 if nothing is known yet
+    unsigned int predict(const std::string &server, const std::string &jobClass,
+                         unsigned int in_bytes) const;
+    void learn(const std::string &server, const std::string &jobClass, unsigned int in_bytes,
+               unsigned int msec);
+
+    // The input size of FILE in earlier builds, or the average of its class.
+    unsigned int inputSize(const std::string &file, const std::string &jobClass) const;
+    void setInputSize(const std::string &file, unsigned int in_bytes);
+
+    std::list<std::string> dump() const;
+
+    void learnScaling(const std::string &server, const std::string &jobClass,
+                      unsigned int in_bytes, unsigned int concurrency, unsigned int real_msec);
+    // What one more job adds to the throughput of SERVER running CONCURRENCY
+    // jobs, relative to a job running alone, 0 if not known.
+    double marginalSpeed(const std::string &server, unsigned int concurrency) const;
+    std::list<std::string> dumpScaling() const;
+
+    static std::string jobClass(const std::string &language, unsigned int argFlags);
+
+private:
+    struct Ratio {
+        Ratio() : value(1), count(0) {}
+        double value; // actual / predicted by the class fit
+        unsigned int count;
+    };
+
+    // per job speed by concurrency
+    typedef std::map<unsigned int, Ratio> Curve;
+    // the speed at concurrency, 0 if not known
+    static double speedAt(const Curve &curve, unsigned int concurrency);
+    static double reference(const Curve &curve);
+
+    std::map<std::string, LinearFit> m_classes;
+    std::map<std::pair<std::string, std::string>, LinearFit> m_servers;
+    std::map<std::string, Ratio> m_ratios;
+    std::map<std::string, unsigned int> m_inputSizes;
+    std::map<std::string, Curve> m_curves;
+};
+
+#endif
@@ -0,0 +1,177 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "tracefile.h"
+#include "../services/logging.h"
+#include <sys/time.h>
+#include <sstream>
+
+using namespace std;
+
+static const char header[] = "icecream-scheduler-trace 1";
+
+static const char *const type_names[] = { "login", "logout", "getcs", "begin", "done", "stats" };
+
+TraceEvent::TraceEvent()
+    : type(Login)
+    , msec(0)
+    , jobId(0)
+    , maxJobs(0)
+    , noRemote(false)
+    , language(0)
+    , argFlags(0)
+    , priority(0)
+    , exitCode(0)
+    , fromServer(true)
+    , realMsec(0)
+    , userMsec(0)
+    , sysMsec(0)
+    , inBytes(0)
+    , outBytes(0)
+    , load(0)
+{
+}
+
+bool TraceFile::open(const string &file)
+{
+    m_out.open(file.c_str(), ios::out | ios::trunc);
+
+    if (!m_out) {
+        log_perror("open") << "\t" << file << endl;
+        return false;
+    }
+
+    m_out << header << endl;
+    return true;
+}
+
+bool TraceFile::isOpen() const
+{
+    return m_out.is_open();
+}
+
+void TraceFile::write(const TraceEvent &event)
+{
+    m_out << event.msec << " " << type_names[event.type] << " " << event.host;
+
+    switch (event.type) {
+    case TraceEvent::Login:
+        m_out << " " << event.platform << " " << event.maxJobs << " " << event.noRemote;
+        break;
+    case TraceEvent::GetCS:
+        // the file name goes last, it may have spaces
+        m_out << " " << event.jobId << " " << event.language << " " << event.argFlags << " "
+              << event.priority << " " << (event.user.empty() ? "-" : event.user) << " "
+              << event.fileName;
+        break;
+    case TraceEvent::JobBegin:
+        m_out << " " << event.jobId;
+        break;
+    case TraceEvent::JobDone:
+        m_out << " " << event.jobId << " " << event.exitCode << " " << event.fromServer << " "
+              << event.realMsec << " " << event.userMsec << " " << event.sysMsec << " "
+              << event.inBytes << " " << event.outBytes;
+        break;
+    case TraceEvent::Stats:
+        m_out << " " << event.load;
+        break;
+    case TraceEvent::Logout:
+        break;
+    }
+
+    // a trace is most interesting when the scheduler did not end well
+    m_out << endl;
+}
+
+unsigned long long TraceFile::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+bool TraceFile::read(const string &file, vector<TraceEvent> &events)
+{
+    ifstream in(file.c_str());
+
+    if (!in) {
+        log_perror("open") << "\t" << file << endl;
+        return false;
+    }
+
+    string line;
+
+    if (!getline(in, line) || line != header) {
+        log_error() << file << " is not a scheduler trace" << endl;
+        return false;
+    }
+
+    for (unsigned int lineno = 2; getline(in, line); ++lineno) {
+        istringstream words(line);
+        TraceEvent event;
+        string type;
+
+        if (!(words >> event.msec >> type >> event.host)) {
+            log_error() << file << ":" << lineno << ": cannot parse '" << line << "'" << endl;
+            continue;
+        }
+
+        bool ok = true;
+
+        if (type == "login") {
+            event.type = TraceEvent::Login;
+            ok = bool(words >> event.platform >> event.maxJobs >> event.noRemote);
+        } else if (type == "logout") {
+            event.type = TraceEvent::Logout;
+        } else if (type == "getcs") {
+            event.type = TraceEvent::GetCS;
+            ok = bool(words >> event.jobId >> event.language >> event.argFlags >> event.priority
+                      >> event.user);
+            words >> ws;
+            getline(words, event.fileName);
+
+            if (event.user == "-") {
+                event.user.clear();
+            }
+        } else if (type == "begin") {
+            event.type = TraceEvent::JobBegin;
+            ok = bool(words >> event.jobId);
+        } else if (type == "done") {
+            event.type = TraceEvent::JobDone;
+            ok = bool(words >> event.jobId >> event.exitCode >> event.fromServer >> event.realMsec
+                      >> event.userMsec >> event.sysMsec >> event.inBytes >> event.outBytes);
+        } else if (type == "stats") {
+            event.type = TraceEvent::Stats;
+            ok = bool(words >> event.load);
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            log_error() << file << ":" << lineno << ": cannot parse '" << line << "'" << endl;
+            continue;
+        }
+
+        events.push_back(event);
+    }
+
+    return true;
+}
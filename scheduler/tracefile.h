@@ -0,0 +1,91 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_TRACEFILE_H
+#define ICECREAM_TRACEFILE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* One thing a daemon told the scheduler, as far as placing jobs is concerned.  */
+struct TraceEvent {
+    enum Type {
+        Login,
+        Logout,
+        GetCS,
+        JobBegin,
+        JobDone,
+        Stats
+    };
+
+    TraceEvent();
+
+    Type type;
+    unsigned long long msec; // since the epoch
+    std::string host;        // the daemon that sent it
+    unsigned int jobId;
+
+    // Login
+    std::string platform;
+    unsigned int maxJobs;
+    bool noRemote;
+
+    // GetCS
+    unsigned int language; // CompileJob::Language
+    unsigned int argFlags;
+    int priority;
+    std::string user;
+    std::string fileName;
+
+    // JobDone
+    int exitCode;
+    bool fromServer;
+    unsigned int realMsec;
+    unsigned int userMsec;
+    unsigned int sysMsec;
+    unsigned int inBytes;
+    unsigned int outBytes;
+
+    // Stats
+    unsigned int load;
+};
+
+/**
+ * A trace of the events the scheduler placed jobs by, written by
+ * icecc-scheduler --trace-file and replayed by icecc-scheduler-sim. It is a
+ * text file with one event per line, so that traces can be cut and edited.
+ */
+class TraceFile
+{
+public:
+    bool open(const std::string &file);
+    bool isOpen() const;
+    void write(const TraceEvent &event);
+
+    static unsigned long long now();
+    // The events of FILE in the order they were written.
+    static bool read(const std::string &file, std::vector<TraceEvent> &events);
+
+private:
+    std::ofstream m_out;
+};
+
+#endif
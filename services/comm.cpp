@@ -317,7 +317,9 @@ void MsgChannel::chop_input()
 
 void MsgChannel::chop_output()
 {
-    if (msgofs > 8192 || msgtogo <= 16) {
+    /* New output is appended at msgbuf + msgtogo, so what a non-blocking
+       send left behind has to be moved to the front.  */
+    if (msgofs) {
         if (msgtogo) {
             memmove(msgbuf, msgbuf + msgofs, msgtogo);
         }
@@ -387,6 +389,9 @@ bool MsgChannel::flush_writebuf(bool blocking)
                 }
 
                 /* Timeout or real error --> error.  */
+            } else if (!blocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* The rest goes with the next send, see pending_output().  */
+                break;
             }
 
             log_perror("flush_writebuf() failed");
@@ -1254,6 +1259,39 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_GET_ENV:
+        m = new GetEnvMsg;
+        break;
+    case M_FETCH_ENV:
+        m = new FetchEnvMsg;
+        break;
+    case M_FETCH_ENV_RESULT:
+        m = new FetchEnvResultMsg;
+        break;
+    case M_JOB_SENT:
+        m = new JobSentMsg;
+        break;
+    case M_STEAL_JOBS:
+        m = new StealJobsMsg;
+        break;
+    case M_REDIRECT_JOB:
+        m = new RedirectJobMsg;
+        break;
+    case M_JOB_REDIRECTED:
+        m = new JobRedirectedMsg;
+        break;
+    case M_SLOT_LEASE:
+        m = new SlotLeaseMsg;
+        break;
+    case M_LEASE_USED:
+        m = new LeaseUsedMsg;
+        break;
+    case M_LEASE_RETURN:
+        m = new LeaseReturnMsg;
+        break;
+    case M_MON_BATCH:
+        m = new MonBatchMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
@@ -1946,6 +1984,26 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_39(c)) {
         *c >> client_count;
     }
+
+    env_files.clear();
+
+    if (IS_PROTOCOL_42(c)) {
+        *c >> env_files;
+    }
+
+    user = string();
+
+    if (IS_PROTOCOL_51(c)) {
+        *c >> user;
+    }
+
+    priority = 0;
+
+    if (IS_PROTOCOL_52(c)) {
+        uint32_t _priority;
+        *c >> _priority;
+        priority = int32_t(_priority);
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -1973,6 +2031,18 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_39(c)) {
         *c << client_count;
     }
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << env_files;
+    }
+
+    if (IS_PROTOCOL_51(c)) {
+        *c << user;
+    }
+
+    if (IS_PROTOCOL_52(c)) {
+        *c << uint32_t(priority);
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -1990,6 +2060,10 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_41(c)) {
+        *c >> env_peers;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -2005,6 +2079,10 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_41(c)) {
+        *c << env_peers;
+    }
 }
 
 void NoCSMsg::fill_from_channel(MsgChannel *c)
@@ -2213,6 +2291,11 @@ void JobLocalBeginMsg::fill_from_channel(MsgChannel *c)
     *c >> stime;
     *c >> outfile;
     *c >> id;
+
+    if (IS_PROTOCOL_48(c)) {
+        *c >> jobclass;
+        *c >> mem_estimate;
+    }
 }
 
 void JobLocalBeginMsg::send_to_channel(MsgChannel *c) const
@@ -2221,6 +2304,11 @@ void JobLocalBeginMsg::send_to_channel(MsgChannel *c) const
     *c << stime;
     *c << outfile;
     *c << id;
+
+    if (IS_PROTOCOL_48(c)) {
+        *c << jobclass;
+        *c << mem_estimate;
+    }
 }
 
 void JobLocalDoneMsg::fill_from_channel(MsgChannel *c)
@@ -2246,6 +2334,12 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags, unsigned int _clie
     user_msec = 0;
     sys_msec = 0;
     pfaults = 0;
+    mem_peak = 0;
+    io_kb = 0;
+    cpu_stall_msec = 0;
+    mem_stall_msec = 0;
+    io_stall_msec = 0;
+    telemetry_version = JobTelemetry::version;
     in_compressed = 0;
     in_uncompressed = 0;
     out_compressed = 0;
@@ -2276,6 +2370,29 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_39(c)) {
         *c >> client_count;
     }
+    if (IS_PROTOCOL_45(c)) {
+        *c >> mem_peak;
+        *c >> io_kb;
+        *c >> cpu_stall_msec;
+        *c >> mem_stall_msec;
+        *c >> io_stall_msec;
+    }
+    if (IS_PROTOCOL_49(c)) {
+        uint32_t count = 0;
+        *c >> telemetry_version;
+        *c >> count;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t key = 0;
+            uint32_t value = 0;
+            *c >> key;
+            *c >> value;
+
+            if (telemetry.size() < JobTelemetry::num_keys + 64) {
+                telemetry[key] = value;
+            }
+        }
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -2299,6 +2416,61 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_39(c)) {
         *c << client_count;
     }
+    if (IS_PROTOCOL_45(c)) {
+        *c << mem_peak;
+        *c << io_kb;
+        *c << cpu_stall_msec;
+        *c << mem_stall_msec;
+        *c << io_stall_msec;
+    }
+    if (IS_PROTOCOL_49(c)) {
+        *c << telemetry_version;
+        *c << (uint32_t) telemetry.size();
+
+        for (std::map<uint32_t, uint32_t>::const_iterator it = telemetry.begin();
+                it != telemetry.end(); ++it) {
+            *c << it->first;
+            *c << it->second;
+        }
+    }
+}
+
+std::string JobTelemetry::name(uint32_t key)
+{
+    switch (key) {
+    case max_rss_kb:
+        return "max_rss_kb";
+    case read_kb:
+        return "read_kb";
+    case write_kb:
+        return "write_kb";
+    case voluntary_csw:
+        return "voluntary_csw";
+    case involuntary_csw:
+        return "involuntary_csw";
+    case receive_msec:
+        return "receive_msec";
+    case compile_msec:
+        return "compile_msec";
+    case send_msec:
+        return "send_msec";
+    case queue_msec:
+        return "queue_msec";
+    case time_report_msec:
+        return "time_report_msec";
+    case cache_hit:
+        return "cache_hit";
+    case cpu_usage_msec:
+        return "cpu_usage_msec";
+    case cpu_user_msec:
+        return "cpu_user_msec";
+    case cpu_system_msec:
+        return "cpu_system_msec";
+    }
+
+    char buf[16];
+    sprintf(buf, "%u", key);
+    return buf;
 }
 
 void JobDoneMsg::set_unknown_job_client_id( uint32_t clientId )
@@ -2325,6 +2497,8 @@ LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std:
     : Msg(M_LOGIN)
     , port(myport)
     , max_kids(0)
+    , max_link_jobs(0)
+    , max_heavy_jobs(0)
     , noremote(false)
     , chroot_possible(false)
     , nodename(_nodename)
@@ -2356,6 +2530,16 @@ void LoginMsg::fill_from_channel(MsgChannel *c)
     }
 
     noremote = (net_noremote != 0);
+    verified_envs.clear();
+
+    if (IS_PROTOCOL_43(c)) {
+        c->read_environments(verified_envs);
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c >> max_link_jobs;
+        *c >> max_heavy_jobs;
+    }
 }
 
 void LoginMsg::send_to_channel(MsgChannel *c) const
@@ -2371,6 +2555,15 @@ void LoginMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_26(c)) {
         *c << noremote;
     }
+
+    if (IS_PROTOCOL_43(c)) {
+        c->write_environments(verified_envs);
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c << max_link_jobs;
+        *c << max_heavy_jobs;
+    }
 }
 
 void ConfCSMsg::fill_from_channel(MsgChannel *c)
@@ -2399,6 +2592,33 @@ void StatsMsg::fill_from_channel(MsgChannel *c)
     *c >> loadAvg5;
     *c >> loadAvg10;
     *c >> freeMem;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> cpuPressure;
+        *c >> memPressure;
+        *c >> ioPressure;
+    }
+
+    if (IS_PROTOCOL_46(c)) {
+        uint32_t count;
+        *c >> count;
+        slotSpeeds.clear();
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t speed;
+            *c >> speed;
+            slotSpeeds.push_back(speed);
+        }
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c >> maxJobs;
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c >> linkJobs;
+        *c >> heavyJobs;
+    }
 }
 
 void StatsMsg::send_to_channel(MsgChannel *c) const
@@ -2409,6 +2629,29 @@ void StatsMsg::send_to_channel(MsgChannel *c) const
     *c << loadAvg5;
     *c << loadAvg10;
     *c << freeMem;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << cpuPressure;
+        *c << memPressure;
+        *c << ioPressure;
+    }
+
+    if (IS_PROTOCOL_46(c)) {
+        *c << (uint32_t) slotSpeeds.size();
+
+        for (size_t i = 0; i < slotSpeeds.size(); ++i) {
+            *c << slotSpeeds[i];
+        }
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c << maxJobs;
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c << linkJobs;
+        *c << heavyJobs;
+    }
 }
 
 void GetNativeEnvMsg::fill_from_channel(MsgChannel *c)
@@ -2457,6 +2700,25 @@ void EnvTransferMsg::send_to_channel(MsgChannel *c) const
     *c << target;
 }
 
+void MonLoginMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    batch_msec = 0;
+
+    if (IS_PROTOCOL_54(c)) {
+        *c >> batch_msec;
+    }
+}
+
+void MonLoginMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+
+    if (IS_PROTOCOL_54(c)) {
+        *c << batch_msec;
+    }
+}
+
 void MonGetCSMsg::fill_from_channel(MsgChannel *c)
 {
     if (IS_PROTOCOL_29(c)) {
@@ -2585,6 +2847,60 @@ void VerifyEnvResultMsg::send_to_channel(MsgChannel *c) const
     *c << uint32_t(ok);
 }
 
+void GetEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+}
+
+void GetEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+}
+
+void FetchEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> peers;
+}
+
+void FetchEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << peers;
+}
+
+void FetchEnvResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t read_ok;
+    *c >> read_ok;
+    ok = read_ok != 0;
+
+    if (IS_PROTOCOL_42(c)) {
+        *c >> target;
+        *c >> name;
+    }
+}
+
+void FetchEnvResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << uint32_t(ok);
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << target;
+        *c << name;
+    }
+}
+
 void BlacklistHostEnvMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -2601,6 +2917,290 @@ void BlacklistHostEnvMsg::send_to_channel(MsgChannel *c) const
     *c << hostname;
 }
 
+void JobSentMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> job_id;
+    *c >> send_msec;
+}
+
+void JobSentMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+    *c << send_msec;
+}
+
+void StealJobsMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> free_slots;
+}
+
+void StealJobsMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << free_slots;
+}
+
+void JobRedirectedMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t read_ok;
+    *c >> job_id;
+    *c >> read_ok;
+    ok = read_ok != 0;
+}
+
+void JobRedirectedMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+    *c << uint32_t(ok);
+}
+
+void SlotLeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> duration;
+    *c >> target;
+    *c >> host_platform;
+    *c >> version;
+    uint32_t count;
+    *c >> count;
+    slots.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Slot slot;
+        *c >> slot.job_id;
+        *c >> slot.hostname;
+        *c >> slot.port;
+        slots.push_back(slot);
+    }
+}
+
+void SlotLeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << duration;
+    *c << target;
+    *c << host_platform;
+    *c << version;
+    *c << uint32_t(slots.size());
+
+    for (std::vector<Slot>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+        *c << it->job_id;
+        *c << it->hostname;
+        *c << it->port;
+    }
+}
+
+void LeaseUsedMsg::fill_from_channel(MsgChannel *c)
+{
+    GetCSMsg::fill_from_channel(c);
+    *c >> job_id;
+}
+
+void LeaseUsedMsg::send_to_channel(MsgChannel *c) const
+{
+    GetCSMsg::send_to_channel(c);
+    *c << job_id;
+}
+
+void LeaseReturnMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t count;
+    *c >> count;
+    job_ids.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t id;
+        *c >> id;
+        job_ids.push_back(id);
+    }
+}
+
+void LeaseReturnMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << uint32_t(job_ids.size());
+
+    for (std::vector<uint32_t>::const_iterator it = job_ids.begin(); it != job_ids.end(); ++it) {
+        *c << *it;
+    }
+}
+
+static void read_job_starts(MsgChannel *c, std::vector<MonBatchMsg::JobStart> &starts,
+                            bool local)
+{
+    uint32_t count;
+    *c >> count;
+    starts.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        MonBatchMsg::JobStart start;
+        *c >> start.job_id;
+        *c >> start.hostid;
+        *c >> start.stime;
+
+        if (local) {
+            *c >> start.file;
+        }
+
+        starts.push_back(start);
+    }
+}
+
+static void write_job_starts(MsgChannel *c, const std::vector<MonBatchMsg::JobStart> &starts,
+                             bool local)
+{
+    *c << uint32_t(starts.size());
+
+    for (std::vector<MonBatchMsg::JobStart>::const_iterator it = starts.begin();
+            it != starts.end(); ++it) {
+        *c << it->job_id;
+        *c << it->hostid;
+        *c << it->stime;
+
+        if (local) {
+            *c << shorten_filename(it->file);
+        }
+    }
+}
+
+void MonBatchMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> dropped;
+
+    uint32_t count;
+    *c >> count;
+    hosts.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Host host;
+        *c >> host.hostid;
+        uint32_t n;
+        *c >> n;
+
+        for (uint32_t j = 0; j < n; ++j) {
+            uint32_t key;
+            *c >> key;
+            *c >> host.values[key];
+        }
+
+        *c >> n;
+
+        for (uint32_t j = 0; j < n; ++j) {
+            uint32_t key;
+            *c >> key;
+            *c >> host.texts[key];
+        }
+
+        hosts.push_back(host);
+    }
+
+    *c >> count;
+    requests.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        JobRequest request;
+        *c >> request.job_id;
+        *c >> request.hostid;
+        *c >> request.lang;
+        *c >> request.filename;
+        requests.push_back(request);
+    }
+
+    read_job_starts(c, begins, false);
+    read_job_starts(c, local_begins, true);
+
+    *c >> count;
+    ends.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        JobEnd end;
+        *c >> end.job_id;
+        *c >> end.exitcode;
+        *c >> end.flags;
+        *c >> end.real_msec;
+        *c >> end.user_msec;
+        *c >> end.sys_msec;
+        *c >> end.pfaults;
+        *c >> end.in_uncompressed;
+        *c >> end.out_uncompressed;
+        ends.push_back(end);
+    }
+
+    *c >> count;
+    local_ends.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t id;
+        *c >> id;
+        local_ends.push_back(id);
+    }
+}
+
+void MonBatchMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << dropped;
+    *c << uint32_t(hosts.size());
+
+    for (std::vector<Host>::const_iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        *c << it->hostid;
+        *c << uint32_t(it->values.size());
+
+        for (std::map<uint32_t, uint32_t>::const_iterator vit = it->values.begin();
+                vit != it->values.end(); ++vit) {
+            *c << vit->first;
+            *c << vit->second;
+        }
+
+        *c << uint32_t(it->texts.size());
+
+        for (std::map<uint32_t, std::string>::const_iterator tit = it->texts.begin();
+                tit != it->texts.end(); ++tit) {
+            *c << tit->first;
+            *c << tit->second;
+        }
+    }
+
+    *c << uint32_t(requests.size());
+
+    for (std::vector<JobRequest>::const_iterator it = requests.begin(); it != requests.end(); ++it) {
+        *c << it->job_id;
+        *c << it->hostid;
+        *c << it->lang;
+        *c << shorten_filename(it->filename);
+    }
+
+    write_job_starts(c, begins, false);
+    write_job_starts(c, local_begins, true);
+
+    *c << uint32_t(ends.size());
+
+    for (std::vector<JobEnd>::const_iterator it = ends.begin(); it != ends.end(); ++it) {
+        *c << it->job_id;
+        *c << it->exitcode;
+        *c << it->flags;
+        *c << it->real_msec;
+        *c << it->user_msec;
+        *c << it->sys_msec;
+        *c << it->pfaults;
+        *c << it->in_uncompressed;
+        *c << it->out_uncompressed;
+    }
+
+    *c << uint32_t(local_ends.size());
+
+    for (std::vector<uint32_t>::const_iterator it = local_ends.begin(); it != local_ends.end(); ++it) {
+        *c << *it;
+    }
+}
+
 /*
 vim:cinoptions={.5s,g0,p5,t0,(0,^-0.5s,n-0.5s:tw=78:cindent:sw=4:
 */
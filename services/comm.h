@@ -34,9 +34,11 @@
 #include <netinet/tcp.h>
 
 #include "job.h"
+#include <map>
+#include <vector>
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 40
+#define PROTOCOL_VERSION 54
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -65,6 +67,20 @@
 #define IS_PROTOCOL_38(c) ((c)->protocol >= 38)
 #define IS_PROTOCOL_39(c) ((c)->protocol >= 39)
 #define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
+#define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
+#define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
+#define IS_PROTOCOL_48(c) ((c)->protocol >= 48)
+#define IS_PROTOCOL_49(c) ((c)->protocol >= 49)
+#define IS_PROTOCOL_50(c) ((c)->protocol >= 50)
+#define IS_PROTOCOL_51(c) ((c)->protocol >= 51)
+#define IS_PROTOCOL_52(c) ((c)->protocol >= 52)
+#define IS_PROTOCOL_53(c) ((c)->protocol >= 53)
+#define IS_PROTOCOL_54(c) ((c)->protocol >= 54)
 
 // Terms used:
 // S  = scheduler
@@ -138,7 +154,30 @@ enum MsgType {
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
     M_BLACKLIST_HOST_ENV,
     // S --> CS
-    M_NO_CS
+    M_NO_CS,
+    // CS --> CS, asks a peer to send an environment it has installed (or the tarball of it)
+    M_GET_ENV,
+    // C --> CS, S --> CS, install the environment from the given peers instead of transferring it
+    M_FETCH_ENV,
+    // CS --> C, CS --> S
+    M_FETCH_ENV_RESULT,
+    // CS --> S, how long sending the output of a finished job to its client took
+    M_JOB_SENT,
+    // CS --> S, the CS has free slots and takes jobs queued on other CS
+    M_STEAL_JOBS,
+    // S --> CS, pass a job that has not started yet on to another CS (the C gets a M_USE_CS)
+    M_REDIRECT_JOB,
+    // CS --> S, answer to M_REDIRECT_JOB
+    M_JOB_REDIRECTED,
+    // S --> CS, slots the CS may hand to its clients without asking
+    M_SLOT_LEASE,
+    // CS --> S, a leased slot was given to a client
+    M_LEASE_USED,
+    // CS --> S, leased slots that will not be used
+    // S --> CS, leased slots that are gone with their server
+    M_LEASE_RETURN,
+    // S --> monitor, the events of a time window for monitors that asked for it at M_MON_LOGIN
+    M_MON_BATCH
 };
 
 enum Compression {
@@ -203,6 +242,18 @@ public:
         return text_based;
     }
 
+    // bytes of non-blocking sends the other side did not take yet
+    size_t pending_output(void) const
+    {
+        return msgtogo;
+    }
+
+    // sends what it can of them without blocking, false on error
+    bool flush_output(void)
+    {
+        return flush_writebuf(false);
+    }
+
     void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
     void writecompressed(const unsigned char *in_buf,
                          size_t _in_len, size_t &_out_len);
@@ -408,7 +459,8 @@ public:
         , count(1)
         , arg_flags(0)
         , client_id(0)
-        , client_count(0) {}
+        , client_count(0)
+        , priority(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
@@ -425,7 +477,8 @@ public:
         , client_id(0)
         , preferred_host(host)
         , minimal_host_version(_minimal_host_version)
-        , client_count(_client_count) {}
+        , client_count(_client_count)
+        , priority(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -440,6 +493,9 @@ public:
     std::string preferred_host;
     int minimal_host_version;
     uint32_t client_count; // number of CS -> C connections at the moment
+    std::list<std::string> env_files; // C -> CS only, the tarballs of versions
+    std::string user; // whose share of the farm the job counts against
+    int priority; // higher goes first among the jobs of a share, 0 is normal
 };
 
 class UseCSMsg : public Msg
@@ -468,6 +524,8 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // host:port of compile servers that can send the environment if !got_env
+    std::list<std::string> env_peers;
 };
 
 class NoCSMsg : public Msg
@@ -617,6 +675,36 @@ public:
     uint32_t client_count; // number of CS -> C connections at the moment
 };
 
+/* Measurements of a job beyond the fixed fields of JobDoneMsg. They are sent
+   as key/value pairs, so new ones can be added without a protocol change;
+   receivers pass on the keys they don't know. The version changes only if
+   the meaning of existing keys does. */
+namespace JobTelemetry
+{
+enum { version = 1 };
+
+enum key {
+    max_rss_kb = 1, // peak resident set size of the compiler
+    read_kb, // KiB read from and written to storage
+    write_kb,
+    voluntary_csw, // context switches
+    involuntary_csw,
+    receive_msec, // until all input arrived, the compiler runs meanwhile
+    compile_msec, // from then on until the compiler finished
+    send_msec, // sending the result and output to the client
+    queue_msec, // waiting on the compile server for a free slot
+    time_report_msec, // total of the compiler's -ftime-report, if asked for
+    cache_hit, // 1 if answered from the compile server's object cache
+    cpu_usage_msec, // CPU time of the job's cgroup, the serving process included
+    cpu_user_msec,
+    cpu_system_msec,
+    num_keys
+};
+
+// name of KEY for display, or a number for unknown keys
+std::string name(uint32_t key);
+}
+
 class JobDoneMsg : public Msg
 {
 public:
@@ -659,6 +747,16 @@ public:
     uint32_t sys_msec; /* system time used */
     uint32_t pfaults; /* page faults */
 
+    /* only known if the job ran in its own cgroup, otherwise 0 */
+    uint32_t mem_peak; /* peak memory use in KiB */
+    uint32_t io_kb; /* KiB read and written */
+    uint32_t cpu_stall_msec; /* time stalled waiting for CPU */
+    uint32_t mem_stall_msec; /* ... for memory */
+    uint32_t io_stall_msec; /* ... for IO */
+
+    std::map<uint32_t, uint32_t> telemetry; /* JobTelemetry key -> value */
+    uint32_t telemetry_version;
+
     int exitcode; /* exit code */
 
     uint32_t flags;
@@ -675,11 +773,22 @@ public:
 class JobLocalBeginMsg : public Msg
 {
 public:
-    JobLocalBeginMsg(int job_id = 0, const std::string &file = "")
+    /* Local jobs are run in separate slot pools: compiles are cheap,
+       links can be expensive, LTO links and the like even more so. */
+    enum job_class {
+        COMPILE_JOB = 0,
+        LINK_JOB = 1,
+        HEAVY_JOB = 2
+    };
+
+    JobLocalBeginMsg(int job_id = 0, const std::string &file = "",
+                     job_class _job_class = COMPILE_JOB, unsigned int _mem_estimate = 0)
         : Msg(M_JOB_LOCAL_BEGIN)
         , outfile(file)
         , stime(time(0))
-        , id(job_id) {}
+        , id(job_id)
+        , jobclass(_job_class)
+        , mem_estimate(_mem_estimate) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -687,6 +796,8 @@ public:
     std::string outfile;
     uint32_t stime;
     uint32_t id;
+    uint32_t jobclass;
+    uint32_t mem_estimate; // rough guess of the memory needed in MiB, 0 if unknown
 };
 
 class JobLocalDoneMsg : public Msg
@@ -708,14 +819,20 @@ public:
     LoginMsg(unsigned int myport, const std::string &_nodename, const std::string &_host_platform);
     LoginMsg()
         : Msg(M_LOGIN)
-        , port(0) {}
+        , port(0)
+        , max_kids(0)
+        , max_link_jobs(0)
+        , max_heavy_jobs(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
 
     uint32_t port;
     Environments envs;
+    Environments verified_envs; // those of envs that verify_env() succeeded for
     uint32_t max_kids;
+    uint32_t max_link_jobs; // concurrent local jobs of the LINK_JOB class
+    uint32_t max_heavy_jobs; // ... and the HEAVY_JOB class
     bool noremote;
     bool chroot_possible;
     std::string nodename;
@@ -743,6 +860,12 @@ public:
     StatsMsg()
         : Msg(M_STATS)
         , load(0)
+        , cpuPressure(0)
+        , memPressure(0)
+        , ioPressure(0)
+        , maxJobs(0)
+        , linkJobs(0)
+        , heavyJobs(0)
         , client_count(0)
     {
     }
@@ -766,6 +889,29 @@ public:
     uint32_t loadAvg10;
     uint32_t freeMem;
 
+    /**
+     * Share of time (0-1000, averaged over 10 seconds) in which tasks
+     * on the node were stalled waiting for CPU, memory or IO, as reported
+     * by the kernel's pressure stall information. A node can look idle
+     * by its CPU load and still be thrashing; these tell the scheduler.
+     */
+    uint32_t cpuPressure;
+    uint32_t memPressure;
+    uint32_t ioPressure;
+
+    /**
+     * Expected speed (per mille) of the n-th of max_kids concurrent jobs,
+     * as slots sharing a physical core are slower than the first ones.
+     */
+    std::vector<uint32_t> slotSpeeds;
+
+    // current number of concurrent jobs accepted, as the daemon may tune it
+    uint32_t maxJobs;
+
+    // local jobs of the LINK_JOB and HEAVY_JOB classes running
+    uint32_t linkJobs;
+    uint32_t heavyJobs;
+
     uint32_t client_count; // number of CS -> C connections at the moment
 };
 
@@ -800,8 +946,16 @@ public:
 class MonLoginMsg : public Msg
 {
 public:
-    MonLoginMsg()
-        : Msg(M_MON_LOGIN) {}
+    MonLoginMsg(unsigned int _batch_msec = 0)
+        : Msg(M_MON_LOGIN)
+        , batch_msec(_batch_msec) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // if not 0, the monitor gets one M_MON_BATCH per this many msec instead
+    // of a message per event (protocol 54)
+    uint32_t batch_msec;
 };
 
 class MonGetCSMsg : public GetCSMsg
@@ -978,6 +1132,66 @@ public:
     bool ok;
 };
 
+class GetEnvMsg : public Msg
+{
+public:
+    GetEnvMsg()
+        : Msg(M_GET_ENV) {}
+
+    GetEnvMsg(const std::string &_target, const std::string &_name)
+        : Msg(M_GET_ENV)
+        , name(_name)
+        , target(_target) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+};
+
+class FetchEnvMsg : public Msg
+{
+public:
+    FetchEnvMsg()
+        : Msg(M_FETCH_ENV) {}
+
+    FetchEnvMsg(const std::string &_target, const std::string &_name,
+                const std::list<std::string> &_peers)
+        : Msg(M_FETCH_ENV)
+        , name(_name)
+        , target(_target)
+        , peers(_peers) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    std::list<std::string> peers; // host:port, in order of preference
+};
+
+class FetchEnvResultMsg : public Msg
+{
+public:
+    FetchEnvResultMsg()
+        : Msg(M_FETCH_ENV_RESULT) {}
+
+    FetchEnvResultMsg(bool _ok, const std::string &_target = std::string(),
+                      const std::string &_name = std::string())
+        : Msg(M_FETCH_ENV_RESULT)
+        , ok(_ok)
+        , target(_target)
+        , name(_name) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    bool ok;
+    std::string target; // only set when reporting to the scheduler
+    std::string name;
+};
+
 class BlacklistHostEnvMsg : public Msg
 {
 public:
@@ -998,4 +1212,225 @@ public:
     std::string hostname;
 };
 
+/* Follows the M_JOB_DONE of a job, the CS frees the slot of a job before
+   it sends the output to the client.  */
+class JobSentMsg : public Msg
+{
+public:
+    JobSentMsg()
+        : Msg(M_JOB_SENT)
+        , job_id(0)
+        , send_msec(0) {}
+
+    JobSentMsg(unsigned int id, unsigned int msec)
+        : Msg(M_JOB_SENT)
+        , job_id(id)
+        , send_msec(msec) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+    uint32_t send_msec;
+};
+
+class StealJobsMsg : public Msg
+{
+public:
+    StealJobsMsg()
+        : Msg(M_STEAL_JOBS)
+        , free_slots(0) {}
+
+    StealJobsMsg(unsigned int slots)
+        : Msg(M_STEAL_JOBS)
+        , free_slots(slots) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t free_slots;
+};
+
+/* The new compile server for job_id, the CS forwards it to the client as M_USE_CS.  */
+class RedirectJobMsg : public UseCSMsg
+{
+public:
+    RedirectJobMsg() {
+        type = M_REDIRECT_JOB;
+    }
+
+    RedirectJobMsg(std::string platform, std::string host, unsigned int p, unsigned int id,
+                   unsigned int _client_id)
+        : UseCSMsg(platform, host, p, id, true, _client_id, 0) {
+        type = M_REDIRECT_JOB;
+    }
+};
+
+class JobRedirectedMsg : public Msg
+{
+public:
+    JobRedirectedMsg()
+        : Msg(M_JOB_REDIRECTED)
+        , job_id(0)
+        , ok(false) {}
+
+    JobRedirectedMsg(unsigned int id, bool _ok)
+        : Msg(M_JOB_REDIRECTED)
+        , job_id(id)
+        , ok(_ok) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+    bool ok; // false if the job has started already or is unknown
+};
+
+/* Job slots reserved for the CS for a while: it answers M_GET_CS of its
+   clients from them itself and reports each use with M_LEASE_USED.  */
+class SlotLeaseMsg : public Msg
+{
+public:
+    struct Slot {
+        uint32_t job_id;
+        std::string hostname;
+        uint32_t port;
+    };
+
+    SlotLeaseMsg()
+        : Msg(M_SLOT_LEASE)
+        , duration(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t duration; // seconds the slots are valid
+    std::string target;
+    std::string host_platform;
+    std::string version; // the environment all the slots have installed
+    std::vector<Slot> slots;
+};
+
+/* The request the leased slot job_id was used for, the S books it as if it
+   had been a M_GET_CS.  */
+class LeaseUsedMsg : public GetCSMsg
+{
+public:
+    LeaseUsedMsg()
+        : GetCSMsg()
+        , job_id(0)
+    {
+        type = M_LEASE_USED;
+    }
+
+    LeaseUsedMsg(unsigned int id, const GetCSMsg &m)
+        : GetCSMsg(m)
+        , job_id(id)
+    {
+        type = M_LEASE_USED;
+    }
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+};
+
+class LeaseReturnMsg : public Msg
+{
+public:
+    LeaseReturnMsg()
+        : Msg(M_LEASE_RETURN) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::vector<uint32_t> job_ids;
+};
+
+/* What the M_MON_* messages of a time window would have said. The host
+   values are deltas, only those that changed since the last batch to this
+   monitor are in it. The jobs come in the order of the lists, so a job
+   that began and ended in the same window is in both.  */
+class MonBatchMsg : public Msg
+{
+public:
+    enum HostValue {
+        HostOffline = 0,
+        HostLoad,
+        HostMaxJobs,
+        HostNoRemote,
+        HostSpeed, // in thousandths of the Speed of M_MON_STATS
+        HostLoadAvg1,
+        HostLoadAvg5,
+        HostLoadAvg10,
+        HostFreeMem,
+        HostCPUPressure,
+        HostMemPressure,
+        HostIOPressure,
+        HostLinkJobs,
+        HostHeavyJobs
+    };
+
+    enum HostText {
+        HostName = 0,
+        HostIP,
+        HostPlatform
+    };
+
+    struct Host {
+        uint32_t hostid;
+        std::map<uint32_t, uint32_t> values;
+        std::map<uint32_t, std::string> texts;
+    };
+
+    struct JobRequest {
+        uint32_t job_id;
+        uint32_t hostid; // of the submitter
+        uint32_t lang;
+        std::string filename;
+    };
+
+    struct JobStart {
+        uint32_t job_id;
+        uint32_t hostid;
+        uint32_t stime;
+        std::string file; // only for local jobs
+    };
+
+    struct JobEnd {
+        uint32_t job_id;
+        uint32_t exitcode;
+        uint32_t flags;
+        uint32_t real_msec;
+        uint32_t user_msec;
+        uint32_t sys_msec;
+        uint32_t pfaults;
+        uint32_t in_uncompressed;
+        uint32_t out_uncompressed;
+    };
+
+    MonBatchMsg()
+        : Msg(M_MON_BATCH)
+        , dropped(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    bool empty() const
+    {
+        return !dropped && hosts.empty() && requests.empty() && begins.empty()
+               && local_begins.empty() && ends.empty() && local_ends.empty();
+    }
+
+    // job events left out since the last batch as the monitor fell behind
+    uint32_t dropped;
+    std::vector<Host> hosts;
+    std::vector<JobRequest> requests;
+    std::vector<JobStart> begins;
+    std::vector<JobStart> local_begins;
+    std::vector<JobEnd> ends;
+    std::vector<uint32_t> local_ends;
+};
+
 #endif
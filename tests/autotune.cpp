@@ -0,0 +1,118 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* The number of concurrent jobs of a compile server is tuned to where it
+   gets the most done, and cut when memory runs out.  */
+
+#include "../daemon/autotune.h"
+#include "logging.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+
+using namespace std;
+
+static void check(const string &test, const string &got, const string &expected)
+{
+    if (got != expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+/* Output bytes per second of a server with 6 cores, more jobs than that
+   only get in each other's way.  */
+static unsigned int throughput(unsigned int jobs)
+{
+    if (jobs <= 6) {
+        return 1000 * jobs;
+    }
+
+    return jobs >= 26 ? 0 : 6000 - 300 * (jobs - 6);
+}
+
+/* Runs the server saturated at the current limit for WINDOWS windows of 30
+   seconds, returns the limits it went through.  */
+static string run(ConcurrencyTuner &tuner, time_t &now, int windows,
+                  unsigned int memory_fillgrade = 0)
+{
+    string limits;
+
+    for (int window = 0; window < windows; ++window) {
+        unsigned int jobs = tuner.limit();
+
+        for (unsigned int i = 0; i < jobs; ++i) {
+            tuner.jobDone(throughput(jobs) * 30 / jobs);
+        }
+
+        for (int second = 0; second < 30; ++second) {
+            tuner.update(++now, jobs, memory_fillgrade, 0);
+        }
+
+        limits += (limits.empty() ? "" : " ") + toString(tuner.limit());
+    }
+
+    return limits;
+}
+
+/* It starts at half the maximum, doubles until more jobs get less done,
+   then settles just above the number of cores.  */
+static void test_converge()
+{
+    ConcurrencyTuner tuner;
+    time_t now = 1000;
+    tuner.init(16, true);
+    check("start", toString(tuner.limit()), "8");
+    tuner.update(now, 0, 0, 0);
+    check("converge", run(tuner, now, 8), "16 14 12 10 8 9 7 8");
+    check("settled", run(tuner, now, 6), "7 8 7 8 7 8");
+}
+
+/* Memory running out cuts the limit by a quarter, and ends the doubling.  */
+static void test_memory()
+{
+    ConcurrencyTuner tuner;
+    time_t now = 1000;
+    tuner.init(16, true);
+    tuner.update(now, 0, 0, 0);
+    check("memory", run(tuner, now, 2, 950), "6 4");
+    check("memory gone", run(tuner, now, 2), "5 6");
+}
+
+/* A server that is not tuned keeps its maximum.  */
+static void test_disabled()
+{
+    ConcurrencyTuner tuner;
+    time_t now = 1000;
+    tuner.init(16, false);
+    tuner.update(now, 0, 0, 0);
+    check("disabled", run(tuner, now, 3, 950), "16 16 16");
+}
+
+int main()
+{
+    test_converge();
+    test_memory();
+    test_disabled();
+    cout << "autotune test passed\n";
+    return 0;
+}
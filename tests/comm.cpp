@@ -0,0 +1,176 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Non-blocking sends to a peer that does not read keep what did not fit
+   buffered. Later sends have to go after it, so the peer still gets every
+   message in order once it reads again.  */
+
+#include "comm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static const int extra_messages = 50;
+
+static string message_text(int i)
+{
+    ostringstream str;
+    str << "message " << i << " " << string(1000 + (i % 7) * 2500, 'x');
+    return str.str();
+}
+
+static MsgChannel *create_channel(int fd)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    return Service::createChannel(fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static int reader(int fd)
+{
+    MsgChannel *c = create_channel(fd);
+
+    if (!c) {
+        cerr << "reader: no channel\n";
+        return 1;
+    }
+
+    // let the writer run into a full socket buffer first
+    sleep(1);
+
+    for (int i = 0;; ++i) {
+        Msg *msg = c->get_msg(10, true);
+
+        if (!msg) {
+            if (c->at_eof() && i > 0) {
+                delete c;
+                return 0;
+            }
+
+            cerr << "reader: no message " << i << "\n";
+            return 1;
+        }
+
+        if (msg->type != M_STATUS_TEXT
+                || static_cast<StatusTextMsg *>(msg)->text != message_text(i)) {
+            cerr << "reader: message " << i << " is corrupted\n";
+            return 1;
+        }
+
+        delete msg;
+    }
+}
+
+static int writer(int fd)
+{
+    MsgChannel *c = create_channel(fd);
+
+    if (!c) {
+        cerr << "writer: no channel\n";
+        return 1;
+    }
+
+    int size = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    int i = 0;
+    int last = -1;
+
+    for (; last < 0 || i < last; ++i) {
+        if (!c->send_msg(StatusTextMsg(message_text(i)), MsgChannel::SendNonBlocking)) {
+            cerr << "writer: sending message " << i << " failed\n";
+            return 1;
+        }
+
+        if (last < 0 && c->pending_output()) {
+            last = i + 1 + extra_messages;
+        }
+    }
+
+    while (c->pending_output()) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+
+        if (poll(&pfd, 1, 10000) <= 0 || !c->flush_output()) {
+            cerr << "writer: flushing failed\n";
+            return 1;
+        }
+    }
+
+    delete c;
+    return 0;
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(reader(fds[1]));
+    }
+
+    close(fds[1]);
+    int ret = writer(fds[0]);
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        cout << "comm test passed\n";
+    }
+
+    return ret;
+}
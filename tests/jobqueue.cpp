@@ -0,0 +1,226 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* The order in which the scheduler's JobQueue hands out jobs: flows get
+   their share by weight however many jobs they queue up, and within a
+   flow priorities and waiting time decide.  */
+
+#include "../scheduler/compileserver.h"
+#include "../scheduler/job.h"
+#include "../scheduler/jobqueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <sstream>
+
+using namespace std;
+
+static CompileServer *submitter;
+static unsigned int next_id = 1;
+static list<Job *> jobs;
+
+static Job *new_job()
+{
+    Job *job = new Job(next_id++, submitter);
+    jobs.push_back(job);
+    return job;
+}
+
+static void check(const string &test, const string &got, const string &expected)
+{
+    if (got != expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+/* Serves COUNT jobs and returns the flows they came from, by job id.  */
+static string serve(JobQueue &queue, map<Job *, string> &flows, int count)
+{
+    string order;
+
+    for (int i = 0; i < count && !queue.empty(); ++i) {
+        Job *job = queue.front();
+        queue.pop(job);
+        order += flows[job];
+    }
+
+    return order;
+}
+
+static void push(JobQueue &queue, map<Job *, string> &flows, const string &flow, int count,
+                 time_t now = 0)
+{
+    for (int i = 0; i < count; ++i) {
+        Job *job = new_job();
+        flows[job] = flow;
+        queue.push(job, flow, now);
+    }
+}
+
+static string write_shares(const string &contents)
+{
+    char name[] = "/tmp/icecc-jobqueue-XXXXXX";
+    int fd = mkstemp(name);
+
+    if (fd < 0 || write(fd, contents.c_str(), contents.size()) != ssize_t(contents.size())) {
+        perror("writing shares file");
+        exit(1);
+    }
+
+    close(fd);
+    return name;
+}
+
+/* Equal flows take turns, however many jobs each one queued.  */
+static void test_equal_shares()
+{
+    JobQueue queue;
+    map<Job *, string> flows;
+    push(queue, flows, "A", 10);
+    push(queue, flows, "B", 3);
+    check("equal shares", serve(queue, flows, 8), "ABABABAA");
+}
+
+/* A flow with twice the weight gets twice the jobs, members share their group's.  */
+static void test_weights()
+{
+    string file = write_shares("# comment\nshare H 2\nmember alice H\nmember bob B\n");
+    JobQueue queue;
+
+    if (!queue.loadShares(file)) {
+        cerr << "weights: cannot load " << file << "\n";
+        exit(1);
+    }
+
+    unlink(file.c_str());
+    check("members", queue.flow("alice") + queue.flow("bob") + queue.flow("carol"), "HBcarol");
+
+    map<Job *, string> flows;
+    push(queue, flows, queue.flow("alice"), 20);
+    push(queue, flows, queue.flow("bob"), 20);
+
+    string order = serve(queue, flows, 12);
+    ostringstream counts;
+    counts << count(order.begin(), order.end(), 'H') << " "
+           << count(order.begin(), order.end(), 'B');
+    check("weights", counts.str(), "8 4");
+}
+
+/* A flow that had nothing queued can't save up turns for later.  */
+static void test_idle_flow()
+{
+    JobQueue queue;
+    map<Job *, string> flows;
+    push(queue, flows, "A", 10);
+    check("idle flow alone", serve(queue, flows, 6), "AAAAAA");
+    push(queue, flows, "B", 10);
+    check("idle flow", serve(queue, flows, 6), "BABABA");
+}
+
+static Job *push_priority(JobQueue &queue, map<Job *, string> &flows, const string &label,
+                          const string &flow, int priority, time_t now)
+{
+    Job *job = new_job();
+    job->setPriority(priority);
+    flows[job] = label;
+    queue.push(job, flow, now);
+    return job;
+}
+
+/* Within a flow higher priorities go first, and waiting jobs age up so
+   that they get ahead of later ones with a slightly higher priority.  */
+static void test_priorities()
+{
+    JobQueue queue;
+    map<Job *, string> flows;
+    push_priority(queue, flows, "a", "A", 0, 0);
+    push_priority(queue, flows, "b", "A", 5, 0);
+    // two and a half aging periods later, so "a" has caught up
+    push_priority(queue, flows, "c", "A", 2, JobQueue::aging_seconds * 5 / 2);
+    push_priority(queue, flows, "d", "A", 1, JobQueue::aging_seconds / 2);
+    check("priorities", serve(queue, flows, 4), "bdac");
+
+    // priorities do not buy a flow more than its share
+    push_priority(queue, flows, "x", "X", 0, 0);
+    push_priority(queue, flows, "y", "X", 0, 0);
+    push_priority(queue, flows, "U", "Y", 10, 0);
+    push_priority(queue, flows, "V", "Y", 10, 0);
+    check("priorities and flows", serve(queue, flows, 4), "xUyV");
+}
+
+/* Removing a job that did not get a server gives up no turn.  */
+static void test_remove()
+{
+    JobQueue queue;
+    map<Job *, string> flows;
+    push(queue, flows, "A", 2);
+    push(queue, flows, "B", 2);
+
+    Job *first = queue.front();
+    Job *other = queue.nextFlow(first);
+    check("next flow", flows[first] + (other ? flows[other] : "-"), "AB");
+
+    if (!queue.remove(first) || queue.remove(first)) {
+        cerr << "remove failed\n";
+        exit(1);
+    }
+
+    check("remove", serve(queue, flows, 3), "ABB");
+
+    if (!queue.empty() || queue.size()) {
+        cerr << "remove: queue not empty\n";
+        exit(1);
+    }
+}
+
+int main()
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    submitter = new CompileServer(fds[0], 0, 0, false);
+
+    test_equal_shares();
+    test_weights();
+    test_idle_flow();
+    test_priorities();
+    test_remove();
+
+    for (list<Job *>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        delete *it;
+    }
+
+    delete submitter;
+    cout << "jobqueue test passed\n";
+    return 0;
+}
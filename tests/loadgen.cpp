@@ -0,0 +1,1057 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Puts protocol load on a scheduler or a daemon to measure how much it takes.
+
+   In scheduler mode it logs in many fake daemons, each from its own loopback
+   address, and lets them ask for compile servers at a random (Poisson) rate.
+   The jobs "compile" for a fixed time on the server they were given, so that
+   the scheduler sees the usual JobBegin/JobDone traffic and full farms. It
+   reports how long the scheduler took to answer, the throughput and how much
+   CPU the scheduler used (with --pid).
+
+   In daemon mode a number of fake clients ask a daemon for local job slots
+   (or with --remote for compile servers) over and over, which measures what
+   the daemon adds to every job.  */
+
+#ifndef _GNU_SOURCE
+// getopt_long
+#define _GNU_SOURCE 1
+#endif
+
+#include "config.h"
+#include "comm.h"
+#include "logging.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char load_platform[] = "x86_64";
+static const char load_environment[] = "loadgen-env";
+
+// seconds between the stats of a fake daemon, as the real ones do
+static const unsigned int stats_interval = 5;
+// how long to wait for the answers to the last requests
+static const unsigned int drain_seconds = 10;
+// the listen backlog of the scheduler, which accepts about once a second
+static const unsigned int login_batch = 10;
+
+static unsigned long long now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static Environments load_envs()
+{
+    Environments envs;
+    envs.push_back(make_pair(string(load_platform), string(load_environment)));
+    return envs;
+}
+
+/* CPU time (user + system) of a process in msec, -1 if it can't be read.  */
+static long long process_cpu_msec(pid_t pid)
+{
+    if (!pid) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL
+               + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", int(pid));
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+
+    // the command name may contain anything, the fields start after it
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                     &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+class Latencies
+{
+public:
+    void add(unsigned long long usec)
+    {
+        m_values.push_back(usec);
+    }
+
+    size_t count() const
+    {
+        return m_values.size();
+    }
+
+    void report(const char *what)
+    {
+        static const double bounds[] = { 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500,
+                                         1000, 2000, 5000, 10000 };
+        static const size_t num_bounds = sizeof(bounds) / sizeof(bounds[0]);
+
+        if (m_values.empty()) {
+            printf("%s: none\n", what);
+            return;
+        }
+
+        sort(m_values.begin(), m_values.end());
+        printf("%s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", what,
+               percentile(0.5), percentile(0.9), percentile(0.99), m_values.back() / 1000.0);
+
+        vector<size_t> buckets(num_bounds + 1);
+
+        for (vector<unsigned long long>::const_iterator it = m_values.begin();
+                it != m_values.end(); ++it) {
+            buckets[upper_bound(bounds, bounds + num_bounds, *it / 1000.0) - bounds]++;
+        }
+
+        for (size_t i = 0; i <= num_bounds; ++i) {
+            if (!buckets[i]) {
+                continue;
+            }
+
+            if (i < num_bounds) {
+                printf("  < %7g ms %8zu  %5.1f%%\n", bounds[i], buckets[i],
+                       100.0 * buckets[i] / m_values.size());
+            } else {
+                printf("  >=%7g ms %8zu  %5.1f%%\n", bounds[num_bounds - 1], buckets[i],
+                       100.0 * buckets[i] / m_values.size());
+            }
+        }
+    }
+
+private:
+    double percentile(double p) const
+    {
+        size_t i = min(size_t(p * m_values.size()), m_values.size() - 1);
+        return m_values[i] / 1000.0;
+    }
+
+    vector<unsigned long long> m_values;
+};
+
+static void report_cpu(pid_t pid, long long cpu_before, long long self_before, double seconds)
+{
+    if (seconds <= 0) {
+        return;
+    }
+
+    if (pid) {
+        long long cpu = process_cpu_msec(pid);
+
+        if (cpu >= 0 && cpu_before >= 0) {
+            printf("cpu of %d: %.1f%%\n", int(pid), (cpu - cpu_before) / (10 * seconds));
+        } else {
+            printf("cpu of %d: unknown\n", int(pid));
+        }
+    }
+
+    // if this is near 100% the numbers above say more about us than about them
+    printf("cpu of the load generator: %.1f%%\n",
+           (process_cpu_msec(0) - self_before) / (10 * seconds));
+}
+
+/* Reads what arrived on a channel, calls HANDLER for every message and
+   returns false if the other side closed the connection.  */
+template<typename T>
+static bool read_messages(MsgChannel *c, T &handler)
+{
+    while (!c->read_a_bit() || c->has_msg()) {
+        Msg *m = c->get_msg(0, true);
+
+        if (!m) {
+            return false;
+        }
+
+        bool ok = handler.handle(m);
+        delete m;
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void raise_fd_limit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+struct SchedulerLoad;
+
+struct FakeDaemon {
+    FakeDaemon()
+        : load(0)
+        , channel(0)
+        , running(0)
+        , nextClientId(0) {}
+
+    bool handle(Msg *m);
+
+    SchedulerLoad *load;
+    MsgChannel *channel;
+    string address;
+    unsigned int running;
+    unsigned int nextClientId;
+    // client id -> when it was asked for
+    map<uint32_t, unsigned long long> requests;
+};
+
+struct SchedulerTimer {
+    enum Type {
+        Stats,
+        JobDone
+    } type;
+    FakeDaemon *daemon;
+    uint32_t jobId;
+};
+
+struct SchedulerLoad {
+    SchedulerLoad()
+        : slots(8)
+        , compileMsec(1000)
+        , requests(0)
+        , local(0)
+        , done(0)
+        , pending(0) {}
+
+    void dispatched(FakeDaemon &submitter, uint32_t client_id, FakeDaemon *server, uint32_t job_id);
+    void sendStats(FakeDaemon &d);
+
+    unsigned int slots;
+    unsigned int compileMsec;
+    vector<FakeDaemon> daemons;
+    map<string, FakeDaemon *> byAddress;
+    multimap<unsigned long long, SchedulerTimer> timers;
+    Latencies latencies;
+    unsigned long long requests;
+    unsigned long long local;
+    unsigned long long done;
+    unsigned long long pending;
+};
+
+void SchedulerLoad::sendStats(FakeDaemon &d)
+{
+    StatsMsg msg;
+    msg.load = min(1000U, d.running * 1000 / slots);
+    msg.loadAvg1 = msg.loadAvg5 = msg.loadAvg10 = d.running * 1000;
+    msg.freeMem = 4096;
+    msg.maxJobs = slots;
+    d.channel->send_msg(msg);
+}
+
+void SchedulerLoad::dispatched(FakeDaemon &submitter, uint32_t client_id, FakeDaemon *server,
+                               uint32_t job_id)
+{
+    map<uint32_t, unsigned long long>::iterator request = submitter.requests.find(client_id);
+
+    if (request == submitter.requests.end()) {
+        log_warning() << "answer for unknown client " << client_id << endl;
+        return;
+    }
+
+    unsigned long long now = now_usec();
+    latencies.add(now - request->second);
+    submitter.requests.erase(request);
+    pending--;
+
+    if (!server || !server->channel) {
+        log_warning() << "job " << job_id << " went to an unknown host" << endl;
+        return;
+    }
+
+    // the client would now connect to the server and send the job
+    server->running++;
+    server->channel->send_msg(JobBeginMsg(job_id, 0));
+
+    SchedulerTimer timer;
+    timer.type = SchedulerTimer::JobDone;
+    timer.daemon = server;
+    timer.jobId = job_id;
+    timers.insert(make_pair(now + compileMsec * 1000ULL, timer));
+}
+
+bool FakeDaemon::handle(Msg *m)
+{
+    switch (m->type) {
+    case M_USE_CS: {
+        UseCSMsg *um = static_cast<UseCSMsg *>(m);
+        map<string, FakeDaemon *>::const_iterator server = load->byAddress.find(um->hostname);
+        load->dispatched(*this, um->client_id,
+                         server != load->byAddress.end() ? server->second : 0, um->job_id);
+        break;
+    }
+    case M_NO_CS: {
+        NoCSMsg *nm = static_cast<NoCSMsg *>(m);
+        load->local++;
+        load->dispatched(*this, nm->client_id, this, nm->job_id);
+        break;
+    }
+    case M_PING:
+
+        if (!IS_PROTOCOL_27(channel)) {
+            channel->send_msg(PingMsg());
+        }
+
+        break;
+    case M_GET_INTERNALS:
+        channel->send_msg(StatusTextMsg("load generator"));
+        break;
+    case M_REDIRECT_JOB:
+        // the jobs start right away, there is nothing to move
+        channel->send_msg(JobRedirectedMsg(static_cast<RedirectJobMsg *>(m)->job_id, false));
+        break;
+    case M_SLOT_LEASE: {
+        // measure the scheduler, not the daemons answering by themselves
+        SlotLeaseMsg *sm = static_cast<SlotLeaseMsg *>(m);
+        LeaseReturnMsg lrm;
+
+        for (vector<SlotLeaseMsg::Slot>::const_iterator it = sm->slots.begin();
+                it != sm->slots.end(); ++it) {
+            lrm.job_ids.push_back(it->job_id);
+        }
+
+        channel->send_msg(lrm);
+        break;
+    }
+    case M_END:
+        return false;
+    default:
+        // M_CS_CONF, M_FETCH_ENV and so on, all daemons have the environment
+        break;
+    }
+
+    return true;
+}
+
+static int listen_for_scheduler(unsigned short &port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        log_perror("socket()");
+        return -1;
+    }
+
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+
+    if (bind(fd, (struct sockaddr *) &addr, len) < 0 || listen(fd, SOMAXCONN) < 0
+            || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        log_perror("bind()/listen()");
+        close(fd);
+        return -1;
+    }
+
+    port = ntohs(addr.sin_port);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* Lets the connection tests of the scheduler pass.  */
+static void accept_tests(int listen_fd)
+{
+    int fd;
+
+    while ((fd = accept(listen_fd, 0, 0)) >= 0) {
+        close(fd);
+    }
+}
+
+/* Connects to the scheduler from the loopback address FROM, which is what
+   the scheduler tells the daemons apart by.  */
+static int connect_from(const string &from, const struct sockaddr_in &scheduler)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        log_perror("socket()");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_aton(from.c_str(), &addr.sin_addr);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_perror("bind()");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in remote = scheduler;
+
+    if (connect(fd, (struct sockaddr *) &remote, sizeof(remote)) < 0) {
+        log_perror("connect()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Logs in the daemons FIRST to LAST. They connect together and only set up
+   their channels once the scheduler accepted them and sent its protocol
+   version, the setup would time out while it waits for the next accept.
+   The scheduler only accepts when something else woke it up, so a daemon
+   that is logged in already keeps sending stats meanwhile.  */
+static bool login_daemons(SchedulerLoad &load, size_t first, size_t last,
+                          const struct sockaddr_in &scheduler, unsigned short listen_port)
+{
+    vector<struct pollfd> pfds;
+
+    for (size_t i = first; i < last; ++i) {
+        struct pollfd pfd;
+        pfd.fd = connect_from(load.daemons[i].address, scheduler);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (pfd.fd < 0) {
+            for (vector<struct pollfd>::const_iterator it = pfds.begin(); it != pfds.end(); ++it) {
+                close(it->fd);
+            }
+
+            cerr << "could not connect to the scheduler as " << load.daemons[i].address << endl;
+            return false;
+        }
+
+        pfds.push_back(pfd);
+    }
+
+    size_t waiting = pfds.size();
+    unsigned long long timeout = now_usec() + 30 * 1000000ULL;
+
+    while (waiting) {
+        unsigned long long now = now_usec();
+
+        if (now >= timeout) {
+            break;
+        }
+
+        int ret = poll(&pfds[0], pfds.size(), min(250ULL, (timeout - now) / 1000));
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            break;
+        }
+
+        if (ret == 0) {
+            for (size_t i = last; i-- > 0;) {
+                if (load.daemons[i].channel) {
+                    load.sendStats(load.daemons[i]);
+                    break;
+                }
+            }
+
+            continue;
+        }
+
+        for (size_t i = 0; i < pfds.size(); ++i) {
+            if (pfds[i].fd < 0 || !pfds[i].revents) {
+                continue;
+            }
+
+            FakeDaemon &d = load.daemons[first + i];
+            struct sockaddr_in remote = scheduler;
+            d.channel = Service::createChannel(pfds[i].fd, (struct sockaddr *) &remote,
+                                               sizeof(remote));
+            pfds[i].fd = -1;
+            waiting--;
+
+            if (!d.channel) {
+                continue;
+            }
+
+            LoginMsg lmsg(listen_port, "loadgen-" + toString(first + i), load_platform);
+            lmsg.envs = load_envs();
+            lmsg.verified_envs = lmsg.envs;
+            lmsg.max_kids = load.slots;
+            lmsg.chroot_possible = true;
+
+            if (!d.channel->send_msg(lmsg)) {
+                delete d.channel;
+                d.channel = 0;
+                continue;
+            }
+
+            load.byAddress[d.address] = &d;
+            load.sendStats(d);
+        }
+    }
+
+    bool ok = true;
+
+    for (size_t i = 0; i < pfds.size(); ++i) {
+        if (pfds[i].fd >= 0) {
+            close(pfds[i].fd);
+        }
+
+        if (!load.daemons[first + i].channel) {
+            cerr << "login of " << load.daemons[first + i].address << " failed" << endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static int run_scheduler_load(const string &host, unsigned short port, unsigned int num_daemons,
+                              unsigned int slots, double rate, unsigned int compile_msec,
+                              unsigned int seconds, pid_t pid)
+{
+    struct sockaddr_in scheduler;
+    memset(&scheduler, 0, sizeof(scheduler));
+    scheduler.sin_family = AF_INET;
+    scheduler.sin_port = htons(port);
+
+    if (!inet_aton(host.c_str(), &scheduler.sin_addr)) {
+        cerr << "scheduler mode needs the IP address of the scheduler" << endl;
+        return 1;
+    }
+
+    // the scheduler tests every daemon for incoming connections
+    unsigned short listen_port = 0;
+    int listen_fd = listen_for_scheduler(listen_port);
+
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    SchedulerLoad load;
+    load.slots = max(slots, 1U);
+    load.compileMsec = compile_msec;
+    load.daemons.resize(num_daemons);
+
+    for (unsigned int i = 0; i < num_daemons; ++i) {
+        FakeDaemon &d = load.daemons[i];
+        d.load = &load;
+        d.address = "127.1." + toString(i / 250) + "." + toString(i % 250 + 1);
+    }
+
+    for (unsigned int i = 0; i < num_daemons; i += login_batch) {
+        if (!login_daemons(load, i, min(i + login_batch, num_daemons), scheduler, listen_port)) {
+            return 1;
+        }
+
+        accept_tests(listen_fd);
+    }
+
+    for (unsigned int i = 0; i < num_daemons; ++i) {
+        FakeDaemon &d = load.daemons[i];
+
+        // spread the stats of the daemons over the interval
+        SchedulerTimer timer;
+        timer.type = SchedulerTimer::Stats;
+        timer.daemon = &d;
+        timer.jobId = 0;
+        load.timers.insert(make_pair(now_usec() + (stats_interval * 1000000ULL * i) / num_daemons,
+                                     timer));
+    }
+
+    printf("%u daemons with %u slots logged in, %.1f jobs/s of %u ms\n", num_daemons, load.slots,
+           rate, compile_msec);
+
+    long long cpu_before = process_cpu_msec(pid);
+    long long self_before = process_cpu_msec(0);
+    unsigned long long start = now_usec();
+    unsigned long long end = start + seconds * 1000000ULL;
+    unsigned long long next_arrival = start;
+    unsigned int lost = 0;
+    Environments envs = load_envs();
+    vector<struct pollfd> pfds;
+
+    for (;;) {
+        unsigned long long now = now_usec();
+
+        if (now >= end + drain_seconds * 1000000ULL || (now >= end && !load.pending)) {
+            break;
+        }
+
+        while (now < end && next_arrival <= now) {
+            FakeDaemon &submitter = load.daemons[random() % num_daemons];
+
+            if (submitter.channel) {
+                GetCSMsg msg(envs, "loadgen.cpp", CompileJob::Lang_CXX, 1, load_platform, 0,
+                             string(), 0);
+                msg.client_id = ++submitter.nextClientId;
+                submitter.requests[msg.client_id] = now_usec();
+
+                if (submitter.channel->send_msg(msg)) {
+                    load.requests++;
+                    load.pending++;
+                } else {
+                    submitter.requests.erase(msg.client_id);
+                }
+            }
+
+            next_arrival += (unsigned long long)(-log(1 - drand48()) / rate * 1000000);
+        }
+
+        while (!load.timers.empty() && load.timers.begin()->first <= now) {
+            SchedulerTimer timer = load.timers.begin()->second;
+            load.timers.erase(load.timers.begin());
+            FakeDaemon &d = *timer.daemon;
+
+            if (!d.channel) {
+                continue;
+            }
+
+            if (timer.type == SchedulerTimer::Stats) {
+                load.sendStats(d);
+                timer.jobId = 0;
+                load.timers.insert(make_pair(now + stats_interval * 1000000ULL, timer));
+            } else {
+                JobDoneMsg msg(timer.jobId, 0, JobDoneMsg::FROM_SERVER);
+                msg.real_msec = msg.user_msec = compile_msec;
+                d.channel->send_msg(msg);
+                d.running--;
+                load.done++;
+            }
+        }
+
+        unsigned long long next = now + 100000;
+
+        if (now < end) {
+            next = min(next, next_arrival);
+        }
+
+        if (!load.timers.empty()) {
+            next = min(next, load.timers.begin()->first);
+        }
+
+        pfds.clear();
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfds.push_back(pfd);
+
+        for (vector<FakeDaemon>::const_iterator it = load.daemons.begin();
+                it != load.daemons.end(); ++it) {
+            pfd.fd = it->channel ? it->channel->fd : -1;
+            pfds.push_back(pfd);
+        }
+
+        int timeout = next > now ? int((next - now + 999) / 1000) : 0;
+
+        if (poll(&pfds[0], pfds.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("poll()");
+            return 1;
+        }
+
+        if (pfds[0].revents) {
+            accept_tests(listen_fd);
+        }
+
+        for (size_t i = 0; i < load.daemons.size(); ++i) {
+            FakeDaemon &d = load.daemons[i];
+
+            if (!d.channel || !pfds[i + 1].revents) {
+                continue;
+            }
+
+            if (!read_messages(d.channel, d)) {
+                log_error() << "the scheduler dropped " << d.address << endl;
+                load.pending -= d.requests.size();
+                delete d.channel;
+                d.channel = 0;
+                lost++;
+            }
+        }
+    }
+
+    double elapsed = (now_usec() - start) / 1000000.0;
+
+    printf("requests:    %llu, %llu answered, %llu built locally, %llu unanswered\n",
+           load.requests, (unsigned long long) load.latencies.count(), load.local, load.pending);
+    printf("throughput:  %.1f dispatches/s, %.1f jobs done/s\n", load.latencies.count() / elapsed,
+           load.done / elapsed);
+
+    if (lost) {
+        printf("lost:        %u daemons\n", lost);
+    }
+
+    load.latencies.report("dispatch latency");
+    report_cpu(pid, cpu_before, self_before, elapsed);
+
+    for (vector<FakeDaemon>::iterator it = load.daemons.begin(); it != load.daemons.end(); ++it) {
+        delete it->channel;
+    }
+
+    close(listen_fd);
+    return load.pending || lost ? 1 : 0;
+}
+
+struct FakeClient {
+    FakeClient()
+        : channel(0)
+        , sent(0)
+        , release(0)
+        , answered(false)
+        , remote(false) {}
+
+    bool handle(Msg *m)
+    {
+        if (m->type != (remote ? M_USE_CS : M_JOB_LOCAL_BEGIN)) {
+            log_warning() << "unexpected message " << m->type << " from the daemon" << endl;
+            return false;
+        }
+
+        answered = true;
+        return true;
+    }
+
+    MsgChannel *channel;
+    unsigned long long sent;
+    unsigned long long release;
+    bool answered;
+    bool remote;
+};
+
+static int run_daemon_load(const string &host, unsigned short port, const string &socket_path,
+                           unsigned int num_clients, unsigned int compile_msec, bool remote,
+                           unsigned int seconds, pid_t pid)
+{
+    vector<FakeClient> clients(max(num_clients, 1U));
+    Environments envs = load_envs();
+    Latencies latencies;
+    unsigned long long failed = 0;
+    vector<struct pollfd> pfds;
+
+    printf("%zu clients asking for %s, holding them for %u ms\n", clients.size(),
+           remote ? "compile servers" : "local job slots", compile_msec);
+
+    long long cpu_before = process_cpu_msec(pid);
+    long long self_before = process_cpu_msec(0);
+    unsigned long long start = now_usec();
+    unsigned long long end = start + seconds * 1000000ULL;
+    unsigned int file = 0;
+
+    for (;;) {
+        unsigned long long now = now_usec();
+        bool busy = false;
+
+        for (vector<FakeClient>::iterator it = clients.begin(); it != clients.end(); ++it) {
+            if (it->channel && it->answered && it->release <= now) {
+                // the job is done, the daemon learns it from the closed connection
+                delete it->channel;
+                it->channel = 0;
+            }
+
+            if (!it->channel && now < end) {
+                it->remote = remote;
+                it->answered = false;
+                it->channel = socket_path.empty() ? Service::createChannel(host, port, 10)
+                              : Service::createChannel(socket_path);
+
+                if (!it->channel) {
+                    cerr << "could not connect to the daemon" << endl;
+                    return 1;
+                }
+
+                it->sent = now_usec();
+                string outfile = "/tmp/loadgen-" + toString(++file) + ".o";
+                bool ok;
+
+                if (remote) {
+                    ok = it->channel->send_msg(GetCSMsg(envs, outfile, CompileJob::Lang_CXX, 1,
+                                                        load_platform, 0, string(), 0));
+                } else {
+                    ok = it->channel->send_msg(JobLocalBeginMsg(0, outfile));
+                }
+
+                if (!ok) {
+                    failed++;
+                    delete it->channel;
+                    it->channel = 0;
+                }
+            }
+
+            busy |= it->channel != 0;
+        }
+
+        if (!busy && now >= end) {
+            break;
+        }
+
+        if (now >= end + drain_seconds * 1000000ULL) {
+            break;
+        }
+
+        unsigned long long next = now + 100000;
+        pfds.clear();
+
+        for (vector<FakeClient>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+            struct pollfd pfd;
+            pfd.fd = it->channel && !it->answered ? it->channel->fd : -1;
+            pfd.events = POLLIN;
+            pfds.push_back(pfd);
+
+            if (it->channel && it->answered) {
+                next = min(next, it->release);
+            }
+        }
+
+        int timeout = next > now ? int((next - now + 999) / 1000) : 0;
+
+        if (poll(&pfds[0], pfds.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("poll()");
+            return 1;
+        }
+
+        for (size_t i = 0; i < clients.size(); ++i) {
+            FakeClient &c = clients[i];
+
+            if (!c.channel || c.answered || !pfds[i].revents) {
+                continue;
+            }
+
+            if (!read_messages(c.channel, c)) {
+                failed++;
+                delete c.channel;
+                c.channel = 0;
+            } else if (c.answered) {
+                unsigned long long answered = now_usec();
+                latencies.add(answered - c.sent);
+                c.release = answered + compile_msec * 1000ULL;
+            }
+        }
+    }
+
+    double elapsed = (now_usec() - start) / 1000000.0;
+
+    printf("requests:    %llu answered, %llu failed\n",
+           (unsigned long long) latencies.count(), failed);
+    printf("throughput:  %.1f jobs/s\n", latencies.count() / elapsed);
+    latencies.report(remote ? "compile server latency" : "job slot latency");
+    report_cpu(pid, cpu_before, self_before, elapsed);
+
+    return failed ? 1 : 0;
+}
+
+static void usage(const char *reason = 0)
+{
+    if (reason) {
+        cerr << reason << endl;
+    }
+
+    cerr << "usage: icecc-loadgen scheduler|daemon [options]\n"
+         << "Options:\n"
+         << "  -s, --host <address>        of the scheduler or daemon, default 127.0.0.1\n"
+         << "  -p, --port <port>           default 8765 for the scheduler, 10245 for the daemon\n"
+         << "  -t, --time <seconds>        to put load on it, default 10\n"
+         << "  -m, --compile-msec <msec>   how long a job holds its slot, default 1000\n"
+         << "  -P, --pid <pid>             of the scheduler or daemon, to measure its CPU use\n"
+         << "scheduler mode:\n"
+         << "  -n, --daemons <count>       fake daemons to log in, default 100\n"
+         << "  -j, --slots <count>         of every fake daemon, default 8\n"
+         << "  -r, --rate <jobs/s>         of job requests, default 100\n"
+         << "daemon mode:\n"
+         << "  -c, --clients <count>       concurrent fake clients, default 8\n"
+         << "  -u, --socket <path>         of the daemon, instead of TCP\n"
+         << "  --remote                    ask for compile servers instead of local slots\n"
+         << "  -h, --help\n"
+         << "  -v[v[v]]]\n"
+         << endl;
+
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+    }
+
+    string mode = argv[1];
+
+    if (mode != "scheduler" && mode != "daemon") {
+        usage("Error: the mode is scheduler or daemon");
+    }
+
+    string host = "127.0.0.1";
+    unsigned short port = 0;
+    string socket_path;
+    unsigned int seconds = 10;
+    unsigned int compile_msec = 1000;
+    pid_t pid = 0;
+    unsigned int num_daemons = 100;
+    unsigned int slots = 8;
+    double rate = 100;
+    unsigned int num_clients = 8;
+    bool remote = false;
+    int debug_level = Error;
+
+    while (true) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            { "host", 1, NULL, 's' },
+            { "port", 1, NULL, 'p' },
+            { "time", 1, NULL, 't' },
+            { "compile-msec", 1, NULL, 'm' },
+            { "pid", 1, NULL, 'P' },
+            { "daemons", 1, NULL, 'n' },
+            { "slots", 1, NULL, 'j' },
+            { "rate", 1, NULL, 'r' },
+            { "clients", 1, NULL, 'c' },
+            { "socket", 1, NULL, 'u' },
+            { "remote", 0, NULL, 0 },
+            { "help", 0, NULL, 'h' },
+            { 0, 0, 0, 0 }
+        };
+
+        const int c = getopt_long(argc - 1, argv + 1, "s:p:t:m:P:n:j:r:c:u:hv", long_options,
+                                  &option_index);
+
+        if (c == -1) {
+            break;    // eoo
+        }
+
+        switch (c) {
+        case 0: {
+            string optname = long_options[option_index].name;
+
+            if (optname == "remote") {
+                remote = true;
+            }
+        }
+        break;
+        case 's':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'm':
+            compile_msec = atoi(optarg);
+            break;
+        case 'P':
+            pid = atoi(optarg);
+            break;
+        case 'n':
+            num_daemons = atoi(optarg);
+            break;
+        case 'j':
+            slots = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'c':
+            num_clients = atoi(optarg);
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 'v':
+
+            if (debug_level < MaxVerboseLevel) {
+                debug_level++;
+            }
+
+            break;
+        default:
+            usage();
+        }
+    }
+
+    setup_debug(debug_level);
+    raise_fd_limit();
+    srand48(getpid());
+    srandom(getpid());
+
+    if (mode == "scheduler") {
+        if (!num_daemons || num_daemons > 250 * 250) {
+            usage("Error: between 1 and 62500 daemons");
+        }
+
+        if (rate <= 0) {
+            usage("Error: the rate has to be positive");
+        }
+
+        return run_scheduler_load(host, port ? port : 8765, num_daemons, slots, rate,
+                                  compile_msec, seconds, pid);
+    }
+
+    return run_daemon_load(host, port ? port : 10245, socket_path, num_clients, compile_msec,
+                           remote, seconds, pid);
+}
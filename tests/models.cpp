@@ -0,0 +1,208 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+/* What the scheduler learns from finished jobs and transfers converges to
+   what they really take.  */
+
+#include "../scheduler/netmodel.h"
+#include "../scheduler/timemodel.h"
+#include "../services/job.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <iostream>
+
+using namespace std;
+
+static const string cls = "C++ -O";
+
+static void check_near(const string &test, double got, double expected, double tolerance)
+{
+    if (fabs(got - expected) > tolerance * expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: " << got << "\nexpected: " << expected << " +- "
+             << tolerance * 100 << "%\n";
+        exit(1);
+    }
+}
+
+// the same noise every run, within +-5%
+static double noise(unsigned int i)
+{
+    return 1 + (int(i * 7919 % 101) - 50) / 1000.0;
+}
+
+/* msec = 200 + 3 * KiB on a server, the job sizes vary.  */
+static void learn_jobs(CompileTimeModel &model, const string &server, double factor, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        unsigned int kib = 20 + (i * 37) % 300;
+        model.learn(server, cls, kib * 1024, (unsigned int)((200 + 3 * kib) * factor * noise(i)));
+    }
+}
+
+/* The fit of a server converges to its real times, and odd jobs do not move it much.  */
+static void test_time_fit()
+{
+    CompileTimeModel model;
+
+    if (model.predict("fast", cls, 100 * 1024)) {
+        cerr << "time fit: predicts without jobs\n";
+        exit(1);
+    }
+
+    learn_jobs(model, "fast", 1, 60);
+    check_near("time fit", model.predict("fast", cls, 100 * 1024), 500, 0.05);
+    check_near("time fit large", model.predict("fast", cls, 1000 * 1024), 3200, 0.1);
+
+    // a job stuck in swap is clamped to what the server usually takes
+    model.learn("fast", cls, 100 * 1024, 50000);
+    check_near("time fit outlier", model.predict("fast", cls, 100 * 1024), 500, 0.1);
+}
+
+/* A server with too few jobs of its own is predicted from the class fit,
+   scaled by how it did compared to that so far.  */
+static void test_time_ratio()
+{
+    CompileTimeModel model;
+    learn_jobs(model, "fast", 1, 60);
+    learn_jobs(model, "slow", 2, 6);
+    check_near("time ratio", model.predict("slow", cls, 100 * 1024), 1000, 0.15);
+    // unknown servers get the class
+    check_near("time class", model.predict("new", cls, 100 * 1024), 500, 0.2);
+}
+
+/* The input size of a file is remembered, or guessed from its class.  */
+static void test_input_size()
+{
+    CompileTimeModel model;
+    learn_jobs(model, "fast", 1, 60);
+    model.setInputSize("a.cpp", 12345);
+    check_near("input size", model.inputSize("a.cpp", cls), 12345, 0);
+    check_near("input size class", model.inputSize("b.cpp", cls), 160 * 1024, 0.2);
+}
+
+/* Learns jobs of 100KiB on SERVER running CONCURRENCY jobs, each SLOWDOWN times slower than
+   running alone.  */
+static void learn_scaling(CompileTimeModel &model, const string &server, unsigned int concurrency,
+                          double slowdown, int count)
+{
+    unsigned int alone = model.predict("", cls, 100 * 1024);
+
+    for (int i = 0; i < count; ++i) {
+        model.learnScaling(server, cls, 100 * 1024, concurrency,
+                           (unsigned int)(alone * slowdown));
+    }
+}
+
+/* What one more job adds to the throughput of a server that scales up to 4
+   jobs and not at all beyond them.  */
+static void test_scaling()
+{
+    CompileTimeModel model;
+    learn_jobs(model, "fast", 1, 60);
+
+    for (unsigned int concurrency = 1; concurrency <= 8; ++concurrency) {
+        learn_scaling(model, "four", concurrency, concurrency <= 4 ? 1 : concurrency / 4.0, 5);
+    }
+
+    check_near("scaling first", model.marginalSpeed("four", 0), 1, 0.05);
+    check_near("scaling linear", model.marginalSpeed("four", 2), 1, 0.05);
+    // nothing to gain, but never quite nothing
+    check_near("scaling flat", model.marginalSpeed("four", 4), 0.05, 0.05);
+    check_near("scaling flat more", model.marginalSpeed("four", 6), 0.05, 0.05);
+
+    // busy servers that never ran a single job compare to the fewest they ran
+    learn_scaling(model, "busy", 4, 1, 5);
+    learn_scaling(model, "busy", 5, 1 / 0.9, 5);
+    check_near("scaling busy", model.marginalSpeed("busy", 4), 0.5, 0.05);
+
+    // not known with too few jobs, nor beyond what was measured
+    learn_scaling(model, "few", 1, 1, 4);
+    learn_scaling(model, "few", 2, 1, 4);
+
+    if (model.marginalSpeed("few", 1) || model.marginalSpeed("four", 8)
+            || model.marginalSpeed("none", 1)) {
+        cerr << "scaling unknown failed\n";
+        exit(1);
+    }
+}
+
+/* Links between hosts are learnt once there were a few transfers, the
+   compression ratios move slowly from their defaults.  */
+static void test_network()
+{
+    NetworkModel model;
+
+    // 2 msec round trip, 10 MiB/s
+    for (unsigned int i = 0; i < 20; ++i) {
+        unsigned int kib = 10 + (i * 37) % 500;
+
+        if (i == 2 && model.transferTime("sub", "srv", 1000 * 1024)) {
+            cerr << "network: trusts two transfers\n";
+            exit(1);
+        }
+
+        model.learn("sub", "srv", kib * 1024, 2 + kib / 10);
+    }
+
+    check_near("network", model.transferTime("sub", "srv", 1000 * 1024), 102, 0.05);
+
+    if (model.transferTime("srv", "sub", 1000 * 1024)) {
+        cerr << "network: learnt the other direction too\n";
+        exit(1);
+    }
+
+    check_near("traffic", model.jobTraffic(1000), 350, 0);
+    model.learnSizes(0, 100, 100);
+    model.learnSizes(1000, 400, 200);
+    check_near("traffic learnt", model.jobTraffic(1000), 362, 0);
+
+    for (int i = 0; i < 200; ++i) {
+        model.learnSizes(1000, 400, 200);
+    }
+
+    check_near("traffic converged", model.jobTraffic(1000), 600, 0.01);
+}
+
+/* Jobs are told apart by language, optimization and debug info only.  */
+static void test_job_class()
+{
+    string got = CompileTimeModel::jobClass("C++", CompileJob::Flag_O2 | CompileJob::Flag_g)
+                 + "," + CompileTimeModel::jobClass("C", CompileJob::Flag_g3)
+                 + "," + CompileTimeModel::jobClass("C", 0);
+
+    if (got != "C++ -O -g,C -O0 -g,C -O0") {
+        cerr << "job class failed\n     got: \"" << got << "\"\n";
+        exit(1);
+    }
+}
+
+int main()
+{
+    test_time_fit();
+    test_time_ratio();
+    test_input_size();
+    test_job_class();
+    test_scaling();
+    test_network();
+    cout << "models test passed\n";
+    return 0;
+}
@@ -0,0 +1,186 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* What the scheduler queues for monitors that take batches: job events
+   are bounded and counted when they do not fit, host values are only
+   sent when they changed.  */
+
+#include "../scheduler/monitorqueue.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+static void check(const string &test, const string &got, const string &expected)
+{
+    if (got != expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+/* Takes a batch and describes it: the number of requests, begins, local
+   begins, ends, local ends and dropped events, then the hosts.  */
+static string take(MonitorQueue &queue)
+{
+    MonBatchMsg batch;
+    queue.take(batch);
+
+    ostringstream out;
+    out << batch.requests.size() << " " << batch.begins.size() << " "
+        << batch.local_begins.size() << " " << batch.ends.size() << " "
+        << batch.local_ends.size() << " " << batch.dropped;
+
+    for (vector<MonBatchMsg::Host>::const_iterator it = batch.hosts.begin();
+            it != batch.hosts.end(); ++it) {
+        out << " " << it->hostid << ":";
+
+        for (map<uint32_t, uint32_t>::const_iterator vit = it->values.begin();
+                vit != it->values.end(); ++vit) {
+            out << vit->first << "=" << vit->second << ",";
+        }
+
+        for (map<uint32_t, string>::const_iterator tit = it->texts.begin();
+                tit != it->texts.end(); ++tit) {
+            out << tit->first << "=" << tit->second << ",";
+        }
+    }
+
+    return out.str();
+}
+
+static void add_jobs(MonitorQueue &queue, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        queue.add(MonJobBeginMsg(i, 0, 1));
+    }
+}
+
+/* Job events go into the batch by kind, other messages are ignored.  */
+static void test_events()
+{
+    MonitorQueue queue;
+    MonGetCSMsg request;
+    request.job_id = 1;
+    queue.add(request);
+    queue.add(MonJobBeginMsg(2, 0, 1));
+    queue.add(MonLocalJobBeginMsg(3, "a.cpp", 0, 1));
+    queue.add(MonJobDoneMsg());
+    queue.add(JobLocalDoneMsg(5));
+    queue.add(EndMsg());
+    check("events", take(queue), "1 1 1 1 1 0");
+    check("events taken", take(queue), "0 0 0 0 0 0");
+}
+
+/* A window holds a bounded number of events, the rest and those of a
+   dropped window are counted until the monitor gets a batch again.  */
+static void test_back_pressure()
+{
+    MonitorQueue queue;
+    add_jobs(queue, 20005);
+    check("bounded", take(queue), "0 20000 0 0 0 5");
+
+    add_jobs(queue, 20003);
+    queue.drop();
+    add_jobs(queue, 2);
+    queue.drop();
+    add_jobs(queue, 1);
+    check("dropped", take(queue), "0 1 0 0 0 20005");
+    check("dropped taken", take(queue), "0 0 0 0 0 0");
+}
+
+/* Only values that differ from what the monitor has are sent, the latest
+   ones if they changed more than once.  */
+static void test_hosts()
+{
+    MonitorQueue queue;
+    map<uint32_t, uint32_t> values;
+    map<uint32_t, string> texts;
+    values[MonBatchMsg::HostLoad] = 100;
+    values[MonBatchMsg::HostMaxJobs] = 4;
+    texts[MonBatchMsg::HostName] = "a";
+    queue.setHost(7, values, texts);
+    check("host", take(queue), "0 0 0 0 0 0 7:1=100,2=4,0=a,");
+
+    queue.setHost(7, values, texts);
+    check("host unchanged", take(queue), "0 0 0 0 0 0");
+
+    values[MonBatchMsg::HostLoad] = 200;
+    queue.setHost(7, values, texts);
+    values[MonBatchMsg::HostLoad] = 300;
+    queue.setHost(7, values, texts);
+    check("host coalesced", take(queue), "0 0 0 0 0 0 7:1=300,");
+
+    values[MonBatchMsg::HostLoad] = 400;
+    queue.setHost(7, values, texts);
+    values[MonBatchMsg::HostLoad] = 300;
+    queue.setHost(7, values, texts);
+    check("host changed back", take(queue), "0 0 0 0 0 0");
+
+    // the id may be reused, the next host starts from nothing
+    queue.setHost(7, values, texts);
+    queue.hostOffline(7);
+    check("host offline", take(queue), "0 0 0 0 0 0 7:0=1,");
+    queue.setHost(7, values, texts);
+    check("host reused", take(queue), "0 0 0 0 0 0 7:1=300,2=4,0=a,");
+}
+
+/* The first batch is due right away, the next one a window later.  */
+static void test_due()
+{
+    MonitorQueue queue(60000);
+    unsigned int due = queue.msecToDue();
+
+    if (due) {
+        cerr << "due: the first batch is due in " << due << " msec\n";
+        exit(1);
+    }
+
+    take(queue);
+    due = queue.msecToDue();
+
+    if (due < 59000 || due > 60000) {
+        cerr << "due: the next batch is due in " << due << " msec\n";
+        exit(1);
+    }
+
+    queue.drop();
+    due = queue.msecToDue();
+
+    if (due < 59000 || due > 60000) {
+        cerr << "due: after dropping the next batch is due in " << due << " msec\n";
+        exit(1);
+    }
+}
+
+int main()
+{
+    test_events();
+    test_back_pressure();
+    test_hosts();
+    test_due();
+    cout << "monitorqueue test passed\n";
+    return 0;
+}
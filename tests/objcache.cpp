@@ -0,0 +1,248 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* The object cache of the compile servers: which jobs share an entry,
+   entries come back as they were stored, and the least recently used ones
+   are removed to stay below the limit.  */
+
+#include "../daemon/objcache.h"
+#include "comm.h"
+#include "job.h"
+#include "logging.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static string dir;
+
+static void check(const string &test, const string &got, const string &expected)
+{
+    if (got != expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+static CompileJob make_job()
+{
+    CompileJob job;
+    job.setTargetPlatform("x86_64");
+    job.setEnvironmentVersion("0123456789abcdef");
+    job.setCompilerName("g++");
+    job.setLanguage(CompileJob::Lang_CXX);
+    job.setInputFile("a.cpp");
+    job.setWorkingDirectory("/src");
+    return job;
+}
+
+static string key_of(const CompileJob &job, const list<string> &flags, const string &source)
+{
+    ObjectCacheKey key(job, flags);
+    key.append(reinterpret_cast<const unsigned char *>(source.data()), source.size());
+    return key.finish();
+}
+
+static void write_file(const string &file, const string &contents)
+{
+    ofstream out(file.c_str());
+    out << contents;
+    out.close();
+
+    if (!out) {
+        perror("writing object file");
+        exit(1);
+    }
+}
+
+static string read_file(const string &file)
+{
+    ifstream in(file.c_str());
+    ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+/* Everything the compiler sees is in the key.  */
+static void test_key()
+{
+    CompileJob job = make_job();
+    list<string> flags;
+    flags.push_back("-O2");
+    string key = key_of(job, flags, "int a;");
+
+    check("key length", toString(key.size()), "32");
+    check("key same job", key_of(make_job(), flags, "int a;"), key);
+
+    if (key_of(job, flags, "int b;") == key) {
+        cerr << "key: the source is not in the key\n";
+        exit(1);
+    }
+
+    list<string> other_flags;
+    other_flags.push_back("-O3");
+
+    if (key_of(job, other_flags, "int a;") == key) {
+        cerr << "key: the flags are not in the key\n";
+        exit(1);
+    }
+
+    CompileJob other_dir = make_job();
+    other_dir.setWorkingDirectory("/build");
+
+    if (key_of(other_dir, flags, "int a;") == key) {
+        cerr << "key: the working directory is not in the key\n";
+        exit(1);
+    }
+
+    list<string> split1, split2;
+    split1.push_back("-a");
+    split1.push_back("bc");
+    split2.push_back("-ab");
+    split2.push_back("c");
+
+    if (key_of(job, split1, "") == key_of(job, split2, "")) {
+        cerr << "key: flags run into each other\n";
+        exit(1);
+    }
+}
+
+/* A stored entry gives back the output of the compiler and the object file.  */
+static void test_store()
+{
+    ObjectCache cache;
+    cache.init(dir + "/store", 1024 * 1024, getuid(), getgid());
+
+    if (!cache.enabled()) {
+        cerr << "store: cache not enabled\n";
+        exit(1);
+    }
+
+    string key = key_of(make_job(), list<string>(), "int a;");
+
+    if (object_cache_open(cache.fd(), key) >= 0) {
+        cerr << "store: found an entry that was never stored\n";
+        exit(1);
+    }
+
+    CompileResultMsg msg;
+    msg.out = "out";
+    msg.err = "warning: something";
+    write_file(dir + "/a.o", "object file");
+    size_t stored = object_cache_store(cache.fd(), key, msg, dir + "/a.o");
+    check("store size", toString(stored), toString(16 + 3 + 18 + 11));
+
+    int fd = object_cache_open(cache.fd(), key);
+    CompileResultMsg restored;
+
+    if (fd < 0 || !object_cache_restore(fd, restored, dir + "/b.o")) {
+        cerr << "store: cannot restore the entry\n";
+        exit(1);
+    }
+
+    close(fd);
+    check("restore", restored.out + "," + restored.err + "," + read_file(dir + "/b.o"),
+          "out,warning: something,object file");
+
+    // broken entries are removed
+    write_file(dir + "/store/" + key, "broken");
+
+    if (object_cache_open(cache.fd(), key) >= 0
+            || access((dir + "/store/" + key).c_str(), F_OK) == 0) {
+        cerr << "store: broken entry not removed\n";
+        exit(1);
+    }
+
+    unlink((dir + "/a.o").c_str());
+    unlink((dir + "/b.o").c_str());
+}
+
+/* Entries used last are kept, the others go once the cache grows too big.  */
+static void test_evict()
+{
+    ObjectCache cache;
+    cache.init(dir + "/evict", 1000, getuid(), getgid());
+    string contents(300 - 16, 'x');
+    write_file(dir + "/a.o", contents);
+    CompileResultMsg msg;
+    const char *keys[] = { "used", "old", "new", "newest" };
+    size_t stored = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        stored = object_cache_store(cache.fd(), keys[i], msg, dir + "/a.o");
+        cache.jobDone(false, true, stored);
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = 1000 + i;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        utimensat(cache.fd(), keys[i], times, 0);
+    }
+
+    // "used" was stored first, but a hit makes it the most recently used one
+    int fd = object_cache_open(cache.fd(), "used");
+    close(fd);
+    cache.jobDone(true, false, 0);
+
+    stored = object_cache_store(cache.fd(), keys[3], msg, dir + "/a.o");
+    cache.jobDone(false, true, stored);
+
+    string left;
+
+    for (int i = 0; i < 4; ++i) {
+        left += string(faccessat(cache.fd(), keys[i], F_OK, 0) == 0 ? keys[i] : "-") + " ";
+    }
+
+    check("evict", left, "used - new newest ");
+    check("evict stats", cache.dump(), "1 hits, 4 misses, 0 of 0 KiB, 1 evicted");
+
+    for (int i = 0; i < 4; ++i) {
+        unlinkat(cache.fd(), keys[i], 0);
+    }
+
+    unlink((dir + "/a.o").c_str());
+}
+
+int main()
+{
+    char name[] = "/tmp/icecc-objcache-XXXXXX";
+
+    if (!mkdtemp(name)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    dir = name;
+    test_key();
+    test_store();
+    test_evict();
+    rmdir((dir + "/store").c_str());
+    rmdir((dir + "/evict").c_str());
+    rmdir(name);
+    cout << "objcache test passed\n";
+    return 0;
+}
@@ -0,0 +1,192 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* The speed statistics the scheduler keeps on disk survive a restart,
+   and nodes not seen for too long are forgotten.  */
+
+#include "../scheduler/jobstat.h"
+#include "../scheduler/statsfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static string dir;
+static const time_t max_age = 1000;
+
+static void check(const string &test, const string &got, const string &expected)
+{
+    if (got != expected) {
+        cerr << test << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+static JobStat stat_of(unsigned long size, unsigned long real, unsigned long user,
+                       unsigned long sys)
+{
+    JobStat stat;
+    stat.setOutputSize(size);
+    stat.setCompileTimeReal(real);
+    stat.setCompileTimeUser(user);
+    stat.setCompileTimeSys(sys);
+    return stat;
+}
+
+/* What is known about NODE, or "-".  */
+static string record(const StatsFile &stats, const string &node, const string &platform)
+{
+    const StatsFile::Record *record = stats.find(node, platform);
+
+    if (!record) {
+        return "-";
+    }
+
+    ostringstream out;
+    out << record->lastSeen << " " << record->jobs << " " << record->cum.outputSize() << " "
+        << record->cum.compileTimeReal() << " " << record->cum.compileTimeUser() << " "
+        << record->cum.compileTimeSys();
+    return out.str();
+}
+
+static void write_file(const string &file, const string &contents)
+{
+    ofstream out(file.c_str());
+    out << contents;
+    out.close();
+
+    if (!out) {
+        perror("writing stats file");
+        exit(1);
+    }
+}
+
+/* What is saved is loaded again, per node and platform.  */
+static void test_round_trip()
+{
+    string file = dir + "/round-trip";
+    StatsFile stats;
+    stats.update("a", "x86_64", 100, 10, stat_of(1000, 200, 300, 40));
+    stats.update("a", "aarch64", 100, 5, stat_of(500, 100, 150, 20));
+    stats.update("b", "x86_64", 50, 2, stat_of(10, 20, 30, 4));
+    stats.update("b", "x86_64", 120, 3, stat_of(11, 21, 31, 5));
+
+    if (!stats.save(file, 120, max_age) || access((file + ".tmp").c_str(), F_OK) == 0) {
+        cerr << "round trip: saving failed\n";
+        exit(1);
+    }
+
+    StatsFile loaded;
+
+    if (!loaded.load(file, 120, max_age)) {
+        cerr << "round trip: loading failed\n";
+        exit(1);
+    }
+
+    check("round trip", record(loaded, "a", "x86_64") + "," + record(loaded, "a", "aarch64")
+          + "," + record(loaded, "b", "x86_64") + "," + record(loaded, "c", "x86_64"),
+          "100 10 1000 200 300 40,100 5 500 100 150 20,120 3 11 21 31 5,-");
+    unlink(file.c_str());
+}
+
+/* Nodes not seen for longer than the maximum age are dropped when saving
+   and when loading.  */
+static void test_max_age()
+{
+    string file = dir + "/max-age";
+    StatsFile stats;
+    stats.update("old", "x86_64", 100, 1, stat_of(1, 1, 1, 1));
+    stats.update("new", "x86_64", 900, 1, stat_of(2, 2, 2, 2));
+
+    if (!stats.save(file, 100 + max_age + 1, max_age)) {
+        cerr << "max age: saving failed\n";
+        exit(1);
+    }
+
+    check("max age save", record(stats, "old", "x86_64") + "," + record(stats, "new", "x86_64"),
+          "-,900 1 2 2 2 2");
+
+    StatsFile loaded;
+    loaded.load(file, 900 + max_age + 1, max_age);
+    check("max age load", record(loaded, "new", "x86_64"), "-");
+    unlink(file.c_str());
+}
+
+/* Records that could not have been learnt from are skipped, a file that
+   is not a statistics file is not loaded at all.  */
+static void test_bad_records()
+{
+    string file = dir + "/bad";
+    write_file(file, "icecream-scheduler-stats 1\n"
+               "nojobs x86_64 100 0 1 1 1 1\n"
+               "nouser x86_64 100 1 1 1 0 1\n"
+               "garbage\n"
+               "good x86_64 100 1 1 1 1 1\n");
+    StatsFile stats;
+
+    if (!stats.load(file, 100, max_age)) {
+        cerr << "bad records: loading failed\n";
+        exit(1);
+    }
+
+    check("bad records", record(stats, "nojobs", "x86_64") + ","
+          + record(stats, "nouser", "x86_64") + "," + record(stats, "good", "x86_64"),
+          "-,-,100 1 1 1 1 1");
+
+    write_file(file, "icecream-scheduler-stats 2\ngood x86_64 100 1 1 1 1 1\n");
+    StatsFile other;
+
+    if (other.load(file, 100, max_age) || other.find("good", "x86_64")) {
+        cerr << "bad header: loaded anyway\n";
+        exit(1);
+    }
+
+    unlink(file.c_str());
+
+    if (other.load(file, 100, max_age)) {
+        cerr << "missing file: loaded anyway\n";
+        exit(1);
+    }
+}
+
+int main()
+{
+    char name[] = "/tmp/icecc-statsfile-XXXXXX";
+
+    if (!mkdtemp(name)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    dir = name;
+    test_round_trip();
+    test_max_age();
+    test_bad_records();
+    rmdir(name);
+    cout << "statsfile test passed\n";
+    return 0;
+}